@@ -0,0 +1,105 @@
+#ifndef _BENCH_H
+#define	_BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Latency histograms are log-linear, with each power of two
+ * of nanoseconds split into BENCH_SUB_BUCKETS buckets, so a
+ * reported percentile is within about 3% of the true value
+ */
+#define		BENCH_SUB_BUCKET_BITS 5
+#define		BENCH_SUB_BUCKETS (1 << BENCH_SUB_BUCKET_BITS)
+// Values from 2^BENCH_MAX_POWER nanoseconds (about 18 minutes) on
+#define		BENCH_MAX_POWER 40
+#define		BENCH_BUCKETS \
+	((BENCH_MAX_POWER - BENCH_SUB_BUCKET_BITS + 1) * BENCH_SUB_BUCKETS)
+
+// Formats results are written in
+typedef enum bench_format {
+	BENCH_CSV,
+	BENCH_JSON
+} bench_format_t;
+
+typedef struct bench_histogram {
+	unsigned long long count;
+	unsigned long long sum_ns;
+	unsigned long long max_ns;
+	unsigned long long buckets[BENCH_BUCKETS];
+} bench_histogram_t;
+
+// Monotonic clock in nanoseconds
+unsigned long long
+bench_now_ns();
+
+void
+bench_histogram_add(bench_histogram_t * histogram, unsigned long long ns);
+
+void
+bench_histogram_merge(bench_histogram_t * to, const bench_histogram_t * from);
+
+/*
+ * Value in nanoseconds below which the given fraction
+ * of the recorded values fall
+ */
+unsigned long long
+bench_histogram_quantile(const bench_histogram_t * histogram,
+	double fraction);
+
+/*
+ * Parse "csv" or "json"; returns -1 for anything else
+ */
+int
+bench_parse_format(const char * name);
+
+/*
+ * Parse a list of weights such as "retr=6,list=1" against the
+ * given names, filling weights in the same order; names left
+ * out get a weight of zero. Returns the sum of the weights, or
+ * -1 on an unknown name or a malformed list.
+ */
+int
+bench_parse_weights(const char * list, const char * const * names,
+	int num_names, unsigned * weights);
+
+/*
+ * Pick an index with probability proportional to its weight,
+ * given the sum of the weights and a random number
+ */
+int
+bench_pick_weighted(const unsigned * weights, int num_weights,
+	unsigned total, unsigned random);
+
+/*
+ * Cycle counter: the time stamp counter on x86, which ticks at
+ * the nominal clock rate; elsewhere this falls back to nanoseconds
+ */
+static inline unsigned long long
+bench_cycles() {
+
+#if defined(__x86_64__) || defined(__i386__)
+	return (__rdtsc());
+#else
+	return (bench_now_ns());
+#endif
+}
+
+// Small, fast per-thread random number generator (xorshift64*)
+static inline unsigned long long
+bench_random(unsigned long long * state) {
+
+	unsigned long long x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return (x * 0x2545f4914f6cdd1dULL);
+}
+
+#endif
@@ -0,0 +1,153 @@
+#include <strings.h>
+#include "bench.h"
+
+unsigned long long
+bench_now_ns() {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+
+// Bucket of a value in nanoseconds
+static int
+bench_bucket(unsigned long long ns) {
+
+	if (ns < BENCH_SUB_BUCKETS)
+		return ((int)ns);
+
+	int power = 63 - __builtin_clzll(ns);
+	if (power >= BENCH_MAX_POWER)
+		return (BENCH_BUCKETS - 1);
+
+	int sub = (int)(ns >> (power - BENCH_SUB_BUCKET_BITS)) &
+		(BENCH_SUB_BUCKETS - 1);
+	return ((power - BENCH_SUB_BUCKET_BITS + 1) * BENCH_SUB_BUCKETS + sub);
+}
+
+// Midpoint, in nanoseconds, of the values a bucket holds
+static unsigned long long
+bench_bucket_value(int bucket) {
+
+	if (bucket < BENCH_SUB_BUCKETS)
+		return (bucket);
+
+	int power = bucket / BENCH_SUB_BUCKETS + BENCH_SUB_BUCKET_BITS - 1;
+	unsigned long long sub = bucket % BENCH_SUB_BUCKETS;
+	unsigned long long width = 1ULL << (power - BENCH_SUB_BUCKET_BITS);
+	return ((1ULL << power) + sub * width + width / 2);
+}
+
+void
+bench_histogram_add(bench_histogram_t * histogram, unsigned long long ns) {
+
+	histogram->buckets[bench_bucket(ns)]++;
+	histogram->count++;
+	histogram->sum_ns += ns;
+	if (ns > histogram->max_ns)
+		histogram->max_ns = ns;
+}
+
+void
+bench_histogram_merge(bench_histogram_t * to, const bench_histogram_t * from) {
+
+	for (int i = 0; i < BENCH_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+	to->count += from->count;
+	to->sum_ns += from->sum_ns;
+	if (from->max_ns > to->max_ns)
+		to->max_ns = from->max_ns;
+}
+
+unsigned long long
+bench_histogram_quantile(const bench_histogram_t * histogram,
+	double fraction) {
+
+	if (histogram->count == 0)
+		return (0);
+
+	unsigned long long rank = (unsigned long long)
+		(fraction * histogram->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	unsigned long long seen = 0;
+	for (int i = 0; i < BENCH_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= rank) {
+			unsigned long long value = bench_bucket_value(i);
+			return (value < histogram->max_ns ? value :
+				histogram->max_ns);
+		}
+	}
+
+	return (histogram->max_ns);
+}
+
+int
+bench_parse_format(const char * name) {
+
+	if (!strcasecmp(name, "csv"))
+		return (BENCH_CSV);
+	if (!strcasecmp(name, "json"))
+		return (BENCH_JSON);
+
+	return (-1);
+}
+
+int
+bench_parse_weights(const char * list, const char * const * names,
+	int num_names, unsigned * weights) {
+
+	memset(weights, 0, num_names * sizeof (unsigned));
+
+	char * copy = strdup(list);
+	if (copy == NULL)
+		return (-1);
+
+	int total = 0;
+	char * state;
+	for (char * item = strtok_r(copy, ",", &state); item != NULL;
+		item = strtok_r(NULL, ",", &state)) {
+
+		char * value = strchr(item, '=');
+		if (value == NULL) {
+			free(copy);
+			return (-1);
+		}
+		*value++ = '\0';
+
+		int i;
+		for (i = 0; i < num_names; i++) {
+			if (!strcasecmp(item, names[i]))
+				break;
+		}
+		char * end;
+		long weight = strtol(value, &end, 10);
+		if (i == num_names || *end != '\0' || weight < 0 ||
+			weight > 1000000) {
+			free(copy);
+			return (-1);
+		}
+
+		weights[i] = weight;
+		total += weight;
+	}
+
+	free(copy);
+	return (total);
+}
+
+int
+bench_pick_weighted(const unsigned * weights, int num_weights,
+	unsigned total, unsigned random) {
+
+	unsigned point = random % total;
+	for (int i = 0; i < num_weights; i++) {
+		if (point < weights[i])
+			return (i);
+		point -= weights[i];
+	}
+
+	return (num_weights - 1);
+}
@@ -0,0 +1,308 @@
+/*
+ * Generates the file trees the load generator runs against:
+ * many small text files, a few huge binary files, a few large
+ * CSV exports, a wide directory of empty files, a tree of small
+ * files nested two levels deep, optionally a few small files at
+ * the bottom of a long chain of directories, and an empty upload
+ * directory.
+ * The same seed always produces the same bytes, and a
+ * MANIFEST listing every file lets ftp_load pick its targets.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bench.h"
+
+// Size of the buffer file contents are generated in
+#define		FIXTURE_BUFFER_SIZE (1 << 20)
+// Files in each directory at the bottom of the tree
+#define		TREE_FILES_PER_DIRECTORY 100
+// Directories under each directory above the bottom of the tree
+#define		TREE_FANOUT 10
+// Files at the bottom of the deep chain of directories
+#define		DEEP_FILES 100
+#define		MAX_DEEP_LEVELS 99
+
+// What a file is filled with
+typedef enum contents {
+	CONTENTS_BINARY,
+	CONTENTS_TEXT,
+	// Rows of an export: an id, a few words, an amount and a date
+	CONTENTS_CSV
+} contents_t;
+
+static const char * optstring = "d:s:S:H:z:e:E:w:T:D:r:h";
+
+static const char * words[] = {
+	"alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf",
+	"hotel", "india", "juliet", "kilo", "lima", "mike", "november",
+	"oscar", "papa", "quebec", "romeo", "sierra", "tango", "uniform",
+	"victor", "whiskey", "xray", "yankee", "zulu"
+};
+
+static char buffer[FIXTURE_BUFFER_SIZE];
+
+static void
+usage() {
+
+	printf("Usage: ftp_fixtures -d <directory> [-s <small files>] "
+		"[-S <largest small file>] [-H <huge files>] "
+		"[-z <huge file MiB>] [-e <export files>] "
+		"[-E <export file MiB>] [-w <wide directory entries>] "
+		"[-T <tree files>] [-D <deep directory levels>] [-r <seed>] "
+		"[-h]\n");
+}
+
+static void
+fail(const char * what, const char * path) {
+
+	fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+static void
+make_directory(const char * path) {
+
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		fail("Error on creating", path);
+}
+
+/*
+ * Fill a file with size bytes: lines of words, rows
+ * of CSV or random binary data
+ */
+static void
+make_file(const char * path, unsigned long long size, contents_t contents,
+	unsigned long long * seed) {
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		fail("Error on creating", path);
+
+	int num_words = sizeof (words) / sizeof (words[0]);
+	unsigned long long row = 0;
+	while (size > 0) {
+
+		size_t len = size < FIXTURE_BUFFER_SIZE ? size : FIXTURE_BUFFER_SIZE;
+		size_t i = 0;
+		if (contents == CONTENTS_CSV) {
+			char line[128];
+			while (i < len) {
+				unsigned long long r = bench_random(seed);
+				int n = snprintf(line, sizeof (line),
+					"%llu,%s,%s,%llu.%02llu,2026-%02llu-%02llu\n", ++row,
+					words[r % num_words], words[(r >> 8) % num_words],
+					(r >> 16) % 100000, (r >> 40) % 100,
+					1 + (r >> 48) % 12, 1 + (r >> 56) % 28);
+				for (int j = 0; j < n && i < len; j++)
+					buffer[i++] = line[j];
+			}
+		}
+		else if (contents == CONTENTS_TEXT) {
+			while (i < len) {
+				const char * word =
+					words[bench_random(seed) % num_words];
+				char separator = bench_random(seed) % 8 == 0 ? '\n' : ' ';
+				while (*word != '\0' && i < len)
+					buffer[i++] = *word++;
+				if (i < len)
+					buffer[i++] = separator;
+			}
+		}
+		else {
+			for (; i + 8 <= len; i += 8) {
+				unsigned long long r = bench_random(seed);
+				memcpy(buffer + i, &r, 8);
+			}
+			for (; i < len; i++)
+				buffer[i] = (char)bench_random(seed);
+		}
+
+		for (size_t done = 0; done < len; ) {
+			ssize_t n = write(fd, buffer + done, len - done);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				fail("Error on writing", path);
+			}
+			done += n;
+		}
+		size -= len;
+	}
+
+	close(fd);
+}
+
+int
+main(int argc, char * argv[]) {
+
+	const char * root = NULL;
+	long small_files = 2000;
+	long small_size = 16384;
+	long huge_files = 2;
+	long huge_mib = 128;
+	long export_files = 4;
+	long export_mib = 8;
+	long wide_entries = 20000;
+	long tree_files = 10000;
+	long deep_levels = 0;
+	unsigned long long seed = 1;
+
+	int opt;
+	while ((opt = getopt(argc, argv, optstring)) != -1) {
+		switch (opt) {
+			case 'd':
+				root = optarg;
+				break;
+			case 's':
+				small_files = atol(optarg);
+				break;
+			case 'S':
+				small_size = atol(optarg);
+				break;
+			case 'H':
+				huge_files = atol(optarg);
+				break;
+			case 'z':
+				huge_mib = atol(optarg);
+				break;
+			case 'e':
+				export_files = atol(optarg);
+				break;
+			case 'E':
+				export_mib = atol(optarg);
+				break;
+			case 'w':
+				wide_entries = atol(optarg);
+				break;
+			case 'T':
+				tree_files = atol(optarg);
+				break;
+			case 'D':
+				deep_levels = atol(optarg);
+				break;
+			case 'r':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'h':
+				usage();
+				exit(0);
+			default:
+				usage();
+				exit(1);
+		}
+	}
+
+	if (root == NULL || small_files < 0 || small_size < 1 ||
+		huge_files < 0 || huge_mib < 0 || export_files < 0 ||
+		export_mib < 0 || wide_entries < 0 || tree_files < 0 ||
+		deep_levels < 0 || deep_levels > MAX_DEEP_LEVELS) {
+		usage();
+		exit(1);
+	}
+	// A zero state would stay zero
+	if (seed == 0)
+		seed = 1;
+
+	char path[4096];
+	make_directory(root);
+	const char * subdirectories[] = { "small", "huge", "export", "wide",
+		"tree", "upload" };
+	for (int i = 0; i < 6; i++) {
+		snprintf(path, sizeof (path), "%s/%s", root, subdirectories[i]);
+		make_directory(path);
+	}
+
+	snprintf(path, sizeof (path), "%s/MANIFEST", root);
+	FILE * manifest = fopen(path, "w");
+	if (manifest == NULL)
+		fail("Error on creating", path);
+
+	// Directories first, so that ftp_load can list them
+	fprintf(manifest, "dir 0 .\n");
+	for (int i = 0; i < 5; i++)
+		fprintf(manifest, "dir 0 %s\n", subdirectories[i]);
+
+	for (long i = 0; i < small_files; i++) {
+		unsigned long long size = 1 + bench_random(&seed) % small_size;
+		snprintf(path, sizeof (path), "%s/small/f%06ld", root, i);
+		make_file(path, size, CONTENTS_TEXT, &seed);
+		fprintf(manifest, "small %llu small/f%06ld\n", size, i);
+	}
+
+	for (long i = 0; i < huge_files; i++) {
+		unsigned long long size = (unsigned long long)huge_mib << 20;
+		snprintf(path, sizeof (path), "%s/huge/h%02ld", root, i);
+		make_file(path, size, CONTENTS_BINARY, &seed);
+		fprintf(manifest, "huge %llu huge/h%02ld\n", size, i);
+	}
+
+	for (long i = 0; i < export_files; i++) {
+		unsigned long long size = (unsigned long long)export_mib << 20;
+		snprintf(path, sizeof (path), "%s/export/x%02ld.csv", root, i);
+		make_file(path, size, CONTENTS_CSV, &seed);
+		fprintf(manifest, "export %llu export/x%02ld.csv\n", size, i);
+	}
+
+	for (long i = 0; i < wide_entries; i++) {
+		snprintf(path, sizeof (path), "%s/wide/e%07ld", root, i);
+		make_file(path, 0, CONTENTS_BINARY, &seed);
+		fprintf(manifest, "wide 0 wide/e%07ld\n", i);
+	}
+
+	/*
+	 * Files like the small ones, a hundred to a directory,
+	 * under tree/dNN/dNN: what a directory download walks
+	 */
+	for (long i = 0; i < tree_files; i++) {
+		long leaf = i / TREE_FILES_PER_DIRECTORY;
+		if (i % TREE_FILES_PER_DIRECTORY == 0) {
+			if (leaf % TREE_FANOUT == 0) {
+				snprintf(path, sizeof (path), "%s/tree/d%02ld", root,
+					leaf / TREE_FANOUT);
+				make_directory(path);
+			}
+			snprintf(path, sizeof (path), "%s/tree/d%02ld/d%02ld", root,
+				leaf / TREE_FANOUT, leaf % TREE_FANOUT);
+			make_directory(path);
+		}
+
+		unsigned long long size = 1 + bench_random(&seed) % small_size;
+		snprintf(path, sizeof (path), "%s/tree/d%02ld/d%02ld/f%06ld", root,
+			leaf / TREE_FANOUT, leaf % TREE_FANOUT, i);
+		make_file(path, size, CONTENTS_TEXT, &seed);
+		fprintf(manifest, "tree %llu tree/d%02ld/d%02ld/f%06ld\n", size,
+			leaf / TREE_FANOUT, leaf % TREE_FANOUT, i);
+	}
+
+	/*
+	 * Small files under deep/l01/l02/... down to the given
+	 * level: what resolving a long path costs
+	 */
+	if (deep_levels > 0) {
+		if (strlen(root) + 4 * MAX_DEEP_LEVELS + 16 >= sizeof (path)) {
+			fprintf(stderr, "Directory name too long: %s\n", root);
+			exit(1);
+		}
+		char * end = path + snprintf(path, sizeof (path), "%s/deep", root);
+		make_directory(path);
+		for (long level = 1; level <= deep_levels; level++) {
+			end += sprintf(end, "/l%02ld", level);
+			make_directory(path);
+		}
+		const char * relative = path + strlen(root) + 1;
+		for (long i = 0; i < DEEP_FILES; i++) {
+			unsigned long long size = 1 + bench_random(&seed) % small_size;
+			sprintf(end, "/f%04ld", i);
+			make_file(path, size, CONTENTS_TEXT, &seed);
+			fprintf(manifest, "deep %llu %s\n", size, relative);
+		}
+	}
+
+	if (fclose(manifest) != 0)
+		fail("Error on writing", "MANIFEST");
+
+	return (0);
+}
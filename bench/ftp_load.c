@@ -0,0 +1,1438 @@
+/*
+ * Load generator for ftp2_server. Simulates concurrent clients
+ * over loopback, each logging in and then running a weighted
+ * mix of LIST, RETR, STOR and APPE over PASV, EPSV, PORT and
+ * EPRT data connections, against a tree made by ftp_fixtures.
+ * LIST may be held to a single directory, such as a wide one.
+ * A large file can be pulled in segments over parallel sessions
+ * with REST, as a segmented download manager would. Connections
+ * may be opened and closed at the greeting, to load the accept path.
+ * RETR picks files uniformly, or by a Zipf law to model a set
+ * of hot files. A whole group of files can be downloaded
+ * file by file, or as an archive with SITE TARGET. Transfers may run in MODE Z, and data
+ * connections may be throttled to the rate of a slow link. A
+ * crowd of idle sessions can be logged in and held at the prompt
+ * while the clients run, to load the server with sessions.
+ * Reports throughput and per-command latency as CSV or JSON.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <zlib.h>
+#include "bench.h"
+
+// Longest reply line or command we handle
+#define		LINE_SIZE 1024
+#define		CONTROL_BUFFER_SIZE 4096
+#define		DATA_BUFFER_SIZE (256 * 1024)
+// How long a client waits on the server before giving up
+#define		IO_TIMEOUT_MS 30000
+// STOR cycles through this many names per client
+#define		STOR_NAMES 16
+// Bytes moved at a time over a throttled data connection
+#define		THROTTLE_CHUNK_SIZE 16384
+// Larger uploads send the payload over and over
+#define		PAYLOAD_SIZE (64L * 1024 * 1024)
+
+// Everything a client times, including the steps of a session setup
+typedef enum command {
+	// TCP connect up to the greeting
+	CMD_CONNECT,
+	// TCP connect up to a 421 from a server turning the session away
+	CMD_REJECTED,
+	// Connect through a completed login
+	CMD_SETUP,
+	CMD_USER,
+	CMD_PASS,
+	CMD_TYPE,
+	CMD_MODE,
+	CMD_OPTS,
+	CMD_PASV,
+	CMD_EPSV,
+	CMD_PORT,
+	CMD_EPRT,
+	CMD_CWD,
+	CMD_REST,
+	CMD_LIST,
+	CMD_RETR,
+	CMD_STOR,
+	CMD_APPE,
+	// SITE TARGET of the group's directory, read to its end
+	CMD_SITE,
+	// Every file of the group by RETR, one after the other
+	CMD_MIRROR,
+	// A LIST, RETR or SITE TARGET up to the first byte of its data
+	CMD_TTFB,
+	NUM_COMMANDS
+} command_t;
+
+static const char * command_names[NUM_COMMANDS] = {
+	"CONNECT", "REJECTED", "SETUP", "USER", "PASS", "TYPE", "MODE", "OPTS",
+	"PASV", "EPSV", "PORT", "EPRT", "CWD", "REST", "LIST", "RETR", "STOR",
+	"APPE", "SITE", "MIRROR", "TTFB"
+};
+
+// Operations the mix is made of
+typedef enum operation {
+	OP_LIST,
+	OP_RETR,
+	OP_STOR,
+	OP_APPE,
+	OP_MIRROR,
+	OP_ARCHIVE,
+	OP_SEGMENT,
+	OP_CONNECT,
+	NUM_OPERATIONS
+} operation_t;
+
+static const char * operation_names[NUM_OPERATIONS] = {
+	"list", "retr", "stor", "appe", "mirror", "archive", "segment",
+	"connect"
+};
+
+// Ways of setting up a data connection
+typedef enum data_mode {
+	MODE_PASV,
+	MODE_EPSV,
+	MODE_PORT,
+	MODE_EPRT,
+	NUM_MODES
+} data_mode_t;
+
+static const char * mode_names[NUM_MODES] = {
+	"pasv", "epsv", "port", "eprt"
+};
+
+// A file or directory listed in the fixture MANIFEST
+typedef struct target {
+	char * path;
+	unsigned long long size;
+} target_t;
+
+typedef struct target_set {
+	target_t * targets;
+	size_t count;
+	size_t capacity;
+} target_set_t;
+
+// Buffered reader over a control connection
+typedef struct connection {
+	int fd;
+	size_t start;
+	size_t len;
+	char buffer[CONTROL_BUFFER_SIZE];
+} connection_t;
+
+typedef struct client {
+	int id;
+	pthread_t thread;
+	unsigned long long random;
+	connection_t control;
+	int logged_in;
+	unsigned long stor_count;
+	unsigned long long operations;
+	// Command lines sent over the control connection
+	unsigned long long commands;
+	bench_histogram_t latency[NUM_COMMANDS];
+	unsigned long long errors[NUM_COMMANDS];
+	unsigned long long bytes[NUM_COMMANDS];
+	// Bytes on the data connections, compressed in MODE Z
+	unsigned long long wire_bytes;
+	z_stream inflater;
+	char data[DATA_BUFFER_SIZE];
+	char inflated[DATA_BUFFER_SIZE];
+} client_t;
+
+static const char * optstring = "H:p:c:t:n:k:m:d:f:g:s:a:T:o:r:z:Z:B:i:L:S:h";
+
+// Settings, fixed before the clients start
+static struct addrinfo * server_address;
+static long num_clients = 8;
+static long seconds = 10;
+static long operations_per_client = 0;
+static long operations_per_session = 0;
+static unsigned operation_weights[NUM_OPERATIONS];
+static unsigned operation_total;
+static unsigned mode_weights[NUM_MODES];
+static unsigned mode_total;
+static const char * mix = "list=1,retr=6,stor=1,appe=1";
+static const char * modes = "pasv=1,epsv=1,port=1,eprt=1";
+static const char * group = "small";
+static long stor_size = 65536;
+static long appe_size = 4096;
+static char transfer_type = 'I';
+static unsigned long long seed = 1;
+static target_set_t files, directories;
+/*
+ * Zipf exponent of the RETR file popularity, with files ranked
+ * in manifest order, and the resulting cumulative distribution;
+ * zero picks files uniformly
+ */
+static double zipf_exponent = 0;
+static double * zipf_cdf;
+// Payload of STOR and APPE
+static char * payload;
+// MODE Z compression level, -1 for stream mode
+static int compression_level = -1;
+// The payloads as sent in MODE Z
+static char * stor_deflated, * appe_deflated;
+static size_t stor_deflated_size, appe_deflated_size;
+// Rate each data connection is held to in bytes a second, 0 for none
+static long link_rate = 0;
+// Sessions logged in before the run and left idle through it
+static long idle_sessions = 0;
+// The one directory LIST runs in, instead of those of the MANIFEST
+static const char * list_directory = NULL;
+// Segments a segmented download splits the group's first file in
+static long num_segments = 1;
+
+static volatile int stop = 0;
+static pthread_barrier_t start_barrier;
+
+static void
+usage() {
+
+	printf("Usage: ftp_load -f <fixture directory> [-H <host>] "
+		"[-p <port>] [-c <clients>] [-t <seconds>] "
+		"[-n <operations per client>] [-k <operations per session>] "
+		"[-m <list=N,retr=N,stor=N,appe=N,mirror=N,archive=N,"
+		"segment=N,connect=N>] "
+		"[-d <pasv=N,epsv=N,port=N,eprt=N>] "
+		"[-g <small|huge|export|wide|tree|deep|all>] [-s <STOR bytes>] "
+		"[-a <APPE bytes>] [-T <A|I>] [-o <csv|json>] [-r <seed>] "
+		"[-z <Zipf exponent of RETR>] [-Z <MODE Z level>] "
+		"[-B <bytes per second per data connection>] "
+		"[-i <idle sessions>] [-L <LIST directory>] "
+		"[-S <segments>] [-h]\n");
+}
+
+static void
+target_add(target_set_t * set, const char * path, unsigned long long size) {
+
+	if (set->count == set->capacity) {
+		set->capacity = set->capacity ? set->capacity * 2 : 1024;
+		set->targets = realloc(set->targets,
+			set->capacity * sizeof (target_t));
+		if (set->targets == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	set->targets[set->count].path = strdup(path);
+	set->targets[set->count].size = size;
+	set->count++;
+}
+
+/*
+ * Read the MANIFEST of a fixture tree; directories are LIST
+ * targets and files of the selected group RETR targets
+ */
+static void
+load_manifest(const char * root) {
+
+	char path[4096];
+	snprintf(path, sizeof (path), "%s/MANIFEST", root);
+	FILE * manifest = fopen(path, "r");
+	if (manifest == NULL) {
+		fprintf(stderr, "Error on opening %s: %s\n", path,
+			strerror(errno));
+		exit(1);
+	}
+
+	char kind[32], name[2048];
+	unsigned long long size;
+	while (fscanf(manifest, "%31s %llu %2047s", kind, &size, name) == 3) {
+		if (!strcmp(kind, "dir"))
+			target_add(&directories, name, size);
+		else if (!strcmp(group, "all") || !strcmp(group, kind))
+			target_add(&files, name, size);
+	}
+	fclose(manifest);
+
+	if (files.count == 0 && (operation_weights[OP_RETR] > 0 ||
+		operation_weights[OP_MIRROR] > 0 ||
+		operation_weights[OP_SEGMENT] > 0)) {
+		fprintf(stderr, "No files of group %s in %s\n", group, path);
+		exit(1);
+	}
+}
+
+// The probability of the file of rank k is proportional to 1 / k^s
+static void
+zipf_init() {
+
+	zipf_cdf = malloc(files.count * sizeof (double));
+	if (zipf_cdf == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	double sum = 0;
+	for (size_t k = 0; k < files.count; k++) {
+		sum += 1.0 / pow(k + 1, zipf_exponent);
+		zipf_cdf[k] = sum;
+	}
+	for (size_t k = 0; k < files.count; k++)
+		zipf_cdf[k] /= sum;
+}
+
+// Pick a RETR target, by rank when popularity follows a Zipf law
+static const char *
+pick_file(client_t * client) {
+
+	unsigned long long random = bench_random(&client->random);
+	if (zipf_cdf == NULL)
+		return (files.targets[random % files.count].path);
+
+	// 53 random bits make a uniform double in [0, 1)
+	double u = (random >> 11) * (1.0 / (1ULL << 53));
+	size_t low = 0, high = files.count - 1;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (zipf_cdf[mid] > u)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return (files.targets[low].path);
+}
+
+static void
+set_timeouts(int fd) {
+
+	struct timeval timeout = { IO_TIMEOUT_MS / 1000, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+}
+
+/*
+ * A throttled data connection gets small socket buffers, so
+ * that the link holds about as much in flight as a slow one
+ */
+static void
+set_link_buffers(int fd) {
+
+	int size = THROTTLE_CHUNK_SIZE * 4;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof (size));
+}
+
+static int
+connect_to(const struct sockaddr * address, socklen_t len, int data) {
+
+	int fd = socket(address->sa_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return (-1);
+	set_timeouts(fd);
+	if (data && link_rate > 0)
+		set_link_buffers(fd);
+	if (connect(fd, address, len) < 0) {
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+static int
+write_all(int fd, const char * buffer, size_t len) {
+
+	while (len > 0) {
+		ssize_t n = write(fd, buffer, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		buffer += n;
+		len -= n;
+	}
+
+	return (0);
+}
+
+/*
+ * Read one line off the control connection, without its line
+ * ending; returns its length or -1 once the connection fails
+ */
+static int
+read_line(connection_t * connection, char * line) {
+
+	while (1) {
+
+		char * begin = connection->buffer + connection->start;
+		char * eol = memchr(begin, '\n', connection->len);
+		if (eol != NULL || connection->len == CONTROL_BUFFER_SIZE) {
+			size_t len = eol != NULL ? (size_t)(eol - begin) :
+				connection->len;
+			size_t used = eol != NULL ? len + 1 : len;
+			if (len > 0 && begin[len - 1] == '\r')
+				len--;
+			if (len > LINE_SIZE - 1)
+				len = LINE_SIZE - 1;
+			memcpy(line, begin, len);
+			line[len] = '\0';
+			connection->start += used;
+			connection->len -= used;
+			return ((int)len);
+		}
+
+		memmove(connection->buffer, begin, connection->len);
+		connection->start = 0;
+		ssize_t n = read(connection->fd,
+			connection->buffer + connection->len,
+			CONTROL_BUFFER_SIZE - connection->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (-1);
+		connection->len += n;
+	}
+}
+
+/*
+ * Read a complete reply and return its code, or -1 if the
+ * connection failed. The first line, from its code on, is
+ * kept in text. Stray bytes in front of a code and lines
+ * without one are skipped.
+ */
+static int
+read_reply(connection_t * connection, char * text) {
+
+	char line[LINE_SIZE];
+	int code = -1;
+
+	while (1) {
+
+		int len = read_line(connection, line);
+		if (len < 0)
+			return (-1);
+
+		int i = 0;
+		while (i < len && (line[i] == '\0' ||
+			isspace((unsigned char)line[i])))
+			i++;
+		char * p = line + i;
+		if (len - i < 3 || !isdigit((unsigned char)p[0]) ||
+			!isdigit((unsigned char)p[1]) ||
+			!isdigit((unsigned char)p[2]))
+			continue;
+
+		int line_code = (p[0] - '0') * 100 + (p[1] - '0') * 10 +
+			(p[2] - '0');
+		int more = len - i > 3 && p[3] == '-';
+		if (code < 0) {
+			code = line_code;
+			if (text != NULL)
+				memcpy(text, p, len - i + 1);
+		}
+		else if (line_code != code)
+			continue;
+		if (!more)
+			return (code);
+	}
+}
+
+static int
+send_command(client_t * client, const char * format, va_list args) {
+
+	char line[LINE_SIZE];
+	int len = vsnprintf(line, sizeof (line) - 2, format, args);
+	if (len < 0 || len >= (int)sizeof (line) - 2)
+		return (-1);
+	line[len++] = '\r';
+	line[len++] = '\n';
+
+	client->commands++;
+	return (write_all(client->control.fd, line, len));
+}
+
+static void
+record(client_t * client, command_t command, unsigned long long start,
+	int failed) {
+
+	bench_histogram_add(&client->latency[command], bench_now_ns() - start);
+	if (failed)
+		client->errors[command]++;
+}
+
+/*
+ * Run a command that takes a single reply and time it;
+ * returns the reply code or -1 if the connection failed
+ */
+static int
+run_command(client_t * client, command_t command, char * text,
+	const char * format, ...) {
+
+	unsigned long long start = bench_now_ns();
+
+	va_list args;
+	va_start(args, format);
+	int err = send_command(client, format, args);
+	va_end(args);
+
+	int code = err < 0 ? -1 : read_reply(&client->control, text);
+	record(client, command, start, code < 0 || code >= 400);
+
+	return (code);
+}
+
+static void
+session_close(client_t * client) {
+
+	if (client->control.fd < 0)
+		return;
+	// The goodbye is not worth waiting for
+	write_all(client->control.fd, "QUIT\r\n", 6);
+	client->commands++;
+	close(client->control.fd);
+	client->control.fd = -1;
+	client->logged_in = 0;
+}
+
+// Connect and log in; returns 0 or -1
+static int
+session_open(client_t * client) {
+
+	unsigned long long start = bench_now_ns();
+
+	client->control.start = 0;
+	client->control.len = 0;
+	client->control.fd = connect_to(server_address->ai_addr,
+		server_address->ai_addrlen, 0);
+	if (client->control.fd < 0) {
+		record(client, CMD_CONNECT, start, 1);
+		return (-1);
+	}
+	int one = 1;
+	setsockopt(client->control.fd, IPPROTO_TCP, TCP_NODELAY, &one,
+		sizeof (one));
+
+	int code = read_reply(&client->control, NULL);
+	// An overloaded server may say so instead of greeting
+	if (code == 421) {
+		record(client, CMD_REJECTED, start, 0);
+		close(client->control.fd);
+		client->control.fd = -1;
+		return (-1);
+	}
+	record(client, CMD_CONNECT, start, code != 220);
+	if (code != 220)
+		goto failed;
+
+	if (run_command(client, CMD_USER, NULL, "USER anonymous") != 331 ||
+		run_command(client, CMD_PASS, NULL, "PASS bench@") != 230)
+		goto failed;
+	record(client, CMD_SETUP, start, 0);
+
+	if (run_command(client, CMD_TYPE, NULL, "TYPE %c",
+		transfer_type) != 200)
+		goto failed;
+	if (compression_level >= 0 &&
+		(run_command(client, CMD_MODE, NULL, "MODE Z") != 200 ||
+		run_command(client, CMD_OPTS, NULL, "OPTS MODE Z LEVEL %d",
+		compression_level) != 200))
+		goto failed;
+
+	client->logged_in = 1;
+	return (0);
+
+failed:
+	client->errors[CMD_SETUP]++;
+	session_close(client);
+	return (-1);
+}
+
+/*
+ * Set up the data connection of the next transfer. Passive
+ * modes return a connected socket; active modes return a
+ * listener for the server to connect to and set *listening.
+ * Returns -2 if the control connection failed.
+ */
+static int
+data_open(client_t * client, data_mode_t mode, int * listening) {
+
+	char text[LINE_SIZE];
+	struct sockaddr_storage address;
+	socklen_t len = sizeof (address);
+	*listening = mode == MODE_PORT || mode == MODE_EPRT;
+
+	if (!*listening) {
+		int passive = mode == MODE_PASV;
+		int code = run_command(client, passive ? CMD_PASV : CMD_EPSV,
+			text, passive ? "PASV" : "EPSV");
+		if (code < 0)
+			return (-2);
+		if (code != (passive ? 227 : 229))
+			return (-1);
+
+		unsigned h[6], port;
+		char * fields = strchr(text, '(');
+		if (fields == NULL)
+			return (-1);
+		if (passive) {
+			if (sscanf(fields, "(%u,%u,%u,%u,%u,%u)", &h[0], &h[1],
+				&h[2], &h[3], &h[4], &h[5]) != 6)
+				return (-1);
+			port = h[4] * 256 + h[5];
+		}
+		else if (sscanf(fields, "(|||%u|)", &port) != 1)
+			return (-1);
+
+		// The data port is on the host we reached the server at
+		memcpy(&address, server_address->ai_addr,
+			server_address->ai_addrlen);
+		if (address.ss_family == AF_INET)
+			((struct sockaddr_in *)&address)->sin_port = htons(port);
+		else
+			((struct sockaddr_in6 *)&address)->sin6_port = htons(port);
+
+		return (connect_to((struct sockaddr *)&address,
+			server_address->ai_addrlen, 1));
+	}
+
+	// Listen on the address the control connection comes from
+	if (getsockname(client->control.fd, (struct sockaddr *)&address,
+		&len) < 0)
+		return (-1);
+	if (address.ss_family == AF_INET)
+		((struct sockaddr_in *)&address)->sin_port = 0;
+	else
+		((struct sockaddr_in6 *)&address)->sin6_port = 0;
+
+	int fd = socket(address.ss_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return (-1);
+	// Accepted connections take the listener's buffer sizes
+	if (link_rate > 0)
+		set_link_buffers(fd);
+	if (bind(fd, (struct sockaddr *)&address, len) < 0 ||
+		listen(fd, 1) < 0 ||
+		getsockname(fd, (struct sockaddr *)&address, &len) < 0) {
+		close(fd);
+		return (-1);
+	}
+
+	int code;
+	if (mode == MODE_PORT) {
+		if (address.ss_family != AF_INET) {
+			close(fd);
+			return (-1);
+		}
+		unsigned char * ip = (unsigned char *)
+			&((struct sockaddr_in *)&address)->sin_addr;
+		unsigned port = ntohs(((struct sockaddr_in *)&address)->sin_port);
+		code = run_command(client, CMD_PORT, NULL,
+			"PORT %u,%u,%u,%u,%u,%u", ip[0], ip[1], ip[2], ip[3],
+			port / 256, port % 256);
+	}
+	else {
+		char host[INET6_ADDRSTRLEN];
+		int v4 = address.ss_family == AF_INET;
+		unsigned port = v4 ?
+			ntohs(((struct sockaddr_in *)&address)->sin_port) :
+			ntohs(((struct sockaddr_in6 *)&address)->sin6_port);
+		inet_ntop(address.ss_family, v4 ?
+			(void *)&((struct sockaddr_in *)&address)->sin_addr :
+			(void *)&((struct sockaddr_in6 *)&address)->sin6_addr,
+			host, sizeof (host));
+		code = run_command(client, CMD_EPRT, NULL, "EPRT |%d|%s|%u|",
+			v4 ? 1 : 2, host, port);
+	}
+
+	if (code != 200) {
+		close(fd);
+		return (code < 0 ? -2 : -1);
+	}
+
+	return (fd);
+}
+
+// Take the server's connection to an active mode listener
+static int
+data_accept(int listener) {
+
+	struct pollfd pfd = { listener, POLLIN, 0 };
+	int fd = -1;
+	if (poll(&pfd, 1, IO_TIMEOUT_MS) == 1)
+		fd = accept(listener, NULL, NULL);
+	close(listener);
+	if (fd >= 0)
+		set_timeouts(fd);
+
+	return (fd);
+}
+
+/*
+ * Hold a data connection to the link rate by sleeping until
+ * the bytes moved since start are due
+ */
+static void
+throttle(unsigned long long start, unsigned long long moved) {
+
+	if (link_rate <= 0)
+		return;
+
+	unsigned long long due = start + moved * 1000000000ULL / link_rate;
+	unsigned long long now = bench_now_ns();
+	if (due > now) {
+		struct timespec pause = { (due - now) / 1000000000ULL,
+			(due - now) % 1000000000ULL };
+		while (nanosleep(&pause, &pause) < 0 && errno == EINTR)
+			;
+	}
+}
+
+/*
+ * Send len bytes of an upload as they go over the wire, going
+ * through the size bytes of data as many times as it takes;
+ * returns 0 or -1
+ */
+static int
+send_upload(client_t * client, int fd, const char * data, size_t size,
+	size_t len) {
+
+	unsigned long long start = bench_now_ns();
+	size_t chunk = link_rate > 0 ? THROTTLE_CHUNK_SIZE : size;
+
+	for (size_t done = 0, n; done < len; done += n) {
+		size_t offset = done % size;
+		n = len - done < chunk ? len - done : chunk;
+		if (n > size - offset)
+			n = size - offset;
+		if (write_all(fd, data + offset, n) < 0)
+			return (-1);
+		client->wire_bytes += n;
+		throttle(start, done + n);
+	}
+
+	return (0);
+}
+
+/*
+ * Read a download to its end, or up to length bytes unless it
+ * is zero, inflating it in MODE Z, and add its bytes to *moved;
+ * *first_byte is set to when its first bytes came, if any did.
+ * Returns 0, or -1 if the connection failed or, in MODE Z, did
+ * not carry a whole stream.
+ */
+static int
+receive_download(client_t * client, int fd, unsigned long long * moved,
+	unsigned long long length, unsigned long long * first_byte) {
+
+	z_stream * z = &client->inflater;
+	unsigned long long start = bench_now_ns(), wire = 0;
+	size_t size = link_rate > 0 ? THROTTLE_CHUNK_SIZE : DATA_BUFFER_SIZE;
+	int ret = Z_OK;
+
+	if (compression_level >= 0 && inflateReset(z) != Z_OK)
+		return (-1);
+
+	while (length == 0 || *moved < length) {
+
+		if (length > 0 && length - *moved < size)
+			size = length - *moved;
+		ssize_t n = read(fd, client->data, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (-1);
+		if (n == 0)
+			break;
+		if (wire == 0)
+			*first_byte = bench_now_ns();
+		wire += n;
+		client->wire_bytes += n;
+		throttle(start, wire);
+
+		if (compression_level < 0) {
+			*moved += n;
+			continue;
+		}
+		z->next_in = (Bytef *)client->data;
+		z->avail_in = n;
+		do {
+			z->next_out = (Bytef *)client->inflated;
+			z->avail_out = DATA_BUFFER_SIZE;
+			ret = inflate(z, Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+				return (-1);
+			*moved += DATA_BUFFER_SIZE - z->avail_out;
+		} while (z->avail_out == 0);
+	}
+
+	return (compression_level < 0 || ret == Z_STREAM_END ? 0 : -1);
+}
+
+/*
+ * Run a LIST, RETR, STOR, APPE or SITE TARGET with its data connection,
+ * timed from sending the command to its final reply. With a length,
+ * the download is a segment: it starts at offset, given with REST,
+ * and is cut off after length bytes.
+ * Returns 0, or -1 if the control connection failed.
+ */
+static int
+run_transfer(client_t * client, command_t command, const char * path,
+	size_t upload, unsigned long long offset, unsigned long long length) {
+
+	data_mode_t mode = bench_pick_weighted(mode_weights, NUM_MODES,
+		mode_total, (unsigned)bench_random(&client->random));
+	int listening;
+	int fd = data_open(client, mode, &listening);
+	if (fd < 0) {
+		client->errors[command]++;
+		return (fd == -2 ? -1 : 0);
+	}
+	if (length > 0) {
+		int code = run_command(client, CMD_REST, NULL, "REST %llu",
+			offset);
+		if (code != 350) {
+			close(fd);
+			return (code < 0 ? -1 : 0);
+		}
+	}
+
+	unsigned long long start = bench_now_ns();
+	const char * verb = command == CMD_SITE ? "SITE TARGET" :
+		command_names[command];
+	client->commands++;
+	if ((path == NULL ? write_all(client->control.fd, "LIST\r\n", 6) :
+		dprintf(client->control.fd, "%s %s\r\n", verb, path) < 0)) {
+		close(fd);
+		record(client, command, start, 1);
+		return (-1);
+	}
+
+	/*
+	 * The server only opens the data connection once the file
+	 * is ready, and says so in a preliminary reply first
+	 */
+	int code = read_reply(&client->control, NULL);
+	if (code < 100 || code >= 200) {
+		close(fd);
+		record(client, command, start, 1);
+		return (code < 0 ? -1 : 0);
+	}
+	if (listening && (fd = data_accept(fd)) < 0) {
+		record(client, command, start, 1);
+		return (-1);
+	}
+
+	int failed = 0;
+	unsigned long long moved = 0, first_byte = 0;
+	if (upload > 0 && compression_level >= 0) {
+		int stor = command == CMD_STOR;
+		size_t size = stor ? stor_deflated_size : appe_deflated_size;
+		failed = send_upload(client, fd, stor ? stor_deflated :
+			appe_deflated, size, size) < 0;
+		moved = failed ? 0 : upload;
+	}
+	else if (upload > 0) {
+		failed = send_upload(client, fd, payload,
+			upload < PAYLOAD_SIZE ? upload : PAYLOAD_SIZE, upload) < 0;
+		moved = failed ? 0 : upload;
+	}
+	else
+		failed = receive_download(client, fd, &moved, length,
+			&first_byte) < 0;
+	close(fd);
+
+	/*
+	 * A segment cut off before the end of the file may be
+	 * reported as failed; it got what it came for
+	 */
+	code = read_reply(&client->control, NULL);
+	int cut = length > 0 && moved == length;
+	record(client, command, start, failed || code < 200 ||
+		(code >= 300 && !cut));
+	client->bytes[command] += moved;
+	if (first_byte > 0)
+		bench_histogram_add(&client->latency[CMD_TTFB], first_byte - start);
+
+	return (code < 0 ? -1 : 0);
+}
+
+// Run one operation of the mix; returns -1 if the session broke
+static int
+run_operation(client_t * client) {
+
+	operation_t operation = bench_pick_weighted(operation_weights,
+		NUM_OPERATIONS, operation_total,
+		(unsigned)bench_random(&client->random));
+	char path[64];
+
+	switch (operation) {
+		case OP_LIST: {
+			const char * dir = list_directory != NULL ? list_directory :
+				directories.count == 0 ? "." :
+				directories.targets[bench_random(&client->random) %
+				directories.count].path;
+			int in_root = !strcmp(dir, ".");
+			if (!in_root && run_command(client, CMD_CWD, NULL, "CWD %s",
+				dir) != 250)
+				return (-1);
+			if (run_transfer(client, CMD_LIST, NULL, 0, 0, 0) < 0)
+				return (-1);
+			// Back up to the root, a level at a time
+			for (const char * c = dir; !in_root && c != NULL;
+				c = strchr(c + 1, '/')) {
+				if (run_command(client, CMD_CWD, NULL, "CWD ..") != 250)
+					return (-1);
+			}
+			return (0);
+		}
+		case OP_RETR:
+			return (run_transfer(client, CMD_RETR, pick_file(client),
+				0, 0, 0));
+		case OP_STOR:
+			snprintf(path, sizeof (path), "upload/s%04d_%02lu",
+				client->id, client->stor_count++ % STOR_NAMES);
+			return (run_transfer(client, CMD_STOR, path, stor_size,
+				0, 0));
+		case OP_APPE:
+			snprintf(path, sizeof (path), "upload/a%04d", client->id);
+			return (run_transfer(client, CMD_APPE, path, appe_size,
+				0, 0));
+		/*
+		 * The whole group, to set a download file by file against
+		 * one archive of it; the files count as RETR, the time
+		 * all of them took as MIRROR
+		 */
+		case OP_MIRROR: {
+			unsigned long long start = bench_now_ns();
+			unsigned long long errors = client->errors[CMD_RETR];
+			for (size_t i = 0; i < files.count && !stop; i++) {
+				if (run_transfer(client, CMD_RETR,
+					files.targets[i].path, 0, 0, 0) < 0) {
+					record(client, CMD_MIRROR, start, 1);
+					return (-1);
+				}
+			}
+			// One cut short by the end of the run is not timed
+			if (!stop)
+				record(client, CMD_MIRROR, start,
+					client->errors[CMD_RETR] != errors);
+			return (0);
+		}
+		/*
+		 * The client's segment of the group's first file; the
+		 * clients take the segments in turn by id, so that as
+		 * many of them as there are segments pull the whole file
+		 * in parallel
+		 */
+		case OP_SEGMENT: {
+			target_t * file = &files.targets[0];
+			unsigned long long length = file->size / num_segments;
+			long segment = client->id % num_segments;
+			unsigned long long offset = segment * length;
+			if (segment == num_segments - 1)
+				length = file->size - offset;
+			if (length == 0)
+				return (0);
+			return (run_transfer(client, CMD_RETR, file->path, 0,
+				offset, length));
+		}
+		/*
+		 * A connection apart from the session's, timed up to the
+		 * greeting and closed at once: what accepting a session
+		 * costs the server
+		 */
+		case OP_CONNECT: {
+			connection_t probe;
+			probe.start = 0;
+			probe.len = 0;
+			unsigned long long start = bench_now_ns();
+			probe.fd = connect_to(server_address->ai_addr,
+				server_address->ai_addrlen, 0);
+			if (probe.fd < 0) {
+				record(client, CMD_CONNECT, start, 1);
+				return (0);
+			}
+			int code = read_reply(&probe, NULL);
+			if (code == 421)
+				record(client, CMD_REJECTED, start, 0);
+			else
+				record(client, CMD_CONNECT, start, code != 220);
+			write_all(probe.fd, "QUIT\r\n", 6);
+			client->commands++;
+			close(probe.fd);
+			return (0);
+		}
+		case OP_ARCHIVE:
+		default:
+			return (run_transfer(client, CMD_SITE,
+				strcmp(group, "all") ? group : ".", 0, 0, 0));
+	}
+}
+
+static void *
+client_thread(void * args) {
+
+	client_t * client = args;
+	unsigned long long session_operations = 0;
+
+	pthread_barrier_wait(&start_barrier);
+
+	while (!stop) {
+
+		if (!client->logged_in) {
+			if (session_open(client) < 0) {
+				// Back off rather than spin on a refusing server
+				poll(NULL, 0, 10);
+				continue;
+			}
+			session_operations = 0;
+		}
+
+		if (run_operation(client) < 0)
+			session_close(client);
+		client->operations++;
+		session_operations++;
+
+		if (operations_per_session > 0 &&
+			session_operations >= (unsigned long long)operations_per_session)
+			session_close(client);
+		if (operations_per_client > 0 &&
+			client->operations >= (unsigned long long)operations_per_client)
+			break;
+	}
+
+	session_close(client);
+	return (NULL);
+}
+
+/*
+ * Log in the idle sessions one after the other and keep their
+ * control connections, leaving them at the prompt; returns the
+ * number opened
+ */
+static long
+idle_open(client_t * idler, int * fds) {
+
+	long opened = 0;
+	for (long i = 0; i < idle_sessions; i++) {
+		if (session_open(idler) < 0)
+			continue;
+		fds[opened++] = idler->control.fd;
+		idler->control.fd = -1;
+		idler->logged_in = 0;
+	}
+
+	return (opened);
+}
+
+/*
+ * Count the idle sessions the server has dropped: an idle
+ * control connection only turns readable once the server has
+ * said goodbye or closed it. The rest are closed.
+ */
+static long
+idle_close(int * fds, long count) {
+
+	struct pollfd * pfds = calloc(count, sizeof (struct pollfd));
+	if (pfds == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (long i = 0; i < count; i++) {
+		pfds[i].fd = fds[i];
+		pfds[i].events = POLLIN;
+	}
+
+	long dropped = 0;
+	if (poll(pfds, count, 0) > 0) {
+		for (long i = 0; i < count; i++)
+			dropped += pfds[i].revents != 0;
+	}
+	for (long i = 0; i < count; i++)
+		close(fds[i]);
+	free(pfds);
+
+	return (dropped);
+}
+
+/*
+ * TCP segments this host has sent so far, from the kernel's
+ * SNMP counters; on loopback those of both ends count. Returns
+ * -1 where the counters are not available.
+ */
+static long long
+tcp_segments() {
+
+	FILE * snmp = fopen("/proc/net/snmp", "r");
+	if (snmp == NULL)
+		return (-1);
+
+	char names[1024], values[1024];
+	long long segments = -1;
+	while (fgets(names, sizeof (names), snmp) != NULL &&
+		fgets(values, sizeof (values), snmp) != NULL) {
+		if (strncmp(names, "Tcp:", 4) != 0)
+			continue;
+		// Find OutSegs among the names, then take the same column
+		char * name_state, * value_state;
+		char * name = strtok_r(names, " \n", &name_state);
+		char * value = strtok_r(values, " \n", &value_state);
+		while (name != NULL && value != NULL) {
+			if (strcmp(name, "OutSegs") == 0) {
+				segments = atoll(value);
+				break;
+			}
+			name = strtok_r(NULL, " \n", &name_state);
+			value = strtok_r(NULL, " \n", &value_state);
+		}
+		break;
+	}
+
+	fclose(snmp);
+	return (segments);
+}
+
+// Compress a payload as a MODE Z upload carries it
+static char *
+deflate_payload(size_t len, size_t * deflated_size) {
+
+	uLongf size = compressBound(len);
+	char * deflated = malloc(size);
+	if (deflated == NULL || compress2((Bytef *)deflated, &size,
+		(Bytef *)payload, len, compression_level) != Z_OK) {
+		fprintf(stderr, "Error on compressing the payload\n");
+		exit(1);
+	}
+
+	*deflated_size = size;
+	return (deflated);
+}
+
+static void
+print_results(bench_format_t format, client_t * total, double duration,
+	long long segments, long idle_held, long idle_dropped) {
+
+	unsigned long long errors = 0, bytes = 0;
+	for (int i = 0; i < NUM_COMMANDS; i++) {
+		errors += total->errors[i];
+		bytes += total->bytes[i];
+	}
+
+	if (format == BENCH_CSV)
+		printf("command,count,errors,per_sec,mb_per_sec,mean_us,p50_us,"
+			"p99_us,p999_us,max_us\n");
+	else {
+		printf("{\n  \"config\": {\"clients\": %ld, \"seconds\": %ld, "
+			"\"operations_per_client\": %ld, "
+			"\"operations_per_session\": %ld, \"mix\": \"%s\", "
+			"\"modes\": \"%s\", \"group\": \"%s\", \"stor_size\": %ld, "
+			"\"appe_size\": %ld, \"type\": \"%c\", \"seed\": %llu, "
+			"\"compression_level\": %d, \"link_rate\": %ld, "
+			"\"idle_sessions\": %ld, \"segments\": %ld},\n",
+			num_clients, seconds, operations_per_client,
+			operations_per_session, mix, modes, group, stor_size,
+			appe_size, transfer_type, seed, compression_level,
+			link_rate, idle_sessions, num_segments);
+		printf("  \"duration_s\": %.3f,\n  \"operations\": %llu,\n"
+			"  \"operations_per_sec\": %.1f,\n  \"mb_per_sec\": %.2f,\n"
+			"  \"errors\": %llu,\n  \"commands\": [",
+			duration, total->operations, total->operations / duration,
+			bytes / duration / 1e6, errors);
+	}
+
+	int first = 1;
+	for (int i = 0; i < NUM_COMMANDS; i++) {
+
+		bench_histogram_t * h = &total->latency[i];
+		if (h->count == 0 && total->errors[i] == 0)
+			continue;
+
+		double mean = h->count ? h->sum_ns / 1e3 / h->count : 0;
+		double p50 = bench_histogram_quantile(h, 0.5) / 1e3;
+		double p99 = bench_histogram_quantile(h, 0.99) / 1e3;
+		double p999 = bench_histogram_quantile(h, 0.999) / 1e3;
+		if (format == BENCH_CSV)
+			printf("%s,%llu,%llu,%.1f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+				command_names[i], h->count, total->errors[i],
+				h->count / duration, total->bytes[i] / duration / 1e6,
+				mean, p50, p99, p999, h->max_ns / 1e3);
+		else
+			printf("%s\n    {\"command\": \"%s\", \"count\": %llu, "
+				"\"errors\": %llu, \"per_sec\": %.1f, "
+				"\"mb_per_sec\": %.2f, \"mean_us\": %.1f, "
+				"\"p50_us\": %.1f, \"p99_us\": %.1f, "
+				"\"p999_us\": %.1f, \"max_us\": %.1f}",
+				first ? "" : ",", command_names[i], h->count,
+				total->errors[i], h->count / duration,
+				total->bytes[i] / duration / 1e6, mean, p50, p99, p999,
+				h->max_ns / 1e3);
+		first = 0;
+	}
+
+	/*
+	 * Commands and segments, to see how many packets a command
+	 * costs; only meaningful when nothing else uses the network.
+	 * The bytes the data connections carried, against the bytes
+	 * transferred, give the compression ratio of MODE Z. Of
+	 * the idle sessions, those logged in and those the server
+	 * dropped before the run ended are counted.
+	 */
+	if (format == BENCH_CSV) {
+		printf("COMMANDS,%llu,,%.1f,,,,,,\n", total->commands,
+			total->commands / duration);
+		if (segments >= 0)
+			printf("SEGMENTS,%lld,,%.1f,,,,,,\n", segments,
+				segments / duration);
+		printf("WIRE,%llu,,,%.2f,,,,,\n", total->wire_bytes,
+			total->wire_bytes / duration / 1e6);
+		if (idle_sessions > 0)
+			printf("IDLE,%ld,%ld,,,,,,,\n", idle_held, idle_dropped);
+	}
+	else {
+		printf("\n  ],\n  \"control_commands\": %llu",
+			total->commands);
+		if (segments >= 0)
+			printf(",\n  \"tcp_segments\": %lld", segments);
+		printf(",\n  \"wire_bytes\": %llu,\n  \"data_bytes\": %llu",
+			total->wire_bytes, bytes);
+		if (idle_sessions > 0)
+			printf(",\n  \"idle_sessions\": %ld,\n"
+				"  \"idle_dropped\": %ld", idle_held, idle_dropped);
+	}
+
+	if (format == BENCH_CSV)
+		printf("TOTAL,%llu,%llu,%.1f,%.2f,,,,,\n", total->operations,
+			errors, total->operations / duration, bytes / duration / 1e6);
+	else
+		printf("\n}\n");
+}
+
+int
+main(int argc, char * argv[]) {
+
+	const char * host = "127.0.0.1";
+	const char * port = "2121";
+	const char * fixtures = NULL;
+	bench_format_t format = BENCH_CSV;
+
+	int opt;
+	while ((opt = getopt(argc, argv, optstring)) != -1) {
+		switch (opt) {
+			case 'H':
+				host = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'c':
+				num_clients = atol(optarg);
+				break;
+			case 't':
+				seconds = atol(optarg);
+				break;
+			case 'n':
+				operations_per_client = atol(optarg);
+				break;
+			case 'k':
+				operations_per_session = atol(optarg);
+				break;
+			case 'm':
+				mix = optarg;
+				break;
+			case 'd':
+				modes = optarg;
+				break;
+			case 'f':
+				fixtures = optarg;
+				break;
+			case 'g':
+				group = optarg;
+				break;
+			case 's':
+				stor_size = atol(optarg);
+				break;
+			case 'a':
+				appe_size = atol(optarg);
+				break;
+			case 'T':
+				transfer_type = toupper((unsigned char)optarg[0]);
+				break;
+			case 'o':
+				if (bench_parse_format(optarg) < 0) {
+					usage();
+					exit(1);
+				}
+				format = bench_parse_format(optarg);
+				break;
+			case 'r':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'z':
+				zipf_exponent = atof(optarg);
+				break;
+			case 'Z':
+				compression_level = atoi(optarg);
+				break;
+			case 'B':
+				link_rate = atol(optarg);
+				break;
+			case 'i':
+				idle_sessions = atol(optarg);
+				break;
+			case 'L':
+				list_directory = optarg;
+				break;
+			case 'S':
+				num_segments = atol(optarg);
+				break;
+			case 'h':
+				usage();
+				exit(0);
+			default:
+				usage();
+				exit(1);
+		}
+	}
+
+	int total = bench_parse_weights(mix, operation_names, NUM_OPERATIONS,
+		operation_weights);
+	int total_modes = bench_parse_weights(modes, mode_names, NUM_MODES,
+		mode_weights);
+	if (fixtures == NULL || num_clients < 1 || seconds < 0 ||
+		(seconds == 0 && operations_per_client < 1) ||
+		total <= 0 || total_modes <= 0 || stor_size < 1 ||
+		appe_size < 1 || (transfer_type != 'A' && transfer_type != 'I') ||
+		zipf_exponent < 0 || compression_level > 9 || link_rate < 0 ||
+		idle_sessions < 0 || num_segments < 1 ||
+		(compression_level >= 0 && (stor_size > PAYLOAD_SIZE ||
+		appe_size > PAYLOAD_SIZE))) {
+		usage();
+		exit(1);
+	}
+	operation_total = total;
+	mode_total = total_modes;
+	load_manifest(fixtures);
+	if (zipf_exponent > 0 && files.count > 0)
+		zipf_init();
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_socktype = SOCK_STREAM;
+	int err = getaddrinfo(host, port, &hints, &server_address);
+	if (err != 0) {
+		fprintf(stderr, "Error on resolving %s: %s\n", host,
+			gai_strerror(err));
+		exit(1);
+	}
+
+	/*
+	 * In stream mode, a larger upload goes through the payload
+	 * over and over; MODE Z sends it deflated as a whole
+	 */
+	long upload = stor_size > appe_size ? stor_size : appe_size;
+	if (upload > PAYLOAD_SIZE)
+		upload = PAYLOAD_SIZE;
+	payload = malloc(upload);
+	if (payload == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	unsigned long long payload_seed = seed | 1;
+	for (long i = 0; i < upload; i++)
+		payload[i] = "abcdefghijklmnopqrstuvwxyz\n"
+			[bench_random(&payload_seed) % 27];
+	if (compression_level >= 0) {
+		stor_deflated = deflate_payload(stor_size, &stor_deflated_size);
+		appe_deflated = deflate_payload(appe_size, &appe_deflated_size);
+	}
+
+	/*
+	 * Every idle session holds a descriptor; their logins are
+	 * timed apart from those of the clients
+	 */
+	int * idle_fds = NULL;
+	long idle_held = 0;
+	if (idle_sessions > 0) {
+		struct rlimit fd_limit;
+		if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0) {
+			fd_limit.rlim_cur = fd_limit.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &fd_limit);
+		}
+		client_t * idler = calloc(1, sizeof (client_t));
+		idle_fds = calloc(idle_sessions, sizeof (int));
+		if (idler == NULL || idle_fds == NULL) {
+			perror("calloc");
+			exit(1);
+		}
+		idler->control.fd = -1;
+		idle_held = idle_open(idler, idle_fds);
+		free(idler);
+	}
+
+	client_t * clients = calloc(num_clients, sizeof (client_t));
+	if (clients == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	pthread_barrier_init(&start_barrier, NULL, num_clients + 1);
+	for (long i = 0; i < num_clients; i++) {
+		clients[i].id = i;
+		clients[i].control.fd = -1;
+		// Distinct, non-zero streams per client
+		clients[i].random = (seed + 1) * 0x9e3779b97f4a7c15ULL + i * 2 + 1;
+		if (compression_level >= 0 &&
+			inflateInit(&clients[i].inflater) != Z_OK) {
+			fprintf(stderr, "Error on setting up zlib\n");
+			exit(1);
+		}
+		if (pthread_create(&clients[i].thread, NULL, client_thread,
+			&clients[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	unsigned long long start = bench_now_ns();
+	long long segments = tcp_segments();
+	if (seconds > 0) {
+		struct timespec run = { seconds, 0 };
+		while (nanosleep(&run, &run) < 0 && errno == EINTR)
+			;
+		stop = 1;
+	}
+
+	client_t * sum = calloc(1, sizeof (client_t));
+	if (sum == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (long i = 0; i < num_clients; i++) {
+		pthread_join(clients[i].thread, NULL);
+		sum->operations += clients[i].operations;
+		sum->commands += clients[i].commands;
+		sum->wire_bytes += clients[i].wire_bytes;
+		for (int c = 0; c < NUM_COMMANDS; c++) {
+			bench_histogram_merge(&sum->latency[c],
+				&clients[i].latency[c]);
+			sum->errors[c] += clients[i].errors[c];
+			sum->bytes[c] += clients[i].bytes[c];
+		}
+	}
+	double duration = (bench_now_ns() - start) / 1e9;
+	long long end_segments = tcp_segments();
+	segments = segments >= 0 && end_segments >= 0 ?
+		end_segments - segments : -1;
+	long idle_dropped = idle_held > 0 ? idle_close(idle_fds, idle_held) : 0;
+
+	print_results(format, sum, duration, segments, idle_held, idle_dropped);
+
+	return (0);
+}
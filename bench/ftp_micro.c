@@ -0,0 +1,1399 @@
+/*
+ * Microbenchmarks of the server's hot functions, called directly:
+ * RETR and STOR over socketpairs and pipes against tmpfs files,
+ * small downloads opened directly and through the file cache,
+ * binary transfers through the io_uring backend,
+ * LIST and MLSD of a directory, the command line parser on
+ * short, typical and near-limit lines, a mix
+ * of control commands run as a session would run them, the
+ * verb lookup, the job ring against the locked job queue it
+ * replaced, alone and shared by four threads, the session
+ * timer wheel with 100k sessions, the CRLF kernels and MODE Z
+ * downloads and uploads of text. Each result
+ * is the median of several timed runs and gives time, cycles,
+ * allocations and I/O system calls per call, and throughput
+ * for transfers.
+ * Results can be checked against a stored baseline of the
+ * allocations and system calls, which do not depend on the host.
+ */
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/uio.h>
+#include "ftp_functions.h"
+#include "crlf.h"
+#include "mlsx.h"
+#include "file_cache.h"
+#include "zmode.h"
+#include "uring.h"
+#include "bench.h"
+
+// Size of the files RETR and STOR move per call
+#define		TRANSFER_SIZE (1 << 20)
+// Size of the file the small downloads send
+#define		SMALL_FILE_SIZE 16384
+// Entries of the directory LIST and MLSD render
+#define		LIST_ENTRIES 1000
+// Command lines the parser gets per call
+#define		PARSER_LINES 64
+// Length of a typical command line, CRLF included
+#define		PARSER_TYPICAL_LINE 40
+// What a read brings in at a time when a line comes in pieces
+#define		PARSER_READ_SIZE 1448
+#define		MAX_REPEATS 15
+// Idle sessions whose deadlines the timer wheel micros keep
+#define		TIMER_SESSIONS 100000
+#define		TIMER_IDLE_NS (DEFAULT_IDLE_TIMEOUT_S * 1000000000ULL)
+// Threads sharing a job queue at once, and the jobs each moves per call
+#define		QUEUE_THREADS 4
+#define		QUEUE_JOBS 256
+
+typedef struct micro {
+	const char * name;
+	// Bytes handled per call, for cycles/byte and throughput
+	size_t bytes;
+	// Operations one call stands for; results are per operation
+	unsigned operations;
+	void (*run)(long calls);
+	// Whether the micro can run on this host; always if NULL
+	int (*available)();
+} micro_t;
+
+typedef struct result {
+	long calls;
+	double ns;
+	double cycles;
+	double allocations;
+	double syscalls;
+} result_t;
+
+static const char * optstring = "f:m:r:o:b:t:h";
+
+/*
+ * Allocations made by the server's code; the program is linked
+ * with --wrap so that every malloc, calloc and realloc the server
+ * objects call comes through here
+ */
+static unsigned long allocations = 0;
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t count, size_t size);
+void * __real_realloc(void * pointer, size_t size);
+
+void *
+__wrap_malloc(size_t size) {
+
+	__atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+	return (__real_malloc(size));
+}
+
+void *
+__wrap_calloc(size_t count, size_t size) {
+
+	__atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+	return (__real_calloc(count, size));
+}
+
+void *
+__wrap_realloc(void * pointer, size_t size) {
+
+	__atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+	return (__real_realloc(pointer, size));
+}
+
+/*
+ * I/O system calls the measuring thread made through the
+ * server's code; the program is linked with --wrap for each
+ * call a transfer may use, io_uring_enter included through
+ * syscall. Calls made by the helper threads standing in for
+ * clients go to their own counters.
+ */
+static __thread unsigned long syscalls = 0;
+
+ssize_t __real_read(int fd, void * buffer, size_t len);
+ssize_t __real_write(int fd, const void * buffer, size_t len);
+ssize_t __real_writev(int fd, const struct iovec * iov, int count);
+ssize_t __real_pread64(int fd, void * buffer, size_t len, off_t offset);
+ssize_t __real_recv(int fd, void * buffer, size_t len, int flags);
+ssize_t __real_send(int fd, const void * buffer, size_t len, int flags);
+ssize_t __real_sendfile64(int out_fd, int in_fd, off_t * offset,
+	size_t count);
+ssize_t __real_splice(int in_fd, loff_t * in_offset, int out_fd,
+	loff_t * out_offset, size_t len, unsigned int flags);
+int __real_poll(struct pollfd * fds, nfds_t count, int timeout);
+long __real_syscall(long number, ...);
+
+ssize_t
+__wrap_read(int fd, void * buffer, size_t len) {
+
+	syscalls++;
+	return (__real_read(fd, buffer, len));
+}
+
+ssize_t
+__wrap_write(int fd, const void * buffer, size_t len) {
+
+	syscalls++;
+	return (__real_write(fd, buffer, len));
+}
+
+ssize_t
+__wrap_writev(int fd, const struct iovec * iov, int count) {
+
+	syscalls++;
+	return (__real_writev(fd, iov, count));
+}
+
+ssize_t
+__wrap_pread64(int fd, void * buffer, size_t len, off_t offset) {
+
+	syscalls++;
+	return (__real_pread64(fd, buffer, len, offset));
+}
+
+ssize_t
+__wrap_recv(int fd, void * buffer, size_t len, int flags) {
+
+	syscalls++;
+	return (__real_recv(fd, buffer, len, flags));
+}
+
+ssize_t
+__wrap_send(int fd, const void * buffer, size_t len, int flags) {
+
+	syscalls++;
+	return (__real_send(fd, buffer, len, flags));
+}
+
+ssize_t
+__wrap_sendfile64(int out_fd, int in_fd, off_t * offset, size_t count) {
+
+	syscalls++;
+	return (__real_sendfile64(out_fd, in_fd, offset, count));
+}
+
+ssize_t
+__wrap_splice(int in_fd, loff_t * in_offset, int out_fd,
+	loff_t * out_offset, size_t len, unsigned int flags) {
+
+	syscalls++;
+	return (__real_splice(in_fd, in_offset, out_fd, out_offset, len,
+		flags));
+}
+
+int
+__wrap_poll(struct pollfd * fds, nfds_t count, int timeout) {
+
+	syscalls++;
+	return (__real_poll(fds, count, timeout));
+}
+
+// Every system call takes at most six arguments, passed in registers
+long
+__wrap_syscall(long number, ...) {
+
+	va_list args;
+	va_start(args, number);
+	long a = va_arg(args, long), b = va_arg(args, long);
+	long c = va_arg(args, long), d = va_arg(args, long);
+	long e = va_arg(args, long), f = va_arg(args, long);
+	va_end(args);
+
+	syscalls++;
+	return (__real_syscall(number, a, b, c, d, e, f));
+}
+
+// Scratch directory on tmpfs holding the fixtures
+static char scratch[256];
+static int binary_file = -1, text_file = -1, upload_file = -1;
+// Cut to nothing once the file cache holds it
+static int truncated_file = -1;
+static int list_dir = -1;
+static int scratch_dir = -1;
+static char * text_block, * crlf_block, * convert_out;
+// text_block compressed, as a MODE Z upload of it arrives
+static char * deflated_block;
+static size_t deflated_size;
+// Compression state of the MODE Z micros, set up by their first call
+static zmode_t * zmode;
+
+/*
+ * Helper thread reading everything written to a socket or
+ * pipe until it is closed, standing in for the client
+ */
+typedef struct drain {
+	int fd;
+	pthread_t thread;
+} drain_t;
+
+static void *
+drain_thread(void * args) {
+
+	drain_t * drain = args;
+	static __thread char buffer[1 << 16];
+	ssize_t n;
+
+	while ((n = read(drain->fd, buffer, sizeof (buffer))) != 0) {
+		if (n < 0 && errno != EINTR)
+			break;
+	}
+
+	return (NULL);
+}
+
+/*
+ * Helper thread sending its payload into every descriptor
+ * handed to it, then closing it, so that each STOR sees
+ * an upload that ends
+ */
+typedef struct feed {
+	int fd;
+	int done;
+	const char * payload;
+	size_t len;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+} feed_t;
+
+static void *
+feed_thread(void * args) {
+
+	feed_t * feed = args;
+
+	pthread_mutex_lock(&feed->lock);
+	while (!feed->done) {
+		if (feed->fd < 0) {
+			pthread_cond_wait(&feed->cond, &feed->lock);
+			continue;
+		}
+		int fd = feed->fd;
+		feed->fd = -1;
+		pthread_mutex_unlock(&feed->lock);
+
+		write_all(fd, feed->payload, feed->len);
+		close(fd);
+
+		pthread_mutex_lock(&feed->lock);
+	}
+	pthread_mutex_unlock(&feed->lock);
+
+	return (NULL);
+}
+
+static void
+feed_start(feed_t * feed, const char * payload, size_t len) {
+
+	feed->fd = -1;
+	feed->done = 0;
+	feed->payload = payload;
+	feed->len = len;
+	pthread_mutex_init(&feed->lock, NULL);
+	pthread_cond_init(&feed->cond, NULL);
+	pthread_create(&feed->thread, NULL, feed_thread, feed);
+}
+
+static void
+feed_give(feed_t * feed, int fd) {
+
+	pthread_mutex_lock(&feed->lock);
+	feed->fd = fd;
+	pthread_cond_signal(&feed->cond);
+	pthread_mutex_unlock(&feed->lock);
+}
+
+static void
+feed_stop(feed_t * feed) {
+
+	pthread_mutex_lock(&feed->lock);
+	feed->done = 1;
+	pthread_cond_signal(&feed->cond);
+	pthread_mutex_unlock(&feed->lock);
+	pthread_join(feed->thread, NULL);
+}
+
+// A pipe or socketpair with a drain thread at its far end
+static int
+drained_channel(int use_pipe, drain_t * drain) {
+
+	int fds[2];
+	if ((use_pipe ? pipe(fds) : socketpair(AF_UNIX, SOCK_STREAM, 0,
+		fds)) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	drain->fd = fds[0];
+	pthread_create(&drain->thread, NULL, drain_thread, drain);
+
+	return (fds[1]);
+}
+
+static void
+drained_channel_close(int fd, drain_t * drain) {
+
+	close(fd);
+	pthread_join(drain->thread, NULL);
+	close(drain->fd);
+}
+
+static void
+retr(long calls, int file_fd, int binary, int use_pipe) {
+
+	drain_t drain;
+	int fd = drained_channel(use_pipe, &drain);
+
+	for (long i = 0; i < calls; i++) {
+		if (RETR(file_fd, fd, binary, 0) != TRANSFER_SIZE) {
+			fprintf(stderr, "RETR failed\n");
+			exit(1);
+		}
+	}
+
+	drained_channel_close(fd, &drain);
+}
+
+static void
+run_retr_binary_socket(long calls) {
+
+	retr(calls, binary_file, 1, 0);
+}
+
+static void
+run_retr_binary_pipe(long calls) {
+
+	retr(calls, binary_file, 1, 1);
+}
+
+static void
+run_retr_ascii_socket(long calls) {
+
+	retr(calls, text_file, 0, 0);
+}
+
+/*
+ * A whole small download as RETR_HANDLER runs it, without the
+ * connections: open the file, send it and close it, either
+ * directly or through the file cache
+ */
+static void
+retr_small(long calls, int cached) {
+
+	drain_t drain;
+	int fd = drained_channel(0, &drain);
+
+	for (long i = 0; i < calls; i++) {
+		off_t nsent;
+		if (cached) {
+			file_entry_t * file = file_cache_open(scratch_dir, "small");
+			nsent = file == NULL ? -1 : file->shared ?
+				file_cache_send(file, fd, 1, 0) :
+				RETR(file->fd, fd, 1, 0);
+			if (file != NULL)
+				file_cache_release(file);
+		}
+		else {
+			struct stat st;
+			int file_fd = openat(scratch_dir, "small", O_RDONLY);
+			nsent = file_fd < 0 || fstat(file_fd, &st) < 0 ? -1 :
+				RETR(file_fd, fd, 1, 0);
+			if (file_fd >= 0)
+				close(file_fd);
+		}
+		if (nsent != SMALL_FILE_SIZE) {
+			fprintf(stderr, "RETR of a small file failed\n");
+			exit(1);
+		}
+	}
+
+	drained_channel_close(fd, &drain);
+}
+
+static void
+run_retr_small_open(long calls) {
+
+	retr_small(calls, 0);
+}
+
+static void
+run_retr_small_cached(long calls) {
+
+	retr_small(calls, 1);
+}
+
+/*
+ * An ASCII download of a cached file truncated underneath its
+ * mapping: every call faults on the same thread and must fail
+ * the transfer, not kill the process on its second fault
+ */
+static void
+run_retr_cached_truncated(long calls) {
+
+	static file_entry_t * file;
+	if (file == NULL) {
+		file = file_cache_open(scratch_dir, "truncated");
+		if (file == NULL || !file->cached ||
+			ftruncate(truncated_file, 0) < 0) {
+			fprintf(stderr, "Error on truncating a cached file\n");
+			exit(1);
+		}
+	}
+
+	drain_t drain;
+	int fd = drained_channel(0, &drain);
+
+	for (long i = 0; i < calls; i++) {
+		if (file_cache_send(file, fd, 0, 0) >= 0) {
+			fprintf(stderr, "RETR of a truncated file succeeded\n");
+			exit(1);
+		}
+	}
+
+	drained_channel_close(fd, &drain);
+}
+
+/*
+ * Binary transfers through the io_uring backend, to set their
+ * time and system calls per call against the blocking path's
+ */
+static int
+uring_available() {
+
+	int available = uring_init(1) == 0;
+	uring_init(0);
+	return (available);
+}
+
+static void
+run_retr_binary_uring(long calls) {
+
+	uring_init(1);
+	retr(calls, binary_file, 1, 0);
+	uring_init(0);
+}
+
+static void
+stor(long calls, int binary, int use_pipe) {
+
+	feed_t feed;
+	feed_start(&feed, binary ? text_block : crlf_block, TRANSFER_SIZE);
+
+	for (long i = 0; i < calls; i++) {
+		int fds[2];
+		if ((use_pipe ? pipe(fds) : socketpair(AF_UNIX, SOCK_STREAM, 0,
+			fds)) < 0) {
+			perror("pipe");
+			exit(1);
+		}
+		feed_give(&feed, fds[1]);
+		lseek(upload_file, 0, SEEK_SET);
+		if (STOR(upload_file, fds[0], binary, 0) < 0) {
+			fprintf(stderr, "STOR failed\n");
+			exit(1);
+		}
+		close(fds[0]);
+	}
+
+	feed_stop(&feed);
+}
+
+static void
+run_stor_binary_socket(long calls) {
+
+	stor(calls, 1, 0);
+}
+
+static void
+run_stor_binary_pipe(long calls) {
+
+	stor(calls, 1, 1);
+}
+
+static void
+run_stor_ascii_socket(long calls) {
+
+	stor(calls, 0, 0);
+}
+
+static void
+run_stor_binary_uring(long calls) {
+
+	uring_init(1);
+	stor(calls, 1, 0);
+	uring_init(0);
+}
+
+// A MODE Z download of the text file, at the default level
+static void
+run_retr_zmode_text(long calls) {
+
+	drain_t drain;
+	int fd = drained_channel(0, &drain);
+	if (zmode == NULL)
+		zmode = zmode_create();
+
+	for (long i = 0; i < calls; i++) {
+		if (zmode_send_file(zmode, DEFAULT_COMPRESSION_LEVEL, text_file,
+			fd, 1, 0) != TRANSFER_SIZE) {
+			fprintf(stderr, "MODE Z RETR failed\n");
+			exit(1);
+		}
+	}
+
+	drained_channel_close(fd, &drain);
+}
+
+// A MODE Z upload of the same text
+static void
+run_stor_zmode_text(long calls) {
+
+	feed_t feed;
+	feed_start(&feed, deflated_block, deflated_size);
+	if (zmode == NULL)
+		zmode = zmode_create();
+
+	for (long i = 0; i < calls; i++) {
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+			perror("socketpair");
+			exit(1);
+		}
+		feed_give(&feed, fds[1]);
+		lseek(upload_file, 0, SEEK_SET);
+		if (zmode_recv_file(zmode, fds[0], upload_file, 1, 0) !=
+			TRANSFER_SIZE) {
+			fprintf(stderr, "MODE Z STOR failed\n");
+			exit(1);
+		}
+		close(fds[0]);
+	}
+
+	feed_stop(&feed);
+}
+
+static void
+run_list(long calls) {
+
+	for (long i = 0; i < calls; i++) {
+		size_t len;
+		char * listing = LIST(list_dir, &len);
+		if (listing == NULL) {
+			fprintf(stderr, "LIST failed\n");
+			exit(1);
+		}
+		free(listing);
+	}
+}
+
+static int
+discard(void * arg, const char * buffer, size_t len) {
+
+	*(size_t *)arg += len;
+	return (0);
+}
+
+static void
+run_mlsd(long calls) {
+
+	for (long i = 0; i < calls; i++) {
+		size_t len = 0;
+		if (mlsx_stream_dir(list_dir, discard, &len) < 0) {
+			fprintf(stderr, "MLSD failed\n");
+			exit(1);
+		}
+	}
+}
+
+/*
+ * A pipelined batch of command lines through the line parser
+ * and dispatch, as process_session runs them after reads of up
+ * to read_size bytes: SYST, its argument, which it ignores,
+ * padding each line to line_len bytes
+ */
+static void
+parse_lines(long calls, size_t line_len, int lines, size_t read_size) {
+
+	static char input[COMMAND_BUFFER_SIZE];
+	size_t total = line_len * lines;
+	for (int l = 0; l < lines; l++) {
+		char * line = input + l * line_len;
+		memset(line, 'x', line_len);
+		memcpy(line, "SYST ", 5);
+		memcpy(line + line_len - 2, "\r\n", 2);
+	}
+
+	client_context_t * context = calloc(1, sizeof (client_context_t));
+	drain_t drain;
+	context->client_comm_fd = drained_channel(0, &drain);
+	context->state = SESSION_IDLE;
+	arena_init(&context->arena, context->arena_block, SESSION_ARENA_SIZE);
+
+	for (long i = 0; i < calls; i++) {
+		for (size_t done = 0, n; done < total; done += n) {
+			n = total - done < read_size ? total - done : read_size;
+			memcpy(context->command_buffer + context->command_len,
+				input + done, n);
+			execute_commands(context, n);
+		}
+	}
+
+	drained_channel_close(context->client_comm_fd, &drain);
+	free(context);
+}
+
+static void
+run_parser(long calls) {
+
+	parse_lines(calls, sizeof ("SYST\r\n") - 1, PARSER_LINES,
+		COMMAND_BUFFER_SIZE);
+}
+
+static void
+run_parser_typical(long calls) {
+
+	parse_lines(calls, PARSER_TYPICAL_LINE, PARSER_LINES,
+		COMMAND_BUFFER_SIZE);
+}
+
+// The longest line the buffer takes, read at once
+static void
+run_parser_near_limit(long calls) {
+
+	parse_lines(calls, COMMAND_BUFFER_SIZE, 1, COMMAND_BUFFER_SIZE);
+}
+
+// The same line coming in a segment at a time
+static void
+run_parser_near_limit_split(long calls) {
+
+	parse_lines(calls, COMMAND_BUFFER_SIZE, 1, PARSER_READ_SIZE);
+}
+
+// Control commands that reply without a data connection
+static const char session_lines[] =
+	"PWD\r\nTYPE I\r\nPORT 127,0,0,1,4,1\r\nEPRT |1|127.0.0.1|1025|\r\n"
+	"REST 0\r\nSYST\r\nFEAT\r\nTYPE A\r\n";
+#define		SESSION_LINES 8
+
+/*
+ * Replies of a session's control commands, to count what
+ * formatting them costs in time and allocations
+ */
+static void
+run_session_commands(long calls) {
+
+	client_context_t * context = calloc(1, sizeof (client_context_t));
+	drain_t drain;
+	context->client_comm_fd = drained_channel(0, &drain);
+	context->state = SESSION_IDLE;
+	context->data_fd = -1;
+	arena_init(&context->arena, context->arena_block, SESSION_ARENA_SIZE);
+	strcpy(context->current_working_directory, scratch);
+
+	for (long i = 0; i < calls; i++) {
+		memcpy(context->command_buffer, session_lines,
+			sizeof (session_lines) - 1);
+		execute_commands(context, sizeof (session_lines) - 1);
+	}
+
+	drained_channel_close(context->client_comm_fd, &drain);
+	free(context);
+}
+
+// Keeps the lookups from being optimized away
+static void (* volatile handler_sink)(client_context_t *);
+
+static void
+run_get_handler(long calls) {
+
+	static char verbs[][5] = {
+		"USER", "PASS", "SYST", "FEAT", "PWD", "PASV", "EPSV", "CWD",
+		"PORT", "TYPE", "LIST", "RETR", "STOR", "noop", "MLSD", "XYZZ"
+	};
+	for (long i = 0; i < calls; i++) {
+		for (int v = 0; v < 16; v++)
+			handler_sink = get_handler(verbs[v]);
+	}
+}
+
+static job_ring_t * job_ring;
+
+static void
+job_ring_pairs(long count) {
+
+	struct sockaddr_storage addr;
+	memset(&addr, 0, sizeof (addr));
+	job_t job;
+
+	for (long i = 0; i < count; i++) {
+		/*
+		 * A slot stays taken until its consumer is done with it:
+		 * past a consumer preempted in the middle, the ring looks
+		 * full a lap later. The server defers the session then;
+		 * here the producer lets the consumer run.
+		 */
+		while (enqueue(job_ring, 0, addr, NULL) < 0)
+			sched_yield();
+		if (dequeue(job_ring, &job, -1) < 0) {
+			fprintf(stderr, "Job ring failed\n");
+			exit(1);
+		}
+	}
+}
+
+/*
+ * The job queue the ring replaced, to measure one against the
+ * other: a list of jobs allocated one at a time, under a mutex,
+ * with a condition variable the workers wait on. It keeps a
+ * tail where the old one walked the list to its end, which
+ * only spares it time.
+ */
+typedef struct locked_job {
+	int fd;
+	struct sockaddr_storage client_addr;
+	struct locked_job * next;
+} locked_job_t;
+
+static struct locked_queue {
+	locked_job_t * head;
+	locked_job_t * tail;
+	int available_jobs;
+	pthread_mutex_t lock;
+	pthread_cond_t job_available;
+} locked_queue = { NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER };
+
+static void
+locked_enqueue(int fd, struct sockaddr_storage client_addr) {
+
+	locked_job_t * job = calloc(1, sizeof (locked_job_t));
+	if (job == NULL) {
+		fprintf(stderr, "Out of memory for a job\n");
+		exit(1);
+	}
+	job->fd = fd;
+	job->client_addr = client_addr;
+
+	pthread_mutex_lock(&locked_queue.lock);
+	if (locked_queue.tail != NULL)
+		locked_queue.tail->next = job;
+	else
+		locked_queue.head = job;
+	locked_queue.tail = job;
+	locked_queue.available_jobs++;
+	pthread_mutex_unlock(&locked_queue.lock);
+	pthread_cond_signal(&locked_queue.job_available);
+}
+
+static int
+locked_dequeue() {
+
+	pthread_mutex_lock(&locked_queue.lock);
+	while (locked_queue.available_jobs == 0)
+		pthread_cond_wait(&locked_queue.job_available, &locked_queue.lock);
+	locked_job_t * job = locked_queue.head;
+	locked_queue.head = job->next;
+	if (locked_queue.head == NULL)
+		locked_queue.tail = NULL;
+	locked_queue.available_jobs--;
+	pthread_mutex_unlock(&locked_queue.lock);
+
+	int fd = job->fd;
+	free(job);
+	return (fd);
+}
+
+static void
+locked_queue_pairs(long count) {
+
+	struct sockaddr_storage addr;
+	memset(&addr, 0, sizeof (addr));
+
+	for (long i = 0; i < count; i++) {
+		locked_enqueue(0, addr);
+		locked_dequeue();
+	}
+}
+
+// The jobs of a call of a contended queue micro, as one thread's share
+typedef struct queue_share {
+	void (*pairs)(long count);
+	long count;
+	pthread_t thread;
+} queue_share_t;
+
+static void *
+queue_share_thread(void * args) {
+
+	queue_share_t * share = args;
+	share->pairs(share->count);
+
+	return (NULL);
+}
+
+/*
+ * Move QUEUE_JOBS jobs per call through a queue on each of
+ * QUEUE_THREADS threads at once, the measuring thread among
+ * them, every thread queueing a job and taking one in turn as
+ * the event loops and workers do
+ */
+static void
+run_contended(void (*pairs)(long count), long calls) {
+
+	queue_share_t shares[QUEUE_THREADS - 1];
+	for (int i = 0; i < QUEUE_THREADS - 1; i++) {
+		shares[i].pairs = pairs;
+		shares[i].count = calls * QUEUE_JOBS;
+		pthread_create(&shares[i].thread, NULL, queue_share_thread,
+			&shares[i]);
+	}
+	pairs(calls * QUEUE_JOBS);
+	for (int i = 0; i < QUEUE_THREADS - 1; i++)
+		pthread_join(shares[i].thread, NULL);
+}
+
+static void
+run_job_ring(long calls) {
+
+	if (job_ring == NULL)
+		job_ring = job_ring_create();
+	job_ring_pairs(calls);
+}
+
+static void
+run_job_ring_threads(long calls) {
+
+	if (job_ring == NULL)
+		job_ring = job_ring_create();
+	run_contended(job_ring_pairs, calls);
+}
+
+static void
+run_locked_queue(long calls) {
+
+	locked_queue_pairs(calls);
+}
+
+static void
+run_locked_queue_threads(long calls) {
+
+	run_contended(locked_queue_pairs, calls);
+}
+
+/*
+ * A wheel holding the idle timeouts of TIMER_SESSIONS sessions,
+ * due evenly over the idle timeout from a clock of our own
+ */
+typedef struct timer_bench {
+	timer_wheel_t wheel;
+	wheel_timer_t * timers;
+	unsigned long long now;
+	unsigned long next;
+} timer_bench_t;
+
+static timer_bench_t rearm_bench, tick_bench;
+
+// An idle session that timed out is replaced by one just gone idle
+static unsigned long long
+timer_bench_expire(wheel_timer_t * timer, void * arg) {
+
+	return (tick_bench.now + TIMER_IDLE_NS);
+}
+
+static void
+timer_bench_init(timer_bench_t * bench) {
+
+	if (bench->timers != NULL)
+		return;
+
+	bench->timers = calloc(TIMER_SESSIONS, sizeof (wheel_timer_t));
+	if (bench->timers == NULL) {
+		fprintf(stderr, "Out of memory for the timers\n");
+		exit(1);
+	}
+	bench->now = TIMER_IDLE_NS;
+	timer_wheel_init(&bench->wheel, bench->now);
+	for (unsigned long i = 0; i < TIMER_SESSIONS; i++) {
+		bench->timers[i].expire = timer_bench_expire;
+		timer_wheel_schedule(&bench->wheel, &bench->timers[i], bench->now +
+			TIMER_IDLE_NS * i / TIMER_SESSIONS + 1);
+	}
+}
+
+/*
+ * What a command costs the wheel: the event loop cancels the
+ * session's timeout, and the worker sets it again once done
+ */
+static void
+run_timer_rearm(long calls) {
+
+	timer_bench_init(&rearm_bench);
+	for (long i = 0; i < calls; i++) {
+		wheel_timer_t * timer =
+			&rearm_bench.timers[rearm_bench.next++ % TIMER_SESSIONS];
+		timer_wheel_cancel(&rearm_bench.wheel, timer);
+		timer_wheel_schedule(&rearm_bench.wheel, timer,
+			rearm_bench.now + TIMER_IDLE_NS);
+	}
+}
+
+// What an event loop pays every tick, expiries and cascades included
+static void
+run_timer_tick(long calls) {
+
+	timer_bench_init(&tick_bench);
+	for (long i = 0; i < calls; i++) {
+		tick_bench.now += TIMER_WHEEL_TICK_NS;
+		timer_wheel_advance(&tick_bench.wheel, tick_bench.now, NULL);
+	}
+}
+
+static void
+run_crlf_expand(long calls) {
+
+	crlf_state_t state;
+	for (long i = 0; i < calls; i++) {
+		crlf_init(&state);
+		crlf_expand(&state, text_block, CRLF_BLOCK_SIZE, convert_out);
+	}
+}
+
+static void
+run_crlf_collapse(long calls) {
+
+	crlf_state_t state;
+	for (long i = 0; i < calls; i++) {
+		crlf_init(&state);
+		crlf_collapse(&state, crlf_block, CRLF_BLOCK_SIZE, convert_out);
+	}
+}
+
+static micro_t micros[] = {
+	{ "retr_binary_socket", TRANSFER_SIZE, 1, run_retr_binary_socket },
+	{ "retr_binary_pipe", TRANSFER_SIZE, 1, run_retr_binary_pipe },
+	{ "retr_ascii_socket", TRANSFER_SIZE, 1, run_retr_ascii_socket },
+	{ "retr_binary_uring", TRANSFER_SIZE, 1, run_retr_binary_uring,
+		uring_available },
+	{ "retr_small_open", SMALL_FILE_SIZE, 1, run_retr_small_open },
+	{ "retr_small_cached", SMALL_FILE_SIZE, 1, run_retr_small_cached },
+	{ "retr_cached_truncated", 0, 1, run_retr_cached_truncated },
+	{ "stor_binary_socket", TRANSFER_SIZE, 1, run_stor_binary_socket },
+	{ "stor_binary_pipe", TRANSFER_SIZE, 1, run_stor_binary_pipe },
+	{ "stor_ascii_socket", TRANSFER_SIZE, 1, run_stor_ascii_socket },
+	{ "stor_binary_uring", TRANSFER_SIZE, 1, run_stor_binary_uring,
+		uring_available },
+	{ "retr_zmode_text", TRANSFER_SIZE, 1, run_retr_zmode_text },
+	{ "stor_zmode_text", TRANSFER_SIZE, 1, run_stor_zmode_text },
+	{ "list_1000", 0, 1, run_list },
+	{ "mlsd_1000", 0, 1, run_mlsd },
+	{ "parse_pipelined", 0, PARSER_LINES, run_parser },
+	{ "parse_typical", PARSER_TYPICAL_LINE * PARSER_LINES, PARSER_LINES,
+		run_parser_typical },
+	{ "parse_near_limit", COMMAND_BUFFER_SIZE, 1, run_parser_near_limit },
+	{ "parse_near_limit_split", COMMAND_BUFFER_SIZE, 1,
+		run_parser_near_limit_split },
+	{ "session_commands", 0, SESSION_LINES, run_session_commands },
+	{ "get_handler", 0, 16, run_get_handler },
+	{ "job_ring_enqueue_dequeue", 0, 1, run_job_ring },
+	{ "job_queue_locked_enqueue_dequeue", 0, 1, run_locked_queue },
+	{ "job_ring_4_threads", 0, QUEUE_THREADS * QUEUE_JOBS,
+		run_job_ring_threads },
+	{ "job_queue_locked_4_threads", 0, QUEUE_THREADS * QUEUE_JOBS,
+		run_locked_queue_threads },
+	{ "timer_rearm_100k", 0, 1, run_timer_rearm },
+	{ "timer_tick_100k", 0, 1, run_timer_tick },
+	{ "crlf_expand_64k", CRLF_BLOCK_SIZE, 1, run_crlf_expand },
+	{ "crlf_collapse_64k", CRLF_BLOCK_SIZE, 1, run_crlf_collapse }
+};
+
+static void
+usage() {
+
+	printf("Usage: ftp_micro [-f <name filter>] [-m <ms per run>] "
+		"[-r <runs>] [-o <csv|json>] [-b <baseline csv>] "
+		"[-t <tolerance percent>] [-h]\n");
+}
+
+static void
+cleanup() {
+
+	char command[512];
+	if (scratch[0] != '\0') {
+		snprintf(command, sizeof (command), "rm -rf '%s'", scratch);
+		if (system(command) != 0)
+			fprintf(stderr, "Error on removing %s\n", scratch);
+	}
+}
+
+static int
+make_file(const char * name, const char * contents, size_t len) {
+
+	char path[512];
+	snprintf(path, sizeof (path), "%s/%s", scratch, name);
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write_all(fd, contents, len) < 0) {
+		perror(path);
+		exit(1);
+	}
+
+	return (fd);
+}
+
+// Fill text_block with lines of text and crlf_block with the same in CRLF
+static void
+make_text() {
+
+	text_block = malloc(TRANSFER_SIZE);
+	crlf_block = malloc(2 * TRANSFER_SIZE);
+	convert_out = malloc(CRLF_EXPAND_SIZE(CRLF_BLOCK_SIZE));
+	if (text_block == NULL || crlf_block == NULL || convert_out == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	unsigned long long seed = 1;
+	for (size_t i = 0; i < TRANSFER_SIZE; i++) {
+		unsigned r = bench_random(&seed) % 64;
+		text_block[i] = r == 0 ? '\n' : 'a' + r % 26;
+	}
+
+	uLongf size = compressBound(TRANSFER_SIZE);
+	deflated_block = malloc(size);
+	if (deflated_block == NULL || compress2((Bytef *)deflated_block, &size,
+		(Bytef *)text_block, TRANSFER_SIZE, DEFAULT_COMPRESSION_LEVEL) !=
+		Z_OK) {
+		fprintf(stderr, "Error on compressing the text\n");
+		exit(1);
+	}
+	deflated_size = size;
+
+	// The upload is cut to TRANSFER_SIZE bytes of CRLF text
+	size_t len = 0;
+	for (size_t i = 0; len < TRANSFER_SIZE; i++) {
+		if (text_block[i] == '\n')
+			crlf_block[len++] = '\r';
+		crlf_block[len++] = text_block[i];
+	}
+}
+
+static void
+setup() {
+
+	const char * base = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+	snprintf(scratch, sizeof (scratch), "%s/ftp_micro.%d", base,
+		(int)getpid());
+	if (mkdir(scratch, 0755) < 0) {
+		perror(scratch);
+		exit(1);
+	}
+	atexit(cleanup);
+
+	make_text();
+	char * binary = malloc(TRANSFER_SIZE);
+	unsigned long long seed = 2;
+	for (size_t i = 0; i < TRANSFER_SIZE; i++)
+		binary[i] = (char)bench_random(&seed);
+	binary_file = make_file("binary", binary, TRANSFER_SIZE);
+	text_file = make_file("text", text_block, TRANSFER_SIZE);
+	upload_file = make_file("upload", "", 0);
+
+	// Old enough for the file cache to take it
+	int small_file = make_file("small", binary, SMALL_FILE_SIZE);
+	struct timespec times[2] = { { 0, UTIME_OMIT }, { 1, 0 } };
+	futimens(small_file, times);
+	close(small_file);
+	truncated_file = make_file("truncated", binary, SMALL_FILE_SIZE);
+	futimens(truncated_file, times);
+	free(binary);
+	scratch_dir = open(scratch, O_RDONLY | O_DIRECTORY);
+	if (scratch_dir < 0 || file_cache_init(FILE_CACHE_DEFAULT_BYTES) < 0) {
+		perror(scratch);
+		exit(1);
+	}
+
+	char path[512];
+	snprintf(path, sizeof (path), "%s/list", scratch);
+	mkdir(path, 0755);
+	for (int i = 0; i < LIST_ENTRIES; i++) {
+		char name[64];
+		snprintf(name, sizeof (name), "list/entry%05d", i);
+		close(make_file(name, name, strlen(name)));
+	}
+	list_dir = open(path, O_RDONLY | O_DIRECTORY);
+	if (list_dir < 0) {
+		perror(path);
+		exit(1);
+	}
+}
+
+// Time one run of calls calls
+static result_t
+measure(micro_t * micro, long calls) {
+
+	result_t result;
+	unsigned long start_allocations =
+		__atomic_load_n(&allocations, __ATOMIC_RELAXED);
+	unsigned long start_syscalls = syscalls;
+	unsigned long long start = bench_now_ns();
+	unsigned long long start_cycles = bench_cycles();
+
+	micro->run(calls);
+
+	result.cycles = bench_cycles() - start_cycles;
+	result.ns = bench_now_ns() - start;
+	result.allocations = __atomic_load_n(&allocations, __ATOMIC_RELAXED) -
+		start_allocations;
+	result.syscalls = syscalls - start_syscalls;
+	result.calls = calls;
+
+	return (result);
+}
+
+static int
+compare_ns(const void * a, const void * b) {
+
+	const result_t * x = a, * y = b;
+	double xn = x->ns / x->calls, yn = y->ns / y->calls;
+	return ((xn > yn) - (xn < yn));
+}
+
+/*
+ * Size runs to take about min_ms each, then take the median
+ * of repeats runs, per operation
+ */
+static result_t
+benchmark(micro_t * micro, long min_ms, int repeats) {
+
+	// Warm up caches, lazily set up state and find the run length
+	long calls = 1;
+	result_t result = measure(micro, calls);
+	while (result.ns < min_ms * 1e6 / 4 && calls < (1L << 40)) {
+		calls *= 2;
+		result = measure(micro, calls);
+	}
+	calls = calls * (min_ms * 1e6) / (result.ns > 1 ? result.ns : 1);
+	if (calls < 1)
+		calls = 1;
+
+	result_t runs[MAX_REPEATS];
+	for (int i = 0; i < repeats; i++)
+		runs[i] = measure(micro, calls);
+	qsort(runs, repeats, sizeof (result_t), compare_ns);
+
+	result = runs[repeats / 2];
+	double operations = (double)result.calls * micro->operations;
+	result.ns /= operations;
+	result.cycles /= operations;
+	result.allocations /= operations;
+	result.syscalls /= operations;
+
+	return (result);
+}
+
+// Baseline counts, as written in CSV by an earlier run
+typedef struct baseline {
+	char name[64];
+	double allocations;
+	double syscalls;
+} baseline_t;
+
+/*
+ * Read the name, allocs_per_op and syscalls_per_op columns of
+ * a baseline, wherever its header puts them, so that either
+ * the full output of a run or those columns alone will do
+ */
+static int
+load_baseline(const char * path, baseline_t * baseline, int max) {
+
+	FILE * in = fopen(path, "r");
+	if (in == NULL) {
+		perror(path);
+		exit(1);
+	}
+
+	char line[512];
+	char * state;
+	int name_column = -1, allocs_column = -1, syscalls_column = -1;
+	if (fgets(line, sizeof (line), in) != NULL) {
+		int column = 0;
+		for (char * field = strtok_r(line, ",\n", &state);
+			field != NULL;
+			field = strtok_r(NULL, ",\n", &state), column++) {
+			if (strcmp(field, "name") == 0)
+				name_column = column;
+			else if (strcmp(field, "allocs_per_op") == 0)
+				allocs_column = column;
+			else if (strcmp(field, "syscalls_per_op") == 0)
+				syscalls_column = column;
+		}
+	}
+	if (name_column < 0 || allocs_column < 0 || syscalls_column < 0) {
+		fprintf(stderr, "%s: no name, allocs_per_op and "
+			"syscalls_per_op columns\n", path);
+		exit(1);
+	}
+
+	int count = 0;
+	while (count < max && fgets(line, sizeof (line), in) != NULL) {
+		baseline_t * entry = &baseline[count];
+		int found = 0;
+		int column = 0;
+		for (char * field = strtok_r(line, ",\n", &state);
+			field != NULL;
+			field = strtok_r(NULL, ",\n", &state), column++) {
+			if (column == name_column &&
+				strlen(field) < sizeof (entry->name)) {
+				strcpy(entry->name, field);
+				found++;
+			}
+			else if (column == allocs_column) {
+				entry->allocations = atof(field);
+				found++;
+			}
+			else if (column == syscalls_column) {
+				entry->syscalls = atof(field);
+				found++;
+			}
+		}
+		if (found == 3)
+			count++;
+	}
+	fclose(in);
+
+	return (count);
+}
+
+int
+main(int argc, char * argv[]) {
+
+	const char * filter = NULL;
+	const char * baseline_path = NULL;
+	long min_ms = 200;
+	int repeats = 5;
+	double tolerance = 20;
+	bench_format_t format = BENCH_CSV;
+
+	int opt;
+	while ((opt = getopt(argc, argv, optstring)) != -1) {
+		switch (opt) {
+			case 'f':
+				filter = optarg;
+				break;
+			case 'm':
+				min_ms = atol(optarg);
+				break;
+			case 'r':
+				repeats = atoi(optarg);
+				break;
+			case 'o':
+				if (bench_parse_format(optarg) < 0) {
+					usage();
+					exit(1);
+				}
+				format = bench_parse_format(optarg);
+				break;
+			case 'b':
+				baseline_path = optarg;
+				break;
+			case 't':
+				tolerance = atof(optarg);
+				break;
+			case 'h':
+				usage();
+				exit(0);
+			default:
+				usage();
+				exit(1);
+		}
+	}
+	if (min_ms < 1 || repeats < 1 || repeats > MAX_REPEATS ||
+		tolerance < 0) {
+		usage();
+		exit(1);
+	}
+
+	// Writes to a drain that went away must fail, not kill us
+	signal(SIGPIPE, SIG_IGN);
+	setup();
+
+	baseline_t baseline[64];
+	int num_baseline = baseline_path == NULL ? 0 :
+		load_baseline(baseline_path, baseline, 64);
+	int regressions = 0;
+
+	if (format == BENCH_CSV)
+		printf("name,calls,ns_per_op,cycles_per_op,bytes_per_op,"
+			"cycles_per_byte,mb_per_sec,allocs_per_op,syscalls_per_op\n");
+	else
+		printf("[");
+
+	int first = 1;
+	int num_micros = sizeof (micros) / sizeof (micros[0]);
+	for (int i = 0; i < num_micros; i++) {
+
+		micro_t * micro = &micros[i];
+		if (filter != NULL && strstr(micro->name, filter) == NULL)
+			continue;
+		if (micro->available != NULL && !micro->available()) {
+			fprintf(stderr, "%s is not available here, skipped\n",
+				micro->name);
+			continue;
+		}
+
+		result_t result = benchmark(micro, min_ms, repeats);
+		double cycles_per_byte = micro->bytes ?
+			result.cycles / micro->bytes : 0;
+		double mb_per_sec = micro->bytes ?
+			micro->bytes / result.ns * 1e3 : 0;
+
+		if (format == BENCH_CSV)
+			printf("%s,%ld,%.1f,%.1f,%zu,%.3f,%.1f,%.2f,%.2f\n",
+				micro->name, result.calls, result.ns, result.cycles,
+				micro->bytes, cycles_per_byte, mb_per_sec,
+				result.allocations, result.syscalls);
+		else
+			printf("%s\n  {\"name\": \"%s\", \"calls\": %ld, "
+				"\"ns_per_op\": %.1f, \"cycles_per_op\": %.1f, "
+				"\"bytes_per_op\": %zu, \"cycles_per_byte\": %.3f, "
+				"\"mb_per_sec\": %.1f, \"allocs_per_op\": %.2f, "
+				"\"syscalls_per_op\": %.2f}",
+				first ? "" : ",", micro->name, result.calls, result.ns,
+				result.cycles, micro->bytes, cycles_per_byte, mb_per_sec,
+				result.allocations, result.syscalls);
+		fflush(stdout);
+		first = 0;
+
+		for (int b = 0; b < num_baseline; b++) {
+			if (strcmp(baseline[b].name, micro->name))
+				continue;
+			// Allocation counts do not jitter, so any growth counts
+			int allocates = result.allocations >
+				baseline[b].allocations + 0.005;
+			/*
+			 * System calls only jitter where the kernel splits
+			 * the work differently from run to run, as io_uring
+			 * completions do
+			 */
+			int calls = result.syscalls > baseline[b].syscalls *
+				(1 + tolerance / 100) + 0.05;
+			fprintf(stderr, "%-26s %6.2f allocs/op vs %6.2f, "
+				"%7.2f syscalls/op vs %7.2f%s\n", micro->name,
+				result.allocations, baseline[b].allocations,
+				result.syscalls, baseline[b].syscalls,
+				allocates || calls ? "  REGRESSION" : "");
+			regressions += allocates || calls;
+		}
+	}
+
+	if (format == BENCH_JSON)
+		printf("\n]\n");
+
+	if (regressions > 0) {
+		fprintf(stderr, "%d regressions against %s\n", regressions,
+			baseline_path);
+		return (2);
+	}
+
+	return (0);
+}
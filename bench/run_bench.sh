@@ -0,0 +1,266 @@
+#!/bin/sh
+#
+# End-to-end benchmark: generates the fixture tree (once), starts
+# ftp2_server on it and runs ftp_load through a set of scenarios,
+# writing one CSV per scenario to the results directory.
+#
+# Usage: run_bench.sh [-p <port>] [-d <fixture directory>]
+#                     [-o <results directory>] [-t <seconds>]
+#                     [-c <clients>] [scenario ...]
+#
+# Scenarios: small, huge, list, list100k, list1m, mixed, setup, zipf,
+# burst, overload, wan, wanz, mirror, archive, idle, segments1,
+# segments4, segments16, logoff, logon, size1m, size1g, size8g,
+# upload10g, accept, reuseport, pasv, pasvpool, deep, metricson,
+# metricsoff (all by default). Each scenario's CSV ends with an RSS
+# line, the server's peak resident set in kB while it ran.
+# SERVER_ARGS is passed on to ftp2_server, e.g. SERVER_ARGS="-u"; a
+# scenario may add arguments of its own, in which case the server is
+# restarted for it. The server's output goes to server.log in the
+# results directory.
+
+set -e
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+SERVER="$BENCH/../src/ftp2_server"
+PORT=2121
+FIXTURES=/tmp/ftp_bench_fixtures
+RESULTS="$BENCH/results"
+SECONDS_PER_RUN=10
+CLIENTS=16
+
+while getopts "p:d:o:t:c:h" opt; do
+	case $opt in
+		p) PORT=$OPTARG ;;
+		d) FIXTURES=$OPTARG ;;
+		o) RESULTS=$OPTARG ;;
+		t) SECONDS_PER_RUN=$OPTARG ;;
+		c) CLIENTS=$OPTARG ;;
+		*) sed -n '3,21p' "$0"; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+SCENARIOS=${*:-"small huge list list100k list1m mixed setup zipf burst overload wan wanz mirror archive idle segments1 segments4 segments16 logoff logon size1m size1g size8g upload10g accept reuseport pasv pasvpool deep metricson metricsoff"}
+
+if [ ! -x "$SERVER" ] || [ ! -x "$BENCH/ftp_load" ]; then
+	echo "Build with 'make bench' in src first" >&2
+	exit 1
+fi
+
+# The tree only depends on the seed, so it is made once and reused,
+# unless it predates the tree of small files
+if ! grep -q '^tree ' "$FIXTURES/MANIFEST" 2>/dev/null; then
+	echo "Generating fixtures in $FIXTURES"
+	"$BENCH/ftp_fixtures" -d "$FIXTURES"
+fi
+mkdir -p "$RESULTS"
+
+SERVER_PID=
+RUNNING_ARGS=
+rate_on=
+rate_off=
+trap 'kill $SERVER_PID 2>/dev/null' EXIT INT TERM
+
+# Start the server in the given root with the given extra arguments,
+# unless it already runs so
+start_server() {
+	if [ -n "$SERVER_PID" ] && [ "$RUNNING_ARGS" = "$*" ]; then
+		return
+	fi
+	if [ -n "$SERVER_PID" ]; then
+		kill $SERVER_PID
+		wait $SERVER_PID 2>/dev/null || true
+	fi
+	RUNNING_ARGS="$*"
+	(cd "$1" && shift && exec "$SERVER" -p "$PORT" -l error $SERVER_ARGS "$@" \
+		>> "$RESULTS/server.log") &
+	SERVER_PID=$!
+	sleep 0.5
+}
+
+for scenario in $SCENARIOS; do
+	server_args=
+	clients=$CLIENTS
+	root=$FIXTURES
+	# Rows of the CSV shown as it runs
+	rows='MIRROR|SITE|TOTAL|WIRE|IDLE|RSS'
+	case $scenario in
+		small) args="-m retr=1 -g small" ;;
+		huge) args="-m retr=1 -g huge" ;;
+		list) args="-m list=1" ;;
+		# LIST of a single directory of 100k and of 1M empty files,
+		# made under the fixtures when first needed: the LIST max is
+		# the first, uncached listing. Every command waits on its
+		# reply, so the COMMANDS row against the TOTAL one gives
+		# the round trips a listing takes, and the TTFB row the
+		# time from the LIST to the first bytes of the listing.
+		list100k|list1m)
+			entries=100000
+			if [ "$scenario" = list1m ]; then
+				entries=1000000
+			fi
+			if [ ! -f "$FIXTURES/$scenario/MANIFEST" ]; then
+				echo "Generating $entries entries in $FIXTURES/$scenario"
+				"$BENCH/ftp_fixtures" -d "$FIXTURES/$scenario" -s 0 \
+					-H 0 -e 0 -T 0 -w $entries
+			fi
+			args="-m list=1 -L $scenario/wide"
+			rows="$rows|COMMANDS|LIST|TTFB" ;;
+		mixed) args="-m list=1,retr=6,stor=1,appe=1" ;;
+		# A fresh session for every operation: the cost of connecting
+		setup) args="-m retr=1 -g small -k 1 -d pasv=1" ;;
+		# A few hot files among many: what the file cache is for
+		zipf) args="-m retr=1 -g small -z 1.1" ;;
+		# Far more clients than the workers keep up with, a session
+		# each per download, first with every session let in, then
+		# with the admission limits turning the excess away with a
+		# 421: compare the latency of the sessions that got in
+		burst|overload)
+			args="-m retr=1 -g small -k 1 -d pasv=1"
+			clients=$((CLIENTS * 16))
+			if [ "$scenario" = overload ]; then
+				server_args="-S $CLIENTS -W 20"
+			fi ;;
+		# A few clients pulling CSV exports over 10 Mbit/s links,
+		# in stream mode and then in MODE Z: compare the RETR MB/s,
+		# and the data against the WIRE bytes for the compression
+		# ratio
+		wan|wanz)
+			args="-m retr=1 -g export -B 1250000"
+			clients=4
+			if [ "$scenario" = wanz ]; then
+				args="$args -Z 6"
+			fi ;;
+		# The tree of small files downloaded by one client, file by
+		# file and then as a single SITE TARGET archive: compare the
+		# MIRROR and SITE latencies, the time the whole tree takes
+		mirror)
+			args="-m mirror=1 -g tree"
+			clients=1 ;;
+		archive)
+			args="-m archive=1 -g tree"
+			clients=1 ;;
+		# 10k sessions logged in and left at the prompt while the
+		# clients download: compare the RETR latency with small, and
+		# see in the IDLE line whether the server dropped any. Each
+		# session takes two descriptors of the server.
+		idle) args="-m retr=1 -g small -i 10000" ;;
+		# One huge file pulled over 1, 4 and 16 sessions at once,
+		# each with REST to the start of its segment: compare the
+		# aggregate RETR MB/s
+		segments1|segments4|segments16)
+			clients=${scenario#segments}
+			args="-m segment=1 -g huge -S $clients" ;;
+		# A session per small download, as in setup, with only errors
+		# logged and then with every command traced at debug level:
+		# the latency of each command shows what logging it costs
+		logoff|logon)
+			args="-m retr=1 -g small -k 1 -d pasv=1"
+			if [ "$scenario" = logon ]; then
+				server_args="-l debug"
+			fi ;;
+		# A single file of 1 MB, 1 GB and 8 GB pulled by four
+		# clients over and over, each served from a fixture of its
+		# own: compare the RETR MB/s and how the RSS of the server
+		# grows, or not, with the size of the file
+		size1m|size1g|size8g)
+			case $scenario in
+				size1m) mib=1 ;;
+				size1g) mib=1024 ;;
+				size8g) mib=8192 ;;
+			esac
+			root=$FIXTURES/$scenario
+			if [ ! -f "$root/MANIFEST" ]; then
+				echo "Generating a file of $mib MiB in $root"
+				"$BENCH/ftp_fixtures" -d "$root" -s 0 -H 1 -z $mib \
+					-e 0 -w 0 -T 0
+			fi
+			args="-m retr=1 -g huge"
+			clients=4 ;;
+		# Four clients uploading 10 GB each at once, a single STOR
+		# apiece: the STOR MB/s and the RSS of the server show
+		# whether it keeps up with them in bounded memory. Needs
+		# 40 GB free under the fixtures.
+		upload10g)
+			args="-m stor=1 -s 10737418240 -t 0 -n 1"
+			clients=4 ;;
+		# Connections closed as soon as the server greets them,
+		# against a single acceptor and against four SO_REUSEPORT
+		# listeners: the CONNECT row gives the accepts a second
+		# and the time to the banner
+		accept|reuseport)
+			args="-m connect=1"
+			if [ "$scenario" = reuseport ]; then
+				server_args="-r 4"
+			fi ;;
+		# Small downloads over passive data connections, each on a
+		# socket bound for it and then on the ports the server
+		# keeps listening: the RETR row gives the transfers a
+		# second, the PASV and EPSV rows what setting one up costs
+		pasv|pasvpool)
+			args="-m retr=1 -g small -d pasv=1,epsv=1"
+			if [ "$scenario" = pasvpool ]; then
+				server_args="-P 40000-40999"
+			fi ;;
+		# Four times as many sessions changing into a directory 32
+		# levels down, listing it and back up, and downloading the
+		# small files there by their full path, from a fixture of
+		# its own: the CWD, LIST and RETR rows give what resolving
+		# deep paths costs
+		deep)
+			root=$FIXTURES/deep
+			if [ ! -f "$root/MANIFEST" ]; then
+				echo "Generating a directory 32 levels deep in $root"
+				"$BENCH/ftp_fixtures" -d "$root" -s 0 -H 0 -e 0 -w 0 \
+					-T 0 -D 32
+			fi
+			bottom=deep
+			for level in $(seq -w 1 32); do
+				bottom=$bottom/l$level
+			done
+			args="-m list=1,retr=4 -g deep -L $bottom"
+			clients=$((CLIENTS * 4)) ;;
+		# Small downloads over the passive port pool, the steadiest
+		# of the scenarios, with the server recording its metrics
+		# and with them turned off: once both ran, the difference
+		# in operations a second is printed as what the metrics
+		# cost. It is only worth reading if it is larger than what
+		# runs of the same scenario differ by.
+		metricson|metricsoff)
+			args="-m retr=1 -g small -d pasv=1,epsv=1"
+			server_args="-P 40000-40999"
+			if [ "$scenario" = metricsoff ]; then
+				server_args="$server_args -N"
+			fi ;;
+		*) echo "Unknown scenario $scenario" >&2; exit 1 ;;
+	esac
+	start_server "$root" $server_args
+
+	# Uploads from an earlier run would only grow; those of this
+	# one are not kept either
+	rm -f "$root"/upload/*
+	# Reset the peak resident set of the server, to read it after
+	echo 5 2>/dev/null > /proc/$SERVER_PID/clear_refs || true
+	echo "Running $scenario"
+	"$BENCH/ftp_load" -f "$root" -p "$PORT" -c "$clients" \
+		-t "$SECONDS_PER_RUN" $args > "$RESULTS/$scenario.csv"
+	rss=$(awk '/^VmHWM:/ { print $2 }' /proc/$SERVER_PID/status \
+		2>/dev/null || true)
+	if [ -n "$rss" ]; then
+		echo "RSS,$rss,,,,,,,," >> "$RESULTS/$scenario.csv"
+	fi
+	grep -E "^($rows)," "$RESULTS/$scenario.csv"
+	rm -f "$root"/upload/*
+
+	rate=$(awk -F, '$1 == "TOTAL" { print $4 }' "$RESULTS/$scenario.csv")
+	case $scenario in
+		metricson) rate_on=$rate ;;
+		metricsoff) rate_off=$rate ;;
+	esac
+done
+
+if [ -n "$rate_on" ] && [ -n "$rate_off" ]; then
+	awk -v on="$rate_on" -v off="$rate_off" 'BEGIN {
+		printf "Metrics overhead: %.2f%% of the operations a second\n",
+			(off - on) * 100 / off }'
+fi
@@ -0,0 +1,65 @@
+#ifndef _ADMISSION_H
+#define	_ADMISSION_H
+
+#include "worker_pool.h"
+
+// Number of hash buckets of the sessions per client host
+#define		ADMISSION_HOST_BUCKETS 1024
+/*
+ * Default bound on the jobs queued on a pool before new
+ * connections are turned away, which keeps the rest of the
+ * ring for the commands of the sessions already admitted
+ */
+#define		DEFAULT_MAX_QUEUE_DEPTH (JOB_RING_CAPACITY / 2)
+
+/*
+ * Limits on the sessions the server takes on; a limit of
+ * zero is not enforced. Connections beyond them are turned
+ * away by the acceptor with a 421 before any worker sees
+ * them, so an overloaded server keeps serving the sessions
+ * it has instead of queueing ever more.
+ */
+typedef struct admission_limits {
+	// Sessions open at once
+	unsigned long max_sessions;
+	// Jobs waiting in the worker pool of the acceptor
+	unsigned long max_queue_depth;
+	// Time the oldest of those jobs has waited, in milliseconds
+	unsigned long max_queue_wait_ms;
+	// Sessions open at once from a single client host
+	unsigned long max_host_sessions;
+} admission_limits_t;
+
+// The outcome of admission, and the limit a connection ran into
+typedef enum admission {
+	ADMISSION_ADMITTED,
+	ADMISSION_SESSIONS,
+	ADMISSION_QUEUE_DEPTH,
+	ADMISSION_QUEUE_WAIT,
+	ADMISSION_HOST
+} admission_t;
+
+// Set the limits; called once, before any connection is accepted
+void
+admission_init(const admission_limits_t * limits);
+
+/*
+ * Decide whether a connection accepted for the given worker
+ * pool may start a session. An admitted connection counts
+ * against the limits until admission_release is called.
+ */
+admission_t
+admission_check(worker_pool_t * pool, struct sockaddr_storage * client_addr);
+
+// Give back what an admitted session counted against the limits
+void
+admission_release(struct sockaddr_storage * client_addr);
+
+/*
+ * Tell the client of a connection that was not admitted that
+ * the server is busy, without waiting on it, and close it
+ */
+void
+admission_reject(int fd, admission_t reason);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef _ARCHIVE_H
+#define	_ARCHIVE_H
+
+#include "utils.h"
+
+// Threads walking the directories of one archive
+#define		ARCHIVE_WALKERS 4
+/*
+ * Entries the walkers may get ahead of the data connection by;
+ * regular files among them are held open
+ */
+#define		ARCHIVE_QUEUE_ENTRIES 64
+/*
+ * Bodies from this size on are sent with sendfile; smaller ones
+ * are copied into the buffer along with the headers around them
+ */
+#define		ARCHIVE_SENDFILE_MIN_SIZE 16384
+// Blocks of a tar archive, and the records it is padded to
+#define		TAR_BLOCK_SIZE 512
+#define		TAR_RECORD_SIZE (20 * TAR_BLOCK_SIZE)
+
+struct zmode;
+
+/*
+ * Stream the tree under the directory open at dir_fd as a POSIX
+ * tar archive over data_fd, with its entries named under prefix
+ * (none if it is empty). Directories are walked in parallel,
+ * files are held open only while they wait in a bounded queue,
+ * and symbolic links are archived, not followed. With zmode set
+ * the archive is compressed at the given level. Returns the size
+ * of the archive, or -1.
+ */
+off_t
+archive_send_tree(int dir_fd, const char * prefix, int data_fd,
+	struct zmode * zmode, int level);
+
+#endif
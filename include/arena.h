@@ -0,0 +1,54 @@
+#ifndef _ARENA_H
+#define	_ARENA_H
+
+#include <stdarg.h>
+#include "utils.h"
+
+// Bytes every session has for the transient data of a command
+#define		SESSION_ARENA_SIZE 4096
+// Alignment of the memory handed out by an arena
+#define		ARENA_ALIGN 16
+
+// A block allocated once a command outgrew its arena
+typedef struct arena_chunk {
+	struct arena_chunk * next;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+} arena_chunk_t;
+
+/*
+ * A bump allocator over a fixed block, for memory that only
+ * lives as long as one command, such as formatted replies.
+ * Everything is released at once by arena_reset(); requests
+ * the block cannot hold fall back to the heap until then.
+ */
+typedef struct arena {
+	char * block;
+	size_t size;
+	size_t used;
+	arena_chunk_t * overflow;
+} arena_t;
+
+// Start an arena over the given block of memory
+void
+arena_init(arena_t * arena, char * block, size_t size);
+
+/*
+ * Allocate size bytes, aligned to ARENA_ALIGN, that stay
+ * valid until the arena is reset; returns NULL on failure
+ */
+void *
+arena_alloc(arena_t * arena, size_t size);
+
+/*
+ * Format a string into the arena like sprintf; returns it,
+ * with its length in len if not NULL, or NULL on failure
+ */
+char *
+arena_printf(arena_t * arena, size_t * len, const char * format, ...)
+	__attribute__((format(printf, 3, 4)));
+
+// Release everything allocated since the last reset
+void
+arena_reset(arena_t * arena);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef _BUFFER_POOL_H
+#define	_BUFFER_POOL_H
+
+#include "crlf.h"
+
+/*
+ * Size of a transfer buffer: one block of input plus room for
+ * converting it in either direction, so an ASCII transfer
+ * needs a single buffer
+ */
+#define		BUFFER_POOL_BUFFER_SIZE \
+	(CRLF_BLOCK_SIZE + CRLF_EXPAND_SIZE(CRLF_BLOCK_SIZE))
+// Buffers carved out of the system at a time
+#define		BUFFER_POOL_SLAB_BUFFERS 8
+// Free buffers each thread keeps for itself
+#define		BUFFER_POOL_THREAD_CACHE 2
+
+/*
+ * Get a transfer buffer of BUFFER_POOL_BUFFER_SIZE bytes, from
+ * the calling thread's cache if it has one and otherwise from
+ * the shared pool, which grows by a slab when it runs empty.
+ * Returns NULL if the pool cannot grow.
+ */
+char *
+buffer_pool_get();
+
+// Give back a buffer obtained from buffer_pool_get()
+void
+buffer_pool_put(char * buffer);
+
+// Print the number of buffers made and how many are in use
+void
+buffer_pool_report(FILE * out);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef _CRLF_H
+#define	_CRLF_H
+
+#include "utils.h"
+
+// Size of the blocks ASCII mode transfers are converted in
+#define		CRLF_BLOCK_SIZE 65536
+/*
+ * Output buffer size needed to expand a block of len bytes,
+ * where every byte may be a line feed
+ */
+#define		CRLF_EXPAND_SIZE(len) (2 * (len))
+/*
+ * Output buffer size needed to collapse a block of len bytes,
+ * plus a carriage return held back from the previous block
+ */
+#define		CRLF_COLLAPSE_SIZE(len) ((len) + 1)
+
+/*
+ * State carried between the blocks of one transfer, since a
+ * line ending may straddle two blocks
+ */
+typedef struct crlf_state {
+	// Last byte of the previous block, for expanding
+	char prev;
+	// The previous block ended in a carriage return, for collapsing
+	int pending_cr;
+} crlf_state_t;
+
+// Reset the state for a new transfer
+void
+crlf_init(crlf_state_t * state);
+
+/*
+ * Convert a block of local text into network ASCII by turning
+ * every line feed not already preceded by a carriage return
+ * into CRLF. Returns the number of bytes written to out, which
+ * must hold CRLF_EXPAND_SIZE(len) bytes.
+ */
+size_t
+crlf_expand(crlf_state_t * state, const char * in, size_t len, char * out);
+
+/*
+ * Convert a block of network ASCII into local text by turning
+ * every CRLF into a line feed; lone carriage returns are kept.
+ * Returns the number of bytes written to out, which must hold
+ * CRLF_COLLAPSE_SIZE(len) bytes.
+ */
+size_t
+crlf_collapse(crlf_state_t * state, const char * in, size_t len, char * out);
+
+/*
+ * Flush a carriage return held back at the end of the last
+ * block of a transfer; returns the number of bytes written
+ */
+size_t
+crlf_collapse_finish(crlf_state_t * state, char * out);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef _EVENT_LOOP_H
+#define	_EVENT_LOOP_H
+
+#include "ftp_functions.h"
+
+/*
+ * Number of event loop threads that multiplex the
+ * control connections of all idle sessions
+ */
+#define		NUM_EVENT_LOOPS 4
+// Maximum number of readiness events handled per epoll_wait call
+#define		EVENT_BATCH_SIZE 64
+/*
+ * How long an event loop waits before it offers the sessions
+ * the full job queue turned away to the workers again
+ */
+#define		EVENT_RETRY_MS 1
+
+/*
+ * Every event loop keeps the deadlines of its sessions in a
+ * timer wheel of its own. A session waiting for a command is
+ * closed with a 421 once it has been idle for the idle
+ * timeout; while it runs a transfer, the loop checks its data
+ * connection every stall timeout and shuts it down if it has
+ * not moved the minimum rate, see session_timeouts_t.
+ */
+
+// Create the epoll instances used by the event loops
+int
+event_loop_init();
+
+/*
+ * Assign a session to one of the event loops and start
+ * watching its control connection for incoming commands
+ */
+int
+event_loop_register(client_context_t * current_context);
+
+/*
+ * Watch the control connection of a session again once
+ * its previous command has been processed
+ */
+int
+event_loop_rearm(client_context_t * current_context);
+
+// Stop watching the control connection of a session
+int
+event_loop_unregister(client_context_t * current_context);
+
+/*
+ * Watch the data connection of a transfer the session is
+ * about to run, shutting it down if the transfer stalls
+ */
+void
+event_loop_watch_transfer(client_context_t * current_context, int data_fd);
+
+/*
+ * Stop watching the session's data connection; the session's
+ * transfer_stalled flag tells whether it was shut down
+ */
+void
+event_loop_unwatch_transfer(client_context_t * current_context);
+
+/*
+ * A thread function that waits for readable control
+ * connections and hands their sessions to the worker threads
+ */
+void *
+event_loop_thread(void * args);
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef _FILE_CACHE_H
+#define	_FILE_CACHE_H
+
+#include "utils.h"
+
+// Number of hash buckets of the file cache
+#define		FILE_CACHE_BUCKETS 4096
+// Default bound on the bytes of the files held by the cache
+#define		FILE_CACHE_DEFAULT_BYTES (256UL * 1024 * 1024)
+// Most files the cache keeps open
+#define		FILE_CACHE_MAX_FILES 2048
+/*
+ * Descriptor table room set aside at start: the cached files
+ * and as many descriptors again for the sessions
+ */
+#define		FILE_CACHE_RESERVED_FDS (2 * FILE_CACHE_MAX_FILES)
+/*
+ * Files larger than this fraction of the budget are not cached,
+ * so that one large download cannot flush every hot file
+ */
+#define		FILE_CACHE_MAX_FILE_SHARE 8
+/*
+ * A file modified less than this many nanoseconds before it was
+ * opened may still be being written, so it is not cached
+ */
+#define		FILE_CACHE_RACY_NS 2000000000LL
+
+/*
+ * An open file, kept open while it is cached and mapped into
+ * memory once a transfer needs its contents. Cached entries
+ * are identified by device, inode, mtime and size, so a
+ * modified file no longer matches its entry; entries that
+ * could not be cached only serve the session that opened them.
+ */
+typedef struct file_entry {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	off_t size;
+	int fd;
+	// The whole file, or NULL until it is first mapped
+	char * map;
+	// Sessions currently sending this file, plus one while cached
+	int refcount;
+	// Set while the entry is in the cache, under the lock
+	int cached;
+	/*
+	 * Set once the entry went into the cache, after which its
+	 * descriptor may be shared with other sessions, evicted or not
+	 */
+	int shared;
+	struct file_entry * hash_next;
+	struct file_entry * lru_prev;
+	struct file_entry * lru_next;
+} file_entry_t;
+
+// Counters of the file cache, as reported with the metrics
+typedef struct file_cache_stats {
+	unsigned long files;
+	size_t bytes;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long long served_bytes;
+} file_cache_stats_t;
+
+/*
+ * Set the memory budget of the cache in bytes; 0 disables it.
+ * Also guards the threads reading mappings against files
+ * truncated underneath them. Returns 0 or -1.
+ */
+int
+file_cache_init(size_t max_bytes);
+
+/*
+ * Open a regular file relative to dir_fd for downloading, from
+ * the cache if it holds the file unchanged. Returns NULL with
+ * errno set if the file cannot be opened or is not a regular
+ * file; the entry must be given back with file_cache_release().
+ */
+file_entry_t *
+file_cache_open(int dir_fd, const char * name);
+
+// Give back a file obtained from file_cache_open()
+void
+file_cache_release(file_entry_t * entry);
+
+/*
+ * Send a cached file from the given offset on, in binary or
+ * ASCII mode; returns the number of bytes of the file sent,
+ * or -1, like RETR(). Entries that are not cached are sent
+ * with RETR() on their descriptor instead.
+ */
+off_t
+file_cache_send(file_entry_t * entry, int data_fd, int binary_flag,
+	off_t offset);
+
+// Take a snapshot of the cache's counters
+void
+file_cache_stats(file_cache_stats_t * stats);
+
+// Print the hit rate, bytes served and size of the cache
+void
+file_cache_report(FILE * out);
+
+#endif
@@ -25,16 +25,110 @@
 #endif
 #include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <limits.h>
+#include <stdint.h>
+#include <ctype.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include "arena.h"
+#include "timer_wheel.h"
 
-// Number of threads in the thread pool
-#define		NUM_THREADS 5
+/*
+ * Size of the buffer holding the commands sent over the control
+ * connection; a command line must fit in it
+ */
+#define		COMMAND_BUFFER_SIZE 4096
+/*
+ * Size of the buffer the replies to a session's commands are
+ * gathered in until they are written out together
+ */
+#define		REPLY_BUFFER_SIZE 2048
+// Maximum number of bytes handed to a single sendfile call
+#define		SENDFILE_CHUNK_SIZE (1 << 20)
 /*
  * Maximum number of connected clients to the server;
  * used in the 'listen' system call
  */
 #define		MAX_NUM_CONNECTED_CLIENTS 5
+// Default backlog of the listening control socket
+#define		DEFAULT_LISTEN_BACKLOG SOMAXCONN
+// Default session timeouts in seconds, see session_timeouts_t
+#define		DEFAULT_IDLE_TIMEOUT_S 300
+#define		DEFAULT_DATA_CONNECTION_TIMEOUT_S 30
+#define		DEFAULT_STALL_TIMEOUT_S 60
+// Default transfer rate below which a transfer stalls, in bytes a second
+#define		DEFAULT_MIN_TRANSFER_RATE 0
+
+/*
+ * How long a session may keep the server waiting; a
+ * timeout of zero is not enforced
+ */
+typedef struct session_timeouts {
+	// Control connection without a command, closed with a 421
+	unsigned long idle_s;
+	/*
+	 * Data connection not set up, answered with a 425; also
+	 * the time a client may take to read its replies
+	 */
+	unsigned long data_connection_s;
+	/*
+	 * Transfers that move no more than min_rate bytes a
+	 * second over stall_s are cut off with a 426
+	 */
+	unsigned long stall_s;
+	unsigned long min_rate;
+} session_timeouts_t;
+
+/*
+ * States of a client session. A session sits idle in an
+ * event loop until its control connection becomes readable,
+ * is then handed to a worker thread to run the command,
+ * and finally is closed once the client quits or disconnects.
+ */
+typedef enum session_state {
+	SESSION_IDLE,
+	SESSION_RUNNING,
+	SESSION_CLOSED
+} session_state_t;
+
+/*
+ * The commands the server knows, which index the
+ * per-command metrics; anything else counts as VERB_OTHER
+ */
+typedef enum verb {
+	VERB_USER,
+	VERB_PASS,
+	VERB_SYST,
+	VERB_FEAT,
+	VERB_PWD,
+	VERB_PASV,
+	VERB_EPSV,
+	VERB_CWD,
+	VERB_PORT,
+	VERB_TYPE,
+	VERB_LIST,
+	VERB_EPRT,
+	VERB_RETR,
+	VERB_STOR,
+	VERB_APPE,
+	VERB_RMD,
+	VERB_MKD,
+	VERB_REST,
+	VERB_MLSD,
+	VERB_MLST,
+	VERB_STAT,
+	VERB_QUIT,
+	VERB_MODE,
+	VERB_OPTS,
+	VERB_SITE,
+	VERB_OTHER,
+	NUM_VERBS
+} verb_t;
 
 /*
  * Create a structure that holds all the parameters
@@ -44,17 +138,75 @@
  */
 typedef struct client_context {
 	char * input_command;
+	// strtok_r position within the command being processed
+	char * token_state;
 	int client_comm_fd;
 	int active_flag;
 	int binary_flag;
+	/*
+	 * Whether transfers are deflated (MODE Z), at which level,
+	 * and the zlib streams they use once the first one has run
+	 */
+	int compress_flag;
+	int compression_level;
+	struct zmode * zmode;
 	int data_port;
 	int data_fd;
-	char * current_working_directory;
-	char * PORT;
+	/*
+	 * Directory the session's paths are resolved against,
+	 * and its path as shown to the client
+	 */
+	int cwd_fd;
+	char current_working_directory[PATH_MAX];
+	// Offset the next transfer starts at, as set by REST
+	off_t restart_offset;
+	// Client port for active mode, empty until PORT or EPRT
+	char PORT[NI_MAXSERV];
 	struct sockaddr_storage client_addr;
 	int client_data_fd;
 	int PASV_EPSV_FLAG;
 	int PORT_EPRT_FLAG;
+	session_state_t state;
+	// Worker pool that runs the session's commands
+	struct worker_pool * pool;
+	// epoll instance of the event loop watching this session
+	int epoll_fd;
+	/*
+	 * The session's deadline in the timer wheel of its event
+	 * loop: the idle timeout while it waits for a command, the
+	 * stall check of the data connection during a transfer
+	 */
+	wheel_timer_t timer;
+	struct timer_wheel * wheel;
+	// Data connection under watch and the bytes it had moved when last checked
+	int watched_fd;
+	unsigned long long watched_bytes;
+	// Set when the transfer was cut off for moving too little
+	int transfer_stalled;
+	// Next session timed out in the same tick of the event loop
+	struct client_context * expired_next;
+	// Next session waiting for room in the job queue
+	struct client_context * deferred_next;
+	// Listener checked out of the passive port range, if any
+	struct pasv_listener * pasv_listener;
+	/*
+	 * Bytes read from the control connection that do not yet
+	 * form a complete command line, kept across reads
+	 */
+	char command_buffer[COMMAND_BUFFER_SIZE];
+	size_t command_len;
+	// Dropping the rest of a line that did not fit in the buffer
+	int command_overflow;
+	// Replies queued since they were last written out, see reply.h
+	char reply_buffer[REPLY_BUFFER_SIZE];
+	size_t reply_len;
+	/*
+	 * Memory for the transient data of the command being run,
+	 * such as formatted replies; reset after every command
+	 */
+	arena_t arena;
+	char arena_block[SESSION_ARENA_SIZE]
+		__attribute__((aligned(ARENA_ALIGN)));
 } client_context_t;
 
 /*
@@ -62,33 +214,112 @@ typedef struct client_context {
  * FTP commands to their specific handlers
  */
 typedef struct command_matcher {
+	// The verb packed into an integer, see COMMAND_KEY
+	uint32_t key;
 	char * command;
 	void (*handler)(client_context_t * context);
+	verb_t verb;
 } command_matcher_t;
 
 /*
- *  Returns the appropriate handler for a certain
- * command from the client
+ * Returns the appropriate handler for a certain
+ * command from the client; verbs are case-insensitive
  */
 void
 (*get_handler(char * command))(client_context_t *);
 
+// Name of a command, as used in reports
+const char *
+verb_name(verb_t verb);
 
-// Initlialize mutexes, conditional variables, and job queue
-int
-init();
 
-// A thread function that processes jobs
+/*
+ * A thread function that processes jobs of
+ * the worker pool passed as its argument
+ */
 void *
 ftp_thread(void * args);
 
+/*
+ * Opens the directory every new session starts in;
+ * must be called before any session is started
+ */
+int
+set_session_root(const char * path);
+
+/*
+ * Sets the timeouts of every session; must be called
+ * before any session is started
+ */
+void
+set_session_timeouts(const session_timeouts_t * timeouts);
+
+// The timeouts sessions run with
+const session_timeouts_t *
+get_session_timeouts();
+
+/*
+ * Sets the compression level MODE Z transfers of new
+ * sessions start with, from 0 to 9
+ */
+void
+set_compression_level(int level);
+
+/*
+ * Creates the context for a newly accepted client, greets
+ * the client and hands the session over to an event loop
+ */
+void
+start_session(int fd, struct sockaddr_storage client_addr,
+	struct worker_pool * pool);
+
+/*
+ * Executes the complete command lines in a session's buffer
+ * after nread more bytes were read into it, keeping the
+ * partial line that may follow for the next read
+ */
+void
+execute_commands(client_context_t * current_context, size_t nread);
+
+/*
+ * Reads and executes the pending command of a session whose
+ * control connection has become readable
+ */
+void
+process_session(client_context_t * current_context);
+
+// Closes the control connection and frees the session context
+void
+end_session(client_context_t * current_context);
+
+/*
+ * Accepts the client's data connection on the
+ * passive mode listening socket
+ */
+int
+accept_data_connection(client_context_t * current_context);
+
+/*
+ * Gives the session's passive mode listening socket back
+ * to the port range pool, or closes it
+ */
+void
+release_passive_listener(client_context_t * current_context);
+
+// Sends a whole buffer over a data connection
+ssize_t
+send_data(int data_fd, const char * buffer, size_t len);
+
 // Initiates a 'listen'ing server socket for passive mode
-struct sockaddr_storage
+int
 initiate_server_PASV(int * data_fd, int IPV4FLAG);
 
-// Initiates a 'listen'ing server socket at the given port
+/*
+ * Initiates a non-blocking 'listen'ing server socket at the
+ * given port, optionally sharing the port with SO_REUSEPORT
+ */
 int
-initiate_server(long port);
+initiate_server(long port, int backlog, int reuse_port);
 
 // Handler function for the USER FTP command
 void
@@ -137,13 +368,25 @@ PORT_EPRT_HANDLER(client_context_t * current_context);
 void
 TYPE_HANDLER(client_context_t * current_context);
 
+// Handler function for the MODE FTP command
+void
+MODE_HANDLER(client_context_t * current_context);
+
+// Handler function for the OPTS FTP command
+void
+OPTS_HANDLER(client_context_t * current_context);
+
 // Handle for the RETR FTP command
 void
 RETR_HANDLER(client_context_t * current_context);
 
-// Used to accomplish the RETR FTP command
-int
-RETR(int file_fd, int data_fd, int binary_flag);
+/*
+ * Used to accomplish the RETR FTP command, sending
+ * the file from the given offset on; returns the
+ * number of bytes of the file sent, or -1
+ */
+off_t
+RETR(int file_fd, int data_fd, int binary_flag, off_t offset);
 
 // Handle for the LIST FTP command
 void
@@ -151,15 +394,19 @@ LIST_HANDLER(client_context_t * current_context);
 
 // Used to accmplish the LIST FTP command
 char *
-LIST(char * dir_name);
+LIST(int dir_fd, size_t * len);
 
 // Handle for the STOR FTP command
 void
 STOR_HANDLER(client_context_t * current_context);
 
-// Used to accomplish the STOR FTP command
-int
-STOR(int file_fd, int data_fd, int binary_flag);
+/*
+ * Used to accomplish the STOR FTP command, writing
+ * the upload into the file from the given offset on;
+ * returns the number of bytes stored, or -1
+ */
+off_t
+STOR(int file_fd, int data_fd, int binary_flag, off_t offset);
 
 // Handle for the APPE FTP command
 void
@@ -173,5 +420,25 @@ RMD_HANDLER(client_context_t * current_context);
 void
 MKD_HANDLER(client_context_t * current_context);
 
+// Handle for the REST FTP command
+void
+REST_HANDLER(client_context_t * current_context);
+
+// Handle for the MLSD FTP command
+void
+MLSD_HANDLER(client_context_t * current_context);
+
+// Handle for the MLST FTP command
+void
+MLST_HANDLER(client_context_t * current_context);
+
+// Handle for the STAT FTP command
+void
+STAT_HANDLER(client_context_t * current_context);
+
+// Handle for the SITE FTP command
+void
+SITE_HANDLER(client_context_t * current_context);
+
 
 #endif
@@ -0,0 +1,54 @@
+#ifndef _LIST_CACHE_H
+#define	_LIST_CACHE_H
+
+#include "utils.h"
+
+// Number of hash buckets of the listing cache
+#define		LIST_CACHE_BUCKETS 1024
+// Upper bound on the memory held by cached listings
+#define		LIST_CACHE_MAX_BYTES (64 * 1024 * 1024)
+/*
+ * A directory modified less than this many nanoseconds
+ * before it was read may change again within the same
+ * timestamp tick, so its listing is not cached
+ */
+#define		LIST_CACHE_RACY_NS 2000000000LL
+
+/*
+ * The rendered LIST output of one directory, identified by
+ * its device and inode and valid for as long as the
+ * directory's mtime and ctime stay the same
+ */
+typedef struct list_entry {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec ctime;
+	char * data;
+	size_t len;
+	// Sessions currently sending this listing, plus one while cached
+	int refcount;
+	int cached;
+	struct list_entry * hash_next;
+	struct list_entry * lru_prev;
+	struct list_entry * lru_next;
+} list_entry_t;
+
+/*
+ * Get the listing of the directory open at dir_fd, from the
+ * cache if the directory has not changed since it was cached.
+ * Returns NULL if the directory cannot be read; the entry
+ * must be given back with list_cache_release().
+ */
+list_entry_t *
+list_cache_get(int dir_fd);
+
+// Give back a listing obtained from list_cache_get()
+void
+list_cache_release(list_entry_t * entry);
+
+// Print the hit rate, lookup latency and size of the cache
+void
+list_cache_report(FILE * out);
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef _LOG_H
+#define	_LOG_H
+
+#include <stdarg.h>
+#include <strings.h>
+#include "utils.h"
+
+// Longest message a log record holds; longer ones are cut short
+#define		LOG_MESSAGE_SIZE 240
+/*
+ * Number of records in the ring of each logging thread;
+ * must be a power of two
+ */
+#define		LOG_RING_CAPACITY 512
+// Size of the buffer the writer gathers formatted lines in
+#define		LOG_WRITE_BUFFER_SIZE 65536
+
+// Severity of a message; each level includes the ones above it
+typedef enum log_level {
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_WARN,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_DEBUG
+} log_level_t;
+
+// A message as queued by the thread that logged it
+typedef struct log_record {
+	// Wall clock time of the message, in nanoseconds
+	unsigned long long time_ns;
+	unsigned short len;
+	unsigned char level;
+	char message[LOG_MESSAGE_SIZE];
+} log_record_t;
+
+/*
+ * Single-producer/single-consumer ring of the records of one
+ * thread. Only the owning thread moves the tail and only the
+ * writer moves the head, so neither needs a lock.
+ */
+typedef struct log_ring {
+	unsigned long head __attribute__((aligned(CACHE_LINE_SIZE)));
+	unsigned long tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	// Records lost because the ring was full
+	unsigned long dropped;
+	// The owning thread has exited; freed once drained
+	int orphaned;
+	// Tail as read by the writer when it began draining
+	unsigned long drain_tail;
+	struct log_ring * next;
+	log_record_t records[LOG_RING_CAPACITY];
+} log_ring_t;
+
+// Most verbose level currently written out
+extern int log_threshold;
+
+#define	LOG_ENABLED(level) \
+	((int)(level) <= __atomic_load_n(&log_threshold, __ATOMIC_RELAXED))
+
+/*
+ * Log a printf-style message. The level is checked before the
+ * arguments are evaluated, so a disabled level costs one load
+ * and a branch.
+ */
+#define	LOG_AT(level, ...) \
+	do { \
+		if (LOG_ENABLED(level)) \
+			log_write(level, __VA_ARGS__); \
+	} while (0)
+
+#define	log_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define	log_warn(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define	log_info(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define	log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/*
+ * Start the thread that writes the queued records
+ * to standard output; returns 0 or -1
+ */
+int
+log_init();
+
+// Select the most verbose level that is written out
+void
+log_set_level(log_level_t level);
+
+/*
+ * Parse the name of a level ("error", "warn", "info"
+ * or "debug"); returns -1 for an unknown name
+ */
+int
+log_parse_level(const char * name);
+
+/*
+ * Queue a message on the calling thread's ring without
+ * blocking; the message is dropped if the ring is full
+ */
+void
+log_write(log_level_t level, const char * format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/*
+ * Write out every queued record right away,
+ * such as before the server exits
+ */
+void
+log_flush();
+
+#endif
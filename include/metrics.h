@@ -0,0 +1,120 @@
+#ifndef _METRICS_H
+#define	_METRICS_H
+
+#include "ftp_functions.h"
+
+/*
+ * Histograms are log-linear, as in HDR histograms: values
+ * below HISTOGRAM_SUB_BUCKETS microseconds get a bucket each,
+ * and every power of two above is split into that many
+ * buckets, so a bucket is within 1/8 of the values it holds.
+ */
+#define		HISTOGRAM_SUB_BUCKET_BITS 3
+#define		HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+// Values from 2^HISTOGRAM_MAX_POWER microseconds on share the last bucket
+#define		HISTOGRAM_MAX_POWER 32
+#define		HISTOGRAM_BUCKETS \
+	((HISTOGRAM_MAX_POWER - HISTOGRAM_SUB_BUCKET_BITS + 1) * \
+	HISTOGRAM_SUB_BUCKETS)
+
+// Event counters
+typedef enum metric_counter {
+	METRIC_SESSIONS_OPENED,
+	METRIC_SESSIONS_CLOSED,
+	METRIC_RETR_BYTES,
+	METRIC_STOR_BYTES,
+	METRIC_LIST_BYTES,
+	METRIC_TRANSFER_ERRORS,
+	// Replies sent, and the system calls they were written with
+	METRIC_REPLIES,
+	METRIC_REPLY_WRITES,
+	// Connections turned away by admission control, by limit
+	METRIC_REJECTED_SESSIONS,
+	METRIC_REJECTED_QUEUE_DEPTH,
+	METRIC_REJECTED_QUEUE_WAIT,
+	METRIC_REJECTED_HOST,
+	// Sessions closed for idling, and transfers cut off for stalling
+	METRIC_IDLE_TIMEOUTS,
+	METRIC_STALLED_TRANSFERS,
+	// Bytes of MODE Z transfers, and the compressed bytes they took
+	METRIC_ZMODE_BYTES,
+	METRIC_ZMODE_WIRE_BYTES,
+	NUM_METRIC_COUNTERS
+} metric_counter_t;
+
+// Durations, recorded in microseconds
+typedef enum metric_histogram {
+	// Time jobs spend in the worker pool's queue
+	METRIC_QUEUE_WAIT,
+	// Data phases of RETR, STOR/APPE and LIST/MLSD
+	METRIC_RETR_TRANSFER,
+	METRIC_STOR_TRANSFER,
+	METRIC_LIST_TRANSFER,
+	NUM_METRIC_HISTOGRAMS
+} metric_histogram_t;
+
+typedef struct histogram {
+	unsigned long count;
+	unsigned long long sum_us;
+	unsigned long buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+/*
+ * The metrics recorded by one thread. Only the owning thread
+ * writes them, so updates need no atomic read-modify-write;
+ * readers add the shards of all threads up.
+ */
+typedef struct metrics_shard {
+	unsigned long counters[NUM_METRIC_COUNTERS];
+	histogram_t histograms[NUM_METRIC_HISTOGRAMS];
+	// Latency of every command, by verb
+	histogram_t commands[NUM_VERBS];
+	struct metrics_shard * next;
+} metrics_shard_t;
+
+/*
+ * Stop recording metrics, before any thread has; what was
+ * recorded reads as zero
+ */
+void
+metrics_disable();
+
+// Whether metrics are recorded
+int
+metrics_enabled();
+
+// Add to a counter of the calling thread
+void
+metrics_count(metric_counter_t counter, unsigned long value);
+
+// Record a duration in nanoseconds
+void
+metrics_record(metric_histogram_t histogram, unsigned long long ns);
+
+// Record how long a command took to run, in nanoseconds
+void
+metrics_record_command(verb_t verb, unsigned long long ns);
+
+/*
+ * Register the worker pools whose queue depth and
+ * workers are reported along with the metrics
+ */
+void
+metrics_add_pool(struct worker_pool * pool);
+
+// Print a summary of the metrics as the lines of a STAT reply
+void
+metrics_status(FILE * out);
+
+// Print all metrics in the Prometheus text exposition format
+void
+metrics_prometheus(FILE * out);
+
+/*
+ * Serve the Prometheus dump on a Unix socket at path to
+ * every process that connects; returns 0 or -1
+ */
+int
+metrics_admin_init(const char * path);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef _MLSX_H
+#define	_MLSX_H
+
+#include "utils.h"
+
+// Size of the buffer MLSD entries are gathered in before sending
+#define		MLSD_BUFFER_SIZE 65536
+// Size of the buffer directory entries are read into
+#define		MLSD_DENTS_BUFFER_SIZE 32768
+// Longest line of facts for a single entry, excluding its name
+#define		MLSX_MAX_FACTS_SIZE 256
+// The facts we report, as advertised in FEAT
+#define		MLSX_FACTS "type*;size*;modify*;perm*;unix.mode*;"
+
+/*
+ * Called with every batch of MLSD entries;
+ * returns -1 to abort the listing
+ */
+typedef int (*mlsx_sink_t)(void * arg, const char * buffer, size_t len);
+
+/*
+ * Format the RFC 3659 facts of a file followed by its name
+ * into buffer, ending with CRLF. type overrides the type fact
+ * (for "cdir" and "pdir") when not NULL. Returns the length
+ * of the line, or -1 if it does not fit.
+ */
+int
+mlsx_format_entry(char * buffer, size_t size, const struct stat * st,
+	const char * type, const char * name);
+
+/*
+ * Stream the MLSD listing of the directory open at dir_fd,
+ * handing it to sink in batches as the entries are read.
+ * Returns 0 on success or -1.
+ */
+int
+mlsx_stream_dir(int dir_fd, mlsx_sink_t sink, void * arg);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _PASV_POOL_H
+#define	_PASV_POOL_H
+
+#include "utils.h"
+
+/*
+ * A pre-bound socket listening on one port of the passive
+ * port range, lent to a session for a single transfer
+ */
+typedef struct pasv_listener {
+	int fd;
+	int port;
+	struct pasv_listener * next;
+} pasv_listener_t;
+
+/*
+ * Bind and listen on every port in [low_port, high_port];
+ * returns the number of listeners created or -1
+ */
+int
+pasv_pool_init(int low_port, int high_port);
+
+// Whether a passive port range has been configured
+int
+pasv_pool_enabled();
+
+/*
+ * Take a listener out of the pool; returns NULL
+ * if every port in the range is in use
+ */
+pasv_listener_t *
+pasv_pool_checkout();
+
+/*
+ * Give a listener back to the pool, discarding any
+ * connection still pending on it
+ */
+void
+pasv_pool_return(pasv_listener_t * listener);
+
+// Number of listeners currently lent to sessions
+int
+pasv_pool_in_use();
+
+// Number of listeners waiting in the pool
+int
+pasv_pool_available();
+
+#endif
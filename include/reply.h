@@ -0,0 +1,103 @@
+#ifndef _REPLY_H
+#define	_REPLY_H
+
+#include "ftp_functions.h"
+
+/*
+ * The fixed replies of the server. Their text, with the reply
+ * code and line ending, is laid out at compile time along with
+ * its length, see reply.c.
+ */
+typedef enum reply_id {
+	REPLY_SERVICE_READY,
+	REPLY_GOODBYE,
+	REPLY_TOO_MANY_CONNECTIONS,
+	REPLY_SESSION_TIMEOUT,
+	REPLY_PASSWORD_REQUIRED,
+	REPLY_LOGGED_IN,
+	REPLY_SYSTEM_TYPE,
+	REPLY_FEATURES,
+	REPLY_ACTIVE_MODE,
+	REPLY_ASCII_MODE,
+	REPLY_BINARY_MODE,
+	REPLY_STREAM_MODE,
+	REPLY_DEFLATE_MODE,
+	REPLY_DIRECTORY_CHANGED,
+	REPLY_OPENING_ASCII,
+	REPLY_OPENING_MLSD,
+	REPLY_OPENING_ARCHIVE,
+	REPLY_OPENING_TRANSFER,
+	REPLY_DIRECTORY_LISTED,
+	REPLY_ARCHIVE_SENT,
+	REPLY_TRANSFER_COMPLETE,
+	REPLY_REMOVAL_COMPLETE,
+	REPLY_CREATION_COMPLETE,
+	REPLY_CANT_OPEN_DATA,
+	REPLY_NO_PASSIVE_PORT,
+	REPLY_TRANSFER_ABORTED,
+	REPLY_DIRECTORY_BUSY,
+	REPLY_LOCAL_ERROR,
+	REPLY_FILE_ERROR,
+	REPLY_FILE_UNWRITABLE,
+	REPLY_LINE_TOO_LONG,
+	REPLY_NOT_SUPPORTED,
+	REPLY_SYNTAX_ERROR,
+	REPLY_INVALID_RESTART,
+	REPLY_OPTION_NOT_UNDERSTOOD,
+	REPLY_STAT_PATH,
+	REPLY_MODE_NOT_IMPLEMENTED,
+	REPLY_SITE_NOT_IMPLEMENTED,
+	REPLY_PROTOCOL_NOT_SUPPORTED,
+	REPLY_DIRECTORY_UNAVAILABLE,
+	REPLY_FILE_ACCESS_ERROR,
+	REPLY_FILE_UNAVAILABLE,
+	REPLY_RESTART_OUT_OF_RANGE,
+	NUM_REPLIES
+} reply_id_t;
+
+// A reply ready to be sent as is
+typedef struct reply {
+	int code;
+	const char * text;
+	size_t len;
+} reply_t;
+
+/*
+ * One of the fixed replies, for connections that are turned
+ * away before they have a session to queue it on
+ */
+const reply_t *
+reply_lookup(reply_id_t id);
+
+/*
+ * Replies are queued in the session's output buffer and only
+ * written once the session flushes, so the replies to a batch
+ * of pipelined commands leave in a single system call.
+ */
+
+// Queue one of the fixed replies
+void
+reply_queue(client_context_t * current_context, reply_id_t id);
+
+// Queue a reply formatted like printf, line ending included
+void
+reply_printf(client_context_t * current_context, const char * format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/*
+ * Queue a multi-line reply: the first line, then len bytes of
+ * lines that are already formatted, each starting with a space,
+ * then the last line, all with the given code
+ */
+void
+reply_lines(client_context_t * current_context, int code,
+	const char * first, const char * lines, size_t len, const char * last);
+
+/*
+ * Write out every queued reply. Returns 0, or -1 if the client
+ * is gone, in which case the session is marked closed.
+ */
+int
+reply_flush(client_context_t * current_context);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef _TIMER_WHEEL_H
+#define	_TIMER_WHEEL_H
+
+#include "utils.h"
+
+// Resolution of the timer wheels, in milliseconds
+#define		TIMER_WHEEL_TICK_MS 100
+#define		TIMER_WHEEL_TICK_NS (TIMER_WHEEL_TICK_MS * 1000000ULL)
+/*
+ * Each level has 2^TIMER_WHEEL_SLOT_BITS slots, each slot of a
+ * level covering as many ticks as the whole level below; four
+ * levels of 64 slots reach out to 64^4 ticks, over 19 days
+ */
+#define		TIMER_WHEEL_SLOT_BITS 6
+#define		TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define		TIMER_WHEEL_LEVELS 4
+
+/*
+ * A timer, kept in the structure it times. While it is
+ * pending it sits in one slot of the wheel, linked with
+ * the other timers expiring around the same time.
+ */
+typedef struct wheel_timer {
+	// Tick at which the timer expires
+	unsigned long long expires;
+	struct wheel_timer * next;
+	// Link pointing at this timer, NULL when it is not pending
+	struct wheel_timer ** pprev;
+	/*
+	 * Called with the wheel locked when the timer expires, with
+	 * the argument given to timer_wheel_advance; returns the
+	 * monotonic time at which to run again in nanoseconds, or 0
+	 */
+	unsigned long long (*expire)(struct wheel_timer * timer, void * arg);
+} wheel_timer_t;
+
+/*
+ * A hierarchical timer wheel. Scheduling and cancelling a
+ * timer take constant time; timers due in more than one
+ * revolution of a level wait in the level above and drop
+ * down a level each time its slot comes round.
+ */
+typedef struct timer_wheel {
+	pthread_mutex_t lock;
+	// The last tick that was processed
+	unsigned long long tick;
+	unsigned long pending;
+	wheel_timer_t * slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel_t;
+
+// Set up an empty wheel starting at the given monotonic time
+void
+timer_wheel_init(timer_wheel_t * wheel, unsigned long long now_ns);
+
+/*
+ * Schedule a timer to expire at the given monotonic time,
+ * moving it if it is already pending
+ */
+void
+timer_wheel_schedule(timer_wheel_t * wheel, wheel_timer_t * timer,
+	unsigned long long when_ns);
+
+/*
+ * Cancel a timer if it is pending. Once this returns, the
+ * timer's expire function is not running and will not run.
+ */
+void
+timer_wheel_cancel(timer_wheel_t * wheel, wheel_timer_t * timer);
+
+/*
+ * Run the expire function of every timer due by the given
+ * monotonic time; returns the number of timers that expired
+ */
+unsigned long
+timer_wheel_advance(timer_wheel_t * wheel, unsigned long long now_ns,
+	void * arg);
+
+#endif
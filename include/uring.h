@@ -0,0 +1,63 @@
+#ifndef _URING_H
+#define	_URING_H
+
+#include "utils.h"
+
+// Number of submission queue entries of each thread's ring
+#define		URING_ENTRIES 64
+// Number of registered transfer buffers of each thread's ring
+#define		URING_NUM_BUFFERS 8
+// Size of each registered transfer buffer
+#define		URING_BUFFER_SIZE 65536
+// Registered file slots for the file and the socket of a transfer
+#define		URING_FILE_SLOT 0
+#define		URING_SOCKET_SLOT 1
+#define		URING_NUM_FILES 2
+
+/*
+ * Enable or disable the io_uring transfer backend at runtime.
+ * Returns 0 if the backend can be used, or -1 if it was not
+ * built in or the kernel does not support it.
+ */
+int
+uring_init(int enabled);
+
+/*
+ * All of the functions below return -1 with errno set to
+ * ENOSYS when the backend is not in use, so that callers can
+ * fall back to the regular system calls.
+ */
+
+// Accept a connection on a listening socket through io_uring
+int
+uring_accept(int fd, struct sockaddr * addr, socklen_t * len);
+
+/*
+ * Connect a socket through io_uring, failing with ETIMEDOUT
+ * after timeout_ms milliseconds unless it is negative
+ */
+int
+uring_connect(int fd, const struct sockaddr * addr, socklen_t len,
+	int timeout_ms);
+
+/*
+ * Send a file from offset start on to a socket, batching file
+ * reads and socket writes over the thread's registered buffers;
+ * returns the number of bytes sent or -1
+ */
+off_t
+uring_send_file(int file_fd, int sock_fd, off_t start);
+
+/*
+ * Receive everything from a socket into a file from offset
+ * start on, overlapping socket reads with file writes; returns
+ * the number of bytes written or -1
+ */
+off_t
+uring_recv_file(int sock_fd, int file_fd, off_t start);
+
+// Send a whole buffer to a socket through io_uring
+ssize_t
+uring_send_buffer(int sock_fd, const char * buffer, size_t len);
+
+#endif
@@ -27,53 +27,114 @@
 #include <netinet/in.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <time.h>
 
-#define		DEBUG
+// Size of the buffer used when copying between descriptors
+#define		TRANSFER_BUFFER_SIZE 65536
+// Maximum number of bytes moved by a single splice call
+#define		SPLICE_CHUNK_SIZE 65536
 
-// Node in the job queue linked list
+struct client_context;
+
+/*
+ * Number of slots in the job ring;
+ * must be a power of two
+ */
+#define		JOB_RING_CAPACITY 16384
+// Size of a cache line, used to keep hot ring fields apart
+#define		CACHE_LINE_SIZE 64
+/*
+ * Number of times a worker polls an empty ring
+ * before going to sleep
+ */
+#define		JOB_RING_SPIN_COUNT 64
+
+/*
+ * A unit of work for the worker threads. A job either carries
+ * a freshly accepted connection (session is NULL) or an
+ * existing session whose control connection became readable.
+ */
 typedef struct job {
 	int fd;
 	struct sockaddr_storage client_addr;
-	struct job * next;
-	struct job * previous;
+	struct client_context * session;
+	// Monotonic time at which the job was queued, in nanoseconds
+	unsigned long long enqueue_time;
 } job_t;
 
-// Head of job queue linked list
-job_t * head;
+/*
+ * Slot in the job ring. The sequence number tells producers
+ * and consumers whose turn it is to use the slot.
+ */
+typedef struct job_slot {
+	unsigned long sequence;
+	job_t job;
+} __attribute__((aligned(CACHE_LINE_SIZE))) job_slot_t;
 
-// Number of jobs available for processing
-int available_jobs;
-// Mutex to access the job queue
-pthread_mutex_t * job_queue_lock;
 /*
- * Conditional variable signalling that new job has
- * become available for processing
+ * Bounded lock-free multi-producer/multi-consumer ring of jobs.
+ * The producer and consumer positions live on separate cache
+ * lines so that acceptors and workers do not false-share.
  */
-pthread_cond_t * job_available;
+typedef struct job_ring {
+	unsigned long enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+	unsigned long dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+	// Number of workers sleeping on the ring
+	int idle_workers __attribute__((aligned(CACHE_LINE_SIZE)));
+	// Futex word bumped whenever sleeping workers are woken up
+	unsigned int wakeups;
+#ifndef __linux__
+	pthread_mutex_t wait_lock;
+	pthread_cond_t wait_cond;
+#endif
+	job_slot_t slots[JOB_RING_CAPACITY];
+} job_ring_t;
 
 //  An error function for graceful termination
 void
 error(const char * message);
 
-// Print debugging messages
-void
-print_debug(const char * message);
+// Allocate and initialize an empty job ring
+job_ring_t *
+job_ring_create();
 
-// Destroy mutexes, conditional variables, and job queue
+/*
+ * Enqueue a new job into the job ring and wake up a
+ * sleeping worker if there is one; returns -1 if full
+ */
 int
-destroy();
+enqueue(job_ring_t * ring, int fd, struct sockaddr_storage client_addr,
+	struct client_context * session);
 
-// Enqueue a new job into job queue
+/*
+ * Dequeue a job from the job ring without blocking;
+ * returns -1 if the ring is empty
+ */
 int
-enqueue(job_t *head, int fd, struct sockaddr_storage client_addr);
+try_dequeue(job_ring_t * ring, job_t * job);
 
-// Dequeue a new job from job queue
-job_t
-dequeue(job_t *head);
+/*
+ * Dequeue a job from the job ring, sleeping until one is
+ * available; returns -1 if none arrived within timeout_ms
+ * milliseconds (a negative timeout waits forever)
+ */
+int
+dequeue(job_ring_t * ring, job_t * job, int timeout_ms);
 
-// Free all the remaining jobs in the queue; cleanup function
-void
-free_jobs(job_t * head);
+// Number of jobs currently waiting in the job ring
+unsigned long
+job_ring_depth(job_ring_t * ring);
+
+/*
+ * Monotonic time at which the job at the head of the ring
+ * was queued, in nanoseconds; 0 if the ring is empty
+ */
+unsigned long long
+job_ring_oldest(job_ring_t * ring);
+
+// Monotonic clock reading in nanoseconds
+unsigned long long
+get_time_ns();
 
 /*
  * Gets a random port in the range [1000,65535]
@@ -85,17 +146,35 @@ get_random_port();
 /*
  * Connects to the client with the given
  * IP Address
- * and Port in active mode
+ * and Port in active mode, giving up after
+ * timeout_ms milliseconds unless it is negative;
+ * returns -1 if the connection failed
  */
 int
 get_active_client_connection(const char * ip_address,
-	const char * port);
+	const char * port, int timeout_ms);
 
 /*
- * Reads a line from the inputted file and
- * outputs the contents into the buffer
+ * Writes the whole buffer to the descriptor,
+ * retrying after partial writes and interruptions
  */
-int
-readline(FILE *f, char *buffer, int len);
+ssize_t
+write_all(int fd, const char * buffer, size_t len);
+
+/*
+ * Copies everything readable from one descriptor
+ * into another through a fixed-size buffer;
+ * returns the number of bytes copied or -1 on error
+ */
+off_t
+copy_fd(int from_fd, int to_fd);
+
+/*
+ * Moves everything readable from a socket into a file
+ * through a kernel pipe, without copying the bytes into
+ * user space; returns the number of bytes moved or -1
+ */
+off_t
+splice_fd(int from_fd, int to_fd);
 
 #endif
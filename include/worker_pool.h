@@ -0,0 +1,84 @@
+#ifndef _WORKER_POOL_H
+#define	_WORKER_POOL_H
+
+#include "utils.h"
+
+// Default bounds on the number of worker threads in a pool
+#define		DEFAULT_MIN_WORKERS 5
+#define		DEFAULT_MAX_WORKERS 64
+/*
+ * Queue depth at which a new worker is added
+ * when no worker is idle
+ */
+#define		SCALE_UP_QUEUE_DEPTH 4
+/*
+ * Queue wait, in microseconds, at which a new
+ * worker is added when no worker is idle
+ */
+#define		SCALE_UP_WAIT_US 10000
+// Time after which a worker above the minimum retires
+#define		WORKER_IDLE_TIMEOUT_MS 30000
+/*
+ * Number of buckets in the queue wait histogram;
+ * bucket i counts waits below 2^i microseconds
+ */
+#define		WAIT_HISTOGRAM_BUCKETS 24
+
+/*
+ * A pool of worker threads consuming jobs from one job ring.
+ * The pool grows between its minimum and maximum size when
+ * jobs queue up and shrinks again when workers sit idle.
+ */
+typedef struct worker_pool {
+	job_ring_t * ring;
+	int min_workers;
+	int max_workers;
+	// Number of worker threads currently running
+	int num_workers;
+	int idle_timeout_ms;
+	// Histogram of the time jobs spend in the queue
+	unsigned long wait_histogram[WAIT_HISTOGRAM_BUCKETS];
+	unsigned long jobs_processed;
+} worker_pool_t;
+
+/*
+ * Create a worker pool and start its minimum
+ * number of worker threads
+ */
+worker_pool_t *
+worker_pool_create(int min_workers, int max_workers);
+
+/*
+ * Queue a job on the pool, adding a worker if the queue
+ * is backing up; returns -1 if the queue is full
+ */
+int
+worker_pool_submit(worker_pool_t * pool, int fd,
+	struct sockaddr_storage client_addr, struct client_context * session);
+
+/*
+ * Wait for the next job of the calling worker; returns -1
+ * when the worker has been idle long enough to retire
+ */
+int
+worker_pool_next_job(worker_pool_t * pool, job_t * job);
+
+// Number of jobs waiting in the pool's queue
+unsigned long
+worker_pool_queue_depth(worker_pool_t * pool);
+
+/*
+ * How long the oldest job in the pool's queue has
+ * been waiting so far, in microseconds
+ */
+unsigned long long
+worker_pool_queue_wait_us(worker_pool_t * pool);
+
+/*
+ * Print the size of the pool, its queue depth
+ * and the queue wait histogram
+ */
+void
+worker_pool_report(worker_pool_t * pool, FILE * out);
+
+#endif
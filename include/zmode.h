@@ -0,0 +1,96 @@
+#ifndef _ZMODE_H
+#define	_ZMODE_H
+
+#include <zlib.h>
+#include "utils.h"
+
+// Compression level of MODE Z transfers unless a session picks its own
+#define		DEFAULT_COMPRESSION_LEVEL 6
+/*
+ * Memory level of the deflate streams. zlib's default of 8 gives
+ * a session some 256 KiB of compressor state, kept from its
+ * first compressed transfer until it ends.
+ */
+#define		ZMODE_MEM_LEVEL 8
+
+/*
+ * The compression state of a session in MODE Z (RFC 959's
+ * deflate transmission mode, draft-preston-ftpext-deflate).
+ * Every transfer is a zlib stream of its own; the streams are
+ * reset between transfers rather than set up again, so only a
+ * session's first compressed transfer allocates.
+ */
+typedef struct zmode {
+	z_stream deflater;
+	z_stream inflater;
+	int deflater_ready;
+	int inflater_ready;
+	// Level the deflater was last set to
+	int level;
+} zmode_t;
+
+/*
+ * Compresses a transfer onto a data connection as it is
+ * produced, through a buffer taken from the buffer pool
+ */
+typedef struct zmode_writer {
+	z_stream * stream;
+	int data_fd;
+	char * out;
+	// Bytes taken in, and compressed bytes sent
+	unsigned long long in_bytes;
+	unsigned long long out_bytes;
+} zmode_writer_t;
+
+// The compression state of a new session in MODE Z, or NULL
+zmode_t *
+zmode_create();
+
+void
+zmode_destroy(zmode_t * zmode);
+
+/*
+ * Start a compressed transfer at the given level onto data_fd;
+ * returns -1 if the stream or its buffer cannot be set up
+ */
+int
+zmode_writer_open(zmode_writer_t * writer, zmode_t * zmode, int level,
+	int data_fd);
+
+// Compress len more bytes of the transfer; returns 0 or -1
+int
+zmode_write(zmode_writer_t * writer, const char * buffer, size_t len);
+
+/*
+ * End a compressed transfer, finishing the stream unless the
+ * transfer failed, and give its buffer back; returns 0 or -1
+ */
+int
+zmode_writer_close(zmode_writer_t * writer, int finish);
+
+/*
+ * Send a file compressed from the given offset on, expanding
+ * line endings first in ASCII mode; returns the number of bytes
+ * of the file sent, or -1. The file is read at explicit offsets,
+ * so descriptors shared through the file cache can be used.
+ */
+off_t
+zmode_send_file(zmode_t * zmode, int level, int file_fd, int data_fd,
+	int binary_flag, off_t offset);
+
+// Send a buffer compressed, as a whole transfer; returns len or -1
+ssize_t
+zmode_send_buffer(zmode_t * zmode, int level, int data_fd,
+	const char * buffer, size_t len);
+
+/*
+ * Store a compressed upload into the file from the given offset
+ * on, collapsing line endings after inflating in ASCII mode;
+ * returns the number of bytes stored, or -1 if the upload fails
+ * or ends before its stream does
+ */
+off_t
+zmode_recv_file(zmode_t * zmode, int data_fd, int file_fd, int binary_flag,
+	off_t offset);
+
+#endif
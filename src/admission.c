@@ -0,0 +1,201 @@
+#include "admission.h"
+#include "reply.h"
+#include "log.h"
+#include "metrics.h"
+
+/*
+ * Sessions open from one client host. IPv4 clients are keyed
+ * by their IPv4-mapped address, so that a host is counted
+ * once whichever family its connections come in with.
+ */
+typedef struct admission_host {
+	struct in6_addr addr;
+	unsigned long sessions;
+	struct admission_host * next;
+} admission_host_t;
+
+/*
+ * Each bucket has a lock of its own, so acceptors admitting
+ * and workers closing sessions of different hosts never wait
+ * on each other
+ */
+typedef struct admission_bucket {
+	pthread_mutex_t lock;
+	admission_host_t * hosts;
+} admission_bucket_t;
+
+static admission_limits_t limits;
+static unsigned long open_sessions = 0;
+static admission_bucket_t buckets[ADMISSION_HOST_BUCKETS];
+
+void
+admission_init(const admission_limits_t * new_limits) {
+
+	limits = *new_limits;
+	for (int i = 0; i < ADMISSION_HOST_BUCKETS; i++) {
+		pthread_mutex_init(&buckets[i].lock, NULL);
+		buckets[i].hosts = NULL;
+	}
+}
+
+/*
+ * The host of a client address as an IPv6 address;
+ * returns -1 for families without a host
+ */
+static int
+admission_host_key(struct sockaddr_storage * client_addr,
+	struct in6_addr * key) {
+
+	if (client_addr->ss_family == AF_INET6) {
+		*key = ((struct sockaddr_in6 *)client_addr)->sin6_addr;
+		return (0);
+	}
+	if (client_addr->ss_family == AF_INET) {
+		memset(key, 0, sizeof (struct in6_addr));
+		key->s6_addr[10] = 0xff;
+		key->s6_addr[11] = 0xff;
+		memcpy(&key->s6_addr[12],
+			&((struct sockaddr_in *)client_addr)->sin_addr, 4);
+		return (0);
+	}
+
+	return (-1);
+}
+
+// FNV-1a over the address
+static admission_bucket_t *
+admission_bucket(const struct in6_addr * key) {
+
+	unsigned int hash = 2166136261U;
+	for (int i = 0; i < 16; i++)
+		hash = (hash ^ key->s6_addr[i]) * 16777619U;
+
+	return (&buckets[hash % ADMISSION_HOST_BUCKETS]);
+}
+
+/*
+ * Count one more session for the client's host, unless
+ * the host already has as many as it may; returns -1 then
+ */
+static int
+admission_host_acquire(struct sockaddr_storage * client_addr) {
+
+	struct in6_addr key;
+	if (admission_host_key(client_addr, &key) < 0)
+		return (0);
+
+	admission_bucket_t * bucket = admission_bucket(&key);
+	int err = 0;
+
+	pthread_mutex_lock(&bucket->lock);
+	admission_host_t * host = bucket->hosts;
+	while (host != NULL &&
+		memcmp(&host->addr, &key, sizeof (struct in6_addr)) != 0)
+		host = host->next;
+
+	if (host == NULL) {
+		host = malloc(sizeof (admission_host_t));
+		// Without memory to track the host, do not hold it back
+		if (host != NULL) {
+			host->addr = key;
+			host->sessions = 1;
+			host->next = bucket->hosts;
+			bucket->hosts = host;
+		}
+	}
+	else if (host->sessions >= limits.max_host_sessions)
+		err = -1;
+	else
+		host->sessions++;
+	pthread_mutex_unlock(&bucket->lock);
+
+	return (err);
+}
+
+// Drop a session of the client's host, forgetting hosts left without any
+static void
+admission_host_release(struct sockaddr_storage * client_addr) {
+
+	struct in6_addr key;
+	if (admission_host_key(client_addr, &key) < 0)
+		return;
+
+	admission_bucket_t * bucket = admission_bucket(&key);
+
+	pthread_mutex_lock(&bucket->lock);
+	admission_host_t ** link = &bucket->hosts;
+	while (*link != NULL &&
+		memcmp(&(*link)->addr, &key, sizeof (struct in6_addr)) != 0)
+		link = &(*link)->next;
+
+	admission_host_t * host = *link;
+	if (host != NULL && --host->sessions == 0) {
+		*link = host->next;
+		free(host);
+	}
+	pthread_mutex_unlock(&bucket->lock);
+}
+
+/*
+ * The queue is looked at first: it costs nothing to read and
+ * is what fills up first when the workers fall behind
+ */
+admission_t
+admission_check(worker_pool_t * pool, struct sockaddr_storage * client_addr) {
+
+	if (limits.max_queue_depth > 0 &&
+		worker_pool_queue_depth(pool) >= limits.max_queue_depth)
+		return (ADMISSION_QUEUE_DEPTH);
+
+	if (limits.max_queue_wait_ms > 0 && worker_pool_queue_wait_us(pool) >=
+		(unsigned long long)limits.max_queue_wait_ms * 1000)
+		return (ADMISSION_QUEUE_WAIT);
+
+	if (limits.max_sessions > 0 &&
+		__atomic_add_fetch(&open_sessions, 1, __ATOMIC_RELAXED) >
+		limits.max_sessions) {
+		__atomic_sub_fetch(&open_sessions, 1, __ATOMIC_RELAXED);
+		return (ADMISSION_SESSIONS);
+	}
+
+	if (limits.max_host_sessions > 0 &&
+		admission_host_acquire(client_addr) < 0) {
+		if (limits.max_sessions > 0)
+			__atomic_sub_fetch(&open_sessions, 1, __ATOMIC_RELAXED);
+		return (ADMISSION_HOST);
+	}
+
+	return (ADMISSION_ADMITTED);
+}
+
+void
+admission_release(struct sockaddr_storage * client_addr) {
+
+	if (limits.max_sessions > 0)
+		__atomic_sub_fetch(&open_sessions, 1, __ATOMIC_RELAXED);
+	if (limits.max_host_sessions > 0)
+		admission_host_release(client_addr);
+}
+
+/*
+ * The reply fits in any socket buffer, and the connection
+ * is fresh, so it is sent without blocking the acceptor
+ * and the client is not waited on
+ */
+void
+admission_reject(int fd, admission_t reason) {
+
+	static const metric_counter_t counters[] = {
+		[ADMISSION_SESSIONS] = METRIC_REJECTED_SESSIONS,
+		[ADMISSION_QUEUE_DEPTH] = METRIC_REJECTED_QUEUE_DEPTH,
+		[ADMISSION_QUEUE_WAIT] = METRIC_REJECTED_QUEUE_WAIT,
+		[ADMISSION_HOST] = METRIC_REJECTED_HOST
+	};
+	const reply_t * reply = reply_lookup(REPLY_TOO_MANY_CONNECTIONS);
+
+	if (send(fd, reply->text, reply->len, MSG_DONTWAIT) < 0)
+		log_debug("Error on turning a client away: %s", strerror(errno));
+	close(fd);
+
+	metrics_count(counters[reason], 1);
+}
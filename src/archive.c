@@ -0,0 +1,650 @@
+#include "archive.h"
+#include "ftp_functions.h"
+#include "zmode.h"
+#include "buffer_pool.h"
+#include "log.h"
+
+// Widths of the ustar fields the name of an entry is split across
+#define		TAR_NAME_SIZE 100
+#define		TAR_PREFIX_SIZE 155
+// Largest size the 11 octal digits of a header can hold
+#define		TAR_MAX_OCTAL_SIZE 077777777777ULL
+// Room for the extended header records of one entry
+#define		TAR_PAX_SIZE (3 * PATH_MAX)
+
+/*
+ * An entry found by the walkers, waiting to go into the archive.
+ * Regular files are opened by the walker, so their open and stat
+ * costs are paid in parallel rather than on the data connection.
+ */
+typedef struct archive_entry {
+	// Open file of a regular file, -1 for other entries
+	int fd;
+	struct stat st;
+	// Name within the archive; directories end in a slash
+	char name[PATH_MAX];
+	// Target of a symbolic link
+	char link[PATH_MAX];
+} archive_entry_t;
+
+// A directory waiting to be walked, relative to the archive's root
+typedef struct pending_dir {
+	struct pending_dir * next;
+	char path[];
+} pending_dir_t;
+
+/*
+ * The walkers and the sender share a ring of entries: walkers
+ * wait for room in it, the sender for entries or the end of
+ * the walk. Directories still to walk are kept on a stack, so
+ * the walk goes deep first and the stack stays short.
+ */
+typedef struct archive {
+	int root_fd;
+	const char * prefix;
+	pthread_mutex_t lock;
+	// Signalled when entries are queued or the walk ends
+	pthread_cond_t produced;
+	// Signalled when an entry is sent or the archive is abandoned
+	pthread_cond_t consumed;
+	// Signalled when directories are pending or the walk ends
+	pthread_cond_t work;
+	pending_dir_t * pending;
+	// Walkers in the middle of a directory
+	int busy;
+	int walk_done;
+	int aborted;
+	archive_entry_t * entries;
+	unsigned int head;
+	unsigned int count;
+} archive_t;
+
+/*
+ * Gathers headers and small bodies into a pooled buffer ahead
+ * of the data connection, or of the compressor in MODE Z
+ */
+typedef struct tar_writer {
+	int data_fd;
+	zmode_writer_t * zwriter;
+	char * buffer;
+	size_t len;
+	off_t total;
+} tar_writer_t;
+
+/*
+ * Queue an entry named after its path under the root. Returns -1
+ * once the archive is abandoned; an entry whose name is too long
+ * is dropped, closing its file.
+ */
+static int
+archive_enqueue(archive_t * archive, const char * path, const struct stat * st,
+	int fd, const char * link) {
+
+	pthread_mutex_lock(&archive->lock);
+	while (archive->count == ARCHIVE_QUEUE_ENTRIES && !archive->aborted)
+		pthread_cond_wait(&archive->consumed, &archive->lock);
+	if (archive->aborted) {
+		pthread_mutex_unlock(&archive->lock);
+		if (fd >= 0)
+			close(fd);
+		return (-1);
+	}
+
+	archive_entry_t * entry = &archive->entries[(archive->head +
+		archive->count) % ARCHIVE_QUEUE_ENTRIES];
+	int len = snprintf(entry->name, PATH_MAX, "%s%s%s%s", archive->prefix,
+		archive->prefix[0] != '\0' ? "/" : "", path,
+		S_ISDIR(st->st_mode) ? "/" : "");
+	if (len < 0 || len >= PATH_MAX) {
+		pthread_mutex_unlock(&archive->lock);
+		if (fd >= 0)
+			close(fd);
+		return (0);
+	}
+	entry->fd = fd;
+	entry->st = *st;
+	if (link != NULL)
+		strcpy(entry->link, link);
+	archive->count++;
+	pthread_cond_signal(&archive->produced);
+	pthread_mutex_unlock(&archive->lock);
+
+	return (0);
+}
+
+static void
+archive_push_dir(archive_t * archive, const char * path) {
+
+	size_t len = strlen(path);
+	pending_dir_t * dir = malloc(sizeof (pending_dir_t) + len + 1);
+	if (dir == NULL) {
+		log_debug("archive: dropping directory %s", path);
+		return;
+	}
+	memcpy(dir->path, path, len + 1);
+
+	pthread_mutex_lock(&archive->lock);
+	dir->next = archive->pending;
+	archive->pending = dir;
+	pthread_cond_signal(&archive->work);
+	pthread_mutex_unlock(&archive->lock);
+}
+
+/*
+ * Queue the entries of a directory. A subdirectory is queued
+ * before it is pushed, so its own entry comes ahead of those
+ * of whichever walker takes it up. Entries that vanish or cannot
+ * be opened on the way are left out of the archive.
+ */
+static void
+archive_walk_dir(archive_t * archive, const char * path) {
+
+	int dir_fd = openat(archive->root_fd, path[0] != '\0' ? path : ".",
+		O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (dir_fd < 0)
+		return;
+	DIR * dir = fdopendir(dir_fd);
+	if (dir == NULL) {
+		close(dir_fd);
+		return;
+	}
+
+	char entry_path[PATH_MAX];
+	char link[PATH_MAX];
+	struct dirent * dirent;
+
+	while ((dirent = readdir(dir)) != NULL) {
+
+		const char * name = dirent->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+		int len = snprintf(entry_path, PATH_MAX, "%s%s%s", path,
+			path[0] != '\0' ? "/" : "", name);
+		if (len < 0 || len >= PATH_MAX)
+			continue;
+
+		struct stat st;
+		if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+			continue;
+
+		int err = 0;
+		if (S_ISDIR(st.st_mode)) {
+			if ((err = archive_enqueue(archive, entry_path, &st, -1,
+				NULL)) == 0)
+				archive_push_dir(archive, entry_path);
+		} else if (S_ISREG(st.st_mode)) {
+			int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW);
+			// The size in the header is the one of the file opened
+			if (fd < 0)
+				continue;
+			if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+				close(fd);
+				continue;
+			}
+			err = archive_enqueue(archive, entry_path, &st, fd, NULL);
+		} else if (S_ISLNK(st.st_mode)) {
+			ssize_t nlink = readlinkat(dir_fd, name, link, PATH_MAX - 1);
+			if (nlink < 0)
+				continue;
+			link[nlink] = '\0';
+			err = archive_enqueue(archive, entry_path, &st, -1, link);
+		}
+		// Devices, fifos and sockets have no place in the archive
+		if (err < 0)
+			break;
+	}
+
+	closedir(dir);
+}
+
+/*
+ * Walkers take directories off the stack until it is empty with
+ * no walker left to push more; the last one out ends the walk
+ */
+static void *
+archive_walker(void * arg) {
+
+	archive_t * archive = arg;
+
+	pthread_mutex_lock(&archive->lock);
+	while (!archive->aborted && !archive->walk_done) {
+
+		pending_dir_t * dir = archive->pending;
+		if (dir == NULL) {
+			if (archive->busy == 0) {
+				archive->walk_done = 1;
+				pthread_cond_broadcast(&archive->work);
+				pthread_cond_broadcast(&archive->produced);
+			} else
+				pthread_cond_wait(&archive->work, &archive->lock);
+			continue;
+		}
+
+		archive->pending = dir->next;
+		archive->busy++;
+		pthread_mutex_unlock(&archive->lock);
+
+		archive_walk_dir(archive, dir->path);
+		free(dir);
+
+		pthread_mutex_lock(&archive->lock);
+		archive->busy--;
+	}
+	pthread_mutex_unlock(&archive->lock);
+
+	return (NULL);
+}
+
+// The next entry to send, left in its slot until it is sent, or NULL
+static archive_entry_t *
+archive_next(archive_t * archive) {
+
+	archive_entry_t * entry = NULL;
+
+	pthread_mutex_lock(&archive->lock);
+	while (archive->count == 0 && !archive->walk_done)
+		pthread_cond_wait(&archive->produced, &archive->lock);
+	if (archive->count > 0)
+		entry = &archive->entries[archive->head];
+	pthread_mutex_unlock(&archive->lock);
+
+	return (entry);
+}
+
+static void
+archive_consumed(archive_t * archive) {
+
+	pthread_mutex_lock(&archive->lock);
+	archive->head = (archive->head + 1) % ARCHIVE_QUEUE_ENTRIES;
+	archive->count--;
+	pthread_cond_signal(&archive->consumed);
+	pthread_mutex_unlock(&archive->lock);
+}
+
+static int
+tar_flush(tar_writer_t * writer) {
+
+	if (writer->len == 0)
+		return (0);
+
+	int err;
+	if (writer->zwriter != NULL)
+		err = zmode_write(writer->zwriter, writer->buffer, writer->len);
+	else
+		err = send_data(writer->data_fd, writer->buffer,
+			writer->len) < 0 ? -1 : 0;
+	writer->len = 0;
+
+	return (err);
+}
+
+// Append len bytes of data, or of zeros if data is NULL
+static int
+tar_append(tar_writer_t * writer, const char * data, size_t len) {
+
+	writer->total += len;
+
+	while (len > 0) {
+		if (writer->len == BUFFER_POOL_BUFFER_SIZE &&
+			tar_flush(writer) < 0)
+			return (-1);
+
+		size_t n = BUFFER_POOL_BUFFER_SIZE - writer->len;
+		if (n > len)
+			n = len;
+		if (data != NULL) {
+			memcpy(writer->buffer + writer->len, data, n);
+			data += n;
+		} else
+			memset(writer->buffer + writer->len, 0, n);
+		writer->len += n;
+		len -= n;
+	}
+
+	return (0);
+}
+
+// Zeros up to the end of the block
+static int
+tar_pad(tar_writer_t * writer) {
+
+	size_t tail = writer->total % TAR_BLOCK_SIZE;
+
+	return (tail == 0 ? 0 : tar_append(writer, NULL, TAR_BLOCK_SIZE - tail));
+}
+
+static void
+tar_octal(char * field, size_t size, unsigned long long value) {
+
+	snprintf(field, size, "%0*llo", (int)size - 1, value);
+}
+
+/*
+ * Append a pax extended header record; its length counts
+ * the digits of the length itself
+ */
+static size_t
+tar_pax_record(char * pax, size_t len, const char * key, const char * value) {
+
+	size_t base = strlen(key) + strlen(value) + 3;
+	size_t total = base + 1;
+	while (snprintf(NULL, 0, "%zu", total) + base != total)
+		total++;
+	if (len + total >= TAR_PAX_SIZE)
+		return (len);
+
+	return (len + sprintf(pax + len, "%zu %s=%s\n", total, key, value));
+}
+
+// Fill in a header block and its checksum
+static void
+tar_block(char * header, const char * name, const char * prefix,
+	const struct stat * st, char type, const char * link,
+	unsigned long long size) {
+
+	memset(header, 0, TAR_BLOCK_SIZE);
+	strncpy(header, name, TAR_NAME_SIZE);
+	tar_octal(header + 100, 8, st->st_mode & 07777);
+	tar_octal(header + 108, 8, st->st_uid & 07777777);
+	tar_octal(header + 116, 8, st->st_gid & 07777777);
+	tar_octal(header + 124, 12, size);
+	tar_octal(header + 136, 12, st->st_mtime > 0 ? st->st_mtime : 0);
+	header[156] = type;
+	if (link != NULL)
+		strncpy(header + 157, link, TAR_NAME_SIZE);
+	memcpy(header + 257, "ustar", 6);
+	memcpy(header + 263, "00", 2);
+	if (prefix != NULL)
+		strncpy(header + 345, prefix, TAR_PREFIX_SIZE);
+
+	// The checksum is taken with its own field as spaces
+	memset(header + 148, ' ', 8);
+	unsigned int sum = 0;
+	for (int i = 0; i < TAR_BLOCK_SIZE; i++)
+		sum += (unsigned char)header[i];
+	snprintf(header + 148, 7, "%06o", sum);
+}
+
+/*
+ * Append the header of an entry. Names that fit are split at a
+ * slash between the ustar name and prefix fields; longer names
+ * and links, and sizes past the octal field, go into a pax
+ * extended header ahead of it.
+ */
+static int
+tar_header(tar_writer_t * writer, const char * name, const struct stat * st,
+	char type, const char * link, unsigned long long size) {
+
+	char header[TAR_BLOCK_SIZE];
+	char prefix[TAR_PREFIX_SIZE + 1];
+	const char * short_name = name;
+	int has_prefix = 0;
+	size_t len = strlen(name);
+
+	if (len > TAR_NAME_SIZE) {
+		short_name = NULL;
+		// The last slash leaving at most a name's width after it
+		for (size_t i = len - 1; i > 0; i--) {
+			if (name[i] != '/' || i == len - 1)
+				continue;
+			if (len - i - 1 > TAR_NAME_SIZE)
+				break;
+			if (i <= TAR_PREFIX_SIZE) {
+				memcpy(prefix, name, i);
+				prefix[i] = '\0';
+				short_name = name + i + 1;
+				has_prefix = 1;
+				break;
+			}
+		}
+	}
+
+	int long_link = link != NULL && strlen(link) > TAR_NAME_SIZE;
+	if (short_name == NULL || long_link || size > TAR_MAX_OCTAL_SIZE) {
+
+		char pax[TAR_PAX_SIZE];
+		size_t pax_len = 0;
+		if (short_name == NULL)
+			pax_len = tar_pax_record(pax, pax_len, "path", name);
+		if (long_link)
+			pax_len = tar_pax_record(pax, pax_len, "linkpath", link);
+		if (size > TAR_MAX_OCTAL_SIZE) {
+			char digits[32];
+			snprintf(digits, sizeof (digits), "%llu", size);
+			pax_len = tar_pax_record(pax, pax_len, "size", digits);
+		}
+
+		char pax_name[TAR_NAME_SIZE + 1];
+		snprintf(pax_name, sizeof (pax_name), "PaxHeader/%s", name +
+			(len > TAR_NAME_SIZE - 10 ? len - (TAR_NAME_SIZE - 10) : 0));
+		tar_block(header, pax_name, NULL, st, 'x', NULL, pax_len);
+		if (tar_append(writer, header, TAR_BLOCK_SIZE) < 0 ||
+			tar_append(writer, pax, pax_len) < 0 || tar_pad(writer) < 0)
+			return (-1);
+
+		// Readers take the name from the extended header
+		if (short_name == NULL)
+			short_name = name + len - (len > TAR_NAME_SIZE ?
+				TAR_NAME_SIZE : len);
+		if (size > TAR_MAX_OCTAL_SIZE)
+			size = 0;
+	}
+
+	tar_block(header, short_name, has_prefix ? prefix : NULL, st, type,
+		link, size);
+
+	return (tar_append(writer, header, TAR_BLOCK_SIZE));
+}
+
+/*
+ * Append the body of a regular file, as many bytes as its header
+ * promised: a file that shrank since is padded with zeros, one
+ * that grew is cut off. Large bodies go straight from the file
+ * to the socket with sendfile; small ones, and everything in
+ * MODE Z, are read into the buffer.
+ */
+static int
+tar_body(tar_writer_t * writer, int fd, off_t size) {
+
+	off_t offset = 0;
+
+#ifdef __linux__
+	if (writer->zwriter == NULL && size >= ARCHIVE_SENDFILE_MIN_SIZE) {
+
+		if (tar_flush(writer) < 0)
+			return (-1);
+
+		while (offset < size) {
+			size_t chunk = size - offset < SENDFILE_CHUNK_SIZE ?
+				size - offset : SENDFILE_CHUNK_SIZE;
+			ssize_t nchunk = sendfile(writer->data_fd, fd, &offset,
+				chunk);
+			if (nchunk < 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				// Not sendable, so read it in below
+				if ((errno == EINVAL || errno == ENOSYS) &&
+					offset == 0)
+					break;
+				return (-1);
+			}
+			if (nchunk == 0)
+				break;
+		}
+		writer->total += offset;
+	}
+#endif
+
+	while (offset < size) {
+		if (writer->len == BUFFER_POOL_BUFFER_SIZE &&
+			tar_flush(writer) < 0)
+			return (-1);
+
+		size_t n = BUFFER_POOL_BUFFER_SIZE - writer->len;
+		if ((off_t)n > size - offset)
+			n = size - offset;
+		ssize_t nread = pread(fd, writer->buffer + writer->len, n, offset);
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		if (nread == 0)
+			break;
+		writer->len += nread;
+		writer->total += nread;
+		offset += nread;
+	}
+
+	if (offset < size && tar_append(writer, NULL, size - offset) < 0)
+		return (-1);
+
+	return (tar_pad(writer));
+}
+
+static int
+tar_entry(tar_writer_t * writer, archive_entry_t * entry) {
+
+	if (S_ISDIR(entry->st.st_mode))
+		return (tar_header(writer, entry->name, &entry->st, '5', NULL, 0));
+	if (S_ISLNK(entry->st.st_mode))
+		return (tar_header(writer, entry->name, &entry->st, '2',
+			entry->link, 0));
+
+	if (tar_header(writer, entry->name, &entry->st, '0', NULL,
+		entry->st.st_size) < 0)
+		return (-1);
+
+	return (tar_body(writer, entry->fd, entry->st.st_size));
+}
+
+/*
+ * The root's own entry is sent before the walkers start; the
+ * sender then takes entries from the ring as they come, and
+ * ends the archive with two zero blocks padded to a record
+ */
+static int
+archive_send(archive_t * archive, tar_writer_t * writer, int dir_fd) {
+
+	struct stat st;
+	if (archive->prefix[0] != '\0') {
+		char name[PATH_MAX];
+		if (fstat(dir_fd, &st) < 0 ||
+			snprintf(name, PATH_MAX, "%s/", archive->prefix) >= PATH_MAX ||
+			tar_header(writer, name, &st, '5', NULL, 0) < 0)
+			return (-1);
+	}
+
+	archive_entry_t * entry;
+	while ((entry = archive_next(archive)) != NULL) {
+		int err = tar_entry(writer, entry);
+		if (entry->fd >= 0)
+			close(entry->fd);
+		archive_consumed(archive);
+		if (err < 0)
+			return (-1);
+	}
+
+	if (tar_append(writer, NULL, 2 * TAR_BLOCK_SIZE) < 0)
+		return (-1);
+	size_t tail = writer->total % TAR_RECORD_SIZE;
+	if (tail != 0 && tar_append(writer, NULL, TAR_RECORD_SIZE - tail) < 0)
+		return (-1);
+
+	return (tar_flush(writer));
+}
+
+off_t
+archive_send_tree(int dir_fd, const char * prefix, int data_fd,
+	zmode_t * zmode, int level) {
+
+	archive_t archive;
+	memset(&archive, 0, sizeof (archive_t));
+	archive.root_fd = dir_fd;
+	archive.prefix = prefix;
+	archive.entries = malloc(ARCHIVE_QUEUE_ENTRIES * sizeof (archive_entry_t));
+	if (archive.entries == NULL)
+		return (-1);
+
+	tar_writer_t writer;
+	zmode_writer_t zwriter;
+	memset(&writer, 0, sizeof (tar_writer_t));
+	writer.data_fd = data_fd;
+	writer.buffer = buffer_pool_get();
+	if (writer.buffer == NULL) {
+		free(archive.entries);
+		return (-1);
+	}
+	if (zmode != NULL) {
+		if (zmode_writer_open(&zwriter, zmode, level, data_fd) < 0) {
+			buffer_pool_put(writer.buffer);
+			free(archive.entries);
+			return (-1);
+		}
+		writer.zwriter = &zwriter;
+	}
+
+	pthread_mutex_init(&archive.lock, NULL);
+	pthread_cond_init(&archive.produced, NULL);
+	pthread_cond_init(&archive.consumed, NULL);
+	pthread_cond_init(&archive.work, NULL);
+	archive_push_dir(&archive, "");
+
+#ifdef TCP_CORK
+	/*
+	 * Headers and the sendfile bodies between them go out in
+	 * separate calls; corked, they still fill whole segments
+	 */
+	int on = 1;
+	if (zmode == NULL)
+		setsockopt(data_fd, IPPROTO_TCP, TCP_CORK, &on, sizeof (on));
+#endif
+
+	pthread_t walkers[ARCHIVE_WALKERS];
+	int nwalkers = 0;
+	for (int i = 0; i < ARCHIVE_WALKERS; i++) {
+		if (pthread_create(&walkers[nwalkers], NULL, archive_walker,
+			&archive) == 0)
+			nwalkers++;
+	}
+
+	int err = nwalkers > 0 ? archive_send(&archive, &writer, dir_fd) : -1;
+
+	// Let the walkers go, and close what they left queued
+	pthread_mutex_lock(&archive.lock);
+	archive.aborted = 1;
+	pthread_cond_broadcast(&archive.consumed);
+	pthread_cond_broadcast(&archive.work);
+	pthread_mutex_unlock(&archive.lock);
+	for (int i = 0; i < nwalkers; i++)
+		pthread_join(walkers[i], NULL);
+	for (; archive.count > 0; archive.count--) {
+		archive_entry_t * entry = &archive.entries[archive.head];
+		if (entry->fd >= 0)
+			close(entry->fd);
+		archive.head = (archive.head + 1) % ARCHIVE_QUEUE_ENTRIES;
+	}
+	while (archive.pending != NULL) {
+		pending_dir_t * dir = archive.pending;
+		archive.pending = dir->next;
+		free(dir);
+	}
+
+#ifdef TCP_CORK
+	int off = 0;
+	if (zmode == NULL)
+		setsockopt(data_fd, IPPROTO_TCP, TCP_CORK, &off, sizeof (off));
+#endif
+
+	if (writer.zwriter != NULL && zmode_writer_close(writer.zwriter,
+		err == 0) < 0)
+		err = -1;
+	buffer_pool_put(writer.buffer);
+	pthread_cond_destroy(&archive.work);
+	pthread_cond_destroy(&archive.consumed);
+	pthread_cond_destroy(&archive.produced);
+	pthread_mutex_destroy(&archive.lock);
+	free(archive.entries);
+
+	return (err < 0 ? -1 : writer.total);
+}
@@ -0,0 +1,74 @@
+#include "arena.h"
+
+#define	ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+void
+arena_init(arena_t * arena, char * block, size_t size) {
+
+	arena->block = block;
+	arena->size = size;
+	arena->used = 0;
+	arena->overflow = NULL;
+}
+
+void *
+arena_alloc(arena_t * arena, size_t size) {
+
+	size_t rounded = ARENA_ROUND(size);
+	if (rounded >= size && arena->size - arena->used >= rounded) {
+		void * memory = arena->block + arena->used;
+		arena->used += rounded;
+		return (memory);
+	}
+
+	// Too large for what is left; kept until the next reset
+	arena_chunk_t * chunk = malloc(sizeof (arena_chunk_t) + size);
+	if (chunk == NULL)
+		return (NULL);
+	chunk->next = arena->overflow;
+	arena->overflow = chunk;
+
+	return (chunk->data);
+}
+
+char *
+arena_printf(arena_t * arena, size_t * len, const char * format, ...) {
+
+	va_list args;
+	size_t room = arena->size - arena->used;
+	char * out = arena->block + arena->used;
+
+	// Format in place, and only fall back if that did not fit
+	va_start(args, format);
+	int needed = vsnprintf(out, room, format, args);
+	va_end(args);
+	if (needed < 0)
+		return (NULL);
+
+	if ((size_t)needed < room)
+		arena->used += ARENA_ROUND(needed + 1) < room ?
+			ARENA_ROUND(needed + 1) : room;
+	else {
+		out = arena_alloc(arena, needed + 1);
+		if (out == NULL)
+			return (NULL);
+		va_start(args, format);
+		vsnprintf(out, needed + 1, format, args);
+		va_end(args);
+	}
+
+	if (len != NULL)
+		*len = needed;
+	return (out);
+}
+
+void
+arena_reset(arena_t * arena) {
+
+	while (arena->overflow != NULL) {
+		arena_chunk_t * next = arena->overflow->next;
+		free(arena->overflow);
+		arena->overflow = next;
+	}
+	arena->used = 0;
+}
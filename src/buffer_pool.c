@@ -0,0 +1,123 @@
+#include <sys/mman.h>
+#include "buffer_pool.h"
+
+// Free buffers are linked through their first bytes
+typedef struct free_buffer {
+	struct free_buffer * next;
+} free_buffer_t;
+
+static free_buffer_t * free_list = NULL;
+static unsigned long num_buffers = 0;
+static unsigned long num_free = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Each thread keeps a few buffers to itself, so that a worker
+ * running one transfer after another never touches the lock;
+ * the key hands them back when the thread exits
+ */
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static __thread char * thread_cache[BUFFER_POOL_THREAD_CACHE];
+static __thread int thread_cached = 0;
+static __thread int thread_registered = 0;
+
+static void
+pool_push(char * buffer) {
+
+	free_buffer_t * node = (free_buffer_t *)buffer;
+	node->next = free_list;
+	free_list = node;
+	num_free++;
+}
+
+// Return the buffers of an exiting thread to the shared pool
+static void
+buffer_pool_retire(void * arg) {
+
+	pthread_mutex_lock(&pool_lock);
+	while (thread_cached > 0)
+		pool_push(thread_cache[--thread_cached]);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static void
+buffer_pool_make_key() {
+
+	pthread_key_create(&cache_key, buffer_pool_retire);
+}
+
+/*
+ * Map a slab of buffers and put all but the first one on the
+ * free list; called with the lock held. The memory is never
+ * unmapped, so the pool stays at its high-water mark.
+ */
+static char *
+pool_grow() {
+
+	char * slab = mmap(NULL,
+		(size_t)BUFFER_POOL_SLAB_BUFFERS * BUFFER_POOL_BUFFER_SIZE,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slab == MAP_FAILED)
+		return (NULL);
+
+	for (int i = 1; i < BUFFER_POOL_SLAB_BUFFERS; i++)
+		pool_push(slab + (size_t)i * BUFFER_POOL_BUFFER_SIZE);
+	num_buffers += BUFFER_POOL_SLAB_BUFFERS;
+
+	return (slab);
+}
+
+char *
+buffer_pool_get() {
+
+	if (thread_cached > 0)
+		return (thread_cache[--thread_cached]);
+
+	pthread_mutex_lock(&pool_lock);
+	char * buffer = (char *)free_list;
+	if (buffer != NULL) {
+		free_list = free_list->next;
+		num_free--;
+	}
+	else
+		buffer = pool_grow();
+	pthread_mutex_unlock(&pool_lock);
+
+	return (buffer);
+}
+
+void
+buffer_pool_put(char * buffer) {
+
+	if (buffer == NULL)
+		return;
+
+	if (thread_cached < BUFFER_POOL_THREAD_CACHE) {
+		// Registered once the thread first keeps a buffer
+		if (!thread_registered) {
+			pthread_once(&cache_key_once, buffer_pool_make_key);
+			pthread_setspecific(cache_key, thread_cache);
+			thread_registered = 1;
+		}
+		thread_cache[thread_cached++] = buffer;
+		return;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	pool_push(buffer);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void
+buffer_pool_report(FILE * out) {
+
+	pthread_mutex_lock(&pool_lock);
+	unsigned long buffers = num_buffers;
+	unsigned long available = num_free;
+	pthread_mutex_unlock(&pool_lock);
+
+	fprintf(out, "Buffer pool: %lu buffers of %d bytes, %lu in the "
+		"shared pool\n", buffers, BUFFER_POOL_BUFFER_SIZE, available);
+	fflush(out);
+}
@@ -0,0 +1,266 @@
+#include "crlf.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define	CRLF_HAVE_X86 1
+#endif
+
+// Reset the state for a new transfer
+void
+crlf_init(crlf_state_t * state) {
+
+	state->prev = '\0';
+	state->pending_cr = 0;
+}
+
+/*
+ * Expand one block of width bytes in which mask has a bit set
+ * for every line feed; before is the byte preceding the block
+ */
+static size_t
+expand_masked(const char * block, unsigned int mask, size_t width,
+	char before, char * out) {
+
+	size_t o = 0, start = 0;
+
+	while (mask != 0) {
+		size_t k = __builtin_ctz(mask);
+		memcpy(out + o, block + start, k - start);
+		o += k - start;
+		if ((k == 0 ? before : block[k - 1]) != '\r')
+			out[o++] = '\r';
+		out[o++] = '\n';
+		start = k + 1;
+		mask &= mask - 1;
+	}
+	memcpy(out + o, block + start, width - start);
+
+	return (o + width - start);
+}
+
+/*
+ * Collapse one block of width bytes starting at in[i], in which
+ * mask has a bit set for every carriage return. A carriage return
+ * at the very end of the input is held back in the state.
+ */
+static size_t
+collapse_masked(const char * in, size_t len, size_t i, unsigned int mask,
+	size_t width, crlf_state_t * state, char * out) {
+
+	const char * block = in + i;
+	size_t o = 0, start = 0;
+
+	while (mask != 0) {
+		size_t k = __builtin_ctz(mask);
+		memcpy(out + o, block + start, k - start);
+		o += k - start;
+		if (i + k + 1 < len) {
+			if (in[i + k + 1] != '\n')
+				out[o++] = '\r';
+		}
+		else
+			state->pending_cr = 1;
+		start = k + 1;
+		mask &= mask - 1;
+	}
+	memcpy(out + o, block + start, width - start);
+
+	return (o + width - start);
+}
+
+#ifdef CRLF_HAVE_X86
+/*
+ * The vector loops compare a whole vector against the line
+ * ending byte at once. Vectors without one are stored as they
+ * are, which is the common case for text with long lines.
+ */
+__attribute__((target("sse2")))
+static size_t
+expand_sse2(const char * in, size_t len, char before, char * out,
+	size_t * consumed) {
+
+	const __m128i lf = _mm_set1_epi8('\n');
+	size_t i = 0, o = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+		if (mask == 0) {
+			_mm_storeu_si128((__m128i *)(out + o), v);
+			o += 16;
+		}
+		else
+			o += expand_masked(in + i, mask, 16,
+				i == 0 ? before : in[i - 1], out + o);
+	}
+
+	*consumed = i;
+	return (o);
+}
+
+__attribute__((target("avx2")))
+static size_t
+expand_avx2(const char * in, size_t len, char before, char * out,
+	size_t * consumed) {
+
+	const __m256i lf = _mm256_set1_epi8('\n');
+	size_t i = 0, o = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+		unsigned int mask =
+			(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+		if (mask == 0) {
+			_mm256_storeu_si256((__m256i *)(out + o), v);
+			o += 32;
+		}
+		else
+			o += expand_masked(in + i, mask, 32,
+				i == 0 ? before : in[i - 1], out + o);
+	}
+
+	*consumed = i;
+	return (o);
+}
+
+__attribute__((target("sse2")))
+static size_t
+collapse_sse2(crlf_state_t * state, const char * in, size_t len, char * out,
+	size_t * consumed) {
+
+	const __m128i cr = _mm_set1_epi8('\r');
+	size_t i = 0, o = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+		if (mask == 0) {
+			_mm_storeu_si128((__m128i *)(out + o), v);
+			o += 16;
+		}
+		else
+			o += collapse_masked(in, len, i, mask, 16, state, out + o);
+	}
+
+	*consumed = i;
+	return (o);
+}
+
+__attribute__((target("avx2")))
+static size_t
+collapse_avx2(crlf_state_t * state, const char * in, size_t len, char * out,
+	size_t * consumed) {
+
+	const __m256i cr = _mm256_set1_epi8('\r');
+	size_t i = 0, o = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+		unsigned int mask =
+			(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+		if (mask == 0) {
+			_mm256_storeu_si256((__m256i *)(out + o), v);
+			o += 32;
+		}
+		else
+			o += collapse_masked(in, len, i, mask, 32, state, out + o);
+	}
+
+	*consumed = i;
+	return (o);
+}
+
+// Whether the CPU we run on has AVX2, checked once
+static int
+have_avx2() {
+
+	static int avx2 = -1;
+	if (avx2 < 0)
+		avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	return (avx2);
+}
+#endif
+
+/*
+ * Expand a block of local text into network ASCII. The vector
+ * loop handles whole vectors and the scalar loop the rest, or
+ * everything on CPUs without a vector kernel.
+ */
+size_t
+crlf_expand(crlf_state_t * state, const char * in, size_t len, char * out) {
+
+	size_t i = 0, o = 0;
+
+	if (len == 0)
+		return (0);
+
+#ifdef CRLF_HAVE_X86
+	if (have_avx2())
+		o = expand_avx2(in, len, state->prev, out, &i);
+	else
+		o = expand_sse2(in, len, state->prev, out, &i);
+#endif
+
+	char before = i == 0 ? state->prev : in[i - 1];
+	for (; i < len; i++) {
+		if (in[i] == '\n' && before != '\r')
+			out[o++] = '\r';
+		out[o++] = in[i];
+		before = in[i];
+	}
+
+	state->prev = in[len - 1];
+	return (o);
+}
+
+// Collapse a block of network ASCII into local text
+size_t
+crlf_collapse(crlf_state_t * state, const char * in, size_t len, char * out) {
+
+	size_t i = 0, o = 0;
+
+	if (len == 0)
+		return (0);
+
+	// A carriage return from the previous block is kept unless a LF follows
+	if (state->pending_cr) {
+		if (in[0] != '\n')
+			out[o++] = '\r';
+		state->pending_cr = 0;
+	}
+
+#ifdef CRLF_HAVE_X86
+	size_t vector_len;
+	if (have_avx2())
+		o += collapse_avx2(state, in, len, out + o, &vector_len);
+	else
+		o += collapse_sse2(state, in, len, out + o, &vector_len);
+	i = vector_len;
+#endif
+
+	for (; i < len; i++) {
+		if (in[i] == '\r') {
+			if (i + 1 == len) {
+				state->pending_cr = 1;
+				continue;
+			}
+			if (in[i + 1] == '\n')
+				continue;
+		}
+		out[o++] = in[i];
+	}
+
+	return (o);
+}
+
+// Flush a carriage return held back at the end of a transfer
+size_t
+crlf_collapse_finish(crlf_state_t * state, char * out) {
+
+	if (!state->pending_cr)
+		return (0);
+
+	state->pending_cr = 0;
+	out[0] = '\r';
+	return (1);
+}
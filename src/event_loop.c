@@ -0,0 +1,301 @@
+#include <sys/epoll.h>
+#include <stddef.h>
+#include "event_loop.h"
+#include "worker_pool.h"
+#include "reply.h"
+#include "metrics.h"
+#include "log.h"
+#include "utils.h"
+
+// The session a timer belongs to
+#define	SESSION_OF_TIMER(t) \
+	((client_context_t *)((char *)(t) - offsetof(client_context_t, timer)))
+
+#ifdef __linux__
+/*
+ * The kernel's tcp_info goes on past the end of the C library's
+ * with fields added since; the byte counters of Linux 4.1 follow
+ * the pacing rates
+ */
+typedef struct tcp_progress {
+	struct tcp_info info;
+	uint64_t pacing_rate;
+	uint64_t max_pacing_rate;
+	uint64_t bytes_acked;
+	uint64_t bytes_received;
+} tcp_progress_t;
+#endif
+
+// One epoll instance per event loop thread
+static int epoll_fds[NUM_EVENT_LOOPS];
+// And the deadlines of the sessions it watches
+static timer_wheel_t wheels[NUM_EVENT_LOOPS];
+
+// Round-robin counter used to spread sessions over the event loops
+static unsigned int next_loop = 0;
+
+// Create the epoll instances used by the event loops
+int
+event_loop_init() {
+
+	for (int i = 0; i < NUM_EVENT_LOOPS; i++) {
+
+		epoll_fds[i] = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fds[i] < 0)
+			error("Error on creating epoll instance\n");
+		timer_wheel_init(&wheels[i], get_time_ns());
+	}
+
+	return (0);
+}
+
+/*
+ * Expiry of the idle timeout: the session is idle, so only its
+ * event loop may touch it, which takes it on once the wheel is
+ * unlocked again
+ */
+static unsigned long long
+session_idle_expired(wheel_timer_t * timer, void * arg) {
+
+	client_context_t ** expired = arg;
+	client_context_t * session = SESSION_OF_TIMER(timer);
+
+	session->expired_next = *expired;
+	*expired = session;
+	return (0);
+}
+
+// Start the idle timeout of a session about to wait for a command
+static void
+session_wait_idle(client_context_t * current_context) {
+
+	const session_timeouts_t * timeouts = get_session_timeouts();
+	if (timeouts->idle_s == 0)
+		return;
+
+	current_context->timer.expire = session_idle_expired;
+	timer_wheel_schedule(current_context->wheel, &current_context->timer,
+		get_time_ns() + timeouts->idle_s * 1000000000ULL);
+}
+
+/*
+ * Close a session that has been idle for too long. The reply
+ * is only sent if the socket takes it right away, so that a
+ * client that stopped reading cannot hold up the event loop.
+ */
+static void
+session_timed_out(client_context_t * session) {
+
+	const reply_t * reply = reply_lookup(REPLY_SESSION_TIMEOUT);
+
+	log_debug("Closing idle session");
+	send(session->client_comm_fd, reply->text, reply->len, MSG_DONTWAIT);
+	metrics_count(METRIC_IDLE_TIMEOUTS, 1);
+	end_session(session);
+}
+
+/*
+ * Assign a session to one of the event loops. The control
+ * connection is registered in one-shot mode so that exactly one
+ * worker owns the session between two readiness events.
+ */
+int
+event_loop_register(client_context_t * current_context) {
+
+	unsigned int loop = __atomic_fetch_add(&next_loop, 1,
+		__ATOMIC_RELAXED);
+	current_context->epoll_fd = epoll_fds[loop % NUM_EVENT_LOOPS];
+	current_context->wheel = &wheels[loop % NUM_EVENT_LOOPS];
+	current_context->state = SESSION_IDLE;
+	// The timeout must be set before the loop can see the session
+	session_wait_idle(current_context);
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof (ev));
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = current_context;
+
+	return (epoll_ctl(current_context->epoll_fd, EPOLL_CTL_ADD,
+		current_context->client_comm_fd, &ev));
+}
+
+// Re-enable the one-shot registration of a session
+int
+event_loop_rearm(client_context_t * current_context) {
+
+	current_context->state = SESSION_IDLE;
+	session_wait_idle(current_context);
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof (ev));
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = current_context;
+
+	return (epoll_ctl(current_context->epoll_fd, EPOLL_CTL_MOD,
+		current_context->client_comm_fd, &ev));
+}
+
+// Stop watching the control connection of a session
+int
+event_loop_unregister(client_context_t * current_context) {
+
+	if (current_context->wheel != NULL)
+		timer_wheel_cancel(current_context->wheel, &current_context->timer);
+	return (epoll_ctl(current_context->epoll_fd, EPOLL_CTL_DEL,
+		current_context->client_comm_fd, NULL));
+}
+
+/*
+ * Bytes a data connection has moved so far, both ways; sockets
+ * the kernel cannot tell about always seem to be moving
+ */
+static unsigned long long
+transfer_progress(int data_fd, unsigned long long last) {
+
+#ifdef __linux__
+	tcp_progress_t progress;
+	socklen_t len = sizeof (progress);
+	memset(&progress, 0, sizeof (progress));
+	if (getsockopt(data_fd, IPPROTO_TCP, TCP_INFO, &progress, &len) == 0 &&
+		len >= sizeof (progress))
+		return (progress.bytes_acked + progress.bytes_received);
+#endif
+	return (last + ~0U);
+}
+
+/*
+ * Stall check of a transfer, run with the wheel locked so
+ * that the worker cannot close the data connection under
+ * us: a transfer short of the minimum rate is shut down,
+ * which ends the system call the worker is blocked in
+ */
+static unsigned long long
+transfer_check(wheel_timer_t * timer, void * arg) {
+
+	client_context_t * session = SESSION_OF_TIMER(timer);
+	const session_timeouts_t * timeouts = get_session_timeouts();
+
+	unsigned long long bytes = transfer_progress(session->watched_fd,
+		session->watched_bytes);
+	if (bytes - session->watched_bytes >
+		timeouts->min_rate * timeouts->stall_s) {
+		session->watched_bytes = bytes;
+		return (get_time_ns() + timeouts->stall_s * 1000000000ULL);
+	}
+
+	log_debug("Cutting off a stalled transfer");
+	session->transfer_stalled = 1;
+	shutdown(session->watched_fd, SHUT_RDWR);
+	metrics_count(METRIC_STALLED_TRANSFERS, 1);
+	return (0);
+}
+
+void
+event_loop_watch_transfer(client_context_t * current_context, int data_fd) {
+
+	const session_timeouts_t * timeouts = get_session_timeouts();
+
+	current_context->transfer_stalled = 0;
+	if (current_context->wheel == NULL || timeouts->stall_s == 0)
+		return;
+
+	current_context->watched_fd = data_fd;
+	current_context->watched_bytes = transfer_progress(data_fd, 0);
+	current_context->timer.expire = transfer_check;
+	timer_wheel_schedule(current_context->wheel, &current_context->timer,
+		get_time_ns() + timeouts->stall_s * 1000000000ULL);
+}
+
+void
+event_loop_unwatch_transfer(client_context_t * current_context) {
+
+	if (current_context->wheel == NULL)
+		return;
+
+	timer_wheel_cancel(current_context->wheel, &current_context->timer);
+	current_context->watched_fd = -1;
+}
+
+/*
+ * Queue the sessions that were turned away by a full job
+ * queue, oldest first, until the queue is full again
+ */
+static void
+submit_deferred(client_context_t ** head, client_context_t ** tail) {
+
+	while (*head != NULL) {
+		client_context_t * session = *head;
+		if (worker_pool_submit(session->pool, session->client_comm_fd,
+			session->client_addr, session) < 0)
+			return;
+		*head = session->deferred_next;
+	}
+	*tail = NULL;
+}
+
+/*
+ * Event_Loop_Thread - waits for control connections
+ * to become readable and queues their sessions as jobs.
+ * Idle sessions therefore cost no worker thread at all.
+ * Between waits, the loop expires the deadlines of its
+ * sessions, so it never sleeps for longer than a tick.
+ * Sessions the full job queue turns away stay disarmed and
+ * are offered again every EVENT_RETRY_MS, so the loop keeps
+ * dispatching and expiring timers while the workers catch up.
+ */
+void *
+event_loop_thread(void * args) {
+
+	int epoll_fd = epoll_fds[(long)args % NUM_EVENT_LOOPS];
+	timer_wheel_t * wheel = &wheels[(long)args % NUM_EVENT_LOOPS];
+	struct epoll_event events[EVENT_BATCH_SIZE];
+	client_context_t * deferred = NULL;
+	client_context_t * deferred_tail = NULL;
+
+	while (1) {
+
+		submit_deferred(&deferred, &deferred_tail);
+
+		int nevents = epoll_wait(epoll_fd, events, EVENT_BATCH_SIZE,
+			deferred != NULL ? EVENT_RETRY_MS : TIMER_WHEEL_TICK_MS);
+		if (nevents < 0) {
+			if (errno == EINTR)
+				continue;
+			error("Error on epoll_wait in the event loop!\n");
+		}
+
+		for (int i = 0; i < nevents; i++) {
+
+			client_context_t * session = events[i].data.ptr;
+			session->state = SESSION_RUNNING;
+			timer_wheel_cancel(wheel, &session->timer);
+
+			/*
+			 * Once queued, the session belongs to the worker
+			 * that dequeues it until it is re-armed. If the
+			 * queue is full, the session waits its turn behind
+			 * those already turned away, still disarmed.
+			 */
+			if (deferred == NULL && worker_pool_submit(session->pool,
+				session->client_comm_fd,
+				session->client_addr, session) == 0)
+				continue;
+			session->deferred_next = NULL;
+			if (deferred_tail != NULL)
+				deferred_tail->deferred_next = session;
+			else
+				deferred = session;
+			deferred_tail = session;
+		}
+
+		client_context_t * expired = NULL;
+		timer_wheel_advance(wheel, get_time_ns(), &expired);
+		while (expired != NULL) {
+			client_context_t * session = expired;
+			expired = session->expired_next;
+			session_timed_out(session);
+		}
+	}
+
+	return (NULL);
+}
@@ -0,0 +1,420 @@
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include "file_cache.h"
+#include "ftp_functions.h"
+#include "crlf.h"
+#include "buffer_pool.h"
+#include "uring.h"
+
+#ifdef __APPLE__
+#define	st_mtim st_mtimespec
+#endif
+
+// Cached files, hashed by identity
+static file_entry_t * buckets[FILE_CACHE_BUCKETS];
+// Least recently used file first
+static file_entry_t * lru_head = NULL;
+static file_entry_t * lru_tail = NULL;
+static size_t max_bytes = 0;
+static size_t cached_bytes = 0;
+static unsigned long cached_files = 0;
+static pthread_mutex_t file_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Counters for the cache report
+static unsigned long hits = 0;
+static unsigned long misses = 0;
+static unsigned long evictions = 0;
+static unsigned long long served_bytes = 0;
+
+/*
+ * Where a thread reading a mapping jumps to if the file was
+ * truncated underneath it and the read faults
+ */
+static __thread sigjmp_buf * sigbus_jump = NULL;
+
+static void
+file_cache_sigbus(int signal) {
+
+	if (sigbus_jump != NULL)
+		siglongjmp(*sigbus_jump, 1);
+
+	// A fault outside of a mapping read is a real crash
+	struct sigaction action;
+	memset(&action, 0, sizeof (action));
+	action.sa_handler = SIG_DFL;
+	sigaction(SIGBUS, &action, NULL);
+	raise(SIGBUS);
+}
+
+static unsigned long
+file_cache_hash(dev_t dev, ino_t ino) {
+
+	unsigned long long key = (unsigned long long)ino * 0x9E3779B97F4A7C15ULL ^
+		(unsigned long long)dev;
+	return ((unsigned long)(key >> 32) % FILE_CACHE_BUCKETS);
+}
+
+static int
+same_version(const file_entry_t * entry, const struct stat * st) {
+
+	return (entry->size == st->st_size &&
+		entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+		entry->mtime.tv_nsec == st->st_mtim.tv_nsec);
+}
+
+static void
+file_entry_free(file_entry_t * entry) {
+
+	if (entry->map != NULL)
+		munmap(entry->map, entry->size);
+	close(entry->fd);
+	free(entry);
+}
+
+static void
+lru_unlink(file_entry_t * entry) {
+
+	if (entry->lru_prev != NULL)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		lru_head = entry->lru_next;
+	if (entry->lru_next != NULL)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		lru_tail = entry->lru_prev;
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void
+lru_push(file_entry_t * entry) {
+
+	entry->lru_prev = lru_tail;
+	entry->lru_next = NULL;
+	if (lru_tail != NULL)
+		lru_tail->lru_next = entry;
+	else
+		lru_head = entry;
+	lru_tail = entry;
+}
+
+/*
+ * Take an entry out of the cache; it is unmapped once the
+ * last session sending it lets go. Called with the lock held.
+ */
+static void
+file_cache_remove(file_entry_t * entry) {
+
+	file_entry_t ** link =
+		&buckets[file_cache_hash(entry->dev, entry->ino)];
+	while (*link != entry)
+		link = &(*link)->hash_next;
+	*link = entry->hash_next;
+
+	lru_unlink(entry);
+	entry->cached = 0;
+	cached_bytes -= entry->size;
+	cached_files--;
+
+	if (--entry->refcount == 0)
+		file_entry_free(entry);
+}
+
+/*
+ * Add a freshly opened file, evicting the least recently used
+ * ones to stay within the budget. Called with the lock held.
+ */
+static void
+file_cache_insert(file_entry_t * entry) {
+
+	// Another session may have cached the same file meanwhile
+	file_entry_t ** bucket =
+		&buckets[file_cache_hash(entry->dev, entry->ino)];
+	for (file_entry_t * cur = *bucket; cur != NULL; cur = cur->hash_next) {
+		if (cur->dev == entry->dev && cur->ino == entry->ino) {
+			file_cache_remove(cur);
+			break;
+		}
+	}
+
+	while (lru_head != NULL && (cached_bytes + entry->size > max_bytes ||
+		cached_files >= FILE_CACHE_MAX_FILES)) {
+		file_cache_remove(lru_head);
+		evictions++;
+	}
+
+	entry->hash_next = *bucket;
+	*bucket = entry;
+	lru_push(entry);
+	entry->cached = 1;
+	entry->shared = 1;
+	entry->refcount++;
+	cached_bytes += entry->size;
+	cached_files++;
+}
+
+int
+file_cache_init(size_t bytes) {
+
+	max_bytes = bytes;
+
+	/*
+	 * Growing the descriptor table of a threaded process waits
+	 * for an RCU grace period, a few milliseconds, in whichever
+	 * openat or accept needs the room; grow it once up front
+	 * for the cached descriptors, if the limit allows
+	 */
+	if (max_bytes > 0) {
+		int fd = fcntl(STDIN_FILENO, F_DUPFD, FILE_CACHE_RESERVED_FDS);
+		if (fd >= 0)
+			close(fd);
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof (action));
+	action.sa_handler = file_cache_sigbus;
+	sigemptyset(&action.sa_mask);
+
+	return (sigaction(SIGBUS, &action, NULL));
+}
+
+/*
+ * The file is looked up by name first, so that a hit costs a
+ * single fstatat and no descriptor; on a miss the file is
+ * opened and kept open if it is settled and fits the budget.
+ * Mapping is left to the first transfer that needs it, since
+ * binary transfers are sent from the descriptor.
+ */
+file_entry_t *
+file_cache_open(int dir_fd, const char * name) {
+
+	struct stat st;
+	if (fstatat(dir_fd, name, &st, 0) < 0)
+		return (NULL);
+	if (!S_ISREG(st.st_mode)) {
+		errno = EISDIR;
+		return (NULL);
+	}
+
+	pthread_mutex_lock(&file_cache_lock);
+	file_entry_t * entry = buckets[file_cache_hash(st.st_dev, st.st_ino)];
+	while (entry != NULL &&
+		(entry->dev != st.st_dev || entry->ino != st.st_ino))
+		entry = entry->hash_next;
+
+	if (entry != NULL) {
+		if (same_version(entry, &st)) {
+			entry->refcount++;
+			lru_unlink(entry);
+			lru_push(entry);
+			hits++;
+			pthread_mutex_unlock(&file_cache_lock);
+			return (entry);
+		}
+		// The file changed, so the mapping is stale
+		file_cache_remove(entry);
+	}
+	if (max_bytes > 0)
+		misses++;
+	pthread_mutex_unlock(&file_cache_lock);
+
+	entry = calloc(1, sizeof (file_entry_t));
+	if (entry == NULL)
+		return (NULL);
+	entry->fd = openat(dir_fd, name, O_RDONLY);
+	// The name may have been replaced since we looked it up
+	if (entry->fd < 0 || fstat(entry->fd, &st) < 0 ||
+		!S_ISREG(st.st_mode)) {
+		if (entry->fd >= 0)
+			close(entry->fd);
+		free(entry);
+		return (NULL);
+	}
+	entry->dev = st.st_dev;
+	entry->ino = st.st_ino;
+	entry->mtime = st.st_mtim;
+	entry->size = st.st_size;
+	entry->refcount = 1;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	long long age_ns = (long long)(now.tv_sec - st.st_mtim.tv_sec) *
+		1000000000LL + (now.tv_nsec - st.st_mtim.tv_nsec);
+
+	// Files too young, too large or empty are only sent this once
+	if (age_ns < FILE_CACHE_RACY_NS || st.st_size == 0 ||
+		(size_t)st.st_size > max_bytes / FILE_CACHE_MAX_FILE_SHARE)
+		return (entry);
+
+	pthread_mutex_lock(&file_cache_lock);
+	file_cache_insert(entry);
+	pthread_mutex_unlock(&file_cache_lock);
+
+	return (entry);
+}
+
+/*
+ * Map a cached file on first use; sessions racing to map the
+ * same file keep whichever mapping was installed first
+ */
+static char *
+file_cache_map(file_entry_t * entry) {
+
+	char * map = __atomic_load_n(&entry->map, __ATOMIC_ACQUIRE);
+	if (map != NULL)
+		return (map);
+
+	map = mmap(NULL, entry->size, PROT_READ, MAP_SHARED, entry->fd, 0);
+	if (map == MAP_FAILED)
+		return (NULL);
+
+	char * expected = NULL;
+	if (!__atomic_compare_exchange_n(&entry->map, &expected, map, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		munmap(map, entry->size);
+		map = expected;
+	}
+
+	return (map);
+}
+
+void
+file_cache_release(file_entry_t * entry) {
+
+	pthread_mutex_lock(&file_cache_lock);
+	int last = --entry->refcount == 0;
+	pthread_mutex_unlock(&file_cache_lock);
+
+	if (last)
+		file_entry_free(entry);
+}
+
+/*
+ * Binary transfers go out with sendfile from the cached
+ * descriptor, at explicit offsets since the descriptor is
+ * shared; ASCII transfers are converted straight from the
+ * mapping. A file truncated while it is read from the mapping
+ * makes the read fault, which fails the transfer.
+ */
+off_t
+file_cache_send(file_entry_t * entry, int data_fd, int binary_flag,
+	off_t offset) {
+
+	off_t start = offset;
+	char * volatile out = NULL;
+	sigjmp_buf jump;
+
+	/*
+	 * The handler is left by a jump, so SIGBUS stays blocked
+	 * unless the mask is saved and restored with it; a second
+	 * fault on this thread would then kill the server
+	 */
+	if (sigsetjmp(jump, 1)) {
+		sigbus_jump = NULL;
+		buffer_pool_put(out);
+		errno = EIO;
+		return (-1);
+	}
+
+	if (binary_flag) {
+		// The io_uring backend also reads at explicit offsets
+		off_t nsent = uring_send_file(entry->fd, data_fd, offset);
+		if (nsent >= 0) {
+			__atomic_fetch_add(&served_bytes, nsent, __ATOMIC_RELAXED);
+			return (nsent);
+		}
+		if (errno != ENOSYS)
+			return (-1);
+
+		int fallback = 1;
+#ifdef __linux__
+		fallback = 0;
+		while (offset < entry->size) {
+			ssize_t nchunk = sendfile(data_fd, entry->fd, &offset,
+				SENDFILE_CHUNK_SIZE);
+			if (nchunk < 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				// Copy from the mapping instead
+				if ((errno == EINVAL || errno == ENOSYS) &&
+					offset == start) {
+					fallback = 1;
+					break;
+				}
+				return (-1);
+			}
+			// The file was truncated
+			if (nchunk == 0)
+				break;
+		}
+#endif
+		if (fallback) {
+			const char * map = file_cache_map(entry);
+			if (map == NULL)
+				return (-1);
+			sigbus_jump = &jump;
+			int err = write_all(data_fd, map + offset,
+				entry->size - offset);
+			sigbus_jump = NULL;
+			if (err < 0)
+				return (-1);
+			offset = entry->size;
+		}
+	}
+	else {
+		const char * map = file_cache_map(entry);
+		out = buffer_pool_get();
+		if (map == NULL || out == NULL) {
+			buffer_pool_put(out);
+			return (-1);
+		}
+
+		crlf_state_t state;
+		crlf_init(&state);
+		sigbus_jump = &jump;
+		while (offset < entry->size) {
+			size_t len = entry->size - offset < CRLF_BLOCK_SIZE ?
+				entry->size - offset : CRLF_BLOCK_SIZE;
+			size_t nout = crlf_expand(&state, map + offset, len, out);
+			if (write_all(data_fd, out, nout) < 0)
+				break;
+			offset += len;
+		}
+		sigbus_jump = NULL;
+		buffer_pool_put(out);
+		if (offset < entry->size)
+			return (-1);
+	}
+
+	__atomic_fetch_add(&served_bytes, offset - start, __ATOMIC_RELAXED);
+	return (offset - start);
+}
+
+void
+file_cache_stats(file_cache_stats_t * stats) {
+
+	pthread_mutex_lock(&file_cache_lock);
+	stats->files = cached_files;
+	stats->bytes = cached_bytes;
+	stats->hits = hits;
+	stats->misses = misses;
+	stats->evictions = evictions;
+	pthread_mutex_unlock(&file_cache_lock);
+	stats->served_bytes = __atomic_load_n(&served_bytes, __ATOMIC_RELAXED);
+}
+
+void
+file_cache_report(FILE * out) {
+
+	file_cache_stats_t stats;
+	file_cache_stats(&stats);
+
+	unsigned long lookups = stats.hits + stats.misses;
+	fprintf(out, "File cache: %lu files, %zu of %zu bytes, "
+		"%lu hits, %lu misses (%.1f%% hit rate), %lu evictions, "
+		"%llu bytes served\n",
+		stats.files, stats.bytes, max_bytes, stats.hits, stats.misses,
+		lookups ? 100.0 * stats.hits / lookups : 0.0, stats.evictions,
+		stats.served_bytes);
+	fflush(out);
+}
@@ -1,28 +1,106 @@
 #include "ftp_functions.h"
+#include "event_loop.h"
+#include "worker_pool.h"
+#include "admission.h"
+#include "uring.h"
+#include "pasv_pool.h"
+#include "list_cache.h"
+#include "file_cache.h"
+#include "buffer_pool.h"
+#include "mlsx.h"
+#include "crlf.h"
+#include "zmode.h"
+#include "archive.h"
+#include "log.h"
+#include "metrics.h"
+#include "reply.h"
 #include "utils.h"
 
 
-static const command_matcher_t commands[] =
-{ {"USER", USER_HANDLER},
-	{"PASS", PASS_HANDLER},
-	{"SYST", SYST_HANDLER},
-	{"FEAT", FEAT_HANDLER},
-	{"PWD", PWD_HANDLER},
-	{"PASV", PASV_EPSV_HANDLER},
-	{"EPSV", PASV_EPSV_HANDLER},
-	{"CWD", CWD_HANDLER},
-	{"PORT", PORT_EPRT_HANDLER},
-	{"TYPE", TYPE_HANDLER},
-	{"LIST", LIST_HANDLER},
-	{"EPRT", PORT_EPRT_HANDLER},
-	{"RETR", RETR_HANDLER},
-	{"STOR", STOR_HANDLER},
-	{"APPE", APPE_HANDLER},
-	{"RMD", RMD_HANDLER},
-	{"MKD", MKD_HANDLER},
-	{"QUIT", QUIT_HANDLER},
+/*
+ * Commands are looked up in a perfect hash table. A verb of up
+ * to four letters is packed into an integer, one byte per letter,
+ * and multiplied by a constant picked so that every verb of RFC
+ * 959, 2428 and 3659 lands in a slot of its own; a standard
+ * verb can be added without choosing a new constant.
+ */
+#define	COMMAND_KEY(a, b, c, d) \
+	((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | \
+	(uint32_t)(c) << 8 | (uint32_t)(d))
+#define	COMMAND_HASH_BITS 7
+#define	COMMAND_HASH_MULTIPLIER 0x76e4f7efU
+#define	COMMAND_SLOT(key) \
+	((uint32_t)((key) * COMMAND_HASH_MULTIPLIER) >> (32 - COMMAND_HASH_BITS))
+#define	COMMAND(a, b, c, d, name, handler) \
+	[COMMAND_SLOT(COMMAND_KEY(a, b, c, d))] = \
+	{ COMMAND_KEY(a, b, c, d), #name, handler, VERB_##name }
+
+static const command_matcher_t commands[1 << COMMAND_HASH_BITS] =
+{ COMMAND('U', 'S', 'E', 'R', USER, USER_HANDLER),
+	COMMAND('P', 'A', 'S', 'S', PASS, PASS_HANDLER),
+	COMMAND('S', 'Y', 'S', 'T', SYST, SYST_HANDLER),
+	COMMAND('F', 'E', 'A', 'T', FEAT, FEAT_HANDLER),
+	COMMAND(0, 'P', 'W', 'D', PWD, PWD_HANDLER),
+	COMMAND('P', 'A', 'S', 'V', PASV, PASV_EPSV_HANDLER),
+	COMMAND('E', 'P', 'S', 'V', EPSV, PASV_EPSV_HANDLER),
+	COMMAND(0, 'C', 'W', 'D', CWD, CWD_HANDLER),
+	COMMAND('P', 'O', 'R', 'T', PORT, PORT_EPRT_HANDLER),
+	COMMAND('T', 'Y', 'P', 'E', TYPE, TYPE_HANDLER),
+	COMMAND('L', 'I', 'S', 'T', LIST, LIST_HANDLER),
+	COMMAND('E', 'P', 'R', 'T', EPRT, PORT_EPRT_HANDLER),
+	COMMAND('R', 'E', 'T', 'R', RETR, RETR_HANDLER),
+	COMMAND('S', 'T', 'O', 'R', STOR, STOR_HANDLER),
+	COMMAND('A', 'P', 'P', 'E', APPE, APPE_HANDLER),
+	COMMAND(0, 'R', 'M', 'D', RMD, RMD_HANDLER),
+	COMMAND(0, 'M', 'K', 'D', MKD, MKD_HANDLER),
+	COMMAND('R', 'E', 'S', 'T', REST, REST_HANDLER),
+	COMMAND('M', 'L', 'S', 'D', MLSD, MLSD_HANDLER),
+	COMMAND('M', 'L', 'S', 'T', MLST, MLST_HANDLER),
+	COMMAND('S', 'T', 'A', 'T', STAT, STAT_HANDLER),
+	COMMAND('Q', 'U', 'I', 'T', QUIT, QUIT_HANDLER),
+	COMMAND('M', 'O', 'D', 'E', MODE, MODE_HANDLER),
+	COMMAND('O', 'P', 'T', 'S', OPTS, OPTS_HANDLER),
+	COMMAND('S', 'I', 'T', 'E', SITE, SITE_HANDLER),
 };
 
+// Directory new sessions start in, and its absolute path
+static int session_root_fd = -1;
+static char session_root_path[PATH_MAX];
+static session_timeouts_t session_timeouts = {
+	DEFAULT_IDLE_TIMEOUT_S, DEFAULT_DATA_CONNECTION_TIMEOUT_S,
+	DEFAULT_STALL_TIMEOUT_S, DEFAULT_MIN_TRANSFER_RATE
+};
+static int compression_level = DEFAULT_COMPRESSION_LEVEL;
+
+/*
+ * Look a command up in the table; NULL if the
+ * server does not know it
+ */
+static const command_matcher_t *
+find_command(const char * command) {
+
+	uint32_t key = 0;
+	int len;
+
+	// Pack the verb, folding it to upper case on the way
+	for (len = 0; command[len] != '\0'; len++) {
+		if (len == 4)
+			return (NULL);
+		key = key << 8 |
+			(unsigned char)toupper((unsigned char)command[len]);
+	}
+
+	/*
+	 * Every slot holds at most one verb, so a single
+	 * comparison tells whether this is the one
+	 */
+	const command_matcher_t * match = &commands[COMMAND_SLOT(key)];
+	if (len > 0 && match->handler != NULL && match->key == key)
+		return (match);
+
+	return (NULL);
+}
+
 /*
  * Returns the appropriate handler
  * for a certain
@@ -31,229 +109,749 @@ static const command_matcher_t commands[] =
 void
 (*get_handler(char * command))(client_context_t *)
 {
+	const command_matcher_t * match = find_command(command);
+	if (match != NULL)
+		return (match->handler);
+
+	// Case where no handler was found for the command.
+	return (OTHER_HANDLER);
+}
+
+// Name of a command, as used in reports
+const char *
+verb_name(verb_t verb) {
+
+	for (int i = 0; i < (sizeof (commands)/ sizeof (commands[0])); i++) {
+		if (commands[i].handler != NULL && commands[i].verb == verb)
+			return (commands[i].command);
+	}
+
+	return ("other");
+}
+
+/*
+ * FTP_Thread - the core business logic that
+ * processes FTP commands
+ * and executes them.
+ */
+void *
+ftp_thread(void * args) {
+	worker_pool_t * pool = args;
+	job_t client;
+
 	/*
-	 * Go through the handlers and return the appropriate one
+	 * First the thread tries to retrieve a job from the job
+	 * queue; it retires once the pool no longer needs it
 	 */
-	for (int i = 0; i < (sizeof (commands)/ sizeof (commands[0])); i++) {
+	while (worker_pool_next_job(pool, &client) == 0) {
 
-		if (!(strcmp(command, commands[i].command)))
-			return (commands[i].handler);
+		if (client.fd < 0)
+			continue;
 
+		/*
+		 * A job without a session is a freshly accepted
+		 * connection; otherwise the client has sent us
+		 * a new command on an existing session.
+		 */
+		if (client.session == NULL)
+			start_session(client.fd, client.client_addr, pool);
+		else
+			process_session(client.session);
+
+		/*
+		 * Thread will continue to wait for further
+		 * client connections to process
+		 */
 	}
 
-	// Case where no handler was found for the command.
-	return (OTHER_HANDLER);
+	return (NULL);
 }
 
 /*
- * Initlialize mutexes,
- * conditional variables,
- * and job queue
+ * Opens the directory every new session starts in. Each
+ * session then keeps a descriptor of its own working
+ * directory, so no thread ever changes the working
+ * directory of the whole process.
  */
 int
-init() {
-	int err;
-	available_jobs = 0;
-
-	job_queue_lock = calloc(1, sizeof (pthread_mutex_t));
-	if (job_queue_lock == NULL)
-		error("Error on allocaitng job queue lock\n");
-	err = pthread_mutex_init(job_queue_lock, NULL);
-	if (err != 0)
-		error("Error on initializing job queue mutex\n");
-
-	job_available = calloc(1, sizeof (pthread_cond_t));
-	if (job_available == NULL)
-		error("Error on allocating job available condition!\n");
-	err = pthread_cond_init(job_available, NULL);
-	if (err != 0)
-		error("Error on initializing job_available condition\n");
-
-	head = calloc(1, sizeof (struct job));
-	if (head == NULL)
-		error("Error on allocating job queue\n");
+set_session_root(const char * path) {
+
+	int fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return (-1);
+
+	if (realpath(path, session_root_path) == NULL) {
+		close(fd);
+		return (-1);
+	}
 
+	session_root_fd = fd;
 	return (0);
 }
 
+void
+set_session_timeouts(const session_timeouts_t * timeouts) {
+
+	session_timeouts = *timeouts;
+}
+
+const session_timeouts_t *
+get_session_timeouts() {
+
+	return (&session_timeouts);
+}
+
+void
+set_compression_level(int level) {
+
+	compression_level = level;
+}
+
+// How long to wait for a data connection, -1 for as long as it takes
+static int
+data_connection_timeout_ms() {
+
+	return (session_timeouts.data_connection_s == 0 ? -1 :
+		(int)session_timeouts.data_connection_s * 1000);
+}
+
 /*
- * FTP_Thread - the core business logic that
- * processes FTP commands
- * and executes them.
+ * Work out the path of the directory a CWD leads to, without
+ * touching the file system: '.' and empty components are
+ * dropped and '..' removes the last component. Returns -1 if
+ * the result does not fit in a path buffer.
  */
-void *
-ftp_thread(void * args) {
-	int err;
-	// First the thread tries to retrieve a job from the job queue
-	while (1) {
-		// Lock the job queue
-		err = pthread_mutex_lock(job_queue_lock);
+static int
+resolve_virtual_path(char * resolved, const char * cwd, const char * arg) {
+
+	char path[PATH_MAX];
+	size_t len = 0;
+
+	if (arg[0] != '/') {
+		len = strlen(cwd);
+		memcpy(path, cwd, len);
+		// The root is the only path that ends with a slash
+		if (len == 1)
+			len = 0;
+	}
+
+	const char * component = arg;
+	while (*component != '\0') {
+
+		size_t n = strcspn(component, "/");
+
+		if (n == 2 && component[0] == '.' && component[1] == '.') {
+			while (len > 0 && path[len - 1] != '/')
+				len--;
+			if (len > 0)
+				len--;
+		}
+		else if (n > 0 && !(n == 1 && component[0] == '.')) {
+			if (len + n + 2 > PATH_MAX)
+				return (-1);
+			path[len++] = '/';
+			memcpy(path + len, component, n);
+			len += n;
+		}
+
+		component += n;
+		if (*component == '/')
+			component++;
+	}
+
+	if (len == 0)
+		path[len++] = '/';
+	path[len] = '\0';
+	memcpy(resolved, path, len + 1);
+
+	return (0);
+}
+
+/*
+ * Creates the context for a newly accepted client,
+ * sends the welcome message and passes the session
+ * to an event loop until the client sends a command
+ */
+void
+start_session(int fd, struct sockaddr_storage client_addr,
+	worker_pool_t * pool) {
+	/*
+	 * Keep a context structure to hold the current
+	 * state of the communication with the client.
+	 * It lives for as long as the control connection.
+	 */
+	client_context_t * current_context =
+		calloc(1, sizeof (client_context_t));
+	if (current_context == NULL)
+		error("Error on allocating client context\n");
+
+	current_context->client_comm_fd = fd;
+	current_context->pool = pool;
+	/*
+	 * Keep a boolean that indicates whether the client is currently
+	 * communicating via active or passive FTP.
+	 * Default is active mode.
+	 */
+	current_context->active_flag = 1;
+	/*
+	 * Keep track of whether the client has requested ASCII
+	 * file transfer or binary file transfer. At the beginning,
+	 * we start with ASCII file transfer mode.
+	 */
+	current_context->binary_flag = 0;
+	/*
+	 * Transfers go in stream mode until the client asks for
+	 * MODE Z, with the server's compression level
+	 */
+	current_context->compress_flag = 0;
+	current_context->compression_level = compression_level;
+	// Port to listen for connections in passive mode.
+	current_context->data_port = -1;
+	// File descriptor for passive mode listening.
+	current_context->data_fd = -1;
+	// No data connection is being watched for stalls
+	current_context->watched_fd = -1;
+
+	/*
+	 * Every session starts in the server's root directory,
+	 * held open so that paths resolve relative to it
+	 */
+	current_context->cwd_fd = openat(session_root_fd, ".",
+		O_RDONLY | O_DIRECTORY);
+	if (current_context->cwd_fd < 0) {
+		log_warn("Error on opening the session's directory: %s",
+			strerror(errno));
+		admission_release(&client_addr);
+		close(fd);
+		free(current_context);
+		return;
+	}
+	strcpy(current_context->current_working_directory, session_root_path);
+	metrics_count(METRIC_SESSIONS_OPENED, 1);
+
+	arena_init(&current_context->arena, current_context->arena_block,
+		SESSION_ARENA_SIZE);
+	current_context->client_addr = client_addr;
+	/*
+	 * File descriptor for 'accept'ing
+	 * client connection
+	 * in passive mode.
+	 */
+	current_context->client_data_fd = 0;
+
+	/*
+	 * Replies are gathered and written whole, so Nagle's
+	 * algorithm has nothing left to merge; it would only hold
+	 * the 226 of a transfer back until the client acknowledged
+	 * the 150 before it
+	 */
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+	/*
+	 * A client that stops reading its replies would hold the
+	 * worker writing them; give it as long as it has to set up
+	 * a data connection, after which the write fails and the
+	 * session is closed
+	 */
+	struct timeval send_timeout = { session_timeouts.data_connection_s, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+		sizeof (send_timeout));
+
+	// Send a welcome message to the client
+	reply_queue(current_context, REPLY_SERVICE_READY);
+	if (reply_flush(current_context) < 0) {
+		end_session(current_context);
+		return;
+	}
+
+	// Wait for the client's commands in one of the event loops
+	if (event_loop_register(current_context) < 0)
+		error("Error on registering client with the event loop\n");
+}
+
+/*
+ * Runs a single command line, which has had its line
+ * ending stripped. The verb is tokenized in place and
+ * the handlers pick up its arguments from the same buffer.
+ * The command is timed from *clock, which is then moved to
+ * its end, so that pipelined commands read the clock once each.
+ */
+static void
+execute_command(client_context_t * current_context, char * line,
+	unsigned long long * clock) {
+
+	char * command = strtok_r(line, " ", &current_context->token_state);
+	if (command == NULL)
+		command = line;
+
+	// Verbs are case-insensitive, so go on with the canonical form
+	for (char * c = command; *c != '\0'; c++)
+		*c = toupper((unsigned char)*c);
+
+	log_debug("Client input: %s", command);
+
+	current_context->input_command = command;
+	const command_matcher_t * match = find_command(command);
+	verb_t verb = match != NULL ? match->verb : VERB_OTHER;
+
+	// PASV and EPSV, and PORT and EPRT, share a handler
+	switch (verb) {
+		case VERB_PASV:
+			current_context->PASV_EPSV_FLAG = 0;
+			break;
+		case VERB_EPSV:
+			current_context->PASV_EPSV_FLAG = 1;
+			break;
+		case VERB_PORT:
+			current_context->PORT_EPRT_FLAG = 0;
+			break;
+		case VERB_EPRT:
+			current_context->PORT_EPRT_FLAG = 1;
+			break;
+		default:
+			break;
+	}
+
+	if (match != NULL)
+		match->handler(current_context);
+	else
+		OTHER_HANDLER(current_context);
+
+	// Whatever the command allocated is done with
+	arena_reset(&current_context->arena);
+
+	if (metrics_enabled()) {
+		unsigned long long now = get_time_ns();
+		metrics_record_command(verb, now - *clock);
+		*clock = now;
+	}
+}
+
+/*
+ * Executes every complete command line in the session's buffer
+ * once nread more bytes were read into it. A read may end in
+ * the middle of a line, or hold several lines from a client
+ * that pipelines its commands, so the bytes after the last
+ * line ending are kept at the start of the buffer.
+ */
+void
+execute_commands(client_context_t * current_context, size_t nread) {
+
+	char * buf_ptr = current_context->command_buffer;
+	char * line = buf_ptr;
+	char * end = buf_ptr + current_context->command_len + nread;
+	char * eol;
+	unsigned long long clock = metrics_enabled() ? get_time_ns() : 0;
+
+	while (current_context->state != SESSION_CLOSED &&
+		(eol = memchr(line, '\n', end - line)) != NULL) {
+
+		char * next = eol + 1;
 
-		if (err != 0) {
-			error("Error on locking job queue thread\n");
+		// The tail of an overlong line is dropped along with it
+		if (current_context->command_overflow) {
+			current_context->command_overflow = 0;
+			line = next;
+			continue;
 		}
 
-		// Wait while there are no jobs available
-		while (available_jobs == 0) {
-			pthread_cond_wait(job_available, job_queue_lock);
+		if (eol > line && eol[-1] == '\r')
+			eol--;
+		*eol = '\0';
+
+		// Blank lines are not commands
+		if (eol > line)
+			execute_command(current_context, line, &clock);
+		line = next;
+	}
+
+	// Keep the partial line at the start of the buffer
+	size_t len = end - line;
+	if (current_context->command_overflow) {
+		len = 0;
+	}
+	else if (len == COMMAND_BUFFER_SIZE) {
+		reply_queue(current_context, REPLY_LINE_TOO_LONG);
+		current_context->command_overflow = 1;
+		len = 0;
+	}
+	memmove(buf_ptr, line, len);
+	current_context->command_len = len;
+
+	// The replies to the whole batch of commands leave together
+	reply_flush(current_context);
+}
+
+/*
+ * Reads whatever the client has sent on a readable control
+ * connection and executes every complete command line in it.
+ * The session is then handed back to its event loop.
+ */
+void
+process_session(client_context_t * current_context) {
+
+	char * buf_ptr = current_context->command_buffer;
+	size_t len = current_context->command_len;
+
+	/*
+	 * The event loop only queues readable sessions, so
+	 * the read will not block; a spurious wakeup simply
+	 * puts the session back to sleep.
+	 */
+	ssize_t nread = recv(current_context->client_comm_fd, buf_ptr + len,
+		COMMAND_BUFFER_SIZE - len, MSG_DONTWAIT);
+	if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		if (event_loop_rearm(current_context) < 0)
+			end_session(current_context);
+		return;
+	}
+
+	/*
+	 * Client has either closed his/her side of
+	 * the connection or we encountered a
+	 * connection failure, therefore we close the connection
+	 */
+	if (nread <= 0) {
+		end_session(current_context);
+		return;
+	}
+
+	execute_commands(current_context, nread);
+
+	if (current_context->state == SESSION_CLOSED ||
+		event_loop_rearm(current_context) < 0)
+		end_session(current_context);
+}
+
+/*
+ * Closes the control connection of a session
+ * and deallocates its context
+ */
+void
+end_session(client_context_t * current_context) {
+
+	event_loop_unregister(current_context);
+	release_passive_listener(current_context);
+	close(current_context->client_comm_fd);
+
+	log_debug("Client connection stopped or failed!");
+	metrics_count(METRIC_SESSIONS_CLOSED, 1);
+	admission_release(&current_context->client_addr);
+
+	close(current_context->cwd_fd);
+
+	// Deallocate certain buffers
+	zmode_destroy(current_context->zmode);
+	arena_reset(&current_context->arena);
+	free(current_context);
+}
+
+/*
+ * Compare the hosts of two socket addresses, treating
+ * IPv4-mapped IPv6 addresses as the IPv4 addresses they carry
+ */
+static int
+same_host(struct sockaddr_storage * a, struct sockaddr_storage * b) {
+
+	struct in6_addr a6, b6;
+	struct sockaddr_storage * addrs[2] = { a, b };
+	struct in6_addr * hosts[2] = { &a6, &b6 };
+
+	for (int i = 0; i < 2; i++) {
+		if (addrs[i]->ss_family == AF_INET6) {
+			*hosts[i] = ((struct sockaddr_in6 *)addrs[i])->sin6_addr;
+		}
+		else if (addrs[i]->ss_family == AF_INET) {
+			memset(hosts[i], 0, sizeof (struct in6_addr));
+			hosts[i]->s6_addr[10] = 0xff;
+			hosts[i]->s6_addr[11] = 0xff;
+			memcpy(&hosts[i]->s6_addr[12],
+				&((struct sockaddr_in *)addrs[i])->sin_addr, 4);
 		}
+		else
+			return (0);
+	}
 
-		// Dequeue the latest job and process
-		job_t client = dequeue(head);
+	return (memcmp(&a6, &b6, sizeof (struct in6_addr)) == 0);
+}
 
-		// Decrement the number of jobs available
-		available_jobs--;
+/*
+ * Accept the client's data connection on the passive
+ * mode listening socket of the session. Connections coming
+ * from any host other than the one on the control connection
+ * are dropped, so that nobody can steal a transfer by racing
+ * the client to a port of the passive range.
+ */
+int
+accept_data_connection(client_context_t * current_context) {
+
+	struct sockaddr_storage peer;
+	socklen_t peer_len = (socklen_t)sizeof (struct sockaddr_storage);
+	if (getpeername(current_context->client_comm_fd,
+		(struct sockaddr *)&peer, &peer_len) < 0)
+		return (-1);
+
+	struct pollfd pfd = { .fd = current_context->data_fd, .events = POLLIN };
 
-		// Unlock the job queue and continue processing
-		err = pthread_mutex_unlock(job_queue_lock);
-		if (err != 0) {
-			error("Error unlocking job queue\n");
+	for (;;) {
+
+		int ready = poll(&pfd, 1, data_connection_timeout_ms());
+		if (ready < 0 && errno == EINTR)
+			continue;
+		if (ready <= 0) {
+			if (ready == 0)
+				errno = ETIMEDOUT;
+			return (-1);
 		}
 
-		/*
-		 * Where the actual FTP processing takes place. We
-		 * process client commands and
-		 * respond with appropriate server actions.
-		 */
+		struct sockaddr_storage temp;
+		socklen_t len = (socklen_t)sizeof (struct sockaddr_storage);
 
-		/*
-		 * Keep a context structure to hold the current
-		 * state of the communication with the client
-		 */
-		client_context_t current_context;
-		current_context.client_comm_fd = client.fd;
-		/*
-		 * Keep a boolean that indicates whether the client is currently
-		 * communicating via active or passive FTP.
-		 * Default is active mode.
-		 */
-		current_context.active_flag = 1;
-		/*
-		 * Keep track of whether the client has requested ASCII
-		 * file transfer or binary file transfer. At the beginning,
-		 * we start with ASCII file transfer mode.
-		 */
-		current_context.binary_flag = 0;
-		// Port to listen for connections in passive mode.
-		current_context.data_port = -1;
-		// File descriptor for passive mode listening.
-		current_context.data_fd = -1;
+		int fd = uring_accept(current_context->data_fd,
+			(struct sockaddr *)&temp, &len);
+		if (fd < 0 && errno == ENOSYS)
+			fd = accept(current_context->data_fd,
+				(struct sockaddr *)&temp, &len);
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+				errno == ECONNABORTED || errno == EINTR)
+				continue;
+			return (-1);
+		}
 
-		/*
-		 * A variable to keep track of the program's
-		 * current working directory
-		 */
-		char * new_path = calloc(strlen(getenv("PWD"))+1, 1);
-		strcat(new_path, getenv("PWD"));
-		strcat(new_path, "/");
+		if (same_host(&temp, &peer)) {
+			// The transfer itself uses blocking I/O
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+			return (fd);
+		}
 
-		current_context.current_working_directory = new_path;
-		current_context.PORT = NULL;
-		current_context.client_addr = client.client_addr;
-		/*
-		 * File descriptor for 'accept'ing
-		 * client connection
-		 * in passive mode.
-		 */
-		current_context.client_data_fd = 0;
-
-		ssize_t nwrite, nread;
-		// Send a welcome message to the client
-		nwrite = write(current_context.client_comm_fd,
-			"220 CoolFTPServer\r\n",
-			strlen("200 CoolFTPServer\r\n"));
-		if (nwrite < 0)
-			error("Error on writing initial \
-				connection success status to \
-				client\n");
-
-		// Initialize connection buffer
-		char buf[4096];
-		char * buf_ptr = buf;
-		memset(buf_ptr, 0, sizeof (buf));
+		log_warn("Rejected data connection from a foreign host");
+		close(fd);
+	}
+}
 
-		/*
-		 * While the client is sending us a message,
-		 * process the message.
-		 */
-		while ((nread = read(client.fd, buf_ptr, sizeof (buf))) > 0) {
-			/*
-			 * Remove extraneous characters
-			 * that don't
-			 * affect the actual command
-			 */
-			int degenerate = 1;
-			for (int i = 0; i < sizeof (buf); i++) {
-				if (buf[i] != '\r')
-					degenerate = 0;
-			}
+/*
+ * Give the session's passive mode listening socket back to
+ * the port range pool, or close it if it was bound just for
+ * this session
+ */
+void
+release_passive_listener(client_context_t * current_context) {
 
-			if (degenerate)
-				error("Error: client sent \
-				degenerate message\n");
+	if (current_context->pasv_listener != NULL) {
+		pasv_pool_return(current_context->pasv_listener);
+		current_context->pasv_listener = NULL;
+	}
+	else if (current_context->active_flag == 0 &&
+		current_context->data_fd >= 0)
+		close(current_context->data_fd);
 
-			buf[strcspn(buf_ptr, "\r\n")] = 0;
-			// Obtain the command name
-			char * command = strtok(buf_ptr, " ");
+	current_context->data_fd = -1;
+}
 
-			print_debug("Client input: ");
-			print_debug(command);
-			print_debug("\n");
+/*
+ * Tell the client that its passive mode data connection
+ * never arrived, and give up the listening socket
+ */
+static void
+data_connection_failed(client_context_t * current_context) {
 
-			current_context.input_command = command;
-			if (!strcmp(command,"PORT"))
-				current_context.PASV_EPSV_FLAG = 0;
-			if (!strcmp(command,"EPSV"))
-				current_context.PASV_EPSV_FLAG = 1;
-			if (!strcmp(command,"PORT"))
-				current_context.PORT_EPRT_FLAG = 0;
-			if (!strcmp(command,"EPRT"))
-				current_context.PORT_EPRT_FLAG = 1;
+	log_debug("Error on accepting passive client connection: %s",
+		strerror(errno));
+	reply_queue(current_context, REPLY_CANT_OPEN_DATA);
+	release_passive_listener(current_context);
+}
 
-			void (*handler)(client_context_t * current_context) =
-				get_handler(command);
-			handler(&current_context);
+/*
+ * Announce a transfer with a 150 reply. It is written out at
+ * once, with anything queued before it, since the client may
+ * wait for it before taking the data; returns -1 if the
+ * client is gone.
+ */
+static int
+announce_transfer(client_context_t * current_context, reply_id_t reply) {
 
-			/*
-			 * Reset the buffer to receive the
-			 * next command,
-			 * removing any residual characters
-			 */
-			memset(buf_ptr, 0, sizeof (buf));
+	reply_queue(current_context, reply);
+	return (reply_flush(current_context));
+}
+
+/*
+ * Set up the data connection of a transfer: accept the
+ * client's connection in passive mode, or connect to the
+ * address given with PORT in active mode, and announce the
+ * transfer with the given 150 reply. Returns the connected
+ * socket, or -1 once the client has been told.
+ */
+static int
+open_data_connection(client_context_t * current_context, reply_id_t reply) {
+
+	int fd;
+
+	if (!current_context->active_flag) {
+		fd = accept_data_connection(current_context);
+		if (fd < 0) {
+			data_connection_failed(current_context);
+			return (-1);
 		}
+	}
+	else {
+		char hoststr[NI_MAXHOST];
+		char portstr[NI_MAXSERV];
+
+		fd = -1;
+		if (current_context->PORT[0] != '\0' && getnameinfo(
+			(struct sockaddr *)&(current_context->client_addr),
+			sizeof (struct sockaddr_storage), hoststr, sizeof (hoststr),
+			portstr, sizeof (portstr),
+			NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+			fd = get_active_client_connection(hoststr,
+				current_context->PORT,
+				data_connection_timeout_ms());
+
+		if (fd < 0) {
+			reply_queue(current_context, REPLY_CANT_OPEN_DATA);
+			return (-1);
+		}
+	}
+
+	if (announce_transfer(current_context, reply) < 0) {
+		close(fd);
+		if (!current_context->active_flag)
+			release_passive_listener(current_context);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/*
+ * Close the data connection of a finished transfer; in
+ * passive mode the listener goes back to the pool as well
+ */
+static void
+close_data_connection(client_context_t * current_context, int fd) {
+
+	close(fd);
+	if (!current_context->active_flag)
+		release_passive_listener(current_context);
+}
+
+/*
+ * Run the data phase of a RETR, recording the bytes
+ * sent and the time taken; returns 0 or -1
+ */
+static int
+metered_RETR(client_context_t * current_context, file_entry_t * file,
+	int data_fd, int binary_flag, off_t offset) {
+
+	unsigned long long start = get_time_ns();
+	event_loop_watch_transfer(current_context, data_fd);
+	/*
+	 * Cached files are shared, so they are sent at explicit
+	 * offsets; so are compressed files, cached or not
+	 */
+	off_t nsent = current_context->compress_flag ?
+		zmode_send_file(current_context->zmode,
+		current_context->compression_level, file->fd, data_fd,
+		binary_flag, offset) :
+		file->shared ?
+		file_cache_send(file, data_fd, binary_flag, offset) :
+		RETR(file->fd, data_fd, binary_flag, offset);
+	event_loop_unwatch_transfer(current_context);
+	metrics_record(METRIC_RETR_TRANSFER, get_time_ns() - start);
+
+	if (nsent < 0) {
+		metrics_count(METRIC_TRANSFER_ERRORS, 1);
+		return (-1);
+	}
+	metrics_count(METRIC_RETR_BYTES, nsent);
+	return (0);
+}
+
+// Run the data phase of a STOR or APPE, like metered_RETR
+static int
+metered_STOR(client_context_t * current_context, int file_fd, int data_fd,
+	int binary_flag, off_t offset) {
+
+	unsigned long long start = get_time_ns();
+	event_loop_watch_transfer(current_context, data_fd);
+	off_t nstored = current_context->compress_flag ?
+		zmode_recv_file(current_context->zmode, data_fd, file_fd,
+		binary_flag, offset) :
+		STOR(file_fd, data_fd, binary_flag, offset);
+	event_loop_unwatch_transfer(current_context);
+	metrics_record(METRIC_STOR_TRANSFER, get_time_ns() - start);
+
+	if (nstored < 0) {
+		metrics_count(METRIC_TRANSFER_ERRORS, 1);
+		return (-1);
+	}
+	metrics_count(METRIC_STOR_BYTES, nstored);
+	return (0);
+}
+
+// Send a rendered LIST, recording the bytes sent and the time taken
+static ssize_t
+metered_send_listing(client_context_t * current_context, int data_fd,
+	const char * buffer, size_t len) {
+
+	unsigned long long start = get_time_ns();
+	event_loop_watch_transfer(current_context, data_fd);
+	ssize_t nwrite = current_context->compress_flag ?
+		zmode_send_buffer(current_context->zmode,
+		current_context->compression_level, data_fd, buffer, len) :
+		send_data(data_fd, buffer, len);
+	event_loop_unwatch_transfer(current_context);
+	metrics_record(METRIC_LIST_TRANSFER, get_time_ns() - start);
+
+	if (nwrite < 0)
+		metrics_count(METRIC_TRANSFER_ERRORS, 1);
+	else
+		metrics_count(METRIC_LIST_BYTES, nwrite);
+	return (nwrite);
+}
 
-		/*
-		 * Client has either closed his/her side of
-		 * the connection or we encountered a
-		 * connection failure, therefore we close the connection
-		 */
-		close(client.fd);
+/*
+ * Queue the reply to a finished transfer: a 426 if its event
+ * loop cut it off for stalling, which a receiving transfer
+ * sees as the end of the data, else the reply to its failure
+ * or its success
+ */
+static void
+transfer_done(client_context_t * current_context, int err,
+	reply_id_t failed, reply_id_t done) {
+
+	if (current_context->transfer_stalled) {
+		current_context->transfer_stalled = 0;
+		reply_queue(current_context, REPLY_TRANSFER_ABORTED);
+	}
+	else
+		reply_queue(current_context, err < 0 ? failed : done);
+}
 
-		print_debug("Client connection stopped or failed!\n");
+/*
+ * Check a restart offset given with REST against the size of
+ * the file it applies to; a transfer can only resume within
+ * the file. Tells the client and returns -1 if it is invalid.
+ */
+static int
+check_restart_offset(client_context_t * current_context, int file_fd,
+	off_t offset) {
 
-		// Deallocate certain buffers
-		free(new_path);
-		new_path = NULL;
-		free(current_context.PORT);
-		current_context.PORT = NULL;
+	struct stat st;
+	if (offset == 0 || (fstat(file_fd, &st) == 0 && offset <= st.st_size))
+		return (0);
 
-		/*
-		 * Thread will continue to wait for further
-		 * client connections to process
-		 */
-		continue;
-	}
+	reply_queue(current_context, REPLY_RESTART_OUT_OF_RANGE);
+	return (-1);
 }
 
 // Handler function for the USER FTP command
 void
 USER_HANDLER(client_context_t * current_context) {
 	// Ask the client for his or her password.
-	int nwrite = write(current_context->client_comm_fd,
-		"331 Password required for USER\r\n",
-		strlen("331 Password required for USER\r\n"));
-	if (nwrite < 0)
-		error("Error on accepting username\n");
+	reply_queue(current_context, REPLY_PASSWORD_REQUIRED);
 }
 
 /*
@@ -266,11 +864,7 @@ PASS_HANDLER(client_context_t * current_context) {
 	 * so any password is accepted
 	 * without actually verifying it.
 	 */
-	int nwrite = write(current_context->client_comm_fd,
-		"230 You are now logged in.\r\n",
-		strlen("230 You are now logged in.\r\n"));
-	if (nwrite < 0)
-		error("Error on accepting user password\n");
+	reply_queue(current_context, REPLY_LOGGED_IN);
 }
 
 
@@ -282,10 +876,7 @@ SYST_HANDLER(client_context_t * current_context) {
 	 * operating system
 	 * that the server runs on
 	 */
-	int nwrite = write(current_context->client_comm_fd, "215 UNIX\r\n",
-		strlen("215 UNIX\r\n"));
-	if (nwrite < 0)
-		error("Error on sending operating system type\n");
+	reply_queue(current_context, REPLY_SYSTEM_TYPE);
 }
 
 /*
@@ -298,21 +889,44 @@ FEAT_HANDLER(client_context_t * current_context) {
 	 * Inform the client of the
 	 * FTP Extensions that our server supports
 	 */
-	int nwrite = write(current_context->client_comm_fd,
-		"211 Extensions supported\r\n",
-		strlen("211-Extensions supported\r\n"));
-	if (nwrite < 0)
-		error("Error on sending extensions\n");
+	reply_queue(current_context, REPLY_FEATURES);
+}
+
+/*
+ * Handler function for the STAT FTP command. Without an
+ * argument it reports the server's metrics; the status of
+ * a file or directory is not supported.
+ */
+void
+STAT_HANDLER(client_context_t * current_context) {
+
+	if (strtok_r(NULL, " ", &current_context->token_state) != NULL) {
+		reply_queue(current_context, REPLY_STAT_PATH);
+		return;
+	}
+
+	char * status = NULL;
+	size_t len = 0;
+	FILE * out = open_memstream(&status, &len);
+	if (out == NULL) {
+		reply_queue(current_context, REPLY_LOCAL_ERROR);
+		return;
+	}
+	metrics_status(out);
+	fclose(out);
+
+	reply_lines(current_context, 211, "FTP server status:", status, len,
+		"End of status");
+	free(status);
 }
 
 // Handler function for the QUIT FTP command
 void
 QUIT_HANDLER(client_context_t * current_context) {
-	int nwrite = write(current_context->client_comm_fd, "Goodbye.\r\n",
-			strlen("Goodbye.\r\n"));
-	if (nwrite < 0)
-		error("Error on wishing client goodbye.\n");
-	close(current_context->client_comm_fd);
+	reply_queue(current_context, REPLY_GOODBYE);
+
+	// The session is torn down once the handler returns
+	current_context->state = SESSION_CLOSED;
 }
 
 /*
@@ -322,19 +936,14 @@ QUIT_HANDLER(client_context_t * current_context) {
  */
 void
 OTHER_HANDLER(client_context_t * current_context) {
-	print_debug("Unsupported command issued by client\n");
+	log_debug("Unsupported command issued by client");
 
 	/*
 	 * Inform the client that the command
 	 * he/she sent is
 	 * not suppported by the server
 	 */
-	int nwrite = write(current_context->client_comm_fd,
-		"500 Command not supported\r\n",
-		strlen("500 Command not supported\r\n"));
-	if (nwrite < 0)
-		error("Error in informing client of \
-			unsupported command.\n");
+	reply_queue(current_context, REPLY_NOT_SUPPORTED);
 }
 
 // Handler function for the PWD FTP command
@@ -345,220 +954,274 @@ PWD_HANDLER(client_context_t * current_context) {
 	 * along with the associated status codes
 	 */
 	char * working_directory = current_context->current_working_directory;
-	char * full_message = calloc(strlen("257 \r\n") \
-		+ strlen(working_directory)+2, 1);
-	strcat(full_message, "257 ");
-	strcat(full_message, "\"");
-	strcat(full_message, working_directory);
-	strcat(full_message, "\"");
-	strcat(full_message, "\r\n");
-	ssize_t nwrite = write(current_context->client_comm_fd, full_message,
-		strlen(full_message));
-	if (nwrite < 0)
-		error("Error on sending current working directory to client\n");
+	reply_printf(current_context, "257 \"%s\"\r\n", working_directory);
 
-	print_debug("Wrote working directory to client: ");
-	print_debug(full_message);
-	print_debug("\n");
-
-	free(full_message);
+	log_debug("Wrote working directory to client: %s",
+		working_directory);
 }
 
 // Handler function for the PASV FTP command
 void
 PASV_EPSV_HANDLER(client_context_t * current_context) {
 	if (current_context->PASV_EPSV_FLAG == 0)
-		print_debug("Client issued command PASV!\n");
+		log_debug("Client issued command PASV!");
 	else
-		print_debug("Client issued command EPSV!\n");
+		log_debug("Client issued command EPSV!");
+
+	// Drop the listener of an earlier PASV the client never used
+	release_passive_listener(current_context);
 
-	// Choose a random port to listen for data connections
-	// current_context->data_port = get_random_port();
+	/*
+	 * Take a listening socket out of the passive port range,
+	 * or bind one on an ephemeral port if no range was set up
+	 */
+	if (pasv_pool_enabled()) {
+		current_context->pasv_listener = pasv_pool_checkout();
+		if (current_context->pasv_listener == NULL) {
+			log_warn("Passive port range exhausted");
+			reply_queue(current_context, REPLY_NO_PASSIVE_PORT);
+			return;
+		}
+		current_context->data_fd = current_context->pasv_listener->fd;
+	}
+	else {
+		if (initiate_server_PASV(&(current_context->data_fd),
+			current_context->PASV_EPSV_FLAG) < 0) {
+			log_warn("Error initiating passive FTP socket: %s",
+				strerror(errno));
+			reply_queue(current_context, REPLY_CANT_OPEN_DATA);
+			return;
+		}
+	}
 
-	// Generate a socket that is listening on the randomly generated port
-	// current_context->data_fd = initiate_server(current_context->data_port);
-	// if (current_context->data_fd < 0)
-	// 	error("Error initiating passive FTP socket!\n");
-	struct sockaddr_storage ad = \
-	initiate_server_PASV(&(current_context->data_fd),\
-		current_context->PASV_EPSV_FLAG);
-	if (current_context->data_fd < 0)
-		error("Error initiating passive FTP socket!\n");
+	// The port the kernel actually bound the listener to
+	struct sockaddr_storage ad;
+	socklen_t ad_len = sizeof (ad);
+	getsockname(current_context->data_fd, (struct sockaddr *)&ad, &ad_len);
+	current_context->data_port = ad.ss_family == AF_INET ?
+		ntohs(((struct sockaddr_in *)&ad)->sin_port) :
+		ntohs(((struct sockaddr_in6 *)&ad)->sin6_port);
+	log_debug("Passive mode listener on port %d",
+		current_context->data_port);
 
 	/*
 	 * Get formatted IP Address + Port to send to the client.
+	 * PASV needs the IPv4 address the client reached us on.
 	 */
-	char * local_ip_address;
+	char local_ip_address[INET6_ADDRSTRLEN + 32];
 	if (current_context->PASV_EPSV_FLAG == 0) {
-		// local_ip_address =
-		// 	get_formatted_local_ip_address(current_context->data_port, 1);
-		struct sockaddr_in * ad4 = (struct sockaddr_in *)&ad;
-		local_ip_address = calloc(INET_ADDRSTRLEN,1);
-
-		char * ip_addr = calloc(INET_ADDRSTRLEN,1);
-		inet_ntop(AF_INET,&(ad4->sin_addr.s_addr), \
-			ip_addr,INET_ADDRSTRLEN);
-		for (int i = 0; i < strlen(ip_addr); i++) {
+		struct sockaddr_storage local;
+		socklen_t local_len = sizeof (local);
+		struct in_addr ip4 = { INADDR_ANY };
+
+		if (getsockname(current_context->client_comm_fd,
+			(struct sockaddr *)&local, &local_len) == 0) {
+			if (local.ss_family == AF_INET)
+				ip4 = ((struct sockaddr_in *)&local)->sin_addr;
+			else if (IN6_IS_ADDR_V4MAPPED(
+				&((struct sockaddr_in6 *)&local)->sin6_addr))
+				memcpy(&ip4, &((struct sockaddr_in6 *)&local)->
+					sin6_addr.s6_addr[12], 4);
+		}
+
+		char ip_addr[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &ip4, ip_addr, INET_ADDRSTRLEN);
+		for (int i = 0; ip_addr[i] != '\0'; i++) {
 			if (ip_addr[i] == '.')
 				ip_addr[i] = ',';
 		}
 
-		sprintf(local_ip_address,"(%s,%d,%d)",\
-			ip_addr, ad4->sin_port/256, \
-			ad4->sin_port%256);
-		free(ip_addr);
-		ip_addr = NULL;
+		snprintf(local_ip_address, sizeof (local_ip_address),
+			"(%s,%d,%d)", ip_addr,
+			current_context->data_port / 256,
+			current_context->data_port % 256);
 	}
 	else {
-		// local_ip_address =
-		// 	get_formatted_local_ip_address(current_context->data_port, 0);
-		struct sockaddr_in6 * ad6 = (struct sockaddr_in6 *)&ad;
-		local_ip_address = calloc(INET6_ADDRSTRLEN,1);
-		sprintf(local_ip_address,"(|||%d|)",ad6->sin6_port);
+		snprintf(local_ip_address, sizeof (local_ip_address),
+			"(|||%d|)", current_context->data_port);
 	}
 
-	// if (local_ip_address == NULL)
-	// 	error("Error on getting formatted local IP Address\n");
-
 	/*
 	 * Construct status message for client,
 	 * informing him/her of the
 	 * local endpoint of the passive FTP
 	 */
-	char * full_client_message =
-	(char *) calloc(strlen("22x Entering passive mode. \r\n") + \
-		strlen(local_ip_address), 1);
-	if (current_context->PASV_EPSV_FLAG == 0)
-		strcat(full_client_message, "227 Entering passive mode. ");
-	else
-		strcat(full_client_message, "229 Entering passive mode. ");
-
-	strcat(full_client_message, local_ip_address);
-	strcat(full_client_message, "\r\n");
-	ssize_t nwrite = write(current_context->client_comm_fd,
-		full_client_message,
-		strlen(full_client_message));
-	if (nwrite < 0)
-		error("Error on sending passive \
-			server mode status \
-			to client\n");
+	reply_printf(current_context, "%d Entering passive mode. %s\r\n",
+		current_context->PASV_EPSV_FLAG == 0 ? 227 : 229,
+		local_ip_address);
 
-	// We switch active mode off and deallocate resources
+	// We switch active mode off
 	current_context->active_flag = 0;
-	free(full_client_message);
-	full_client_message = NULL;
-	free(local_ip_address);
-	local_ip_address = NULL;
 }
 
 // Handler function for the CWD FTP command
 void
 CWD_HANDLER(client_context_t * current_context) {
-	print_debug("Client issued command CWD\n");
+	log_debug("Client issued command CWD");
 
 	/*
 	 * Obtain the exact directory the client would like
-	 * to switch to via strtok()
+	 * to switch to via strtok_r()
+	 */
+	current_context->input_command = strtok_r(NULL, " ",
+		&current_context->token_state);
+
+	log_debug("Switching to directory %s at the request of the client",
+		current_context->input_command);
+
+	char new_path[PATH_MAX];
+
+	/*
+	 * Open the inputted directory relative to the session's
+	 * own directory; the process working directory is shared
+	 * by every session and stays untouched
 	 */
-	current_context->input_command = strtok(NULL, " ");
-
-	print_debug("Switching to directory ");
-	print_debug(current_context->input_command);
-	print_debug(" at the request of the client\n");
-
-	char * new_path = calloc(
-		strlen(current_context->current_working_directory)
-		+ strlen(current_context->input_command) + 2, 1);
-
-	strcat(new_path, current_context->current_working_directory);
-	strcat(new_path, "/");
-	strcat(new_path, current_context->input_command);
-	strcat(new_path, "/");
-
-	ssize_t nwrite = 0;
-	// Switch to the inputted directory
-	int err = chdir(new_path);
-	if (err < 0) {
-		nwrite = write(current_context->client_comm_fd, "550\r\n",
-			strlen("550\r\n"));
-		free(new_path);
-		new_path = NULL;
+	int new_fd = -1;
+	if (current_context->input_command != NULL &&
+		resolve_virtual_path(new_path,
+		current_context->current_working_directory,
+		current_context->input_command) == 0)
+		new_fd = openat(current_context->cwd_fd,
+			current_context->input_command, O_RDONLY | O_DIRECTORY);
+
+	if (new_fd < 0) {
+		reply_queue(current_context, REPLY_DIRECTORY_UNAVAILABLE);
 	} else {
-		nwrite = write(current_context->client_comm_fd,
-			"250\r\n", strlen("250\r\n"));
-		free(current_context->current_working_directory);
-		current_context->current_working_directory = NULL;
-		current_context->current_working_directory = new_path;
+		reply_queue(current_context, REPLY_DIRECTORY_CHANGED);
+		close(current_context->cwd_fd);
+		current_context->cwd_fd = new_fd;
+		strcpy(current_context->current_working_directory, new_path);
 	}
+}
 
-	if (nwrite < 0)
-		error("Error on writing CWD status to client\n");
+
+/*
+ * Parse the h1,h2,h3,h4,p1,p2 argument of PORT into the port
+ * it gives; -1 unless it is six fields of 0 to 255 and the
+ * port is not zero. Only the port is used: data connections
+ * go to the address the control connection came from.
+ */
+static long
+parse_port_fields(const char * argument) {
+
+	long fields[6];
+	const char * p = argument;
+
+	if (p == NULL)
+		return (-1);
+	for (int i = 0; i < 6; i++) {
+		if (!isdigit((unsigned char)*p))
+			return (-1);
+		char * end;
+		errno = 0;
+		fields[i] = strtol(p, &end, 10);
+		if (errno != 0 || fields[i] > 255)
+			return (-1);
+		p = end;
+		if (i < 5 && *p++ != ',')
+			return (-1);
+	}
+	if (*p != '\0')
+		return (-1);
+
+	long port = (fields[4] << 8) + fields[5];
+	return (port == 0 ? -1 : port);
 }
 
+/*
+ * Parse the <d><af><d><address><d><port><d> argument of EPRT
+ * (RFC 2428) into the port it gives. Returns -2 for a network
+ * protocol other than IPv4 (1) and IPv6 (2), and -1 unless the
+ * address is one of that protocol and the port is 1 to 65535.
+ */
+static long
+parse_eprt_argument(const char * argument) {
+
+	if (argument == NULL || argument[0] < 33 || argument[0] > 126)
+		return (-1);
+
+	char delimiter = argument[0];
+	const char * fields[3];
+	size_t lengths[3];
+	const char * p = argument + 1;
+	for (int i = 0; i < 3; i++) {
+		const char * end = strchr(p, delimiter);
+		if (end == NULL || end == p)
+			return (-1);
+		fields[i] = p;
+		lengths[i] = end - p;
+		p = end + 1;
+	}
+	if (*p != '\0')
+		return (-1);
+
+	if (lengths[0] != 1 || (fields[0][0] != '1' && fields[0][0] != '2'))
+		return (isdigit((unsigned char)fields[0][0]) ? -2 : -1);
+
+	char address[INET6_ADDRSTRLEN];
+	unsigned char binary[sizeof (struct in6_addr)];
+	if (lengths[1] >= sizeof (address))
+		return (-1);
+	memcpy(address, fields[1], lengths[1]);
+	address[lengths[1]] = '\0';
+	if (inet_pton(fields[0][0] == '1' ? AF_INET : AF_INET6, address,
+		binary) != 1)
+		return (-1);
+
+	long port = 0;
+	for (size_t i = 0; i < lengths[2]; i++) {
+		if (!isdigit((unsigned char)fields[2][i]) || port > 65535)
+			return (-1);
+		port = port * 10 + fields[2][i] - '0';
+	}
+	return (port < 1 || port > 65535 ? -1 : port);
+}
 
 // Handler function for the EPRT FTP command
 void 
 PORT_EPRT_HANDLER(client_context_t * current_context) {
 	if (current_context->PORT_EPRT_FLAG == 0)
-		print_debug("Client issued command PORT!\n");
+		log_debug("Client issued command PORT!");
 	else
-		print_debug("Client issued command EPRT!\n");
+		log_debug("Client issued command EPRT!");
 
 	/*
 	 * Get IP Address + port name, formatted according to
 	 * the norms of the RFC
 	 * FTP standards
 	 */
-	current_context->input_command = strtok(NULL, " ");
+	current_context->input_command =
+		strtok_r(NULL, " ", &current_context->token_state);
 	if (current_context->PORT_EPRT_FLAG == 0) {
-		// Separate IP Address from port name based on commas
-		strtok(current_context->input_command, ",");
-		// Read until we get the two numbers corresponding to the port
-		for (int i = 0; i < 3; i++)
-			strtok(NULL, ",");
-
-		/*
-		 * Obtain the upper bits and lower bits
-		 * of the port
-		 * number in binary
-		 */
-		int upper_bits = atoi(strtok(NULL, ","));
-		int lower_bits = atoi(strtok(NULL, ","));
-
-		// Calculate the decimal version of the port number
-		int calculated_port = (upper_bits << 8) + lower_bits;
+		long port = parse_port_fields(current_context->input_command);
+		if (port < 0) {
+			reply_queue(current_context, REPLY_SYNTAX_ERROR);
+			return;
+		}
 
-		// Free the old port
-		free(current_context->PORT);
-		current_context->PORT = NULL;
-		// Allocate a new buffer for the new port
-		current_context->PORT = calloc(6, 1);
-		sprintf(current_context->PORT, "%d", calculated_port);
+		// Replace the old port
+		snprintf(current_context->PORT, sizeof (current_context->PORT),
+			"%ld", port);
 	}
 	else {
-		// Separate IP Address from port name based on |
-		strtok(current_context->input_command, "|");
-		// Read until we get the two numbers corresponding to the port
-		for (int i = 0; i < 2; i++) {
-			current_context->input_command = strtok(NULL, "|");
+		long port = parse_eprt_argument(current_context->input_command);
+		if (port < 0) {
+			reply_queue(current_context, port == -2 ?
+				REPLY_PROTOCOL_NOT_SUPPORTED : REPLY_SYNTAX_ERROR);
+			return;
 		}
 
-		current_context->PORT = calloc(6, 1);
-		sprintf(current_context->PORT, "%s", current_context->input_command);
+		snprintf(current_context->PORT, sizeof (current_context->PORT),
+			"%ld", port);
 	}
 
-	print_debug("Client port for active FTP: ");
-	print_debug(current_context->PORT);
-	print_debug("\n");
+	log_debug("Client port for active FTP: %s", current_context->PORT);
 
 	// Send successful active FTP activation confirmation to client
-	ssize_t nwrite = write(current_context->client_comm_fd,
-		"200 Entering active mode\r\n",
-		strlen("200 Entering active mode\r\n"));
+	reply_queue(current_context, REPLY_ACTIVE_MODE);
 
-	if (nwrite < 0)
-		error("Error on writing active FTP success \
-			status to client\n");
+	// Drop the listener of an earlier PASV the client never used
+	release_passive_listener(current_context);
 
 	// Switch the active FTP flag on
 	current_context->active_flag = 1;
@@ -567,909 +1230,676 @@ PORT_EPRT_HANDLER(client_context_t * current_context) {
 // Handler function for the TYPE FTP command
 void
 TYPE_HANDLER(client_context_t * current_context) {
-	print_debug("Client issued command TYPE!\n");
+	log_debug("Client issued command TYPE!");
 
 	// Get the type of change to the binary flag
-	current_context->input_command = strtok(NULL, " ");
+	current_context->input_command = strtok_r(NULL, " ",
+		&current_context->token_state);
 
+	if (current_context->input_command == NULL) {
+		reply_queue(current_context, REPLY_SYNTAX_ERROR);
+	}
 	// ASCII Type
-	if (strcmp(current_context->input_command, "A") == 0) {
+	else if (strcmp(current_context->input_command, "A") == 0) {
 		current_context->binary_flag = 0;
 		// Send successful binary flag update status to client
-		ssize_t nwrite = write(current_context->client_comm_fd,
-			"200 Entering ASCII mode\r\n",
-			strlen("200 Entering ASCII mode\r\n"));
-
-	if (nwrite < 0)
-		error("Error on writing binary type success \
-			status to client\n");
+		reply_queue(current_context, REPLY_ASCII_MODE);
 	}
 	// Binary type
 	else {
 		current_context->binary_flag = 1;
 		// Send successful binary flag update status to client
-		ssize_t nwrite = write(current_context->client_comm_fd,
-			"200 Entering binary mode\r\n",
-			strlen("200 Entering binary mode\r\n"));
-
-	if (nwrite < 0)
-		error("Error on writing binary \
-			type success status to client\n");
+		reply_queue(current_context, REPLY_BINARY_MODE);
 	}
 }
 
-// Handle for the LIST FTP command
+/*
+ * Handler function for the MODE FTP command. Besides stream
+ * mode there is deflate mode, in which the data of every
+ * transfer is compressed with zlib; block and compressed
+ * mode are not implemented.
+ */
 void
-LIST_HANDLER(client_context_t * current_context) {
-	print_debug("Client issued command LIST!\n");
-
-	ssize_t nwrite;
-	int err;
-	// Get the contents of the current working directory
-	char * directory_list =
-		LIST(current_context->current_working_directory);
+MODE_HANDLER(client_context_t * current_context) {
+	log_debug("Client issued command MODE!");
 
-	/*
-	 * Format and send the status message to the client,
-	 * along with the contents
-	 * of the current working directory
-	 */
-	char * full_message = calloc(strlen(directory_list)+strlen("\r\n"), 1);
-	strcat(full_message, directory_list);
-	strcat(full_message, "\r\n");
-	/*
-	 * Handle the case where the client has currently
-	 * chosen passive mode to be their
-	 * desired form of data transfer
-	 */
-	if (!current_context->active_flag) {
-		struct sockaddr_storage temp;
-		socklen_t len = (socklen_t)sizeof (struct sockaddr_storage);
-		/*
-		 * 'Accept' the incoming client connection to our
-		 * established socket
-		 */
-		current_context->client_data_fd =
-			accept(current_context->data_fd,
-				(struct sockaddr *)&temp,
-				&len);
-
-		if (current_context->client_data_fd < 0)
-			error("Error on accepting passive client connection \
-				for data transfer during LIST\n");
-		else
-			nwrite =
-			write(current_context->client_comm_fd,
-				"150 Opening ASCII mode \
-				data connection\r\n",
-				strlen("150 Opening ASCII \
-					mode data connection\r\n"));
-
-		nwrite = write(current_context->client_data_fd,
-			full_message, strlen(full_message));
-
-		if (nwrite < 0)
-			error("Error when sending directory contents to \
-				client in response to LIST command\n");
+	char * mode = strtok_r(NULL, " ", &current_context->token_state);
 
-
-		/*
-		 * Close the socket descriptors that connect to the client.
-		 * Note that this ends the current passive mode connection;
-		 * a new connection will have to be established
-		 * before performing further transfers
-		 */
-		close(current_context->client_data_fd);
-		close(current_context->data_fd);
+	if (mode == NULL || mode[0] == '\0' || mode[1] != '\0') {
+		reply_queue(current_context, REPLY_SYNTAX_ERROR);
+	}
+	else if (toupper((unsigned char)mode[0]) == 'S') {
+		current_context->compress_flag = 0;
+		reply_queue(current_context, REPLY_STREAM_MODE);
+	}
+	else if (toupper((unsigned char)mode[0]) == 'Z') {
+		// The zlib streams are only set up by the first transfer
+		if (current_context->zmode == NULL &&
+			(current_context->zmode = zmode_create()) == NULL) {
+			reply_queue(current_context, REPLY_LOCAL_ERROR);
+			return;
+		}
+		current_context->compress_flag = 1;
+		reply_queue(current_context, REPLY_DEFLATE_MODE);
 	}
-
-	/*
-	 * Handle the case where the client has currently chosen
-	 *  active mode to be their
-	 * desired form of data transfer
-	 */
 	else {
-		socklen_t len = sizeof (struct sockaddr_storage);
+		reply_queue(current_context, REPLY_MODE_NOT_IMPLEMENTED);
+	}
+}
 
-		/*
-		 * Keep track of the IP address and the port of the client:
-		 * we will be transferring the bytes
-		 * of the file to this port
-		 */
-		char hoststr[NI_MAXHOST];
-		char portstr[NI_MAXSERV];
+/*
+ * Handler function for the OPTS FTP command (RFC 2389); the
+ * only option is the compression level of MODE Z transfers,
+ * set with OPTS MODE Z LEVEL <0-9>
+ */
+void
+OPTS_HANDLER(client_context_t * current_context) {
+	log_debug("Client issued command OPTS!");
+
+	char * fields[4];
+	for (int i = 0; i < 4; i++)
+		fields[i] = strtok_r(NULL, " ", &current_context->token_state);
+
+	long level = -1;
+	if (fields[3] != NULL && strcasecmp(fields[0], "MODE") == 0 &&
+		strcasecmp(fields[1], "Z") == 0 &&
+		strcasecmp(fields[2], "LEVEL") == 0) {
+		char * end = NULL;
+		level = strtol(fields[3], &end, 10);
+		if (end == fields[3] || *end != '\0')
+			level = -1;
+	}
 
-		/*
-		 * Obtain the IP Address
-		 * and port
-		 * number of the current
-		 * client connection
-		 */
-		err = getnameinfo(
-			(struct sockaddr *)&(current_context->client_addr),
-			len, hoststr, sizeof (hoststr),
-			portstr, sizeof (portstr),
-			NI_NUMERICHOST | NI_NUMERICSERV);
+	if (level < 0 || level > 9) {
+		reply_queue(current_context, REPLY_OPTION_NOT_UNDERSTOOD);
+		return;
+	}
 
-		/*
-		 * Handle error situations in processing
-		 * the client connection
-		 */
-		if (err != 0) {
-			nwrite = write(current_context->client_comm_fd,
-				"425 can't open data \
-				connection\r\n",
-				strlen("425 can't open data connection\r\n"));
-			if (nwrite < 0)
-				error("Error on communicating data connection \
-					error to client\n");
-			return;
-		}
+	current_context->compression_level = (int)level;
+	reply_printf(current_context, "200 MODE Z LEVEL set to %ld\r\n", level);
+}
 
-		/*
-		 * Successfully obtained information
-		 * regarding the
-		 * client's connection
-		 */
-		else {
-			/*
-			 * Use a helper function to connect
-			 * to the client's IP Address,
-			 * but in a *different* port than the
-			 * regular command transfers.
-			 * This different port,
-			 * used for data transfers, was provided earlier via
-			 * the PORT command
-			 */
-			current_context->data_fd =
-			get_active_client_connection(hoststr,
-				current_context->PORT);
+// Handle for the LIST FTP command
+void
+LIST_HANDLER(client_context_t * current_context) {
+	log_debug("Client issued command LIST!");
 
-			/*
-			 * If we for some reason fail
-			 * when trying to connect to the
-			 * client port for active FTP, we inform the client
-			 */
-			if (current_context->data_fd < 0) {
-				nwrite = write(current_context->client_comm_fd,
-					"425 can't open active \
-					data connection\r\n",
-					strlen("425 can't open\
-					 active data connection\r\n"));
-				return;
-			}
-			else
-				nwrite = write(current_context->client_comm_fd,
-					"150 Opening ASCII mode \
-					data connection\r\n",
-					strlen("150 Opening ASCII mode\
-					 data connection\r\n"));
-		}
+	ssize_t nwrite;
+	/*
+	 * Get the contents of the current working directory,
+	 * rendered once and shared while the directory is unchanged
+	 */
+	list_entry_t * listing = list_cache_get(current_context->cwd_fd);
+	if (listing == NULL) {
+		reply_queue(current_context, REPLY_DIRECTORY_BUSY);
+		return;
+	}
 
-		nwrite = write(current_context->data_fd, full_message,
-			strlen(full_message));
+	int data_fd = open_data_connection(current_context, REPLY_OPENING_ASCII);
+	if (data_fd < 0) {
+		list_cache_release(listing);
+		return;
+	}
 
-		if (nwrite < 0)
-			error("Error when sending directory contents to client \
-				in response to LIST command.\n");
+	nwrite = metered_send_listing(current_context, data_fd,
+		listing->data, listing->len);
 
-		// Close the associated file descriptors
-		close(current_context->data_fd);
-	}
+	/*
+	 * Close the data connection. Note that this ends the current
+	 * passive mode connection; a new connection will have to be
+	 * established before performing further transfers
+	 */
+	close_data_connection(current_context, data_fd);
 
-	nwrite = write(current_context->client_comm_fd,
-		"226 Directory contents listed\r\n",
-		strlen("226 Directory contents listed\r\n"));
-	if (nwrite < 0)
-		error("Error when writing LIST success status to client.\n");
+	transfer_done(current_context, nwrite < 0 ? -1 : 0, REPLY_LOCAL_ERROR,
+		REPLY_DIRECTORY_LISTED);
 
 	// Deallocate resources
-	free(full_message);
-	full_message = NULL;
-	free(directory_list);
-	directory_list = NULL;
+	list_cache_release(listing);
 }
 
 // Handle for the STOR FTP command
 void
 STOR_HANDLER(client_context_t * current_context) {
-	print_debug("Client has issued command STOR!\n");
+	log_debug("Client has issued command STOR!");
 
-	ssize_t nwrite;
 	int err;
 	// Obtain the filename of the file to be created
-	char * filename = strtok(NULL, " ");
+	char * filename = strtok_r(NULL, " ",
+		&current_context->token_state);
+	// Resume an upload at the offset given with REST
+	off_t offset = current_context->restart_offset;
+	current_context->restart_offset = 0;
 
 	// Declare the file descriptor corresponding to the new file
 	int file_fd;
 
 	/*
-	 * Erase the old contents of the file so
-	 * that may append new client
-	 * content
+	 * Create the file in the session's directory, erasing
+	 * the old contents if it already exists, unless the
+	 * client resumes an earlier upload
 	 */
-	err = truncate(filename, 0);
+	file_fd = filename == NULL ? -1 : openat(current_context->cwd_fd,
+		filename, O_CREAT | O_WRONLY | (offset > 0 ? 0 : O_TRUNC), 0644);
 
-	/*
-	 * If the error is of type ENOENT, it means that the
-	 * truncation failed due to us passing a non-existent file as
-	 * argument. Such a situation is acceptable as we will create
-	 * a new file anyway. If we recieve another error however,
-	 * we have to inform the client and abort
-	 * the procedure
-	 */
-	if (err < 0) {
-		if (errno != ENOENT) {
-			// Inform the client of the error during truncation
-			nwrite = write(current_context->client_comm_fd,
-				"452 file unavailable\r\n",
-				strlen("452 file unavailable\r\n"));
-
-			if (nwrite < 0)
-				error("Error in communicating truncation error \
-					to the client.\n");
-			return;
-		}
+	// An error occured in opening the file descriptor
+	if (file_fd < 0) {
+		// Inform the client of the error
+		reply_queue(current_context, REPLY_FILE_UNWRITABLE);
+		return;
+	}
+
+	if (check_restart_offset(current_context, file_fd, offset) < 0) {
+		close(file_fd);
+		return;
 	}
 
 	/*
-	 * Create the file descriptor with the O_EXCL
-	 * flag since we don't want
-	 * another process to open the file at the same time.
+	 * Connect to the client and inform it that we are ready
+	 * to transfer the bytes to store a file
 	 */
-	file_fd = open(filename, O_CREAT | O_EXCL | O_WRONLY, 0644);
-
-	// An error occured in opening the file descriptor
-	if (file_fd < 0) {
-		/*
-		 * The situation where another process was trying to open
-		 * the same file descriptor
-		 */
-		if (errno == EEXIST) {
-			print_debug("ERROR: Concurrent creation \
-				of the same file \
-				descriptor! \n");
-
-			// Inform the client of the error
-			nwrite = write(current_context->client_comm_fd,
-				"452 file unavailable\r\n",
-				strlen("452 file unavailable\r\n"));
-			if (nwrite < 0)
-				error("Error in communicating file concurrent \
-					access to the client.\n");
-			return;
-		}
+	int data_fd = open_data_connection(current_context,
+		REPLY_OPENING_TRANSFER);
+	if (data_fd < 0) {
+		close(file_fd);
+		return;
 	}
 
 	/*
-	 * Inform the client that we are ready to
-	 * transfer the bytes to
-	 * store a file
+	 * Call the STOR command, and if we encounter an error
+	 * during data transfer, we inform the client
 	 */
-	nwrite = write(current_context->client_comm_fd,
-		"150 Opening file transfer data connection\r\n",
-		strlen("150 Opening file transfer data connection\r\n"));
+	err = metered_STOR(current_context, file_fd, data_fd,
+		current_context->binary_flag, offset);
 
-	if (nwrite < 0)
-		error("Error on communicating ASCII \
-			file transfer to client.\n");
+	transfer_done(current_context, err, REPLY_FILE_ERROR,
+		REPLY_TRANSFER_COMPLETE);
 
 	/*
-	 * Handle the case where the client has currently chosen
-	 * passive mode to be their
-	 * desired form of data transfer
+	 * Close the file descriptor to the file, and the data
+	 * connection. Note that this ends the current passive mode
+	 * connection; a new connection will have to be established
+	 * before performing further transfers
 	 */
-	if (!current_context->active_flag) {
-		struct sockaddr_storage temp;
-		socklen_t len = (socklen_t)sizeof (struct sockaddr_storage);
-		/*
-		 * 'Accept' the incoming client connection
-		 * to our established socket
-		 */
-		current_context->client_data_fd =
-			accept(current_context->data_fd,
-				(struct sockaddr *)&temp, &len);
+	close(file_fd);
+	close_data_connection(current_context, data_fd);
+}
 
-		if (current_context->client_data_fd < 0)
-			error("Error on accepting\
-				client channel for data transfer.\n");
+// Handle for the FTP APPE Command
+void
+APPE_HANDLER(client_context_t * current_context) {
+	log_debug("Client has issued command APPE!");
 
-		/*
-		 * Call the STOR command, and if we encounter
-		 * an error during
-		 * data transfer, we inform the client
-		 */
-		err = STOR(file_fd, current_context->client_data_fd,
-			current_context->binary_flag);
+	int err;
+	// Obtain the filename of the file to be created
+	char * filename = strtok_r(NULL, " ",
+		&current_context->token_state);
 
-		if (err < 0)
-			nwrite = write(current_context->client_comm_fd,
-				"451 Local error in file processing\r\n",
-				strlen("451 Local error\
-				 in file processing\r\n"));
-		else
-			nwrite = write(current_context->client_comm_fd,
-				"226 Transfer complete\r\n",
-				strlen("226 Transfer complete\r\n"));
+	// Declare the file descriptor corresponding to the new file
+	int file_fd;
 
-		/*
-		 * Close the file descriptor to the file, and the
-		 * socket descriptors that connect to the client.
-		 * Note that this ends the current passive mode connection;
-		 * a new connection will have to be established
-		 * before performing further transfers
-		 */
+	/*
+	 * Open a new file descriptor to append to the file; after
+	 * a REST the upload is written from the restart offset on
+	 */
+	off_t offset = current_context->restart_offset;
+	current_context->restart_offset = 0;
+	file_fd = filename == NULL ? -1 : openat(current_context->cwd_fd,
+		filename, O_CREAT | O_WRONLY | (offset > 0 ? 0 : O_APPEND), 0644);
+
+	// Error in opening file descriptor, so we inform the client
+	if (file_fd < 0) {
+		reply_queue(current_context, REPLY_FILE_UNWRITABLE);
+		return;
+	}
+
+	if (check_restart_offset(current_context, file_fd, offset) < 0) {
 		close(file_fd);
-		close(current_context->client_data_fd);
-		close(current_context->data_fd);
+		return;
 	}
 
 	/*
-	 * Handle the case where the client has currently
-	 * chosen active mode to be their
-	 *	desired form of data transfer
+	 * Else we connect to the client and inform it of the
+	 * successful opening of the file for appending
 	 */
-	else {
-		socklen_t len = sizeof (struct sockaddr_storage);
+	int data_fd = open_data_connection(current_context,
+		REPLY_OPENING_TRANSFER);
+	if (data_fd < 0) {
+		close(file_fd);
+		return;
+	}
 
-		/*
-		 * Keep track of the IP address and the port of the client:
-		 * we will be transferring the bytes
-		 * of the file to this port
-		 */
-		char hoststr[NI_MAXHOST];
-		char portstr[NI_MAXSERV];
+	/*
+	 * Using append mode, we again call the STOR command, and
+	 * if we encounter an error during data transfer, we
+	 * inform the client
+	 */
+	err = metered_STOR(current_context, file_fd, data_fd,
+		current_context->binary_flag, offset);
+	transfer_done(current_context, err, REPLY_FILE_ERROR,
+		REPLY_TRANSFER_COMPLETE);
+
+	// Close the file descriptor to the file, and the data connection
+	close(file_fd);
+	close_data_connection(current_context, data_fd);
+}
 
-		/*
-		 * Obtain the IP Address and port
-		 * number of the
-		 * current client connection
-		 */
-		err =
-		getnameinfo((struct sockaddr *)&(current_context->client_addr),
-			len, hoststr,
-			sizeof (hoststr), portstr, sizeof (portstr),
-			NI_NUMERICHOST | NI_NUMERICSERV);
-
-		// Handle error situations in processing the client connection
-		if (err != 0) {
-			nwrite = write(current_context->client_comm_fd,
-				"425 can't open data connection\r\n",
-				strlen("425 can't open data connection\r\n"));
-			if (nwrite < 0)
-				error("Error on communicating data connection \
-					error to client.\n");
-			return;
-		}
+// Handle for the RETR FTP command
+void
+RETR_HANDLER(client_context_t * current_context) {
+	log_debug("Client has issued command RETR!");
 
-		/*
-		 * Successfully obtained information regarding the client's
-		 * connection
-		 */
-		else {
-			/*
-			 * Use a helper function to connect
-			 * to the client's IP Address,
-			 * but in a *different* port than the
-			 * regular command transfers.
-			 * This different port, used for data transfers, was
-			 * provided earlier via the PORT command.
-			 */
-			current_context->data_fd =
-			get_active_client_connection(hoststr,
-				current_context->PORT);
+	int err;
+	// Get the specific filename for retrieval
+	char * filename = strtok_r(NULL, " ",
+		&current_context->token_state);
+	// Resume the download at the offset given with REST
+	off_t offset = current_context->restart_offset;
+	current_context->restart_offset = 0;
 
-			/*
-			 * If we for some reason fail when trying to connect to
-			 * the client port for active FTP, we inform the client
-			 */
-			if (current_context->data_fd < 0) {
-				nwrite = write(current_context->client_comm_fd,
-					"425 can't open data connection\r\n",
-					strlen("425 can't open\
-						data connection\r\n"));
-				return;
-			}
-		}
+	/*
+	 * Open the file through the file cache, returning an
+	 * error to the client if something went wrong; only
+	 * regular files can be retrieved
+	 */
+	file_entry_t * file = filename == NULL ? NULL :
+		file_cache_open(current_context->cwd_fd, filename);
 
-		/*
-		 * After obtaining the active client connection,
-		 * we call the STOR function to
-		 * write the bytes of the client connection into the file
-		 */
-		err = STOR(file_fd, current_context->data_fd,
-			current_context->binary_flag);
+	if (file == NULL) {
+		reply_queue(current_context, REPLY_FILE_ACCESS_ERROR);
+		return;
+	}
 
-		if (err < 0)
-			nwrite = write(current_context->client_comm_fd,
-				"451 Local error in processing\r\n",
-				strlen("451 Local error in processing\r\n"));
-		else
-			nwrite = write(current_context->client_comm_fd,
-				"226 Transfer complete\r\n",
-				strlen("226 Transfer complete\r\n"));
+	if (check_restart_offset(current_context, file->fd, offset) < 0) {
+		file_cache_release(file);
+		return;
+	}
 
-		// Close the associated file descriptors
-		close(file_fd);
-		close(current_context->data_fd);
+	/*
+	 * Connect to the client and inform it that we are ready
+	 * to transfer the requested file
+	 */
+	int data_fd = open_data_connection(current_context,
+		REPLY_OPENING_TRANSFER);
+	if (data_fd < 0) {
+		file_cache_release(file);
+		return;
 	}
 
+	/*
+	 * Call the RETR command, and if we encounter
+	 * an error during data transfer,
+	 * we inform the client
+	 */
+	err = metered_RETR(current_context, file, data_fd,
+		current_context->binary_flag, offset);
+	transfer_done(current_context, err, REPLY_FILE_ERROR,
+		REPLY_TRANSFER_COMPLETE);
+
+	// Close the file descriptor to the file, and the data connection
+	file_cache_release(file);
+	close_data_connection(current_context, data_fd);
+}
+
+// Used to accomplish the RMD FTP command
+void
+RMD_HANDLER(client_context_t * current_context) {
+	log_debug("Client has issued command RMD!");
+
+	int err;
+	// Obtain the directory name for removal
+	const char * dirname = strtok_r(NULL, " ",
+		&current_context->token_state);
+
+	// Then simply remove the specified directory
+	err = dirname == NULL ? -1 :
+		unlinkat(current_context->cwd_fd, dirname, AT_REMOVEDIR);
+	if (err < 0)
+		reply_queue(current_context, REPLY_LOCAL_ERROR);
+	else
+		reply_queue(current_context, REPLY_REMOVAL_COMPLETE);
 }
 
-// Handle for the FTP APPE Command
+// Used to accomplish the MKD FTP command
 void
-APPE_HANDLER(client_context_t * current_context) {
-	print_debug("Client has issued command APPE!\n");
+MKD_HANDLER(client_context_t * current_context) {
+	log_debug("Client has issued command MKD!");
 
-	ssize_t nwrite;
 	int err;
-	// Obtain the filename of the file to be created
-	char * filename = strtok(NULL, " ");
+	// Obtain the directory name for removal
+	const char * dirname = strtok_r(NULL, " ",
+		&current_context->token_state);
 
-	// Declare the file descriptor corresponding to the new file
-	int file_fd;
+	// Then simply make the specified new directory
+	err = dirname == NULL ? -1 :
+		mkdirat(current_context->cwd_fd, dirname, 0755);
+	if (err < 0)
+		reply_queue(current_context, REPLY_LOCAL_ERROR);
+	else
+		reply_queue(current_context, REPLY_CREATION_COMPLETE);
+}
 
-	// Open a new file descriptor to append to the file
-	file_fd = open(filename, O_CREAT | O_APPEND, 0644);
+/*
+ * Handle for the REST FTP command, which makes the next
+ * RETR, STOR or APPE start at the given byte offset
+ */
+void
+REST_HANDLER(client_context_t * current_context) {
+	log_debug("Client has issued command REST!");
+
+	char * marker = strtok_r(NULL, " ",
+		&current_context->token_state);
+	char * end = NULL;
+	long long offset = -1;
+
+	if (marker != NULL && marker[0] >= '0' && marker[0] <= '9') {
+		errno = 0;
+		offset = strtoll(marker, &end, 10);
+		if (errno != 0 || *end != '\0')
+			offset = -1;
+	}
 
-	// Error in opening file descriptor, so we inform the client
-	if (file_fd < 0) {
-		nwrite =
-		write(current_context->client_comm_fd,
-			"452 file unavailable\r\n", strlen("452 file \
-				unavailable\r\n"));
-		if (nwrite < 0)
-			error("Error on communicating file \
-				unavailable to client.\n");
+	if (offset < 0) {
+		reply_queue(current_context, REPLY_INVALID_RESTART);
+		return;
 	}
 
-	// Else we inform client of successful opening of file for appending
-	else {
-		nwrite = write(current_context->client_comm_fd,
-			"150 Opening file transfer data connection\r\n",
-			strlen("150 Opening file transfer\
-				data connection\r\n"));
+	current_context->restart_offset = (off_t)offset;
+	reply_printf(current_context, "350 Restarting at %lld\r\n", offset);
+}
 
-		if (nwrite < 0)
-			error("Error on communicating APPE file opening \
-				success to client.\n");
-	}
+// Sends a batch of MLSD entries over the data connection
+static int
+mlsd_send(void * arg, const char * buffer, size_t len) {
 
-	/*
-	 * Handle the case where the client has currently chosen passive
-	 * mode to be their
-	 * desired form of data transfer
-	 */
-	if (!current_context->active_flag) {
-		struct sockaddr_storage temp;
-		socklen_t len = (socklen_t)sizeof (struct sockaddr_storage);
+	if (send_data(*(int *)arg, buffer, len) < 0)
+		return (-1);
 
-		/*
-		 * 'Accept' the incoming client
-		 * connection to our established socket
-		 */
-		int client_data_fd = accept(current_context->data_fd,
-			(struct sockaddr *)&temp, &len);
+	metrics_count(METRIC_LIST_BYTES, len);
+	return (0);
+}
 
-		if (client_data_fd < 0)
-			error("Error on accepting client channel\
-				for data transfer.\n");
+// Compresses a batch of MLSD entries onto the data connection
+static int
+mlsd_send_compressed(void * arg, const char * buffer, size_t len) {
 
-		/*
-		 * Using append mode, we again call the STOR command, and
-		 * if we encounter an error during data transfer, we
-		 * inform the client
-		 */
-		err = STOR(file_fd,
-			client_data_fd,
-			current_context->binary_flag);
-		if (err < 0)
-			nwrite = write(current_context->client_comm_fd,
-				"451 Local error in file processing\r\n",
-				strlen("451 Local error \
-					in file processing\r\n"));
-		else
-			nwrite = write(current_context->client_comm_fd,
-				"226 Transfer complete\r\n",
-				strlen("226 Transfer complete\r\n"));
+	if (zmode_write(arg, buffer, len) < 0)
+		return (-1);
 
-		/*
-		 * Close the file descriptor to the file, and the socket
-		 * descriptors that connect to the client.
-		 * Note that this ends the current passive mode connection;
-		 * a new connection will have to be established
-		 * before performing further transfers
-		 */
-		close(file_fd);
-		close(client_data_fd);
-		close(current_context->data_fd);
-	}
+	metrics_count(METRIC_LIST_BYTES, len);
+	return (0);
+}
 
-	/*
-	 * Handle the case where the client has
-	 * currently chosen active mode to be their
-	 * desired form of data transfer
-	 */
-	else {
-		socklen_t len = sizeof (struct sockaddr_storage);
+/*
+ * Stream the MLSD listing of a directory over the data
+ * connection, compressed in MODE Z; returns 0 or -1
+ */
+static int
+stream_mlsd(client_context_t * current_context, int dir_fd, int data_fd) {
 
-		/*
-		 * Keep track of the IP address and the port of the client:
-		 * we will be transferring the bytes
-		 * of the file to this port
-		 */
-		char hoststr[NI_MAXHOST];
-		char portstr[NI_MAXSERV];
+	if (!current_context->compress_flag)
+		return (mlsx_stream_dir(dir_fd, mlsd_send, &data_fd));
 
-		/*
-		 * Obtain the IP Address and
-		 * port number of the current
-		 * client connection
-		 */
-		err =
-		getnameinfo((struct sockaddr *)&(current_context->client_addr),
-			len, hoststr,
-			sizeof (hoststr), portstr, sizeof (portstr),
-			NI_NUMERICHOST | NI_NUMERICSERV);
-
-		// Handle error situations in processing the client connection
-		if (err != 0) {
-			nwrite = write(current_context->client_comm_fd,
-				"425 can't open data connection\r\n",
-				strlen("425 can't open data connection\r\n"));
-			if (nwrite < 0)
-				error("Error on communicating data\
-				 connection error \
-					to client.\n");
-			return;
-		}
+	zmode_writer_t writer;
+	if (zmode_writer_open(&writer, current_context->zmode,
+		current_context->compression_level, data_fd) < 0)
+		return (-1);
 
-		/*
-		 * Successfully obtained information regarding the
-		 * client's connection
-		 */
-		else {
-			/*
-			 * Use a helper function to connect to the
-			 * client's IP Address,
-			 * but in a *different* port than the
-			 * regular command transfers.
-			 * This different port, used for data transfers, was
-			 * provided earlier via the PORT command
-			 */
-			current_context->data_fd =
-			get_active_client_connection(hoststr,
-				current_context->PORT);
+	int err = mlsx_stream_dir(dir_fd, mlsd_send_compressed, &writer);
+	if (zmode_writer_close(&writer, err == 0) < 0)
+		err = -1;
 
-			/*
-			 * If we for some reason fail when trying to connect
-			 * to the client port for active FTP,
-			 * we inform the client
-			 */
-			if (current_context->data_fd < 0)
-			{
-				nwrite = write(current_context->client_comm_fd,
-					"425 can't open data connection\r\n",
-					strlen("425 can't open \
-						data connection\r\n"));
-				return;
-			}
-		}
+	return (err);
+}
+
+/*
+ * Handle for the MLSD FTP command, which lists a directory
+ * with the facts of every entry (RFC 3659)
+ */
+void
+MLSD_HANDLER(client_context_t * current_context) {
+	log_debug("Client has issued command MLSD!");
+
+	// The directory to list; the current one if none is given
+	char * dirname = strtok_r(NULL, "",
+		&current_context->token_state);
+
+	int dir_fd = current_context->cwd_fd;
+	if (dirname != NULL)
+		dir_fd = openat(current_context->cwd_fd, dirname,
+			O_RDONLY | O_DIRECTORY);
+
+	if (dir_fd < 0) {
+		reply_queue(current_context, REPLY_DIRECTORY_UNAVAILABLE);
+		return;
+	}
 
+	int data_fd = open_data_connection(current_context,
+		REPLY_OPENING_MLSD);
+	if (data_fd >= 0) {
 		/*
-		 * After obtaining the active
-		 * client connection,
-		 * we call the STOR function with
-		 * our file descriptor in 'append' mode
-		 * to write the bytes of the client connection into the file
+		 * Entries go out in batches as they are read, so
+		 * large directories start arriving right away
 		 */
-		err = STOR(file_fd, current_context->data_fd,
-			current_context->binary_flag);
-
+		unsigned long long start = get_time_ns();
+		event_loop_watch_transfer(current_context, data_fd);
+		int err = stream_mlsd(current_context, dir_fd, data_fd);
+		event_loop_unwatch_transfer(current_context);
+		metrics_record(METRIC_LIST_TRANSFER, get_time_ns() - start);
 		if (err < 0)
-			nwrite = write(current_context->client_comm_fd,
-				"451 Local error in processing\r\n",
-				strlen("451 Local error in processing\r\n"));
-		else
-			nwrite = write(current_context->client_comm_fd,
-				"226 Transfer complete\r\n",
-				strlen("226 Transfer complete\r\n"));
+			metrics_count(METRIC_TRANSFER_ERRORS, 1);
+		close_data_connection(current_context, data_fd);
 
-		// Close the associated file descriptors
-		close(file_fd);
-		close(current_context->data_fd);
+		transfer_done(current_context, err, REPLY_LOCAL_ERROR,
+			REPLY_DIRECTORY_LISTED);
 	}
 
+	if (dir_fd != current_context->cwd_fd)
+		close(dir_fd);
 }
 
-// Handle for the RETR FTP command
+/*
+ * Handle for the MLST FTP command, which sends the facts of
+ * a single file over the control connection (RFC 3659)
+ */
 void
-RETR_HANDLER(client_context_t * current_context) {
-	print_debug("Client has issued command RETR!\n");
+MLST_HANDLER(client_context_t * current_context) {
+	log_debug("Client has issued command MLST!");
 
-	ssize_t nwrite;
+	// The file to describe; the current directory if none is given
+	char * filename = strtok_r(NULL, "",
+		&current_context->token_state);
+	struct stat st;
 	int err;
-	// Get the specific filename for retrieval
-	char * filename = strtok(NULL, " ");
-
-	/*
-	 * Open the file, returning an error to the
-	 * client if something went wrong
-	 */
-	int file_fd = open(filename, O_RDONLY);
-	if (file_fd < 0) {
-		nwrite = write(current_context->client_comm_fd,
-			"550 Error during file access \r\n",
-			strlen("550 Error during file access \r\n"));
-		if (nwrite < 0)
-			error("Error on communicating \
-				file access error code to client.\n");
-	}
 
-	// Inform the client that we are ready to transfer the requested file.
-	else {
-		nwrite = write(current_context->client_comm_fd,
-			"150 Opening file transfer data connection\r\n",
-			strlen("150 Opening file transfer \
-				data connection\r\n"));
-
-		if (nwrite < 0)
-			error("Error on communicating file transfer \
-				information to client.\n");
+	if (filename == NULL) {
+		filename = current_context->current_working_directory;
+		err = fstat(current_context->cwd_fd, &st);
 	}
+	else
+		err = fstatat(current_context->cwd_fd, filename, &st, 0);
 
-	/*
-	 * Handle the case where the client has currently
-	 * chosen passive mode to be their
-	 * desired form of data transfer
-	 */
-	if (!current_context->active_flag) {
-		struct sockaddr_storage temp;
-		socklen_t len = (socklen_t)sizeof (struct sockaddr_storage);
-		/*
-		 * 'Accept' the incoming client connection
-		 * to our established socket
-		 */
-		int client_data_fd = accept(current_context->data_fd,
-			(struct sockaddr *)&temp, &len);
-		if (client_data_fd < 0)
-			error("Error on accepting passive \
-				client connection for data transfer\
-				during RETR.\n");
-
-		/*
-		 * Call the RETR command, and if we encounter
-		 * an error during data transfer,
-		 * we inform the client
-		 */
-		err = RETR(file_fd,
-			client_data_fd,
-			current_context->binary_flag);
-		if (err < 0)
-			nwrite = write(current_context->client_comm_fd,
-				"451 Local error in file\
-				processing\r\n",
-				strlen("451 Local error\
-				 in file processing\r\n"));
-		else
-			nwrite = write(current_context->client_comm_fd,
-				"226 Transfer complete\r\n",
-				strlen("226 Transfer complete\r\n"));
+	// The facts line of the reply starts with a space
+	char facts[1 + MLSX_MAX_FACTS_SIZE + PATH_MAX];
+	int len = err < 0 ? -1 :
+		mlsx_format_entry(facts + 1, sizeof (facts) - 1, &st, NULL,
+		filename);
 
-		/*
-		 * Close the file descriptor to the file,
-		 * and the socket descriptors that connect to the client.
-		 * Note that this ends the current passive mode connection;
-		 * a new connection will have to be established
-		 * before performing further transfers
-		 */
-		close(file_fd);
-		close(client_data_fd);
-		close(current_context->data_fd);
+	if (len < 0) {
+		reply_queue(current_context, REPLY_FILE_UNAVAILABLE);
+		return;
 	}
 
-	/*
-	 * Handle the case where the client has currently chosen
-	 * active mode to be their
-	 * desired form of data transfer
-	 */
-	else {
-		socklen_t len = sizeof (struct sockaddr_storage);
+	facts[0] = ' ';
+	reply_lines(current_context, 250, "Listing", facts, len + 1, "End");
+}
 
-		/*
-		 * Keep track of the IP address and the port of the client:
-		 * we will be transferring the bytes
-		 * of the file to this port
-		 */
-		char hoststr[NI_MAXHOST];
-		char portstr[NI_MAXSERV];
+/*
+ * The name a directory's entries are archived under: the last
+ * component of its path, or none for the root and the like
+ */
+static void
+archive_prefix(const char * path, char * prefix, size_t size) {
+
+	size_t len = strlen(path);
+	while (len > 0 && path[len - 1] == '/')
+		len--;
+	size_t start = len;
+	while (start > 0 && path[start - 1] != '/')
+		start--;
+
+	len -= start;
+	if ((len == 1 && path[start] == '.') ||
+		(len == 2 && path[start] == '.' && path[start + 1] == '.') ||
+		len >= size)
+		len = 0;
+	memcpy(prefix, path + start, len);
+	prefix[len] = '\0';
+}
 
-		/*
-		 * Obtain the IP Address and port number of the
-		 * current client connection
-		 */
-		err =
-		getnameinfo((struct sockaddr *)&(current_context->client_addr),
-			len, hoststr, sizeof (hoststr),
-			portstr, sizeof (portstr),
-			NI_NUMERICHOST | NI_NUMERICSERV);
-
-		// Handle error situations in processing the client connection
-		if (err != 0) {
-			nwrite = write(current_context->client_comm_fd,
-				"425 can't open data connection\r\n",
-				strlen("425 can't open data connection\r\n"));
-			if (nwrite < 0)
-				error("Error on communicating data \
-					connection error to client.\n");
-			return;
-		}
+/*
+ * SITE TARGET <dir> sends a whole directory tree as a tar
+ * archive over a single data connection, compressed in MODE Z;
+ * the current directory if none is given. Its files go out
+ * in whatever order the walk finds them.
+ */
+static void
+SITE_TARGET(client_context_t * current_context) {
 
-		/*
-		 * Successfully obtained information regarding the
-		 * client's connection
-		 */
-		else {
-			/*
-			 * Use a helper function to connect
-			 * to the client's IP Address,
-			 * but in a *different* port than the
-			 * regular command transfers.
-			 * This different port, used for data transfers, was
-			 * provided earlier via the PORT command
-			 */
-			current_context->data_fd =
-			get_active_client_connection(hoststr,
-				current_context->PORT);
+	char * dirname = strtok_r(NULL, "",
+		&current_context->token_state);
 
-			/*
-			 * If we for some reason fail when trying to connect
-			 * to the
-			 * client port for active FTP, we inform the client
-			 */
-			if (current_context->data_fd < 0) {
-				nwrite = write(current_context->client_comm_fd,
-					"425 can't open active\
-					data connection\r\n",
-					strlen("425 can't open active \
-						data connection\r\n"));
-				return;
-			}
-		}
+	int dir_fd = openat(current_context->cwd_fd,
+		dirname != NULL ? dirname : ".", O_RDONLY | O_DIRECTORY);
+	if (dir_fd < 0) {
+		reply_queue(current_context, REPLY_DIRECTORY_UNAVAILABLE);
+		return;
+	}
 
-		/*
-		 * After obtaining the active client connection,
-		 * we call the RETR function to pass the bytes
-		 * of the file to the client
-		 */
-		err = RETR(file_fd, current_context->data_fd,
-			current_context->binary_flag);
-		if (err < 0)
-			nwrite = write(current_context->client_comm_fd,
-				"451 Local error in file processing\r\n",
-				strlen("451 Local error\
-					in file processing\r\n"));
+	char prefix[NAME_MAX + 1];
+	archive_prefix(dirname != NULL ? dirname :
+		current_context->current_working_directory, prefix,
+		sizeof (prefix));
+
+	int data_fd = open_data_connection(current_context,
+		REPLY_OPENING_ARCHIVE);
+	if (data_fd >= 0) {
+		// An archive is a download, so it is metered as a RETR
+		unsigned long long start = get_time_ns();
+		event_loop_watch_transfer(current_context, data_fd);
+		off_t nsent = archive_send_tree(dir_fd, prefix, data_fd,
+			current_context->compress_flag ? current_context->zmode :
+			NULL, current_context->compression_level);
+		event_loop_unwatch_transfer(current_context);
+		metrics_record(METRIC_RETR_TRANSFER, get_time_ns() - start);
+		if (nsent < 0)
+			metrics_count(METRIC_TRANSFER_ERRORS, 1);
 		else
-			nwrite = write(current_context->client_comm_fd,
-				"226 Transfer complete\r\n",
-				strlen("226 Transfer complete\r\n"));
+			metrics_count(METRIC_RETR_BYTES, nsent);
+		close_data_connection(current_context, data_fd);
 
-		// Close the associated file descriptors
-		close(file_fd);
-		close(current_context->data_fd);
+		transfer_done(current_context, nsent < 0 ? -1 : 0,
+			REPLY_LOCAL_ERROR, REPLY_ARCHIVE_SENT);
 	}
+
+	close(dir_fd);
 }
 
-// Used to accomplish the RMD FTP command
+/*
+ * Handle for the SITE FTP command; its only subcommand
+ * is TARGET, which downloads a directory as an archive
+ */
 void
-RMD_HANDLER(client_context_t * current_context) {
-	print_debug("Client has issued command RMD!\n");
+SITE_HANDLER(client_context_t * current_context) {
+	log_debug("Client has issued command SITE!");
 
-	ssize_t nwrite;
-	int err;
-	// Obtain the directory name for removal
-	const char * dirname = strtok(NULL, " ");
+	char * subcommand = strtok_r(NULL, " ",
+		&current_context->token_state);
 
-	// Then simply remove the specified directory
-	err = rmdir(dirname);
-	if (err < 0)
-		nwrite = write(current_context->client_comm_fd,
-			"451 Local error in processing\r\n",
-			strlen("451 Local error in processing\r\n"));
+	if (subcommand != NULL && strcasecmp(subcommand, "TARGET") == 0)
+		SITE_TARGET(current_context);
 	else
-		nwrite = write(current_context->client_comm_fd,
-			"226 Removal complete\r\n",
-			strlen("226 Removal complete\r\n"));
-	if (nwrite < 0)
-		error("Error on informing client\
-			about successful directory\
-			removal.");
+		reply_queue(current_context, REPLY_SITE_NOT_IMPLEMENTED);
 }
 
-// Used to accomplish the MKD FTP command
-void
-MKD_HANDLER(client_context_t * current_context) {
-	print_debug("Client has issued command MKD!\n");
 
-	ssize_t nwrite;
-	int err;
-	// Obtain the directory name for removal
-	const char * dirname = strtok(NULL, " ");
+/*
+ * Sends a buffer over a data connection, through the
+ * io_uring backend when it is enabled
+ */
+ssize_t
+send_data(int data_fd, const char * buffer, size_t len) {
 
-	// Then simply make the specified new directory
-	err = mkdir(dirname, 0644);
-	if (err < 0)
-		nwrite = write(current_context->client_comm_fd,
-			"451 Local error in processing\r\n",
-			strlen("451 Local error in processing\r\n"));
-	else
-		nwrite = write(current_context->client_comm_fd,
-			"226 Directory creation complete\r\n",
-			strlen("226 Directory creation complete\r\n"));
-	if (nwrite < 0)
-		error("Error on informing client\
-			about successful directory\
-			removal.");
-}
+	ssize_t nwrite = uring_send_buffer(data_fd, buffer, len);
+	if (nwrite < 0 && errno == ENOSYS)
+		nwrite = write_all(data_fd, buffer, len);
 
+	return (nwrite);
+}
 
 /*
- * Returns a list of the contents of the inputted working directory;
- * used in conjunction with the LIST command
+ * Returns a list of the contents of the inputted working directory
+ * and stores its length in len; used in conjunction with the
+ * LIST command. The list is not NUL-terminated.
  */
 char *
-LIST(char * dir_name) {
-	// Open the inputted working directory
-	DIR * d;
-	d = opendir(dir_name);
+LIST(int dir_fd, size_t * len) {
+	/*
+	 * Open the inputted working directory. The session keeps
+	 * its descriptor for resolving paths, so read the entries
+	 * through a descriptor of our own with a fresh offset.
+	 */
+	int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return (NULL);
+
+	DIR * d = fdopendir(fd);
+	if (d == NULL) {
+		log_warn("Error opening directory for LIST: %s", strerror(errno));
+		close(fd);
+		return (NULL);
+	}
 
 	/*
 	 * Initialize the variable holding the list of directory contents;
-	 *  max_size is an upper limit: 4096 * 3 = 12288.
-	 * We will later 'realloc' it if the need arises
+	 * the buffer doubles whenever it fills up, so every name is
+	 * copied once and building the list stays linear
 	 */
-	long max_size = 12288;
-	char * full_list = calloc(max_size, 1);
-	long cur_size = 0;
-
-	if (d == 0) {
-		print_debug("Error opening directory: ");
-		print_debug(dir_name);
-		print_debug("\n");
-
-		// TODO: RETURN ERROR MESSAGE TO CLIENT INSTEAD OF EXITING
-		printf("%s\n", dir_name);
-		fflush(stdout);
-		error("Error opening directory for client LIST command");
+	size_t max_size = 12288;
+	size_t cur_size = 0;
+	char * full_list = malloc(max_size);
+	if (full_list == NULL) {
+		closedir(d);
+		return (NULL);
 	}
 
 	struct dirent * cur_dir_entry;
-	cur_dir_entry = readdir(d);
-
-	while (cur_dir_entry != NULL) {
+	while ((cur_dir_entry = readdir(d)) != NULL) {
 
 		// Ignore hidden directories or control directories
-		if (cur_dir_entry->d_name[0] == '.') {
-			cur_dir_entry = readdir(d);
+		if (cur_dir_entry->d_name[0] == '.')
 			continue;
-		}
 
-		/*
-		 * If the directory contents length goes
-		 * above the allotted size,
-		 * we reallocate the buffer
-		 */
-		if (cur_size + strlen(cur_dir_entry->d_name) > max_size-2) {
-			max_size += 4096;
-			full_list = realloc(full_list, max_size);
+		size_t name_len = strlen(cur_dir_entry->d_name);
+		if (cur_size + name_len + 2 > max_size) {
+			while (cur_size + name_len + 2 > max_size)
+				max_size *= 2;
+			char * grown = realloc(full_list, max_size);
+			if (grown == NULL) {
+				free(full_list);
+				closedir(d);
+				return (NULL);
+			}
+			full_list = grown;
 		}
 
-		strcat(full_list, cur_dir_entry->d_name);
-		strcat(full_list, "\r\n");
-		cur_dir_entry = readdir(d);
+		memcpy(full_list + cur_size, cur_dir_entry->d_name, name_len);
+		memcpy(full_list + cur_size + name_len, "\r\n", 2);
+		cur_size += name_len + 2;
 	}
 	closedir(d);
 
+	*len = cur_size;
 	// Return the directory contents
 	return (full_list);
 }
@@ -1479,86 +1909,68 @@ LIST(char * dir_name) {
  * Initialize a 'listen'ing server for a
  * any port number on the local machine;
  * used in conjunction with the Passive FTP module.
+ * Returns -1, with *data_fd set to -1, if no socket
+ * could be set up, as when descriptors run out.
  */
-struct sockaddr_storage
+int
 initiate_server_PASV(int * data_fd, int IPV4FLAG) {
 
 	int err;
 	struct sockaddr_storage my_addr;
+	socklen_t my_addr_len;
 
 	if (!IPV4FLAG) {
 		struct sockaddr_in * my_addr4 = (struct sockaddr_in*)&my_addr;
 
 		*data_fd = socket(AF_INET, SOCK_STREAM, 0);
-		if (*data_fd < 0) {
-			error("Error on initiating server!\n");
-		}
-
-		// Allow socket to be reused
-		if (setsockopt(*data_fd, SOL_SOCKET, SO_REUSEADDR, \
-			&(int){ 1 }, sizeof(int)) < 0)
-    		error("setsockopt(SO_REUSEADDR) failed");
 
-    	memset(my_addr4, 0, sizeof(*my_addr4));
+		memset(my_addr4, 0, sizeof(*my_addr4));
 
 		my_addr4->sin_family = AF_INET;
 		my_addr4->sin_port = 0;     // short, network byte order
 		my_addr4->sin_addr.s_addr = INADDR_ANY;
-		memset(my_addr4->sin_zero, '\0', sizeof my_addr4->sin_zero);
-
-		err = bind(*data_fd, (struct sockaddr *)my_addr4, sizeof *my_addr4);
-		if (err == -1)
-				error("Error on binding during\
-					initiate server.\n");
-
-		print_debug("Initiating server on port: ");
-		printf("%hu",my_addr4->sin_port);
-		print_debug("\n");
+		my_addr_len = sizeof (*my_addr4);
 	}
 	else {
 		struct sockaddr_in6 * my_addr6 = (struct sockaddr_in6 *)&my_addr;
 
 		*data_fd = socket(AF_INET6, SOCK_STREAM, 0);
-		if (*data_fd < 0) {
-			error("Error on initiating server!\n");
-		}
-
-		// Allow socket to be reused
-		if (setsockopt(*data_fd, SOL_SOCKET, SO_REUSEADDR, \
-			&(int){ 1 }, sizeof(int)) < 0)
-    		error("setsockopt(SO_REUSEADDR) failed");
 
-    	memset(my_addr6, 0, sizeof(*my_addr6));
+		memset(my_addr6, 0, sizeof(*my_addr6));
 
 		my_addr6->sin6_family = AF_INET6;
 		my_addr6->sin6_port = 0;     // short, network byte order
 		my_addr6->sin6_addr = in6addr_any;
-
-		err = bind(*data_fd, (struct sockaddr *)my_addr6, sizeof *my_addr6);
-		if (err == -1)
-				error("Error on binding during\
-					initiate server.\n");
-
-		print_debug("Initiating server on port: ");
-		printf("%hu",my_addr6->sin6_port);
-		print_debug("\n");
+		my_addr_len = sizeof (*my_addr6);
+	}
+	if (*data_fd < 0)
+		return (-1);
+
+	// Allow socket to be reused
+	err = setsockopt(*data_fd, SOL_SOCKET, SO_REUSEADDR,
+		&(int){ 1 }, sizeof(int));
+	if (err == 0)
+		err = bind(*data_fd, (struct sockaddr *)&my_addr, my_addr_len);
+	if (err == 0)
+		err = listen(*data_fd, MAX_NUM_CONNECTED_CLIENTS);
+	if (err == -1) {
+		close(*data_fd);
+		*data_fd = -1;
+		return (-1);
 	}
 
-
-	err = listen(*data_fd, MAX_NUM_CONNECTED_CLIENTS);
-			if (err == -1)
-				error("Error on listen during\
-					initiate server.\n");
-
-	return (my_addr);
+	return (0);
 }
 
 /*
  * Initialize a 'listen'ing server for a
  * specific port number on the local machine.
+ * With reuse_port set, several sockets can listen on
+ * the same port and the kernel spreads connections
+ * between them.
  */
 int
-initiate_server(long port) {
+initiate_server(long port, int backlog, int reuse_port) {
 
 	int err, fd = 0;
 	struct addrinfo hints;
@@ -1571,12 +1983,10 @@ initiate_server(long port) {
 	hints.ai_protocol = IPPROTO_TCP;
 	hints.ai_flags = AI_PASSIVE;
 
-	char * port_pointer = calloc(10,1);
-	sprintf(port_pointer, "%ld", port);
+	char port_pointer[NI_MAXSERV];
+	snprintf(port_pointer, sizeof (port_pointer), "%ld", port);
 
-	print_debug("Initiating server on port: ");
-	print_debug(port_pointer);
-	print_debug("\n");
+	log_info("Initiating server on port: %s", port_pointer);
 
 
 	/*
@@ -1610,15 +2020,31 @@ initiate_server(long port) {
 				error("Error on socket during\
 					initiate server.\n");
 
+#ifdef SO_REUSEPORT
+			// Share the port with the other acceptors
+			if (reuse_port && setsockopt(fd, SOL_SOCKET,
+				SO_REUSEPORT, &(int){ 1 }, sizeof(int)) < 0)
+				error("setsockopt(SO_REUSEPORT) failed");
+#endif
+
 			err = bind(fd, res->ai_addr, res->ai_addrlen);
 			if (err == -1)
 				error("Error on binding during\
 					initiate server.\n");
 
-			err = listen(fd, MAX_NUM_CONNECTED_CLIENTS);
+			err = listen(fd, backlog);
 			if (err == -1)
 				error("Error on listen during\
 					initiate server.\n");
+
+			/*
+			 * Accept loops drain the backlog until the
+			 * socket would block
+			 */
+			err = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			if (err == -1)
+				error("Error on fcntl during\
+					initiate server.\n");
 			break;
 		}
 	}
@@ -1626,8 +2052,6 @@ initiate_server(long port) {
 	// Free allocated resources, and return the socket file descriptor
 	freeaddrinfo(res_original);
 	res_original = NULL;
-	free(port_pointer);
-	port_pointer = NULL;
 	return (fd);
 }
 
@@ -1636,96 +2060,78 @@ initiate_server(long port) {
  * receives bytes from the data file descriptor argument,
  * and writes the bytes into the file descriptor
  */
-int
-STOR(int file_fd, int data_fd, int binary_flag) {
+off_t
+STOR(int file_fd, int data_fd, int binary_flag, off_t offset) {
 
-	ssize_t nwrite;
+	// A resumed upload continues at the restart offset
+	if (offset > 0 && lseek(file_fd, offset, SEEK_SET) < 0)
+		return (-1);
+	off_t nstored = 0;
 
 	if (!binary_flag) {
 
-		// Instantiate buffer for holding partial contents of read input
-		int current_length = 4098;
-		char * buf_ptr = calloc(current_length, 1);
-
-		FILE * data_stream = fdopen(data_fd, "r+");
-		if (!data_stream)
-			return (-1);
-
 		/*
-		 * ASCII Mode - read the file's contents line by line,
-		 * replacing new line feeds
-		 * with a \r\n
+		 * ASCII Mode - read the upload in large blocks and turn
+		 * the network's CRLF line endings back into line feeds
 		 */
-		while ((current_length =
-				readline(data_stream,
-					buf_ptr, current_length)) != -1) {
-
-
-			char * read_content = calloc(current_length+2, 1);
-			sprintf(read_content, "%s\r\n", buf_ptr);
-
-			nwrite = write(file_fd,
-				read_content,
-				strlen(read_content));
-			if (nwrite < 0)
-				return (-1);
-
-			free(read_content);
-			read_content = NULL;
-			memset(buf_ptr, 0, strlen(buf_ptr));
+		// Blocks are read into a pooled buffer and converted past them
+		char * in = buffer_pool_get();
+		if (in == NULL)
+			return (-1);
+		char * out = in + CRLF_BLOCK_SIZE;
+
+		crlf_state_t state;
+		crlf_init(&state);
+		ssize_t nread;
+		int err = 0;
+
+		while ((nread = read(data_fd, in, CRLF_BLOCK_SIZE)) != 0) {
+			if (nread < 0) {
+				if (errno == EINTR)
+					continue;
+				err = -1;
+				break;
+			}
+			size_t len = crlf_collapse(&state, in, nread, out);
+			if (write_all(file_fd, out, len) < 0) {
+				err = -1;
+				break;
+			}
+			nstored += len;
 		}
 
-		// Make one last write to flush all residual data
-		char * read_content = calloc(current_length+2, 1);
-		sprintf(read_content, "%s\r\n", buf_ptr);
-		nwrite = write(file_fd, read_content, strlen(read_content));
-		if (nwrite < 0)
-			return (-1);
-		free(read_content);
-		read_content = NULL;
+		size_t len = crlf_collapse_finish(&state, out);
+		if (err == 0 && len > 0 && write_all(file_fd, out, len) < 0)
+			err = -1;
+		nstored += len;
 
-		fclose(data_stream);
-		free(buf_ptr);
-		buf_ptr = NULL;
+		buffer_pool_put(in);
+		if (err < 0)
+			return (-1);
 	}
 
 	if (binary_flag) {
 
-		// File handler and variable to hold the contents
-		FILE * data_stream;
-		char * contents;
-		int file_size = 0;
-
-		// Open the file stream in read binary mode.
-		data_stream = fdopen(data_fd, "rb");
-
-		// Determine the file size
-		fseek(data_stream, 0L, SEEK_END);
-		file_size = ftell(data_stream);
-		fseek(data_stream, 0L, SEEK_SET);
-
-		// Allocate memory for the file's contents
-		contents = malloc(file_size+1);
-
 		/*
-		 * Read the file, and dump the content
-		 * into the variable 'contents'
+		 * Binary Mode - move the bytes from the data connection
+		 * straight into the file as they arrive. Memory use stays
+		 * constant no matter how large the upload is.
 		 */
-		size_t size = fread(contents, 1, file_size, data_stream);
-		contents[size] = 0; // Add terminating zero.
-
-		// Write the file's contents
-		nwrite = write(file_fd, contents, size);
-		if (nwrite < 0)
+		nstored = uring_recv_file(data_fd, file_fd, offset);
+		if (nstored < 0 && errno == ENOSYS)
+			nstored = splice_fd(data_fd, file_fd);
+		if (nstored < 0)
 			return (-1);
-
-		// Clean up
-		fclose(data_stream);
-		free(contents);
-		contents = NULL;
 	}
 
-	return (0);
+	/*
+	 * Anything the file held past the resumed upload belongs
+	 * to the interrupted one, so cut it off
+	 */
+	if (offset > 0 && ftruncate(file_fd, offset + nstored) < 0)
+		return (-1);
+
+	return (nstored);
 }
 
 /*
@@ -1733,94 +2139,99 @@ STOR(int file_fd, int data_fd, int binary_flag) {
  * and write it into the data descriptor.
  * Used in conjunction with a client request to get a file
  */
-int
-RETR(int file_fd, int data_fd, int binary_flag) {
+off_t
+RETR(int file_fd, int data_fd, int binary_flag, off_t offset) {
 
-	ssize_t nwrite;
+	off_t nsent = 0;
 
 	if (!binary_flag) {
 
 		/*
-		 * Instantiate buffer for holding
-		 * partial contents of read input
+		 * ASCII Mode - read the file in large blocks and send
+		 * every line feed as CRLF, one write per block
 		 */
-		int current_length = 4096;
-		char * buf_ptr = calloc(current_length, 1);
-
-		FILE * file_stream = fdopen(file_fd, "r");
-		if (!file_stream)
+		// Blocks are read into a pooled buffer and converted past them
+		char * in = buffer_pool_get();
+		if (in == NULL)
 			return (-1);
-
-		/*
-		 * ASCII Mode - read the file's contents line by line,
-		 * replacing new line feeds with a \r\n
-		 */
-		while ((current_length = readline(file_stream,
-				buf_ptr, current_length)) != -1) {
-
-			char * read_content = calloc(current_length+2, 1);
-			sprintf(read_content, "%s\r\n", buf_ptr);
-
-			nwrite =
-			write(data_fd, read_content,
-				strlen(read_content));
-			if (nwrite < 0)
-				return (-1);
-
-			free(read_content);
-			read_content = NULL;
-			memset(buf_ptr, 0, strlen(buf_ptr));
+		char * out = in + CRLF_BLOCK_SIZE;
+
+		crlf_state_t state;
+		crlf_init(&state);
+		ssize_t nread;
+		int err = 0;
+
+		// A resumed download continues at the restart offset
+		if (lseek(file_fd, offset, SEEK_SET) < 0)
+			err = -1;
+
+		while (err == 0 &&
+			(nread = read(file_fd, in, CRLF_BLOCK_SIZE)) != 0) {
+			if (nread < 0) {
+				if (errno == EINTR)
+					continue;
+				err = -1;
+				break;
+			}
+			size_t len = crlf_expand(&state, in, nread, out);
+			if (write_all(data_fd, out, len) < 0) {
+				err = -1;
+				break;
+			}
+			nsent += nread;
 		}
 
-		// Make one last write to flush all residual data
-		char * read_content = calloc(current_length+2, 1);
-		sprintf(read_content, "%s\r\n", buf_ptr);
-		nwrite = write(data_fd, read_content, strlen(read_content));
-		if (nwrite < 0)
+		buffer_pool_put(in);
+		if (err < 0)
 			return (-1);
-		free(read_content);
-		read_content = NULL;
-
-		fclose(file_stream);
-		free(buf_ptr);
-		buf_ptr = NULL;
 	}
 
 	if (binary_flag) {
 
-		// File handler and variable to hold the contents
-		FILE * file_stream;
-		char * contents;
-		int file_size = 0;
-
-		// Open the file stream in read binary mode.
-		file_stream = fdopen(file_fd, "rb");
-
-		// Determine the file size
-		fseek(file_stream, 0L, SEEK_END);
-		file_size = ftell(file_stream);
-		fseek(file_stream, 0L, SEEK_SET);
-
-		// Allocate memory for the file's contents
-		contents = malloc(file_size+1);
-
 		/*
-		 * Read the file, and dump the
-		 * content into the variable 'contents'
+		 * Binary Mode - stream the file to the client without
+		 * copying it through user space. The offset is an off_t
+		 * so files beyond 2GB are sent in full.
+		 * With the io_uring backend enabled, file reads and
+		 * socket writes are batched through the thread's ring.
 		 */
-		size_t size = fread(contents, 1, file_size, file_stream);
-		contents[size] = 0; // Add terminating zero.
-
-		// Write the file's contents to the client
-		nwrite = write(data_fd, contents, size);
-		if (nwrite < 0)
+		nsent = uring_send_file(file_fd, data_fd, offset);
+		if (nsent >= 0)
+			return (nsent);
+		if (errno != ENOSYS)
 			return (-1);
+		nsent = 0;
+
+#ifdef __linux__
+		off_t start = offset;
+
+		while (1) {
+
+			ssize_t nchunk = sendfile(data_fd, file_fd, &offset,
+				SENDFILE_CHUNK_SIZE);
+			if (nchunk < 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				/*
+				 * The file cannot be sent with sendfile,
+				 * so fall back to a regular copy loop
+				 */
+				if ((errno == EINVAL || errno == ENOSYS) &&
+					offset == start)
+					break;
+				return (-1);
+			}
 
-		// Clean up
-		fclose(file_stream);
-		free(contents);
-		contents = NULL;
+			// Reached the end of the file
+			if (nchunk == 0)
+				return (offset - start);
+		}
+#endif
+
+		if (lseek(file_fd, offset, SEEK_SET) < 0 ||
+			(nsent = copy_fd(file_fd, data_fd)) < 0)
+			return (-1);
 	}
 
-	return (0);
+	return (nsent);
 }
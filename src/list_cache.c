@@ -0,0 +1,226 @@
+#include "list_cache.h"
+#include "ftp_functions.h"
+
+#ifdef __APPLE__
+#define	st_mtim st_mtimespec
+#define	st_ctim st_ctimespec
+#endif
+
+// Cached listings, hashed by directory identity
+static list_entry_t * buckets[LIST_CACHE_BUCKETS];
+// Least recently used listing first
+static list_entry_t * lru_head = NULL;
+static list_entry_t * lru_tail = NULL;
+static size_t cached_bytes = 0;
+static unsigned long cached_entries = 0;
+static pthread_mutex_t list_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Counters for the cache report
+static unsigned long hits = 0;
+static unsigned long misses = 0;
+static unsigned long evictions = 0;
+static unsigned long long hit_ns = 0;
+static unsigned long long miss_ns = 0;
+
+static unsigned long
+list_cache_hash(dev_t dev, ino_t ino) {
+
+	unsigned long long key = (unsigned long long)ino * 0x9E3779B97F4A7C15ULL ^
+		(unsigned long long)dev;
+	return ((unsigned long)(key >> 32) % LIST_CACHE_BUCKETS);
+}
+
+static int
+same_time(const struct timespec * a, const struct timespec * b) {
+
+	return (a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec);
+}
+
+static void
+list_entry_free(list_entry_t * entry) {
+
+	free(entry->data);
+	free(entry);
+}
+
+static void
+lru_unlink(list_entry_t * entry) {
+
+	if (entry->lru_prev != NULL)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		lru_head = entry->lru_next;
+	if (entry->lru_next != NULL)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		lru_tail = entry->lru_prev;
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void
+lru_push(list_entry_t * entry) {
+
+	entry->lru_prev = lru_tail;
+	entry->lru_next = NULL;
+	if (lru_tail != NULL)
+		lru_tail->lru_next = entry;
+	else
+		lru_head = entry;
+	lru_tail = entry;
+}
+
+/*
+ * Take an entry out of the cache; it is freed once the
+ * last session sending it lets go. Called with the lock held.
+ */
+static void
+list_cache_remove(list_entry_t * entry) {
+
+	list_entry_t ** link =
+		&buckets[list_cache_hash(entry->dev, entry->ino)];
+	while (*link != entry)
+		link = &(*link)->hash_next;
+	*link = entry->hash_next;
+
+	lru_unlink(entry);
+	entry->cached = 0;
+	cached_bytes -= entry->len;
+	cached_entries--;
+
+	if (--entry->refcount == 0)
+		list_entry_free(entry);
+}
+
+/*
+ * Add a freshly rendered listing, evicting the least recently
+ * used ones to stay within the size bound. Called with the
+ * lock held.
+ */
+static void
+list_cache_insert(list_entry_t * entry) {
+
+	// Another session may have cached the same directory meanwhile
+	list_entry_t ** bucket =
+		&buckets[list_cache_hash(entry->dev, entry->ino)];
+	for (list_entry_t * cur = *bucket; cur != NULL; cur = cur->hash_next) {
+		if (cur->dev == entry->dev && cur->ino == entry->ino) {
+			list_cache_remove(cur);
+			break;
+		}
+	}
+
+	while (lru_head != NULL &&
+		cached_bytes + entry->len > LIST_CACHE_MAX_BYTES) {
+		list_cache_remove(lru_head);
+		evictions++;
+	}
+
+	entry->hash_next = *bucket;
+	*bucket = entry;
+	lru_push(entry);
+	entry->cached = 1;
+	entry->refcount++;
+	cached_bytes += entry->len;
+	cached_entries++;
+}
+
+/*
+ * Look the directory up by device and inode; a listing is
+ * only served while the directory's mtime and ctime match
+ * the ones it was rendered at, since creating, removing or
+ * renaming an entry updates both.
+ */
+list_entry_t *
+list_cache_get(int dir_fd) {
+
+	unsigned long long start = get_time_ns();
+
+	struct stat st;
+	if (fstat(dir_fd, &st) < 0)
+		return (NULL);
+
+	pthread_mutex_lock(&list_cache_lock);
+	list_entry_t * entry = buckets[list_cache_hash(st.st_dev, st.st_ino)];
+	while (entry != NULL &&
+		(entry->dev != st.st_dev || entry->ino != st.st_ino))
+		entry = entry->hash_next;
+
+	if (entry != NULL) {
+		if (same_time(&entry->mtime, &st.st_mtim) &&
+			same_time(&entry->ctime, &st.st_ctim)) {
+			entry->refcount++;
+			lru_unlink(entry);
+			lru_push(entry);
+			hits++;
+			hit_ns += get_time_ns() - start;
+			pthread_mutex_unlock(&list_cache_lock);
+			return (entry);
+		}
+		// The directory changed, so the listing is stale
+		list_cache_remove(entry);
+	}
+	pthread_mutex_unlock(&list_cache_lock);
+
+	/*
+	 * Render the listing without holding the lock. The
+	 * timestamps were taken before reading, so a change made
+	 * while we read shows up as a mismatch on the next lookup.
+	 */
+	entry = calloc(1, sizeof (list_entry_t));
+	if (entry == NULL)
+		return (NULL);
+	entry->data = LIST(dir_fd, &entry->len);
+	if (entry->data == NULL) {
+		free(entry);
+		return (NULL);
+	}
+	entry->dev = st.st_dev;
+	entry->ino = st.st_ino;
+	entry->mtime = st.st_mtim;
+	entry->ctime = st.st_ctim;
+	entry->refcount = 1;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	long long age_ns = (long long)(now.tv_sec - st.st_mtim.tv_sec) *
+		1000000000LL + (now.tv_nsec - st.st_mtim.tv_nsec);
+
+	pthread_mutex_lock(&list_cache_lock);
+	if (age_ns >= LIST_CACHE_RACY_NS && entry->len <= LIST_CACHE_MAX_BYTES)
+		list_cache_insert(entry);
+	misses++;
+	miss_ns += get_time_ns() - start;
+	pthread_mutex_unlock(&list_cache_lock);
+
+	return (entry);
+}
+
+// Give back a listing obtained from list_cache_get()
+void
+list_cache_release(list_entry_t * entry) {
+
+	pthread_mutex_lock(&list_cache_lock);
+	int last = --entry->refcount == 0;
+	pthread_mutex_unlock(&list_cache_lock);
+
+	if (last)
+		list_entry_free(entry);
+}
+
+// Print the hit rate, lookup latency and size of the cache
+void
+list_cache_report(FILE * out) {
+
+	pthread_mutex_lock(&list_cache_lock);
+	unsigned long lookups = hits + misses;
+	fprintf(out, "LIST cache: %lu listings, %zu bytes, "
+		"%lu hits, %lu misses (%.1f%% hit rate), %lu evictions\n",
+		cached_entries, cached_bytes, hits, misses,
+		lookups ? 100.0 * hits / lookups : 0.0, evictions);
+	fprintf(out, "LIST cache latency: %.1f us per hit, "
+		"%.1f us per miss\n",
+		hits ? hit_ns / 1000.0 / hits : 0.0,
+		misses ? miss_ns / 1000.0 / misses : 0.0);
+	pthread_mutex_unlock(&list_cache_lock);
+	fflush(out);
+}
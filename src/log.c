@@ -0,0 +1,329 @@
+#include "log.h"
+
+// Level names, as printed and as accepted by log_parse_level
+static const char * level_names[] = { "error", "warn", "info", "debug" };
+
+int log_threshold = LOG_LEVEL_INFO;
+
+// Rings of every thread that has logged, walked by the writer
+static log_ring_t * rings = NULL;
+// Guards the list of rings and serializes draining them
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The writer sleeps on this condition once every ring is empty;
+ * it sets writer_sleeping first, so that a thread queueing a
+ * record knows it has to be woken
+ */
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static int writer_sleeping = 0;
+
+// Each thread lazily sets up its own ring
+static pthread_key_t log_key;
+static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Wake the writer if it sleeps. The fence orders the caller's
+ * last store before the load of writer_sleeping, pairing with
+ * the one in log_thread, so either the writer sees that store
+ * or the caller sees it asleep.
+ */
+static void
+log_wake_writer() {
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&writer_sleeping, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&wake_lock);
+		pthread_cond_signal(&wake_cond);
+		pthread_mutex_unlock(&wake_lock);
+	}
+}
+
+/*
+ * Leave the ring of an exiting thread to the writer,
+ * which frees it once it has drained the last records
+ */
+static void
+log_ring_orphan(void * arg) {
+
+	log_ring_t * ring = arg;
+	__atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+	log_wake_writer();
+}
+
+static void
+log_make_key() {
+
+	pthread_key_create(&log_key, log_ring_orphan);
+}
+
+// Return the calling thread's ring, creating it on first use
+static log_ring_t *
+log_ring_get() {
+
+	pthread_once(&log_key_once, log_make_key);
+	log_ring_t * ring = pthread_getspecific(log_key);
+	if (ring == NULL) {
+		ring = calloc(1, sizeof (log_ring_t));
+		if (ring == NULL)
+			return (NULL);
+		pthread_setspecific(log_key, ring);
+
+		pthread_mutex_lock(&rings_lock);
+		ring->next = rings;
+		rings = ring;
+		pthread_mutex_unlock(&rings_lock);
+	}
+
+	return (ring);
+}
+
+void
+log_set_level(log_level_t level) {
+
+	__atomic_store_n(&log_threshold, (int)level, __ATOMIC_RELAXED);
+}
+
+int
+log_parse_level(const char * name) {
+
+	int num_levels = sizeof (level_names) / sizeof (level_names[0]);
+	for (int i = 0; i < num_levels; i++) {
+		if (!strcasecmp(name, level_names[i]))
+			return (i);
+	}
+
+	return (-1);
+}
+
+/*
+ * Only the message itself is rendered here, since its arguments
+ * may not outlive the call; the timestamp and level are
+ * formatted by the writer
+ */
+void
+log_write(log_level_t level, const char * format, ...) {
+
+	log_ring_t * ring = log_ring_get();
+	if (ring == NULL)
+		return;
+
+	unsigned long tail = ring->tail;
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+		LOG_RING_CAPACITY) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	log_record_t * record = &ring->records[tail & (LOG_RING_CAPACITY - 1)];
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	record->time_ns = (unsigned long long)now.tv_sec * 1000000000ULL +
+		now.tv_nsec;
+	record->level = level;
+
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(record->message, LOG_MESSAGE_SIZE, format, args);
+	va_end(args);
+	if (n < 0)
+		n = 0;
+	else if (n >= LOG_MESSAGE_SIZE)
+		n = LOG_MESSAGE_SIZE - 1;
+	record->len = n;
+
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	log_wake_writer();
+}
+
+/*
+ * Output of the writer: formatted lines are gathered here
+ * and written out together. Only used with rings_lock held.
+ */
+static char out[LOG_WRITE_BUFFER_SIZE];
+static size_t out_len = 0;
+// The second the cached timestamp prefix was formatted for
+static time_t out_second = -1;
+static char out_stamp[32];
+
+static void
+log_output_flush() {
+
+	if (out_len > 0)
+		write_all(STDOUT_FILENO, out, out_len);
+	out_len = 0;
+}
+
+// Format one line into the output buffer
+static void
+log_output(unsigned long long time_ns, int level, const char * message,
+	size_t len) {
+
+	// Room for the timestamp, the level and the line ending
+	if (out_len + len + 64 > LOG_WRITE_BUFFER_SIZE)
+		log_output_flush();
+
+	time_t second = time_ns / 1000000000ULL;
+	if (second != out_second) {
+		struct tm tm;
+		localtime_r(&second, &tm);
+		strftime(out_stamp, sizeof (out_stamp), "%Y-%m-%d %H:%M:%S",
+			&tm);
+		out_second = second;
+	}
+
+	// Messages used to carry their own line endings
+	while (len > 0 && message[len - 1] == '\n')
+		len--;
+
+	out_len += snprintf(out + out_len, LOG_WRITE_BUFFER_SIZE - out_len,
+		"%s.%06llu %-5s ", out_stamp,
+		(time_ns % 1000000000ULL) / 1000, level_names[level]);
+	memcpy(out + out_len, message, len);
+	out_len += len;
+	out[out_len++] = '\n';
+}
+
+/*
+ * Write out the records queued on every ring, oldest first
+ * across the rings, and free the rings of threads that have
+ * exited; returns the number of records written. The order
+ * only holds among the records queued when the drain began:
+ * one whose thread was still formatting it then is written
+ * by the next drain, after any newer ones.
+ */
+static unsigned long
+log_drain() {
+
+	unsigned long total = 0;
+
+	pthread_mutex_lock(&rings_lock);
+	for (log_ring_t * ring = rings; ring != NULL; ring = ring->next)
+		ring->drain_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	/*
+	 * Merge the rings by always writing the oldest of their
+	 * first records. Only the threads that have logged have a
+	 * ring, so a scan per record is cheaper than keeping a heap.
+	 */
+	for (;;) {
+
+		log_ring_t * oldest = NULL;
+		log_record_t * first = NULL;
+		for (log_ring_t * ring = rings; ring != NULL; ring = ring->next) {
+			if (ring->head == ring->drain_tail)
+				continue;
+			log_record_t * record =
+				&ring->records[ring->head & (LOG_RING_CAPACITY - 1)];
+			if (first == NULL || record->time_ns < first->time_ns) {
+				oldest = ring;
+				first = record;
+			}
+		}
+		if (oldest == NULL)
+			break;
+
+		log_output(first->time_ns, first->level, first->message,
+			first->len);
+		__atomic_store_n(&oldest->head, oldest->head + 1,
+			__ATOMIC_RELEASE);
+		total++;
+	}
+
+	for (log_ring_t ** link = &rings; *link != NULL; ) {
+
+		log_ring_t * ring = *link;
+		unsigned long dropped = __atomic_exchange_n(&ring->dropped, 0,
+			__ATOMIC_RELAXED);
+		if (dropped > 0) {
+			char message[64];
+			int n = snprintf(message, sizeof (message),
+				"%lu log messages dropped", dropped);
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			log_output((unsigned long long)now.tv_sec * 1000000000ULL +
+				now.tv_nsec, LOG_LEVEL_WARN, message, n);
+		}
+
+		/*
+		 * An exited thread queues nothing more, but it may have
+		 * queued its last records after the tail was read
+		 */
+		if (__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE) &&
+			__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+			ring->head) {
+			*link = ring->next;
+			free(ring);
+		}
+		else
+			link = &ring->next;
+	}
+	log_output_flush();
+	pthread_mutex_unlock(&rings_lock);
+
+	return (total);
+}
+
+/*
+ * Return whether any ring holds records the writer has not
+ * taken yet, or belongs to a thread that has exited
+ */
+static int
+log_pending() {
+
+	int pending = 0;
+
+	pthread_mutex_lock(&rings_lock);
+	for (log_ring_t * ring = rings; ring != NULL && !pending;
+		ring = ring->next)
+		pending = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) !=
+			ring->head ||
+			__atomic_load_n(&ring->orphaned, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&rings_lock);
+
+	return (pending);
+}
+
+/*
+ * Writer thread: drains the rings, and sleeps until a thread
+ * queues a record once they are all empty
+ */
+static void *
+log_thread(void * args) {
+
+	while (1) {
+
+		if (log_drain() > 0)
+			continue;
+
+		pthread_mutex_lock(&wake_lock);
+		__atomic_store_n(&writer_sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		while (!log_pending())
+			pthread_cond_wait(&wake_cond, &wake_lock);
+		__atomic_store_n(&writer_sleeping, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&wake_lock);
+	}
+
+	return (NULL);
+}
+
+int
+log_init() {
+
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int err = pthread_create(&thread, &attr, log_thread, NULL);
+	pthread_attr_destroy(&attr);
+
+	return (err == 0 ? 0 : -1);
+}
+
+void
+log_flush() {
+
+	log_drain();
+}
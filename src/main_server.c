@@ -2,14 +2,56 @@
 #include <poll.h>
 #include <signal.h>
 #include <ctype.h>
+#include <sys/resource.h>
 #include "ftp_functions.h"
+#include "event_loop.h"
+#include "worker_pool.h"
+#include "admission.h"
+#include "uring.h"
+#include "pasv_pool.h"
+#include "list_cache.h"
+#include "file_cache.h"
+#include "buffer_pool.h"
+#include "zmode.h"
+#include "log.h"
+#include "metrics.h"
 #include "utils.h"
 
+/*
+ * How long the main server waits in poll before
+ * checking its signal flags again, in milliseconds
+ */
+#define		MAIN_POLL_TIMEOUT_MS 1000
+
+/*
+ * A listening socket together with the worker
+ * pool that runs the sessions accepted on it
+ */
+typedef struct acceptor {
+	int server_fd;
+	worker_pool_t * pool;
+	pthread_t thread;
+} acceptor_t;
+
 // Volatile quit variable
 volatile sig_atomic_t QUIT_FLAG = 0;
-
-// p for port, h for help
-static const char * optstring = "p:h";
+// Volatile variable requesting a report of the worker pool
+volatile sig_atomic_t REPORT_FLAG = 0;
+
+/*
+ * p for port, m and M for the minimum and maximum
+ * number of worker threads, r for the number of
+ * SO_REUSEPORT acceptors, b for the listen backlog,
+ * P for the passive port range, u for the io_uring
+ * transfer backend, l for the log level, A for the
+ * admin socket, C for the file cache size in MiB,
+ * S, Q, W and I for the admission limits on sessions,
+ * queue depth, queue wait and sessions per host, t, D
+ * and T for the idle, data connection and stall timeouts,
+ * R for the minimum transfer rate, Z for the MODE Z
+ * compression level, N to turn the metrics off, h for help
+ */
+static const char * optstring = "p:m:M:r:b:P:ul:A:C:S:Q:W:I:t:D:T:R:Z:Nh";
 
 
 // Safe signal handler
@@ -19,6 +61,13 @@ handler(int signal) {
 	QUIT_FLAG = 1;
 }
 
+// Signal handler requesting a report of the worker pool
+void
+report_handler(int signal) {
+
+	REPORT_FLAG = 1;
+}
+
 // Check if input is a number
 int
 check_if_number(const char * input) {
@@ -35,7 +84,16 @@ check_if_number(const char * input) {
 void
 usage() {
 
-	printf("Usage: /sftp2_server [-p <port>] [-h]\n");
+	printf("Usage: /sftp2_server [-p <port>] [-m <min workers>] "
+		"[-M <max workers>] [-r <acceptors, 0 for one per core>] "
+		"[-b <listen backlog>] [-P <low port>-<high port>] "
+		"[-u] [-l <error|warn|info|debug>] [-A <admin socket>] "
+		"[-C <file cache MiB, 0 to disable>] [-S <max sessions>] "
+		"[-Q <max queue depth>] [-W <max queue wait ms>] "
+		"[-I <max sessions per host>] [-t <idle timeout s>] "
+		"[-D <data connection timeout s>] [-T <stall timeout s>] "
+		"[-R <min transfer rate B/s>] [-Z <compression level 0-9>] "
+		"[-N] [-h]\n");
 	fflush(stdout);
 }
 
@@ -45,10 +103,124 @@ invalid_port() {
 	fflush(stdout);
 }
 
+void
+invalid_number(const char * what) {
+	printf("Please provide a valid %s!\n", what);
+	fflush(stdout);
+}
+
+/*
+ * Accept every connection pending on the listening socket
+ * and queue it on the acceptor's worker pool. The socket is
+ * non-blocking, so we stop once the backlog is empty.
+ * Connections beyond the admission limits are turned away
+ * right here, so an overloaded pool is not handed more work.
+ */
+void
+drain_connections(acceptor_t * acceptor) {
+
+	while (1) {
+
+		struct sockaddr_storage client_addr;
+		socklen_t len = (socklen_t)sizeof (struct sockaddr_storage);
+
+		// The socket required to communicate with the client directly
+#ifdef __linux__
+		int client_fd = accept4(acceptor->server_fd,
+			(struct sockaddr *)&client_addr, &len, SOCK_CLOEXEC);
+#else
+		int client_fd = accept(acceptor->server_fd,
+			(struct sockaddr *)&client_addr, &len);
+		// Sockets here inherit O_NONBLOCK from the listening socket
+		if (client_fd >= 0)
+			fcntl(client_fd, F_SETFL,
+				fcntl(client_fd, F_GETFL) & ~O_NONBLOCK);
+#endif
+		if (client_fd < 0) {
+
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			// Backlog is empty, or we are out of descriptors for now
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+				errno == EMFILE || errno == ENFILE)
+				return;
+			error("Error on accepting client connection\
+				in main.\n");
+		}
+
+		admission_t admission = admission_check(acceptor->pool,
+			&client_addr);
+		if (admission != ADMISSION_ADMITTED) {
+			admission_reject(client_fd, admission);
+			continue;
+		}
+
+		/*
+		 * Enqueue a new job for the worker threads,
+		 * turning the client away if the queue is full
+		 */
+		if (worker_pool_submit(acceptor->pool, client_fd, client_addr,
+			NULL) < 0) {
+			log_warn("Job queue full, dropping client!");
+			admission_release(&client_addr);
+			admission_reject(client_fd, ADMISSION_QUEUE_DEPTH);
+		}
+	}
+}
+
+/*
+ * Accept_Thread - waits for connections on one listening
+ * socket and hands them to the acceptor's worker pool
+ */
+void *
+accept_thread(void * args) {
+
+	acceptor_t * acceptor = args;
+
+	/*
+	 * Create a server polling architecture so that we
+	 * don't waste system resources on busy waits
+	 */
+	struct pollfd fds[1];
+	struct pollfd server_poll_structure = {acceptor->server_fd, POLLIN, 0};
+	fds[0] = server_poll_structure;
+
+	while (!QUIT_FLAG) {
+
+		int err = poll(fds, 1, MAIN_POLL_TIMEOUT_MS);
+		if (err == -1 && errno != EINTR)
+			error("Error on poll command in the main server!\n");
+
+		if (err > 0 && (fds[0].revents & POLLIN))
+			drain_connections(acceptor);
+	}
+
+	return (NULL);
+}
+
 int
 main(int argc, char * argv[]) {
 
 	long port = -1;
+	long min_workers = DEFAULT_MIN_WORKERS;
+	long max_workers = DEFAULT_MAX_WORKERS;
+	// Zero acceptors means the default single listening socket
+	long num_acceptors = 0;
+	int reuse_port = 0;
+	long backlog = DEFAULT_LISTEN_BACKLOG;
+	int use_io_uring = 0;
+	// No passive port range means an ephemeral port per PASV
+	long pasv_low = -1, pasv_high = -1;
+	// Unix socket serving the metrics, if any
+	const char * admin_path = NULL;
+	size_t file_cache_bytes = FILE_CACHE_DEFAULT_BYTES;
+	// Only the queue depth is limited unless asked otherwise
+	admission_limits_t limits = { 0, DEFAULT_MAX_QUEUE_DEPTH, 0, 0 };
+	session_timeouts_t timeouts = {
+		DEFAULT_IDLE_TIMEOUT_S, DEFAULT_DATA_CONNECTION_TIMEOUT_S,
+		DEFAULT_STALL_TIMEOUT_S, DEFAULT_MIN_TRANSFER_RATE
+	};
+	long compression_level = DEFAULT_COMPRESSION_LEVEL;
 
 	if (argc < 2) {
 
@@ -69,6 +241,116 @@ main(int argc, char * argv[]) {
 					exit(1);
 				}
 				break;
+			case 'm':
+			case 'M':
+				if (check_if_number(optarg) != 1) {
+					invalid_number("number of workers");
+					usage();
+					exit(1);
+				}
+				if (opt == 'm')
+					min_workers = atol(optarg);
+				else
+					max_workers = atol(optarg);
+				break;
+			case 'r':
+				if (check_if_number(optarg) != 1) {
+					invalid_number("number of acceptors");
+					usage();
+					exit(1);
+				}
+				reuse_port = 1;
+				num_acceptors = atol(optarg);
+				break;
+			case 'b':
+				if (check_if_number(optarg) != 1 ||
+					atol(optarg) < 1) {
+					invalid_number("listen backlog");
+					usage();
+					exit(1);
+				}
+				backlog = atol(optarg);
+				break;
+			case 'P':
+				if (sscanf(optarg, "%ld-%ld", &pasv_low,
+					&pasv_high) != 2 || pasv_low < 1 ||
+					pasv_high > 65535 || pasv_low > pasv_high) {
+					invalid_number("passive port range");
+					usage();
+					exit(1);
+				}
+				break;
+			case 'u':
+				use_io_uring = 1;
+				break;
+			case 'l':
+				if (log_parse_level(optarg) < 0) {
+					invalid_number("log level");
+					usage();
+					exit(1);
+				}
+				log_set_level(log_parse_level(optarg));
+				break;
+			case 'A':
+				admin_path = optarg;
+				break;
+			case 'C':
+				if (check_if_number(optarg) != 1) {
+					invalid_number("file cache size");
+					usage();
+					exit(1);
+				}
+				file_cache_bytes = (size_t)atol(optarg) << 20;
+				break;
+			case 'S':
+			case 'Q':
+			case 'W':
+			case 'I':
+				if (check_if_number(optarg) != 1) {
+					invalid_number("admission limit");
+					usage();
+					exit(1);
+				}
+				if (opt == 'S')
+					limits.max_sessions = atol(optarg);
+				else if (opt == 'Q')
+					limits.max_queue_depth = atol(optarg);
+				else if (opt == 'W')
+					limits.max_queue_wait_ms = atol(optarg);
+				else
+					limits.max_host_sessions = atol(optarg);
+				break;
+			case 't':
+			case 'D':
+			case 'T':
+			case 'R':
+				if (check_if_number(optarg) != 1) {
+					invalid_number(opt == 'R' ? "transfer rate" :
+						"timeout");
+					usage();
+					exit(1);
+				}
+				if (opt == 't')
+					timeouts.idle_s = atol(optarg);
+				else if (opt == 'D')
+					timeouts.data_connection_s = atol(optarg);
+				else if (opt == 'T')
+					timeouts.stall_s = atol(optarg);
+				else
+					timeouts.min_rate = atol(optarg);
+				break;
+			case 'Z':
+				if (check_if_number(optarg) != 1 ||
+					atol(optarg) > 9) {
+					invalid_number("compression level");
+					usage();
+					exit(1);
+				}
+				compression_level = atol(optarg);
+				break;
+			case 'N':
+				metrics_disable();
+				break;
 			case 'h':
 				usage();
 				exit(0);
@@ -83,6 +365,16 @@ main(int argc, char * argv[]) {
 		exit(1);
 	}
 
+	// Ensure the worker pool bounds make sense
+	if (min_workers < 1 || max_workers < min_workers) {
+		invalid_number("number of workers");
+		exit(1);
+	}
+
+	// Messages are written out by a thread of their own
+	if (log_init() < 0)
+		error("Error on starting the log writer\n");
+
 	// Register our signal handler for gracefully terminating the server
 	if (signal(SIGUSR1, handler) == SIG_ERR) {
 
@@ -94,95 +386,138 @@ main(int argc, char * argv[]) {
 		error("Error registering signal handler for SIGUSR2.\n");
 	}
 
-	// Initiate random number generator
-	srand(time(NULL));
-	
-	int err;
-
-	// Initiate the server socket running at the specified port
-	int server_fd = initiate_server(port);
-	if (server_fd < 0)
-		error("Error on initiating FTP server!\
-			Perhaps try a new port?\n");
+	// SIGHUP prints the state of the worker pool
+	if (signal(SIGHUP, report_handler) == SIG_ERR) {
 
-	// Initialize the job queue and related resources
-	init();
+		error("Error registering signal handler for SIGHUP.\n");
+	}
 
-	// Spawn NUM_THREADS amount of threads
-	pthread_t arr[NUM_THREADS];
-	for (int i = 0; i < NUM_THREADS; i++) {
+	/*
+	 * A client may close a data connection before the transfer
+	 * is done; the failed write is handled where it happens
+	 */
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
 
-		pthread_create(&arr[i], NULL, ftp_thread, NULL);
+		error("Error ignoring SIGPIPE.\n");
 	}
 
 	/*
-	 * Create a server polling architecture so that we
-	 * don't waste system resources on busy waits
+	 * Every idle session keeps its control connection open,
+	 * so allow as many descriptors as the system permits
 	 */
-	struct pollfd fds[1];
-	struct pollfd server_poll_structure = {server_fd, POLLIN, 0};
-	fds[0] = server_poll_structure;
+	struct rlimit fd_limit;
+	if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0) {
+		fd_limit.rlim_cur = fd_limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &fd_limit);
+	}
 
-	while (!QUIT_FLAG) {
+	/*
+	 * Select the io_uring transfer backend; without kernel
+	 * support, transfers keep using the blocking system calls
+	 */
+	if (uring_init(use_io_uring) < 0)
+		log_warn("io_uring is not available, using blocking transfers.");
 
-		print_debug("Main server: About to call poll command!\n");
+	/*
+	 * Bind the passive port range up front, so that PASV and
+	 * EPSV only have to hand out an already listening socket
+	 */
+	if (pasv_low > 0 && pasv_pool_init(pasv_low, pasv_high) <= 0)
+		error("Error on binding the passive port range\n");
 
-		err = poll(fds, 1, -1);
-		if (err == -1)
-			error("Error on poll command in the main server!\n");
+	// Keep frequently downloaded files open and mapped
+	if (file_cache_init(file_cache_bytes) < 0)
+		error("Error on setting up the file cache\n");
 
-		print_debug("Main server received connection \
-			and finished poll'ing!\n");
+	// Serve the metrics to local monitoring
+	if (admin_path != NULL && metrics_admin_init(admin_path) < 0)
+		error("Error on opening the admin socket\n");
 
-		struct sockaddr_storage client_addr;
+	// Limit the sessions taken on before accepting any
+	admission_init(&limits);
 
-		// The socket required to communicate with the client directly
-		int client_fd = -1;
+	// Close idle sessions and cut off stalled transfers
+	set_session_timeouts(&timeouts);
+	set_compression_level((int)compression_level);
 
-		if (fds[0].revents & POLLIN) {
+	// Sessions start in the directory the server was launched from
+	if (set_session_root(".") < 0)
+		error("Error on opening the server's root directory\n");
 
-			// Accept the latest client connection
-			socklen_t len =
-			(socklen_t)sizeof (struct sockaddr_storage);
-			client_fd =
-			accept(server_fd, (struct sockaddr *)&client_addr,
-				&len);
-			if (client_fd < 0) {
-
-				destroy();
-				error("Error on accepting client connection\
-					in main.\n");
-			}
+	// Initiate random number generator
+	srand(time(NULL));
+	
+	/*
+	 * In SO_REUSEPORT mode every acceptor gets its own
+	 * listening socket and worker pool, by default one per core
+	 */
+	if (!reuse_port)
+		num_acceptors = 1;
+	else if (num_acceptors == 0)
+		num_acceptors = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_acceptors < 1)
+		num_acceptors = 1;
+
+	acceptor_t * acceptors = calloc(num_acceptors, sizeof (acceptor_t));
+	if (acceptors == NULL)
+		error("Error on allocating acceptors\n");
+
+	for (long i = 0; i < num_acceptors; i++) {
+
+		// Initiate the server socket running at the specified port
+		acceptors[i].server_fd = initiate_server(port, backlog,
+			reuse_port);
+		if (acceptors[i].server_fd < 0)
+			error("Error on initiating FTP server!\
+				Perhaps try a new port?\n");
+
+		/*
+		 * Create the worker pool along with its job queue;
+		 * it starts min_workers threads and grows on demand
+		 */
+		acceptors[i].pool = worker_pool_create(min_workers,
+			max_workers);
+		if (acceptors[i].pool == NULL)
+			error("Error on creating the worker pool\n");
+		metrics_add_pool(acceptors[i].pool);
+	}
 
-			// Lock the job queue mutex
-			err = pthread_mutex_lock(job_queue_lock);
+	/*
+	 * Spawn the event loops that wait on the control
+	 * connections of idle sessions
+	 */
+	event_loop_init();
+	pthread_t loops[NUM_EVENT_LOOPS];
+	for (long i = 0; i < NUM_EVENT_LOOPS; i++) {
 
-			if (err != 0) {
+		pthread_create(&loops[i], NULL, event_loop_thread, (void *)i);
+	}
 
-				destroy();
-				error("Error on locking job queue mutex!\n");
-			}
+	// Start accepting connections
+	for (long i = 0; i < num_acceptors; i++) {
 
-			// Enqueue a new job
-			enqueue(head, client_fd, client_addr);
+		pthread_create(&acceptors[i].thread, NULL, accept_thread,
+			&acceptors[i]);
+	}
 
-			// Increment the job counter
-			available_jobs++;
+	while (!QUIT_FLAG) {
 
-			// Unlock the job queue mutex
-			err = pthread_mutex_unlock(job_queue_lock);
-			if (err != 0)
-				error("Error on unlocking job queue mutex!\n");
+		poll(NULL, 0, MAIN_POLL_TIMEOUT_MS);
 
-			/*
-			 * Signal to any waiting threads
-			 * that a new job is available
-			 */
-			err = pthread_cond_signal(job_available);
+		if (REPORT_FLAG) {
+			REPORT_FLAG = 0;
+			for (long i = 0; i < num_acceptors; i++)
+				worker_pool_report(acceptors[i].pool, stdout);
+			list_cache_report(stdout);
+			file_cache_report(stdout);
+			buffer_pool_report(stdout);
 		}
 	}
 
-	// Deallocate resources related to the job queue and associated locks
-	destroy();
+	for (long i = 0; i < num_acceptors; i++)
+		pthread_join(acceptors[i].thread, NULL);
+
+	log_flush();
+
 	return (0);
 }
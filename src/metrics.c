@@ -0,0 +1,567 @@
+#include <sys/un.h>
+#include "metrics.h"
+#include "worker_pool.h"
+#include "pasv_pool.h"
+#include "file_cache.h"
+#include "log.h"
+
+// Most worker pools the metrics report on
+#define	METRICS_MAX_POOLS 1024
+
+/*
+ * Only the owning thread updates its shard, so a plain add
+ * published with a relaxed store is enough for readers
+ */
+#define	METRIC_ADD(field, value) \
+	__atomic_store_n(&(field), (field) + (value), __ATOMIC_RELAXED)
+
+// Shards of the running threads
+static metrics_shard_t * shards = NULL;
+// Everything recorded by threads that have exited
+static metrics_shard_t retired;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Each thread lazily sets up its own shard; the key only
+ * serves to retire it when the thread exits
+ */
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+static __thread metrics_shard_t * local_shard = NULL;
+
+static worker_pool_t * pools[METRICS_MAX_POOLS];
+static int num_pools = 0;
+
+// Set once at startup, before any thread records
+static int metrics_off = 0;
+
+static void
+histogram_merge(histogram_t * to, const histogram_t * from) {
+
+	to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+	to->sum_us += __atomic_load_n(&from->sum_us, __ATOMIC_RELAXED);
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		to->buckets[i] += __atomic_load_n(&from->buckets[i],
+			__ATOMIC_RELAXED);
+}
+
+static void
+shard_merge(metrics_shard_t * to, const metrics_shard_t * from) {
+
+	for (int i = 0; i < NUM_METRIC_COUNTERS; i++)
+		to->counters[i] += __atomic_load_n(&from->counters[i],
+			__ATOMIC_RELAXED);
+	for (int i = 0; i < NUM_METRIC_HISTOGRAMS; i++)
+		histogram_merge(&to->histograms[i], &from->histograms[i]);
+	for (int i = 0; i < NUM_VERBS; i++)
+		histogram_merge(&to->commands[i], &from->commands[i]);
+}
+
+// Fold the shard of an exiting thread into the retired totals
+static void
+metrics_retire(void * arg) {
+
+	metrics_shard_t * shard = arg;
+
+	pthread_mutex_lock(&shards_lock);
+	shard_merge(&retired, shard);
+	metrics_shard_t ** link = &shards;
+	while (*link != shard)
+		link = &(*link)->next;
+	*link = shard->next;
+	pthread_mutex_unlock(&shards_lock);
+
+	local_shard = NULL;
+	free(shard);
+}
+
+static void
+metrics_make_key() {
+
+	pthread_key_create(&metrics_key, metrics_retire);
+}
+
+/*
+ * Return the calling thread's shard, creating it on first
+ * use, or NULL if metrics are off
+ */
+static metrics_shard_t *
+metrics_shard() {
+
+	metrics_shard_t * shard = local_shard;
+	if (shard == NULL && !metrics_off) {
+		shard = calloc(1, sizeof (metrics_shard_t));
+		if (shard == NULL)
+			return (NULL);
+		pthread_once(&metrics_key_once, metrics_make_key);
+		pthread_setspecific(metrics_key, shard);
+		local_shard = shard;
+
+		pthread_mutex_lock(&shards_lock);
+		shard->next = shards;
+		shards = shard;
+		pthread_mutex_unlock(&shards_lock);
+	}
+
+	return (shard);
+}
+
+// Bucket of a value in microseconds
+static int
+histogram_bucket(unsigned long long us) {
+
+	if (us < HISTOGRAM_SUB_BUCKETS)
+		return ((int)us);
+
+	int power = 63 - __builtin_clzll(us);
+	if (power >= HISTOGRAM_MAX_POWER)
+		return (HISTOGRAM_BUCKETS - 1);
+
+	int sub = (int)(us >> (power - HISTOGRAM_SUB_BUCKET_BITS)) &
+		(HISTOGRAM_SUB_BUCKETS - 1);
+	return ((power - HISTOGRAM_SUB_BUCKET_BITS + 1) *
+		HISTOGRAM_SUB_BUCKETS + sub);
+}
+
+// Smallest value, in microseconds, above those of a bucket
+static unsigned long long
+histogram_bucket_limit(int bucket) {
+
+	if (bucket < HISTOGRAM_SUB_BUCKETS)
+		return (bucket + 1);
+
+	int power = bucket / HISTOGRAM_SUB_BUCKETS +
+		HISTOGRAM_SUB_BUCKET_BITS - 1;
+	unsigned long long sub = bucket % HISTOGRAM_SUB_BUCKETS;
+	return ((1ULL << power) +
+		((sub + 1) << (power - HISTOGRAM_SUB_BUCKET_BITS)));
+}
+
+static void
+histogram_add(histogram_t * histogram, unsigned long long ns) {
+
+	unsigned long long us = ns / 1000;
+	METRIC_ADD(histogram->buckets[histogram_bucket(us)], 1);
+	METRIC_ADD(histogram->sum_us, us);
+	METRIC_ADD(histogram->count, 1);
+}
+
+/*
+ * Upper bound, in microseconds, of the value below which
+ * the given fraction of the recorded values fall
+ */
+static unsigned long long
+histogram_quantile(const histogram_t * histogram, double fraction) {
+
+	unsigned long count = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		count += histogram->buckets[i];
+
+	unsigned long rank = (unsigned long)(count * fraction);
+	unsigned long seen = 0;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen > rank)
+			return (histogram_bucket_limit(i));
+	}
+
+	return (0);
+}
+
+void
+metrics_disable() {
+
+	metrics_off = 1;
+}
+
+int
+metrics_enabled() {
+
+	return (!metrics_off);
+}
+
+void
+metrics_count(metric_counter_t counter, unsigned long value) {
+
+	metrics_shard_t * shard = metrics_shard();
+	if (shard != NULL)
+		METRIC_ADD(shard->counters[counter], value);
+}
+
+void
+metrics_record(metric_histogram_t histogram, unsigned long long ns) {
+
+	metrics_shard_t * shard = metrics_shard();
+	if (shard != NULL)
+		histogram_add(&shard->histograms[histogram], ns);
+}
+
+void
+metrics_record_command(verb_t verb, unsigned long long ns) {
+
+	metrics_shard_t * shard = metrics_shard();
+	if (shard != NULL)
+		histogram_add(&shard->commands[verb], ns);
+}
+
+void
+metrics_add_pool(struct worker_pool * pool) {
+
+	pthread_mutex_lock(&shards_lock);
+	if (num_pools < METRICS_MAX_POOLS)
+		pools[num_pools++] = pool;
+	pthread_mutex_unlock(&shards_lock);
+}
+
+/*
+ * Add up the shards of all threads into total; the
+ * caller frees it
+ */
+static metrics_shard_t *
+metrics_collect() {
+
+	metrics_shard_t * total = calloc(1, sizeof (metrics_shard_t));
+	if (total == NULL)
+		return (NULL);
+
+	pthread_mutex_lock(&shards_lock);
+	shard_merge(total, &retired);
+	for (metrics_shard_t * shard = shards; shard != NULL;
+		shard = shard->next)
+		shard_merge(total, shard);
+	pthread_mutex_unlock(&shards_lock);
+
+	return (total);
+}
+
+// Size of the worker pools and the number of jobs they have queued
+static void
+metrics_pools(int * workers, unsigned long * queued) {
+
+	*workers = 0;
+	*queued = 0;
+
+	pthread_mutex_lock(&shards_lock);
+	for (int i = 0; i < num_pools; i++) {
+		*workers += __atomic_load_n(&pools[i]->num_workers,
+			__ATOMIC_RELAXED);
+		*queued += worker_pool_queue_depth(pools[i]);
+	}
+	pthread_mutex_unlock(&shards_lock);
+}
+
+static void
+status_transfers(FILE * out, const char * name, const histogram_t * time,
+	unsigned long bytes) {
+
+	fprintf(out, " %s: %lu transfers, %lu bytes, "
+		"p50 %llu us, p99 %llu us\r\n", name, time->count, bytes,
+		histogram_quantile(time, 0.50), histogram_quantile(time, 0.99));
+}
+
+void
+metrics_status(FILE * out) {
+
+	metrics_shard_t * total = metrics_collect();
+	if (total == NULL)
+		return;
+
+	int workers;
+	unsigned long queued;
+	metrics_pools(&workers, &queued);
+	unsigned long * counters = total->counters;
+
+	unsigned long active = counters[METRIC_SESSIONS_OPENED] -
+		counters[METRIC_SESSIONS_CLOSED];
+
+	fprintf(out, " Sessions: %lu active, %lu total\r\n", active,
+		counters[METRIC_SESSIONS_OPENED]);
+	fprintf(out, " Workers: %d, %lu jobs queued, "
+		"queue wait p50 %llu us, p99 %llu us\r\n", workers, queued,
+		histogram_quantile(&total->histograms[METRIC_QUEUE_WAIT], 0.50),
+		histogram_quantile(&total->histograms[METRIC_QUEUE_WAIT], 0.99));
+	if (pasv_pool_enabled())
+		fprintf(out, " Passive listeners: %d in use, %d available\r\n",
+			pasv_pool_in_use(), pasv_pool_available());
+
+	status_transfers(out, "RETR",
+		&total->histograms[METRIC_RETR_TRANSFER],
+		counters[METRIC_RETR_BYTES]);
+	status_transfers(out, "STOR",
+		&total->histograms[METRIC_STOR_TRANSFER],
+		counters[METRIC_STOR_BYTES]);
+	status_transfers(out, "LIST",
+		&total->histograms[METRIC_LIST_TRANSFER],
+		counters[METRIC_LIST_BYTES]);
+	fprintf(out, " Transfer errors: %lu\r\n",
+		counters[METRIC_TRANSFER_ERRORS]);
+	fprintf(out, " Replies: %lu in %lu writes\r\n",
+		counters[METRIC_REPLIES], counters[METRIC_REPLY_WRITES]);
+	fprintf(out, " Rejected: %lu over sessions, %lu over queue depth, "
+		"%lu over queue wait, %lu over host sessions\r\n",
+		counters[METRIC_REJECTED_SESSIONS],
+		counters[METRIC_REJECTED_QUEUE_DEPTH],
+		counters[METRIC_REJECTED_QUEUE_WAIT],
+		counters[METRIC_REJECTED_HOST]);
+	fprintf(out, " Timeouts: %lu idle sessions, %lu stalled transfers\r\n",
+		counters[METRIC_IDLE_TIMEOUTS], counters[METRIC_STALLED_TRANSFERS]);
+	fprintf(out, " MODE Z: %lu bytes in %lu compressed bytes\r\n",
+		counters[METRIC_ZMODE_BYTES], counters[METRIC_ZMODE_WIRE_BYTES]);
+
+	file_cache_stats_t cache;
+	file_cache_stats(&cache);
+	unsigned long lookups = cache.hits + cache.misses;
+	fprintf(out, " File cache: %lu files, %zu bytes, %lu hits, "
+		"%lu misses (%lu%% hit rate), %lu evictions, "
+		"%llu bytes served\r\n", cache.files, cache.bytes, cache.hits,
+		cache.misses, lookups ? 100 * cache.hits / lookups : 0,
+		cache.evictions, cache.served_bytes);
+
+	for (int i = 0; i < NUM_VERBS; i++) {
+		histogram_t * command = &total->commands[i];
+		if (command->count == 0)
+			continue;
+		fprintf(out, " %s: %lu commands, p50 %llu us, p99 %llu us\r\n",
+			verb_name(i), command->count,
+			histogram_quantile(command, 0.50),
+			histogram_quantile(command, 0.99));
+	}
+
+	free(total);
+}
+
+/*
+ * Print a histogram as cumulative buckets in seconds, one
+ * per power of two up to the largest value recorded
+ */
+static void
+prometheus_histogram(FILE * out, const char * name, const char * labels,
+	const histogram_t * histogram) {
+
+	/*
+	 * The shards were read while being updated, so take the
+	 * count from the buckets to keep the dump consistent
+	 */
+	unsigned long count = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		count += histogram->buckets[i];
+
+	const char * sep = labels[0] != '\0' ? "," : "";
+	unsigned long seen = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS && seen < count; i++) {
+		seen += histogram->buckets[i];
+		if ((i + 1) % HISTOGRAM_SUB_BUCKETS == 0 || seen == count)
+			fprintf(out, "%s_bucket{%s%sle=\"%.6f\"} %lu\n", name,
+				labels, sep, histogram_bucket_limit(i) / 1e6, seen);
+	}
+	fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep,
+		count);
+
+	char braced[80] = "";
+	if (labels[0] != '\0')
+		snprintf(braced, sizeof (braced), "{%s}", labels);
+	fprintf(out, "%s_sum%s %.6f\n", name, braced,
+		histogram->sum_us / 1e6);
+	fprintf(out, "%s_count%s %lu\n", name, braced, count);
+}
+
+void
+metrics_prometheus(FILE * out) {
+
+	metrics_shard_t * total = metrics_collect();
+	if (total == NULL)
+		return;
+
+	int workers;
+	unsigned long queued;
+	metrics_pools(&workers, &queued);
+	unsigned long * counters = total->counters;
+	char labels[64];
+
+	fprintf(out, "# HELP ftp_sessions_active Open control connections.\n"
+		"# TYPE ftp_sessions_active gauge\n"
+		"ftp_sessions_active %lu\n", counters[METRIC_SESSIONS_OPENED] -
+		counters[METRIC_SESSIONS_CLOSED]);
+	fprintf(out, "# HELP ftp_sessions_total Control connections accepted.\n"
+		"# TYPE ftp_sessions_total counter\n"
+		"ftp_sessions_total %lu\n", counters[METRIC_SESSIONS_OPENED]);
+	fprintf(out, "# HELP ftp_workers Worker threads running.\n"
+		"# TYPE ftp_workers gauge\n"
+		"ftp_workers %d\n", workers);
+	fprintf(out, "# HELP ftp_queue_depth Jobs waiting for a worker.\n"
+		"# TYPE ftp_queue_depth gauge\n"
+		"ftp_queue_depth %lu\n", queued);
+	fprintf(out, "# HELP ftp_pasv_listeners Passive port range listeners.\n"
+		"# TYPE ftp_pasv_listeners gauge\n"
+		"ftp_pasv_listeners{state=\"in_use\"} %d\n"
+		"ftp_pasv_listeners{state=\"available\"} %d\n",
+		pasv_pool_in_use(), pasv_pool_available());
+
+	fprintf(out, "# HELP ftp_transfer_bytes_total Bytes moved over "
+		"data connections.\n"
+		"# TYPE ftp_transfer_bytes_total counter\n"
+		"ftp_transfer_bytes_total{command=\"RETR\"} %lu\n"
+		"ftp_transfer_bytes_total{command=\"STOR\"} %lu\n"
+		"ftp_transfer_bytes_total{command=\"LIST\"} %lu\n",
+		counters[METRIC_RETR_BYTES], counters[METRIC_STOR_BYTES],
+		counters[METRIC_LIST_BYTES]);
+	fprintf(out, "# HELP ftp_transfer_errors_total Failed transfers.\n"
+		"# TYPE ftp_transfer_errors_total counter\n"
+		"ftp_transfer_errors_total %lu\n",
+		counters[METRIC_TRANSFER_ERRORS]);
+	fprintf(out, "# HELP ftp_replies_total Replies sent on control "
+		"connections.\n"
+		"# TYPE ftp_replies_total counter\n"
+		"ftp_replies_total %lu\n"
+		"# HELP ftp_reply_writes_total System calls the replies were "
+		"written with.\n"
+		"# TYPE ftp_reply_writes_total counter\n"
+		"ftp_reply_writes_total %lu\n",
+		counters[METRIC_REPLIES], counters[METRIC_REPLY_WRITES]);
+	fprintf(out, "# HELP ftp_rejected_connections_total Connections "
+		"turned away by admission control, by limit.\n"
+		"# TYPE ftp_rejected_connections_total counter\n"
+		"ftp_rejected_connections_total{limit=\"sessions\"} %lu\n"
+		"ftp_rejected_connections_total{limit=\"queue_depth\"} %lu\n"
+		"ftp_rejected_connections_total{limit=\"queue_wait\"} %lu\n"
+		"ftp_rejected_connections_total{limit=\"host_sessions\"} %lu\n",
+		counters[METRIC_REJECTED_SESSIONS],
+		counters[METRIC_REJECTED_QUEUE_DEPTH],
+		counters[METRIC_REJECTED_QUEUE_WAIT],
+		counters[METRIC_REJECTED_HOST]);
+	fprintf(out, "# HELP ftp_timeouts_total Sessions closed for idling "
+		"and transfers cut off for stalling.\n"
+		"# TYPE ftp_timeouts_total counter\n"
+		"ftp_timeouts_total{kind=\"idle\"} %lu\n"
+		"ftp_timeouts_total{kind=\"stall\"} %lu\n",
+		counters[METRIC_IDLE_TIMEOUTS], counters[METRIC_STALLED_TRANSFERS]);
+	fprintf(out, "# HELP ftp_zmode_bytes_total Bytes of MODE Z transfers, "
+		"before compression and on the data connection.\n"
+		"# TYPE ftp_zmode_bytes_total counter\n"
+		"ftp_zmode_bytes_total{side=\"plain\"} %lu\n"
+		"ftp_zmode_bytes_total{side=\"compressed\"} %lu\n",
+		counters[METRIC_ZMODE_BYTES], counters[METRIC_ZMODE_WIRE_BYTES]);
+
+	file_cache_stats_t cache;
+	file_cache_stats(&cache);
+	fprintf(out, "# HELP ftp_file_cache_lookups_total Downloads looked "
+		"up in the file cache.\n"
+		"# TYPE ftp_file_cache_lookups_total counter\n"
+		"ftp_file_cache_lookups_total{result=\"hit\"} %lu\n"
+		"ftp_file_cache_lookups_total{result=\"miss\"} %lu\n",
+		cache.hits, cache.misses);
+	fprintf(out, "# HELP ftp_file_cache_evictions_total Files evicted "
+		"from the file cache.\n"
+		"# TYPE ftp_file_cache_evictions_total counter\n"
+		"ftp_file_cache_evictions_total %lu\n", cache.evictions);
+	fprintf(out, "# HELP ftp_file_cache_served_bytes_total Bytes sent "
+		"from the file cache.\n"
+		"# TYPE ftp_file_cache_served_bytes_total counter\n"
+		"ftp_file_cache_served_bytes_total %llu\n", cache.served_bytes);
+	fprintf(out, "# HELP ftp_file_cache_bytes Bytes of files mapped "
+		"by the file cache.\n"
+		"# TYPE ftp_file_cache_bytes gauge\n"
+		"ftp_file_cache_bytes %zu\n", cache.bytes);
+	fprintf(out, "# HELP ftp_file_cache_files Files held by the "
+		"file cache.\n"
+		"# TYPE ftp_file_cache_files gauge\n"
+		"ftp_file_cache_files %lu\n", cache.files);
+
+	fprintf(out, "# HELP ftp_queue_wait_seconds Time jobs wait "
+		"for a worker.\n"
+		"# TYPE ftp_queue_wait_seconds histogram\n");
+	prometheus_histogram(out, "ftp_queue_wait_seconds", "",
+		&total->histograms[METRIC_QUEUE_WAIT]);
+
+	const char * transfers[] = { "RETR", "STOR", "LIST" };
+	fprintf(out, "# HELP ftp_transfer_duration_seconds Time spent "
+		"moving data.\n"
+		"# TYPE ftp_transfer_duration_seconds histogram\n");
+	for (int i = 0; i < 3; i++) {
+		snprintf(labels, sizeof (labels), "command=\"%s\"", transfers[i]);
+		prometheus_histogram(out, "ftp_transfer_duration_seconds", labels,
+			&total->histograms[METRIC_RETR_TRANSFER + i]);
+	}
+
+	fprintf(out, "# HELP ftp_command_duration_seconds Time taken "
+		"to run commands.\n"
+		"# TYPE ftp_command_duration_seconds histogram\n");
+	for (int i = 0; i < NUM_VERBS; i++) {
+		if (total->commands[i].count == 0)
+			continue;
+		snprintf(labels, sizeof (labels), "command=\"%s\"", verb_name(i));
+		prometheus_histogram(out, "ftp_command_duration_seconds", labels,
+			&total->commands[i]);
+	}
+
+	free(total);
+}
+
+// Admin thread: every connection gets a dump and is closed
+static void *
+metrics_admin_thread(void * args) {
+
+	int server_fd = (int)(long)args;
+
+	while (1) {
+
+		int fd = accept(server_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			log_error("Error on accepting an admin connection: %s",
+				strerror(errno));
+			return (NULL);
+		}
+
+		FILE * out = fdopen(fd, "w");
+		if (out == NULL) {
+			close(fd);
+			continue;
+		}
+		metrics_prometheus(out);
+		fclose(out);
+	}
+
+	return (NULL);
+}
+
+int
+metrics_admin_init(const char * path) {
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof (addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return (-1);
+
+	// A socket left behind by an earlier run
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof (addr)) < 0 ||
+		chmod(path, 0600) < 0 || listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		return (-1);
+	}
+
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int err = pthread_create(&thread, &attr, metrics_admin_thread,
+		(void *)(long)fd);
+	pthread_attr_destroy(&attr);
+	if (err != 0) {
+		close(fd);
+		return (-1);
+	}
+
+	return (0);
+}
@@ -0,0 +1,187 @@
+#include <stdint.h>
+#include "mlsx.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+
+// Directory entry as returned by the getdents64 system call
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+/*
+ * Work out the perm fact from the permission bits that
+ * apply to the server's user
+ */
+static void
+mlsx_perm(char * perm, const struct stat * st) {
+
+	mode_t mode = st->st_mode;
+	uid_t uid = geteuid();
+	int readable, writable, executable;
+
+	if (uid == 0) {
+		readable = writable = executable = 1;
+	}
+	else if (st->st_uid == uid) {
+		readable = mode & S_IRUSR;
+		writable = mode & S_IWUSR;
+		executable = mode & S_IXUSR;
+	}
+	else if (st->st_gid == getegid()) {
+		readable = mode & S_IRGRP;
+		writable = mode & S_IWGRP;
+		executable = mode & S_IXGRP;
+	}
+	else {
+		readable = mode & S_IROTH;
+		writable = mode & S_IWOTH;
+		executable = mode & S_IXOTH;
+	}
+
+	int n = 0;
+	if (S_ISDIR(mode)) {
+		if (writable)
+			n += sprintf(perm + n, "cdfmp");
+		if (executable)
+			perm[n++] = 'e';
+		if (readable)
+			perm[n++] = 'l';
+	}
+	else {
+		if (writable)
+			n += sprintf(perm + n, "adfw");
+		if (readable)
+			perm[n++] = 'r';
+	}
+	perm[n] = '\0';
+}
+
+// Format the facts of a file followed by its name
+int
+mlsx_format_entry(char * buffer, size_t size, const struct stat * st,
+	const char * type, const char * name) {
+
+	if (type == NULL)
+		type = S_ISDIR(st->st_mode) ? "dir" :
+			S_ISREG(st->st_mode) ? "file" :
+			S_ISLNK(st->st_mode) ? "OS.unix=symlink" : "OS.unix=special";
+
+	struct tm tm;
+	char modify[16];
+	gmtime_r(&st->st_mtime, &tm);
+	strftime(modify, sizeof (modify), "%Y%m%d%H%M%S", &tm);
+
+	char perm[16];
+	mlsx_perm(perm, st);
+
+	int n = snprintf(buffer, size,
+		"type=%s;size=%lld;modify=%s;perm=%s;unix.mode=0%o; %s\r\n",
+		type, (long long)st->st_size, modify, perm,
+		(unsigned int)(st->st_mode & 07777), name);
+	if (n < 0 || (size_t)n >= size)
+		return (-1);
+
+	return (n);
+}
+
+/*
+ * Add the line of one directory entry to the output,
+ * handing the output to the sink first if it is full
+ */
+static int
+mlsx_emit(int dir_fd, const char * name, char * out, size_t * out_len,
+	mlsx_sink_t sink, void * arg) {
+
+	const char * type = NULL;
+	struct stat st;
+
+	if (!strcmp(name, "."))
+		type = "cdir";
+	else if (!strcmp(name, ".."))
+		type = "pdir";
+	// Hidden entries are left out, as in LIST
+	else if (name[0] == '.')
+		return (0);
+
+	/*
+	 * Report what symbolic links point to, and the links
+	 * themselves only when they dangle. An entry removed
+	 * since it was read is skipped.
+	 */
+	if (fstatat(dir_fd, name, &st, 0) < 0 &&
+		fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		return (0);
+
+	if (*out_len + MLSX_MAX_FACTS_SIZE + strlen(name) > MLSD_BUFFER_SIZE) {
+		if (sink(arg, out, *out_len) < 0)
+			return (-1);
+		*out_len = 0;
+	}
+
+	int n = mlsx_format_entry(out + *out_len, MLSD_BUFFER_SIZE - *out_len,
+		&st, type, name);
+	if (n > 0)
+		*out_len += n;
+
+	return (0);
+}
+
+/*
+ * Stream the MLSD listing of a directory. Entries are read in
+ * large batches with getdents64 and stat'ed relative to the
+ * directory, and every full buffer goes out right away, so
+ * the client sees the first entries before the last are read.
+ */
+int
+mlsx_stream_dir(int dir_fd, mlsx_sink_t sink, void * arg) {
+
+	// Our own descriptor, so that the read offset is private
+	int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return (-1);
+
+	char out[MLSD_BUFFER_SIZE];
+	size_t out_len = 0;
+	int err = 0;
+
+#ifdef __linux__
+	char dents[MLSD_DENTS_BUFFER_SIZE] __attribute__((aligned(8)));
+	long nread = 0;
+
+	while (err == 0 &&
+		(nread = syscall(SYS_getdents64, fd, dents, sizeof (dents))) > 0) {
+
+		for (long pos = 0; pos < nread && err == 0; ) {
+			struct linux_dirent64 * d =
+				(struct linux_dirent64 *)(dents + pos);
+			err = mlsx_emit(fd, d->d_name, out, &out_len, sink, arg);
+			pos += d->d_reclen;
+		}
+	}
+	if (nread < 0)
+		err = -1;
+	close(fd);
+#else
+	DIR * d = fdopendir(fd);
+	if (d == NULL) {
+		close(fd);
+		return (-1);
+	}
+
+	struct dirent * entry;
+	while (err == 0 && (entry = readdir(d)) != NULL)
+		err = mlsx_emit(fd, entry->d_name, out, &out_len, sink, arg);
+	closedir(d);
+#endif
+
+	if (err == 0 && out_len > 0)
+		err = sink(arg, out, out_len);
+
+	return (err);
+}
@@ -0,0 +1,132 @@
+#include "pasv_pool.h"
+
+// Stack of free listeners, so recently used ports are reused first
+static pasv_listener_t * free_listeners = NULL;
+static pthread_mutex_t pasv_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static int listeners_total = 0;
+static int listeners_free = 0;
+
+/*
+ * Create a non-blocking dual-stack socket listening on the
+ * given port, so that both PASV (IPv4) and EPSV clients
+ * can connect to it
+ */
+static int
+pasv_listen(int port) {
+
+	int fd = socket(AF_INET6, SOCK_STREAM, 0);
+	if (fd < 0)
+		return (-1);
+
+	// Allow socket to be reused
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+	setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int){ 0 }, sizeof(int));
+
+	struct sockaddr_in6 addr;
+	memset(&addr, 0, sizeof (addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_port = htons(port);
+	addr.sin6_addr = in6addr_any;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof (addr)) < 0 ||
+		listen(fd, SOMAXCONN) < 0 ||
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/*
+ * Bind and listen on every port in the passive range up
+ * front. Ports that are already taken are skipped.
+ */
+int
+pasv_pool_init(int low_port, int high_port) {
+
+	for (int port = high_port; port >= low_port; port--) {
+
+		int fd = pasv_listen(port);
+		if (fd < 0)
+			continue;
+
+		pasv_listener_t * listener = calloc(1, sizeof (pasv_listener_t));
+		if (listener == NULL) {
+			close(fd);
+			return (-1);
+		}
+		listener->fd = fd;
+		listener->port = port;
+		listener->next = free_listeners;
+		free_listeners = listener;
+		listeners_total++;
+		listeners_free++;
+	}
+
+	return (listeners_total);
+}
+
+// Whether a passive port range has been configured
+int
+pasv_pool_enabled() {
+
+	return (listeners_total > 0);
+}
+
+// Take a listener out of the pool
+pasv_listener_t *
+pasv_pool_checkout() {
+
+	pthread_mutex_lock(&pasv_pool_lock);
+	pasv_listener_t * listener = free_listeners;
+	if (listener != NULL) {
+		free_listeners = listener->next;
+		listener->next = NULL;
+		listeners_free--;
+	}
+	pthread_mutex_unlock(&pasv_pool_lock);
+
+	return (listener);
+}
+
+/*
+ * Give a listener back to the pool. A client that connected
+ * but never sent a transfer command leaves a pending
+ * connection behind, which must not reach the next session.
+ */
+void
+pasv_pool_return(pasv_listener_t * listener) {
+
+	int fd;
+	while ((fd = accept(listener->fd, NULL, NULL)) >= 0)
+		close(fd);
+
+	pthread_mutex_lock(&pasv_pool_lock);
+	listener->next = free_listeners;
+	free_listeners = listener;
+	listeners_free++;
+	pthread_mutex_unlock(&pasv_pool_lock);
+}
+
+// Number of listeners currently lent to sessions
+int
+pasv_pool_in_use() {
+
+	pthread_mutex_lock(&pasv_pool_lock);
+	int in_use = listeners_total - listeners_free;
+	pthread_mutex_unlock(&pasv_pool_lock);
+
+	return (in_use);
+}
+
+// Number of listeners waiting in the pool
+int
+pasv_pool_available() {
+
+	pthread_mutex_lock(&pasv_pool_lock);
+	int available = listeners_free;
+	pthread_mutex_unlock(&pasv_pool_lock);
+
+	return (available);
+}
@@ -0,0 +1,211 @@
+#include <stdarg.h>
+#include <sys/uio.h>
+#include "reply.h"
+#include "mlsx.h"
+#include "log.h"
+#include "metrics.h"
+
+/*
+ * A reply of one line, and one spanning several lines: the
+ * first line, lines each starting with a space, then the last
+ */
+#define	REPLY(id, code, text) \
+	[id] = { code, #code " " text "\r\n", sizeof (#code " " text "\r\n") - 1 }
+#define	REPLY_LINES(id, code, first, lines, last) \
+	[id] = { code, #code "-" first "\r\n" lines #code " " last "\r\n", \
+	sizeof (#code "-" first "\r\n" lines #code " " last "\r\n") - 1 }
+
+static const reply_t replies[NUM_REPLIES] = {
+	REPLY(REPLY_SERVICE_READY, 220, "CoolFTPServer"),
+	REPLY(REPLY_GOODBYE, 221, "Goodbye."),
+	REPLY(REPLY_TOO_MANY_CONNECTIONS, 421, "Too many connections"),
+	REPLY(REPLY_SESSION_TIMEOUT, 421,
+		"Timeout, closing control connection"),
+	REPLY(REPLY_PASSWORD_REQUIRED, 331, "Password required for USER"),
+	REPLY(REPLY_LOGGED_IN, 230, "You are now logged in."),
+	REPLY(REPLY_SYSTEM_TYPE, 215, "UNIX"),
+	REPLY_LINES(REPLY_FEATURES, 211, "Extensions supported",
+		" EPSV\r\n"
+		" MLST " MLSX_FACTS "\r\n"
+		" MODE Z\r\n"
+		" REST STREAM\r\n", "End"),
+	REPLY(REPLY_ACTIVE_MODE, 200, "Entering active mode"),
+	REPLY(REPLY_ASCII_MODE, 200, "Entering ASCII mode"),
+	REPLY(REPLY_BINARY_MODE, 200, "Entering binary mode"),
+	REPLY(REPLY_STREAM_MODE, 200, "Entering stream mode"),
+	REPLY(REPLY_DEFLATE_MODE, 200, "Entering deflate mode"),
+	REPLY(REPLY_DIRECTORY_CHANGED, 250, "Directory changed"),
+	REPLY(REPLY_OPENING_ASCII, 150, "Opening ASCII mode data connection"),
+	REPLY(REPLY_OPENING_MLSD, 150,
+		"Opening ASCII mode data connection for MLSD"),
+	REPLY(REPLY_OPENING_ARCHIVE, 150,
+		"Opening binary mode data connection for archive"),
+	REPLY(REPLY_OPENING_TRANSFER, 150,
+		"Opening file transfer data connection"),
+	REPLY(REPLY_DIRECTORY_LISTED, 226, "Directory contents listed"),
+	REPLY(REPLY_ARCHIVE_SENT, 226, "Archive sent"),
+	REPLY(REPLY_TRANSFER_COMPLETE, 226, "Transfer complete"),
+	REPLY(REPLY_REMOVAL_COMPLETE, 226, "Removal complete"),
+	REPLY(REPLY_CREATION_COMPLETE, 226, "Directory creation complete"),
+	REPLY(REPLY_CANT_OPEN_DATA, 425, "Can't open data connection"),
+	REPLY(REPLY_NO_PASSIVE_PORT, 425, "No passive port available"),
+	REPLY(REPLY_TRANSFER_ABORTED, 426, "Connection closed; transfer aborted"),
+	REPLY(REPLY_DIRECTORY_BUSY, 450, "Directory unavailable"),
+	REPLY(REPLY_LOCAL_ERROR, 451, "Local error in processing"),
+	REPLY(REPLY_FILE_ERROR, 451, "Local error in file processing"),
+	REPLY(REPLY_FILE_UNWRITABLE, 452, "File unavailable"),
+	REPLY(REPLY_LINE_TOO_LONG, 500, "Command line too long"),
+	REPLY(REPLY_NOT_SUPPORTED, 500, "Command not supported"),
+	REPLY(REPLY_SYNTAX_ERROR, 501, "Syntax error in parameters"),
+	REPLY(REPLY_INVALID_RESTART, 501, "Invalid restart offset"),
+	REPLY(REPLY_OPTION_NOT_UNDERSTOOD, 501, "Option not understood"),
+	REPLY(REPLY_STAT_PATH, 504, "STAT of a path not implemented"),
+	REPLY(REPLY_MODE_NOT_IMPLEMENTED, 504, "Mode not implemented"),
+	REPLY(REPLY_SITE_NOT_IMPLEMENTED, 504, "SITE command not implemented"),
+	REPLY(REPLY_PROTOCOL_NOT_SUPPORTED, 522,
+		"Network protocol not supported, use (1,2)"),
+	REPLY(REPLY_DIRECTORY_UNAVAILABLE, 550, "Directory unavailable"),
+	REPLY(REPLY_FILE_ACCESS_ERROR, 550, "Error during file access"),
+	REPLY(REPLY_FILE_UNAVAILABLE, 550, "File unavailable"),
+	REPLY(REPLY_RESTART_OUT_OF_RANGE, 554, "Invalid restart offset")
+};
+
+const reply_t *
+reply_lookup(reply_id_t id) {
+
+	return (&replies[id]);
+}
+
+/*
+ * Write the queued replies followed by len more bytes, with
+ * a single system call unless the socket takes them in parts
+ */
+static int
+reply_write(client_context_t * current_context, const char * data,
+	size_t len) {
+
+	struct iovec iov[2] = {
+		{ current_context->reply_buffer, current_context->reply_len },
+		{ (void *)data, len }
+	};
+	int first = iov[0].iov_len == 0 ? 1 : 0;
+
+	current_context->reply_len = 0;
+	while (first < 2) {
+		ssize_t nwrite = writev(current_context->client_comm_fd,
+			iov + first, 2 - first);
+		if (nwrite < 0 && errno == EINTR)
+			continue;
+		if (nwrite < 0) {
+			log_debug("Error on sending replies: %s", strerror(errno));
+			current_context->state = SESSION_CLOSED;
+			return (-1);
+		}
+		metrics_count(METRIC_REPLY_WRITES, 1);
+
+		for (; first < 2 && (size_t)nwrite >= iov[first].iov_len; first++)
+			nwrite -= iov[first].iov_len;
+		if (first < 2) {
+			iov[first].iov_base = (char *)iov[first].iov_base + nwrite;
+			iov[first].iov_len -= nwrite;
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Add bytes to the output buffer; what does not fit goes out
+ * right away, together with what was queued before
+ */
+static void
+reply_append(client_context_t * current_context, const char * data,
+	size_t len) {
+
+	if (len > REPLY_BUFFER_SIZE - current_context->reply_len) {
+		reply_write(current_context, data, len);
+		return;
+	}
+
+	memcpy(current_context->reply_buffer + current_context->reply_len,
+		data, len);
+	current_context->reply_len += len;
+}
+
+void
+reply_queue(client_context_t * current_context, reply_id_t id) {
+
+	reply_append(current_context, replies[id].text, replies[id].len);
+	metrics_count(METRIC_REPLIES, 1);
+}
+
+/*
+ * Format into the output buffer in place, and only fall back
+ * to the arena if the text does not fit in what is left of it
+ */
+static void
+reply_vprintf(client_context_t * current_context, const char * format,
+	va_list args) {
+
+	va_list again;
+	size_t room = REPLY_BUFFER_SIZE - current_context->reply_len;
+
+	va_copy(again, args);
+	int needed = vsnprintf(current_context->reply_buffer +
+		current_context->reply_len, room, format, args);
+
+	if (needed >= 0 && (size_t)needed < room) {
+		current_context->reply_len += needed;
+	}
+	else {
+		char * text = needed < 0 ? NULL :
+			arena_alloc(&current_context->arena, needed + 1);
+		if (text != NULL) {
+			vsnprintf(text, needed + 1, format, again);
+			reply_append(current_context, text, needed);
+		}
+		else
+			reply_append(current_context, replies[REPLY_LOCAL_ERROR].text,
+				replies[REPLY_LOCAL_ERROR].len);
+	}
+	va_end(again);
+}
+
+void
+reply_printf(client_context_t * current_context, const char * format, ...) {
+
+	va_list args;
+	va_start(args, format);
+	reply_vprintf(current_context, format, args);
+	va_end(args);
+	metrics_count(METRIC_REPLIES, 1);
+}
+
+// Queue a line of a multi-line reply
+static void
+reply_line(client_context_t * current_context, const char * format, ...) {
+
+	va_list args;
+	va_start(args, format);
+	reply_vprintf(current_context, format, args);
+	va_end(args);
+}
+
+void
+reply_lines(client_context_t * current_context, int code,
+	const char * first, const char * lines, size_t len, const char * last) {
+
+	reply_line(current_context, "%d-%s\r\n", code, first);
+	reply_append(current_context, lines, len);
+	reply_line(current_context, "%d %s\r\n", code, last);
+	metrics_count(METRIC_REPLIES, 1);
+}
+
+int
+reply_flush(client_context_t * current_context) {
+
+	if (current_context->reply_len == 0)
+		return (0);
+
+	return (reply_write(current_context, NULL, 0));
+}
@@ -0,0 +1,149 @@
+#include "timer_wheel.h"
+
+#define		TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// The tick of a monotonic time, rounded up so no timer fires early
+static unsigned long long
+timer_wheel_tick_of(unsigned long long ns) {
+
+	return ((ns + TIMER_WHEEL_TICK_NS - 1) / TIMER_WHEEL_TICK_NS);
+}
+
+/*
+ * Link a timer into the slot it belongs in. The level is the
+ * highest digit in which its expiry differs from the current
+ * tick: the slot of that digit comes round before the timer
+ * is due, and the timer then moves down to a finer level.
+ */
+static void
+timer_wheel_insert(timer_wheel_t * wheel, wheel_timer_t * timer) {
+
+	if (timer->expires <= wheel->tick)
+		timer->expires = wheel->tick + 1;
+
+	unsigned long long diff = timer->expires ^ wheel->tick;
+	int level = 0;
+	while (level < TIMER_WHEEL_LEVELS - 1 &&
+		(diff >> (TIMER_WHEEL_SLOT_BITS * (level + 1))) != 0)
+		level++;
+
+	wheel_timer_t ** slot = &wheel->slots[level][(timer->expires >>
+		(TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK];
+	timer->next = *slot;
+	if (*slot != NULL)
+		(*slot)->pprev = &timer->next;
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+static void
+timer_wheel_unlink(wheel_timer_t * timer) {
+
+	*timer->pprev = timer->next;
+	if (timer->next != NULL)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+void
+timer_wheel_init(timer_wheel_t * wheel, unsigned long long now_ns) {
+
+	memset(wheel, 0, sizeof (timer_wheel_t));
+	pthread_mutex_init(&wheel->lock, NULL);
+	wheel->tick = now_ns / TIMER_WHEEL_TICK_NS;
+}
+
+void
+timer_wheel_schedule(timer_wheel_t * wheel, wheel_timer_t * timer,
+	unsigned long long when_ns) {
+
+	pthread_mutex_lock(&wheel->lock);
+	if (timer->pprev != NULL)
+		timer_wheel_unlink(timer);
+	else
+		wheel->pending++;
+	timer->expires = timer_wheel_tick_of(when_ns);
+	timer_wheel_insert(wheel, timer);
+	pthread_mutex_unlock(&wheel->lock);
+}
+
+void
+timer_wheel_cancel(timer_wheel_t * wheel, wheel_timer_t * timer) {
+
+	pthread_mutex_lock(&wheel->lock);
+	if (timer->pprev != NULL) {
+		timer_wheel_unlink(timer);
+		wheel->pending--;
+	}
+	pthread_mutex_unlock(&wheel->lock);
+}
+
+/*
+ * Move the timers of a slot of an upper level
+ * down to the levels below, now that it has come round
+ */
+static void
+timer_wheel_cascade(timer_wheel_t * wheel, int level) {
+
+	wheel_timer_t ** slot = &wheel->slots[level][(wheel->tick >>
+		(TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK];
+
+	wheel_timer_t * timer = *slot;
+	*slot = NULL;
+	while (timer != NULL) {
+		wheel_timer_t * next = timer->next;
+		timer_wheel_insert(wheel, timer);
+		timer = next;
+	}
+}
+
+/*
+ * Tick by tick: cascade every level whose slot boundary the
+ * tick crosses, then expire the timers of the tick's slot
+ */
+unsigned long
+timer_wheel_advance(timer_wheel_t * wheel, unsigned long long now_ns,
+	void * arg) {
+
+	unsigned long long target = now_ns / TIMER_WHEEL_TICK_NS;
+	unsigned long fired = 0;
+
+	pthread_mutex_lock(&wheel->lock);
+
+	// Nothing can expire, so there is nothing to walk through
+	if (wheel->pending == 0 && target > wheel->tick)
+		wheel->tick = target;
+
+	while (wheel->tick < target) {
+
+		wheel->tick++;
+		for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+			if ((wheel->tick & ((1ULL << (TIMER_WHEEL_SLOT_BITS *
+				level)) - 1)) != 0)
+				break;
+			timer_wheel_cascade(wheel, level);
+		}
+
+		wheel_timer_t ** slot =
+			&wheel->slots[0][wheel->tick & TIMER_WHEEL_SLOT_MASK];
+		wheel_timer_t * timer;
+		while ((timer = *slot) != NULL) {
+
+			timer_wheel_unlink(timer);
+			wheel->pending--;
+			fired++;
+
+			unsigned long long again = timer->expire(timer, arg);
+			if (again != 0) {
+				timer->expires = timer_wheel_tick_of(again);
+				timer_wheel_insert(wheel, timer);
+				wheel->pending++;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&wheel->lock);
+
+	return (fired);
+}
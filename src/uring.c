@@ -0,0 +1,866 @@
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Tag of the entry that cancels the socket read of a receive
+#define		URING_CANCEL_TAG (2 * URING_NUM_BUFFERS)
+
+/*
+ * An io_uring instance owned by a single thread, along with
+ * its memory-mapped queues and registered transfer buffers
+ */
+typedef struct uring {
+	int ring_fd;
+	unsigned sq_entries;
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned * sq_mask;
+	unsigned * sq_array;
+	// Tail of the entries queued but not yet published
+	unsigned sqe_tail;
+	struct io_uring_sqe * sqes;
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned * cq_mask;
+	struct io_uring_cqe * cqes;
+	void * sq_ptr;
+	size_t sq_size;
+	void * cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+	char * buffers;
+} uring_t;
+
+// Whether the backend was requested and is supported
+static int uring_enabled = 0;
+
+// Each worker thread lazily sets up its own ring
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params * params) {
+
+	return (syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+	unsigned flags) {
+
+	return (syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		flags, NULL, 0));
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, void * arg,
+	unsigned nr_args) {
+
+	return (syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+// Unmap and close a thread's ring
+static void
+uring_destroy(void * arg) {
+
+	uring_t * ring = arg;
+	if (ring == NULL)
+		return;
+
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->ring_fd);
+	free(ring->buffers);
+	free(ring);
+}
+
+static void
+uring_make_key() {
+
+	pthread_key_create(&uring_key, uring_destroy);
+}
+
+/*
+ * Set up an io_uring instance: map its submission and
+ * completion queues, register the transfer buffers and
+ * reserve the fixed file slots used during transfers
+ */
+static uring_t *
+uring_create() {
+
+	uring_t * ring = calloc(1, sizeof (uring_t));
+	if (ring == NULL)
+		return (NULL);
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof (params));
+	ring->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+	if (ring->ring_fd < 0) {
+		free(ring);
+		return (NULL);
+	}
+
+	ring->sq_size = params.sq_off.array +
+		params.sq_entries * sizeof (unsigned);
+	ring->cq_size = params.cq_off.cqes +
+		params.cq_entries * sizeof (struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		close(ring->ring_fd);
+		free(ring);
+		return (NULL);
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ptr = ring->sq_ptr;
+	else {
+		ring->cq_ptr = mmap(NULL, ring->cq_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->ring_fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			munmap(ring->sq_ptr, ring->sq_size);
+			close(ring->ring_fd);
+			free(ring);
+			return (NULL);
+		}
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		ring->sqes_size = 0;
+		uring_destroy(ring);
+		return (NULL);
+	}
+
+	char * sq = ring->sq_ptr;
+	ring->sq_entries = params.sq_entries;
+	ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	ring->sqe_tail = *ring->sq_tail;
+
+	char * cq = ring->cq_ptr;
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	// Register the transfer buffers once for the ring's lifetime
+	if (posix_memalign((void **)&ring->buffers, 4096,
+		URING_NUM_BUFFERS * URING_BUFFER_SIZE) != 0) {
+		ring->buffers = NULL;
+		uring_destroy(ring);
+		return (NULL);
+	}
+
+	struct iovec iov[URING_NUM_BUFFERS];
+	for (int i = 0; i < URING_NUM_BUFFERS; i++) {
+		iov[i].iov_base = ring->buffers + i * URING_BUFFER_SIZE;
+		iov[i].iov_len = URING_BUFFER_SIZE;
+	}
+	if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_BUFFERS,
+		iov, URING_NUM_BUFFERS) < 0) {
+		uring_destroy(ring);
+		return (NULL);
+	}
+
+	// Reserve empty fixed file slots, filled in per transfer
+	int fds[URING_NUM_FILES];
+	for (int i = 0; i < URING_NUM_FILES; i++)
+		fds[i] = -1;
+	if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_FILES,
+		fds, URING_NUM_FILES) < 0) {
+		uring_destroy(ring);
+		return (NULL);
+	}
+
+	return (ring);
+}
+
+/*
+ * Return the calling thread's ring, creating it on first
+ * use; NULL if the backend is disabled or unavailable
+ */
+static uring_t *
+uring_get() {
+
+	if (!uring_enabled)
+		return (NULL);
+
+	pthread_once(&uring_key_once, uring_make_key);
+	uring_t * ring = pthread_getspecific(uring_key);
+	if (ring == NULL) {
+		ring = uring_create();
+		if (ring == NULL)
+			return (NULL);
+		pthread_setspecific(uring_key, ring);
+	}
+
+	return (ring);
+}
+
+/*
+ * Grab a cleared submission queue entry; NULL if the queue is
+ * full, which cannot happen after room was made for it with
+ * uring_reserve()
+ */
+static struct io_uring_sqe *
+uring_get_sqe(uring_t * ring) {
+
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sqe_tail - head >= ring->sq_entries)
+		return (NULL);
+
+	unsigned index = ring->sqe_tail & *ring->sq_mask;
+	struct io_uring_sqe * sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof (*sqe));
+	ring->sq_array[index] = index;
+	ring->sqe_tail++;
+
+	return (sqe);
+}
+
+/*
+ * Publish the queued entries and submit them with a single
+ * system call, waiting for wait_nr of them to complete
+ */
+static int
+uring_submit(uring_t * ring, unsigned wait_nr) {
+
+	// Entries an earlier failed call left behind go out as well
+	unsigned to_submit = ring->sqe_tail -
+		__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	while (1) {
+
+		int err = sys_io_uring_enter(ring->ring_fd, to_submit, wait_nr,
+			wait_nr ? IORING_ENTER_GETEVENTS : 0);
+		if (err >= 0)
+			return (0);
+		if (errno != EINTR)
+			return (-1);
+		// Anything already consumed by the kernel is not resubmitted
+		to_submit = ring->sqe_tail -
+			__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	}
+}
+
+/*
+ * Make room for n submission queue entries, submitting those
+ * already queued if the queue is too full; -1 if the kernel
+ * does not take them
+ */
+static int
+uring_reserve(uring_t * ring, unsigned n) {
+
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sqe_tail - head + n <= ring->sq_entries)
+		return (0);
+
+	if (uring_submit(ring, 0) < 0)
+		return (-1);
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	return (ring->sqe_tail - head + n <= ring->sq_entries ? 0 : -1);
+}
+
+// Take the next completion, waiting for one if none is ready
+static int
+uring_wait_cqe(uring_t * ring, struct io_uring_cqe * cqe) {
+
+	while (1) {
+
+		unsigned head = *ring->cq_head;
+		unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		if (head != tail) {
+			*cqe = ring->cqes[head & *ring->cq_mask];
+			__atomic_store_n(ring->cq_head, head + 1,
+				__ATOMIC_RELEASE);
+			return (0);
+		}
+
+		if (sys_io_uring_enter(ring->ring_fd, 0, 1,
+			IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+			return (-1);
+	}
+}
+
+// Submit a single entry and return its result
+static int
+uring_run_one(uring_t * ring) {
+
+	struct io_uring_cqe cqe;
+	if (uring_submit(ring, 1) < 0 || uring_wait_cqe(ring, &cqe) < 0)
+		return (-1);
+	if (cqe.res < 0) {
+		errno = -cqe.res;
+		return (-1);
+	}
+
+	return (cqe.res);
+}
+
+/*
+ * Point the fixed file slots at the descriptors of a
+ * transfer, or clear them again with -1. Registered files
+ * hold a reference, so the slots must be cleared before
+ * the descriptors are closed.
+ */
+static int
+uring_set_files(uring_t * ring, int file_fd, int sock_fd) {
+
+	int fds[URING_NUM_FILES];
+	fds[URING_FILE_SLOT] = file_fd;
+	fds[URING_SOCKET_SLOT] = sock_fd;
+
+	struct io_uring_files_update update;
+	memset(&update, 0, sizeof (update));
+	update.offset = 0;
+	update.fds = (unsigned long)fds;
+
+	return (sys_io_uring_register(ring->ring_fd,
+		IORING_REGISTER_FILES_UPDATE, &update, URING_NUM_FILES) < 0 ?
+		-1 : 0);
+}
+
+// Queue a read or write of a registered buffer on a fixed file
+static void
+uring_prep_fixed(struct io_uring_sqe * sqe, int opcode, int slot,
+	char * buffer, unsigned len, off_t offset, int buffer_index) {
+
+	sqe->opcode = opcode;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = slot;
+	sqe->addr = (unsigned long)buffer;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->buf_index = buffer_index;
+	sqe->user_data = buffer_index;
+}
+
+int
+uring_init(int enabled) {
+
+	uring_enabled = enabled;
+	if (!enabled)
+		return (0);
+
+	// Probe the kernel with a throwaway ring
+	uring_t * ring = uring_create();
+	if (ring == NULL) {
+		uring_enabled = 0;
+		return (-1);
+	}
+	uring_destroy(ring);
+
+	return (0);
+}
+
+int
+uring_accept(int fd, struct sockaddr * addr, socklen_t * len) {
+
+	uring_t * ring = uring_get();
+	if (ring == NULL) {
+		errno = ENOSYS;
+		return (-1);
+	}
+
+	// A ring that cannot take the entry leaves it to accept()
+	if (uring_reserve(ring, 1) < 0) {
+		errno = ENOSYS;
+		return (-1);
+	}
+
+	struct io_uring_sqe * sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)addr;
+	sqe->addr2 = (unsigned long)len;
+
+	return (uring_run_one(ring));
+}
+
+/*
+ * A connect with a timeout is linked to a timeout entry, which
+ * cancels it when it expires; both entries complete either way
+ */
+int
+uring_connect(int fd, const struct sockaddr * addr, socklen_t len,
+	int timeout_ms) {
+
+	uring_t * ring = uring_get();
+	if (ring == NULL) {
+		errno = ENOSYS;
+		return (-1);
+	}
+
+	if (uring_reserve(ring, timeout_ms < 0 ? 1 : 2) < 0) {
+		errno = ENOSYS;
+		return (-1);
+	}
+
+	struct io_uring_sqe * sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)addr;
+	sqe->off = len;
+
+	if (timeout_ms < 0)
+		return (uring_run_one(ring));
+
+	struct __kernel_timespec timeout = {
+		timeout_ms / 1000, (timeout_ms % 1000) * 1000000L
+	};
+	sqe->flags |= IOSQE_IO_LINK;
+	sqe->user_data = 1;
+	struct io_uring_sqe * link = uring_get_sqe(ring);
+	link->opcode = IORING_OP_LINK_TIMEOUT;
+	link->addr = (unsigned long)&timeout;
+	link->len = 1;
+
+	if (uring_submit(ring, 2) < 0)
+		return (-1);
+
+	int res = -EIO;
+	for (int i = 0; i < 2; i++) {
+		struct io_uring_cqe cqe;
+		if (uring_wait_cqe(ring, &cqe) < 0)
+			return (-1);
+		if (cqe.user_data == 1)
+			res = cqe.res;
+	}
+
+	if (res < 0) {
+		errno = (res == -ECANCELED) ? ETIMEDOUT : -res;
+		return (-1);
+	}
+	return (res);
+}
+
+/*
+ * Send a file to a socket. Each round submits reads of all
+ * registered buffers in one system call, then the writes of
+ * whatever was read in a second one. The writes are linked so
+ * they reach the socket in order; a short write breaks the
+ * link and the remainder of the round is sent by hand.
+ */
+off_t
+uring_send_file(int file_fd, int sock_fd, off_t start) {
+
+	uring_t * ring = uring_get();
+	if (ring == NULL) {
+		errno = ENOSYS;
+		return (-1);
+	}
+
+	if (uring_set_files(ring, file_fd, sock_fd) < 0)
+		return (-1);
+
+	off_t offset = start;
+	int result[URING_NUM_BUFFERS];
+	int done = 0;
+
+	while (!done) {
+
+		/*
+		 * A ring that cannot take the round fails the transfer,
+		 * or hands it to the blocking path if nothing was sent
+		 */
+		if (uring_reserve(ring, URING_NUM_BUFFERS) < 0) {
+			errno = (offset == start) ? ENOSYS : EBUSY;
+			break;
+		}
+
+		// Read the next stretch of the file into every buffer
+		for (int i = 0; i < URING_NUM_BUFFERS; i++)
+			uring_prep_fixed(uring_get_sqe(ring), IORING_OP_READ_FIXED,
+				URING_FILE_SLOT,
+				ring->buffers + i * URING_BUFFER_SIZE,
+				URING_BUFFER_SIZE,
+				offset + (off_t)i * URING_BUFFER_SIZE, i);
+
+		if (uring_submit(ring, URING_NUM_BUFFERS) < 0)
+			break;
+
+		int failed = 0;
+		for (int i = 0; i < URING_NUM_BUFFERS; i++) {
+			struct io_uring_cqe cqe;
+			if (uring_wait_cqe(ring, &cqe) < 0) {
+				failed = 1;
+				break;
+			}
+			result[cqe.user_data] = cqe.res;
+			if (cqe.res < 0) {
+				errno = -cqe.res;
+				failed = 1;
+			}
+		}
+		if (failed)
+			break;
+
+		// Only the buffers up to the first short read are contiguous
+		int count = 0;
+		while (count < URING_NUM_BUFFERS) {
+			count++;
+			if (result[count - 1] < URING_BUFFER_SIZE) {
+				done = 1;
+				break;
+			}
+		}
+		if (result[count - 1] == 0)
+			count--;
+		if (count == 0)
+			break;
+
+		if (uring_reserve(ring, count) < 0) {
+			errno = (offset == start) ? ENOSYS : EBUSY;
+			break;
+		}
+
+		// Write the buffers to the socket as one linked chain
+		for (int i = 0; i < count; i++) {
+			struct io_uring_sqe * sqe = uring_get_sqe(ring);
+			uring_prep_fixed(sqe, IORING_OP_WRITE_FIXED,
+				URING_SOCKET_SLOT,
+				ring->buffers + i * URING_BUFFER_SIZE,
+				result[i], -1, i);
+			if (i < count - 1)
+				sqe->flags |= IOSQE_IO_LINK;
+		}
+
+		if (uring_submit(ring, count) < 0)
+			break;
+
+		int written[URING_NUM_BUFFERS];
+		for (int i = 0; i < count; i++) {
+			struct io_uring_cqe cqe;
+			if (uring_wait_cqe(ring, &cqe) < 0) {
+				failed = 1;
+				break;
+			}
+			written[cqe.user_data] = (cqe.res < 0) ? 0 : cqe.res;
+			if (cqe.res < 0 && cqe.res != -ECANCELED) {
+				errno = -cqe.res;
+				failed = 1;
+			}
+		}
+		if (failed)
+			break;
+
+		// Finish any write that the chain left incomplete
+		for (int i = 0; i < count; i++) {
+			if (written[i] < result[i] && write_all(sock_fd,
+				ring->buffers + i * URING_BUFFER_SIZE + written[i],
+				result[i] - written[i]) < 0) {
+				failed = 1;
+				break;
+			}
+			offset += result[i];
+		}
+		if (failed)
+			break;
+	}
+
+	int saved_errno = errno;
+	uring_set_files(ring, -1, -1);
+	errno = saved_errno;
+
+	return (done ? offset - start : -1);
+}
+
+// Entries of a receive transfer still in flight, and its outcome
+typedef struct uring_recv {
+	// Length of the write in flight for each buffer, 0 if none
+	int write_len[URING_NUM_BUFFERS];
+	// Set while the socket read is in flight
+	int reading;
+	// Set while the cancellation of that read is in flight
+	int cancelling;
+	// Result of the last socket read to complete
+	int nread;
+	// First error of a completed entry, 0 if none
+	int error;
+} uring_recv_t;
+
+/*
+ * Reap one completion of a receive transfer. Writes are
+ * tagged above URING_NUM_BUFFERS and clear their buffer's
+ * pending length; the socket read stores its result. Returns
+ * -1 only if no completion could be reaped; a failed entry
+ * leaves its error in the state.
+ */
+static int
+uring_reap_recv(uring_t * ring, uring_recv_t * state) {
+
+	struct io_uring_cqe cqe;
+	if (uring_wait_cqe(ring, &cqe) < 0)
+		return (-1);
+
+	if (cqe.user_data == URING_CANCEL_TAG) {
+		state->cancelling = 0;
+		return (0);
+	}
+
+	if (cqe.user_data >= URING_NUM_BUFFERS) {
+		int index = cqe.user_data - URING_NUM_BUFFERS;
+		int expected = state->write_len[index];
+		state->write_len[index] = 0;
+		// A short write to a regular file means the disk is full
+		if (cqe.res != expected && state->error == 0)
+			state->error = (cqe.res < 0) ? -cqe.res : ENOSPC;
+		return (0);
+	}
+
+	state->reading = 0;
+	if (cqe.res < 0) {
+		if (state->error == 0)
+			state->error = -cqe.res;
+	}
+	else
+		state->nread = cqe.res;
+	return (0);
+}
+
+// Whether any entry of a receive transfer is still in flight
+static int
+uring_recv_pending(const uring_recv_t * state) {
+
+	if (state->reading || state->cancelling)
+		return (1);
+	for (int i = 0; i < URING_NUM_BUFFERS; i++)
+		if (state->write_len[i] > 0)
+			return (1);
+	return (0);
+}
+
+/*
+ * Receive everything from a socket into a file. Once a read
+ * completes, the write of its buffer and the read into the
+ * next buffer are submitted together, so file writes overlap
+ * with waiting on the network.
+ */
+off_t
+uring_recv_file(int sock_fd, int file_fd, off_t start) {
+
+	uring_t * ring = uring_get();
+	if (ring == NULL) {
+		errno = ENOSYS;
+		return (-1);
+	}
+
+	// A ring that cannot take the first read leaves it to splice()
+	if (uring_reserve(ring, 1) < 0) {
+		errno = ENOSYS;
+		return (-1);
+	}
+
+	if (uring_set_files(ring, file_fd, sock_fd) < 0)
+		return (-1);
+
+	uring_recv_t state;
+	memset(&state, 0, sizeof (state));
+
+	off_t offset = start;
+	int current = 0;
+	int failed = 0;
+
+	uring_prep_fixed(uring_get_sqe(ring), IORING_OP_READ_FIXED,
+		URING_SOCKET_SLOT, ring->buffers, URING_BUFFER_SIZE, -1, 0);
+	state.reading = 1;
+
+	while (1) {
+
+		if (uring_submit(ring, 0) < 0) {
+			failed = 1;
+			break;
+		}
+
+		// Wait for the socket read, reaping finished writes meanwhile
+		while (state.reading && state.error == 0 && !failed) {
+			if (uring_reap_recv(ring, &state) < 0)
+				failed = 1;
+		}
+		if (failed || state.error != 0 || state.nread == 0)
+			break;
+
+		if (uring_reserve(ring, 1) < 0) {
+			errno = EBUSY;
+			failed = 1;
+			break;
+		}
+
+		int nread = state.nread;
+		struct io_uring_sqe * sqe = uring_get_sqe(ring);
+		uring_prep_fixed(sqe, IORING_OP_WRITE_FIXED, URING_FILE_SLOT,
+			ring->buffers + current * URING_BUFFER_SIZE,
+			nread, offset, current);
+		sqe->user_data = URING_NUM_BUFFERS + current;
+		state.write_len[current] = nread;
+		offset += nread;
+
+		// The next buffer may still be on its way to the file
+		current = (current + 1) % URING_NUM_BUFFERS;
+		while (state.write_len[current] > 0 && state.error == 0 &&
+			!failed) {
+			if (uring_submit(ring, 0) < 0 ||
+				uring_reap_recv(ring, &state) < 0)
+				failed = 1;
+		}
+		if (failed || state.error != 0)
+			break;
+
+		if (uring_reserve(ring, 1) < 0) {
+			errno = EBUSY;
+			failed = 1;
+			break;
+		}
+
+		uring_prep_fixed(uring_get_sqe(ring), IORING_OP_READ_FIXED,
+			URING_SOCKET_SLOT,
+			ring->buffers + current * URING_BUFFER_SIZE,
+			URING_BUFFER_SIZE, -1, current);
+		state.reading = 1;
+	}
+
+	int saved_errno = failed ? errno : state.error;
+
+	/*
+	 * The socket read may still wait for data that never comes,
+	 * and nothing may be left in flight once the fixed file slots
+	 * are cleared: cancel the read, or cut the connection short if
+	 * the cancellation cannot be queued, then reap every entry
+	 */
+	if (state.reading) {
+		if (uring_reserve(ring, 1) == 0) {
+			struct io_uring_sqe * sqe = uring_get_sqe(ring);
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = current;
+			sqe->user_data = URING_CANCEL_TAG;
+			state.cancelling = 1;
+		}
+		else
+			shutdown(sock_fd, SHUT_RDWR);
+	}
+	while (uring_recv_pending(&state)) {
+		if (uring_submit(ring, 0) < 0 ||
+			uring_reap_recv(ring, &state) < 0)
+			break;
+	}
+	if (saved_errno == 0 && state.error != 0)
+		saved_errno = state.error;
+	uring_set_files(ring, -1, -1);
+	errno = saved_errno;
+
+	return (failed || state.error != 0 ? -1 : offset - start);
+}
+
+ssize_t
+uring_send_buffer(int sock_fd, const char * buffer, size_t len) {
+
+	uring_t * ring = uring_get();
+	if (ring == NULL) {
+		errno = ENOSYS;
+		return (-1);
+	}
+
+	size_t sent = 0;
+	while (sent < len) {
+
+		// The blocking path sends whatever the ring cannot take
+		if (uring_reserve(ring, 1) < 0) {
+			if (sent == 0) {
+				errno = ENOSYS;
+				return (-1);
+			}
+			if (write_all(sock_fd, buffer + sent, len - sent) < 0)
+				return (-1);
+			return (len);
+		}
+
+		struct io_uring_sqe * sqe = uring_get_sqe(ring);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = sock_fd;
+		sqe->addr = (unsigned long)(buffer + sent);
+		sqe->len = len - sent;
+		sqe->msg_flags = MSG_NOSIGNAL;
+
+		int nsent = uring_run_one(ring);
+		if (nsent < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		sent += nsent;
+	}
+
+	return (sent);
+}
+
+#else
+
+/*
+ * The backend was not built in; every operation reports
+ * ENOSYS so that callers use the regular system calls
+ */
+int
+uring_init(int enabled) {
+
+	return (enabled ? -1 : 0);
+}
+
+int
+uring_accept(int fd, struct sockaddr * addr, socklen_t * len) {
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+uring_connect(int fd, const struct sockaddr * addr, socklen_t len,
+	int timeout_ms) {
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+off_t
+uring_send_file(int file_fd, int sock_fd, off_t start) {
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+off_t
+uring_recv_file(int sock_fd, int file_fd, off_t start) {
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+ssize_t
+uring_send_buffer(int sock_fd, const char * buffer, size_t len) {
+
+	errno = ENOSYS;
+	return (-1);
+}
+
+#endif
@@ -1,106 +1,285 @@
 #include "utils.h"
-
-// Print debugging messages
-inline void
-print_debug(const char * message) {
-
-#ifdef DEBUG
-printf("%s", message);
-fflush(stdout);
+#include "uring.h"
+#include "log.h"
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
 #endif
 
-}
-
 // Error function to exit gracefully
 void
 error(const char * message) {
 
+	// Write out what was logged before the error
+	log_flush();
 	// Print the error number
 	printf("Error number: %d\n", errno);
 	fflush(stdout);
 	// Print the error message
 	perror(message);
-	// Deallocate resources related to the thread pool and mutexes
-	destroy();
-	free_jobs(head);
 	exit(1);
 }
 
-// Destroy mutexes, conditional variables, and job queue
-int
-destroy() {
+// Monotonic clock reading in nanoseconds
+unsigned long long
+get_time_ns() {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
 
-	pthread_mutex_destroy(job_queue_lock);
-	job_queue_lock = NULL;
+// Allocate and initialize an empty job ring
+job_ring_t *
+job_ring_create() {
 
-	pthread_cond_destroy(job_available);
-	job_available = NULL;
+	job_ring_t * ring = NULL;
+	if (posix_memalign((void **)&ring, CACHE_LINE_SIZE,
+		sizeof (job_ring_t)) != 0)
+		return (NULL);
+	memset(ring, 0, sizeof (job_ring_t));
 
-	free_jobs(head);
+	// Slot i is initially free for the producer at position i
+	for (unsigned long i = 0; i < JOB_RING_CAPACITY; i++)
+		ring->slots[i].sequence = i;
 
-	return (0);
+#ifndef __linux__
+	pthread_mutex_init(&ring->wait_lock, NULL);
+	pthread_cond_init(&ring->wait_cond, NULL);
+#endif
+
+	return (ring);
+}
+
+/*
+ * Wake up one worker sleeping on the ring.
+ * Only called when a worker has announced itself idle,
+ * so a busy server never pays for the system call.
+ */
+static void
+job_ring_wake(job_ring_t * ring) {
+
+	__atomic_fetch_add(&ring->wakeups, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+	syscall(SYS_futex, &ring->wakeups, FUTEX_WAKE_PRIVATE, 1,
+		NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&ring->wait_lock);
+	pthread_cond_signal(&ring->wait_cond);
+	pthread_mutex_unlock(&ring->wait_lock);
+#endif
+}
+
+/*
+ * Put the calling worker to sleep until the wakeup
+ * counter moves past the value it observed, or until
+ * timeout_ms milliseconds have passed
+ */
+static void
+job_ring_wait(job_ring_t * ring, unsigned int seen, int timeout_ms) {
+
+	struct timespec timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+#ifdef __linux__
+	syscall(SYS_futex, &ring->wakeups, FUTEX_WAIT_PRIVATE, seen,
+		(timeout_ms < 0) ? NULL : &timeout, NULL, 0);
+#else
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout.tv_sec;
+	deadline.tv_nsec += timeout.tv_nsec;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&ring->wait_lock);
+	while (__atomic_load_n(&ring->wakeups, __ATOMIC_SEQ_CST) == seen) {
+		if (timeout_ms < 0)
+			pthread_cond_wait(&ring->wait_cond, &ring->wait_lock);
+		else if (pthread_cond_timedwait(&ring->wait_cond,
+			&ring->wait_lock, &deadline) != 0)
+			break;
+	}
+	pthread_mutex_unlock(&ring->wait_lock);
+#endif
 }
 
-// Enqueue a single job into the job queue
+/*
+ * Enqueue a single job into the job ring. A producer claims
+ * the slot at enqueue_pos once the slot's sequence shows it
+ * has been consumed, fills it, and then publishes it by
+ * advancing the sequence.
+ */
 int
-enqueue(job_t *head, int fd, struct sockaddr_storage client_addr) {
+enqueue(job_ring_t * ring, int fd, struct sockaddr_storage client_addr,
+	struct client_context * session) {
+
+	job_slot_t * slot;
+	unsigned long pos = __atomic_load_n(&ring->enqueue_pos,
+		__ATOMIC_RELAXED);
+
+	while (1) {
+
+		slot = &ring->slots[pos & (JOB_RING_CAPACITY - 1)];
+		unsigned long seq = __atomic_load_n(&slot->sequence,
+			__ATOMIC_ACQUIRE);
+		long diff = (long)seq - (long)pos;
 
-	job_t * jb = head;
-	while (jb->next != NULL)
-	jb = jb->next;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring->enqueue_pos,
+				&pos, pos + 1, 1, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED))
+				break;
+		}
+		// The slot still holds an unconsumed job: ring is full
+		else if (diff < 0)
+			return (-1);
+		else
+			pos = __atomic_load_n(&ring->enqueue_pos,
+				__ATOMIC_RELAXED);
+	}
 
-	job_t * new_job = calloc(1, sizeof (struct job));
-	new_job->fd = fd;
-	new_job->client_addr = client_addr;
-	new_job->previous = jb;
-	new_job->next = NULL;
-	jb->next = new_job;
+	slot->job.fd = fd;
+	slot->job.client_addr = client_addr;
+	slot->job.session = session;
+	slot->job.enqueue_time = get_time_ns();
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+	// Wake a worker only if one has gone to sleep
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->idle_workers, __ATOMIC_SEQ_CST) > 0)
+		job_ring_wake(ring);
 
 	return (0);
 }
 
-// Dequeue a single job from the job queue
-job_t
-dequeue(job_t *head) {
+/*
+ * Dequeue a single job from the job ring without blocking.
+ * The consumer counterpart of enqueue: it claims the slot
+ * at dequeue_pos once it has been published, copies the
+ * job out and hands the slot back to the producers.
+ */
+int
+try_dequeue(job_ring_t * ring, job_t * job) {
 
-	job_t return_job;
-	job_t * jb = head;
-	jb = jb->next;
+	job_slot_t * slot;
+	unsigned long pos = __atomic_load_n(&ring->dequeue_pos,
+		__ATOMIC_RELAXED);
 
-	if (jb != NULL) {
+	while (1) {
 
-		job_t * nxt_job = jb->next;
-		jb->previous->next = nxt_job;
-		if (nxt_job != NULL)
-			nxt_job->previous = jb->previous;
+		slot = &ring->slots[pos & (JOB_RING_CAPACITY - 1)];
+		unsigned long seq = __atomic_load_n(&slot->sequence,
+			__ATOMIC_ACQUIRE);
+		long diff = (long)seq - (long)(pos + 1);
 
-		return_job.fd = jb->fd;
-		return_job.client_addr = jb->client_addr;
-		free(jb);
-		jb = NULL;
-	}
-	else
-	{
-	printf("No jobs available!\n");
-	fflush(stdout);
-	return_job.fd = -1;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring->dequeue_pos,
+				&pos, pos + 1, 1, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED))
+				break;
+		}
+		// Nothing has been published at this position yet
+		else if (diff < 0)
+			return (-1);
+		else
+			pos = __atomic_load_n(&ring->dequeue_pos,
+				__ATOMIC_RELAXED);
 	}
 
-	return (return_job);
+	*job = slot->job;
+	__atomic_store_n(&slot->sequence, pos + JOB_RING_CAPACITY,
+		__ATOMIC_RELEASE);
+
+	return (0);
 }
 
-// Free all the remaining jobs in the queue, cleanup function
-void
-free_jobs(job_t * head) {
+/*
+ * Dequeue a single job from the job ring. The worker
+ * spins briefly on an empty ring and then sleeps until a
+ * producer wakes it up or the timeout expires.
+ */
+int
+dequeue(job_ring_t * ring, job_t * job, int timeout_ms) {
 
-	while (head->next != NULL) {
-		job_t * next = head->next;
-		free(head);
-		head = next;
+	unsigned long long deadline = get_time_ns() +
+		(unsigned long long)timeout_ms * 1000000ULL;
+
+	while (1) {
+
+		for (int i = 0; i < JOB_RING_SPIN_COUNT; i++) {
+			if (try_dequeue(ring, job) == 0)
+				return (0);
+		}
+
+		/*
+		 * Announce that we are about to sleep, then look at the
+		 * ring once more: a producer that enqueued in between
+		 * either sees us idle and wakes us, or we see its job.
+		 */
+		unsigned int seen = __atomic_load_n(&ring->wakeups,
+			__ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&ring->idle_workers, 1, __ATOMIC_SEQ_CST);
+
+		if (try_dequeue(ring, job) == 0) {
+			__atomic_fetch_sub(&ring->idle_workers, 1,
+				__ATOMIC_SEQ_CST);
+			return (0);
+		}
+
+		int remaining_ms = -1;
+		if (timeout_ms >= 0) {
+			unsigned long long now = get_time_ns();
+			if (now >= deadline) {
+				__atomic_fetch_sub(&ring->idle_workers, 1,
+					__ATOMIC_SEQ_CST);
+				return (-1);
+			}
+			remaining_ms = (deadline - now) / 1000000ULL + 1;
+		}
+
+		job_ring_wait(ring, seen, remaining_ms);
+		__atomic_fetch_sub(&ring->idle_workers, 1, __ATOMIC_SEQ_CST);
 	}
+}
 
-	// For extra safety, don't want double free problems later
-	head = NULL;
+// Number of jobs currently waiting in the job ring
+unsigned long
+job_ring_depth(job_ring_t * ring) {
+
+	unsigned long enqueued = __atomic_load_n(&ring->enqueue_pos,
+		__ATOMIC_RELAXED);
+	unsigned long dequeued = __atomic_load_n(&ring->dequeue_pos,
+		__ATOMIC_RELAXED);
+
+	return ((enqueued > dequeued) ? enqueued - dequeued : 0);
+}
+
+/*
+ * Peek at the job at the head of the ring. A consumer may
+ * take it while we read, so the enqueue time only counts if
+ * the slot still holds the same job afterwards.
+ */
+unsigned long long
+job_ring_oldest(job_ring_t * ring) {
+
+	unsigned long pos = __atomic_load_n(&ring->dequeue_pos,
+		__ATOMIC_ACQUIRE);
+	job_slot_t * slot = &ring->slots[pos & (JOB_RING_CAPACITY - 1)];
+
+	if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1)
+		return (0);
+	unsigned long long enqueue_time = __atomic_load_n(
+		&slot->job.enqueue_time, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != pos + 1)
+		return (0);
+
+	return (enqueue_time);
 }
 
 /*
@@ -123,14 +302,16 @@ get_random_port() {
  * a socket connection to the specified IP Address and port.
  * Used in conjunction with active mode transfers where
  * we would like to connect to the same client IP Address,
- * but in a different port.
+ * but in a different port. A blocking connect gives up once
+ * the socket's send timeout expires, which is cleared again
+ * so that it does not cut the transfer short.
  */
 int
-get_active_client_connection(const char * ip_address, const char * port) {
+get_active_client_connection(const char * ip_address, const char * port,
+	int timeout_ms) {
 
-	printf("Chosen port: %s\n",port);
-	printf("Chosen IP address: %s\n", ip_address);
-	fflush(stdout);
+	log_debug("Connecting to %s port %s for active mode",
+		ip_address, port);
 	/*
 	 * Initialize various structures and parameters
 	 * used for the getaddrinfo/4 function
@@ -168,14 +349,40 @@ get_active_client_connection(const char * ip_address, const char * port) {
 			break;
 	}
 
-	fd = socket(AF_INET6, SOCK_STREAM, 0);
-	if (fd == -1)
-		error("Error in IPV6 socket \
-			establishment in active client connection.\n");
-	err = connect(fd, res->ai_addr, res->ai_addrlen);
-	if (err < 0)
-		error("Error in 'connect'ing to the \
-			active client port with IPV6.\n");
+	if (res != NULL)
+		fd = socket(AF_INET6, SOCK_STREAM, 0);
+	if (fd == -1) {
+		log_warn("Error in IPV6 socket establishment in active "
+			"client connection: %s", strerror(errno));
+		freeaddrinfo(res_original);
+		return (-1);
+	}
+
+	struct timeval timeout = { 0, 0 };
+	if (timeout_ms >= 0) {
+		timeout.tv_sec = timeout_ms / 1000;
+		timeout.tv_usec = (timeout_ms % 1000) * 1000;
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+	}
+
+	err = uring_connect(fd, res->ai_addr, res->ai_addrlen, timeout_ms);
+	if (err < 0 && errno == ENOSYS)
+		err = connect(fd, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res_original);
+
+	// The client is not listening, or did not answer in time
+	if (err < 0) {
+		log_debug("Error in 'connect'ing to the active client port: %s",
+			strerror(errno));
+		close(fd);
+		return (-1);
+	}
+
+	if (timeout_ms >= 0) {
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+	}
 
 	/*
 	 * Return the obtained socket file descriptor
@@ -185,32 +392,136 @@ get_active_client_connection(const char * ip_address, const char * port) {
 }
 
 /*
- * Reads a line from the inputted file and outputs
- * the contents into the buffer
+ * Writes the whole buffer to the descriptor. A socket may
+ * accept fewer bytes than requested, so keep writing
+ * the remainder until everything has been sent.
  */
-int readline(FILE *f, char *buffer, int len) {
+ssize_t
+write_all(int fd, const char * buffer, size_t len) {
+
+	size_t written = 0;
+	while (written < len) {
+
+		ssize_t nwrite = write(fd, buffer + written, len - written);
+		if (nwrite < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		written += nwrite;
+	}
 
-	int counter = 0;
-	int new_length = len;
+	return (written);
+}
 
-	int c = fgetc(f);
-	while (!((feof(f)) || (c == '\r') || (c == '\n'))) {
+/*
+ * Copies everything readable from one descriptor into
+ * another, one fixed-size chunk at a time, so that memory
+ * use does not depend on the amount of data copied
+ */
+off_t
+copy_fd(int from_fd, int to_fd) {
 
-		buffer[counter] = c;
+	char buffer[TRANSFER_BUFFER_SIZE];
+	off_t total = 0;
 
-		if ((counter + 1) > len) {
+	while (1) {
 
-			buffer = realloc(buffer, counter + 4096);
-			new_length = counter + 4096;
+		ssize_t nread = read(from_fd, buffer, sizeof (buffer));
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
 		}
-		counter++;
-		c = fgetc(f);
+		if (nread == 0)
+			break;
+
+		if (write_all(to_fd, buffer, nread) < 0)
+			return (-1);
+		total += nread;
 	}
 
-	if (feof(f))
-		return (-1);
-	else {
+	return (total);
+}
 
-		return (new_length);
+/*
+ * Moves everything readable from one descriptor into another
+ * through a pipe using splice(), so the data never passes
+ * through user space and at most one pipe's worth of it is
+ * in flight. Falls back to copy_fd where splice is unavailable.
+ */
+off_t
+splice_fd(int from_fd, int to_fd) {
+
+#ifdef __linux__
+	int pipe_fds[2];
+	if (pipe(pipe_fds) < 0)
+		return (copy_fd(from_fd, to_fd));
+
+	off_t total = 0;
+	while (1) {
+
+		ssize_t nin = splice(from_fd, NULL, pipe_fds[1], NULL,
+			SPLICE_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (nin < 0) {
+			if (errno == EINTR)
+				continue;
+			// The source does not support splice at all
+			if (errno == EINVAL && total == 0) {
+				close(pipe_fds[0]);
+				close(pipe_fds[1]);
+				return (copy_fd(from_fd, to_fd));
+			}
+			total = -1;
+			break;
+		}
+		if (nin == 0)
+			break;
+
+		// Drain the pipe into the destination
+		while (nin > 0) {
+
+			ssize_t nout = splice(pipe_fds[0], NULL, to_fd, NULL,
+				nin, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (nout < 0 && errno == EINTR)
+				continue;
+
+			/*
+			 * The destination does not support splice, so
+			 * empty the pipe by hand and copy the rest
+			 */
+			if (nout < 0 && errno == EINVAL) {
+				char buffer[SPLICE_CHUNK_SIZE];
+				while (nin > 0) {
+					ssize_t nread = read(pipe_fds[0],
+						buffer, nin);
+					if (nread <= 0 || write_all(to_fd,
+						buffer, nread) < 0)
+						break;
+					nin -= nread;
+					total += nread;
+				}
+				off_t rest = (nin == 0) ?
+					copy_fd(from_fd, to_fd) : -1;
+				close(pipe_fds[0]);
+				close(pipe_fds[1]);
+				return ((rest < 0) ? -1 : total + rest);
+			}
+
+			if (nout <= 0) {
+				close(pipe_fds[0]);
+				close(pipe_fds[1]);
+				return (-1);
+			}
+			nin -= nout;
+			total += nout;
+		}
 	}
+
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+	return (total);
+#else
+	return (copy_fd(from_fd, to_fd));
+#endif
 }
@@ -0,0 +1,185 @@
+#include "worker_pool.h"
+#include "ftp_functions.h"
+#include "metrics.h"
+
+/*
+ * Start one more worker thread unless the pool
+ * is already at its maximum size
+ */
+static int
+worker_pool_grow(worker_pool_t * pool) {
+
+	int n = __atomic_load_n(&pool->num_workers, __ATOMIC_RELAXED);
+	while (n < pool->max_workers) {
+
+		if (!__atomic_compare_exchange_n(&pool->num_workers, &n, n + 1,
+			0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			continue;
+
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		int err = pthread_create(&thread, &attr, ftp_thread, pool);
+		pthread_attr_destroy(&attr);
+
+		if (err != 0) {
+			__atomic_fetch_sub(&pool->num_workers, 1,
+				__ATOMIC_SEQ_CST);
+			return (-1);
+		}
+		return (0);
+	}
+
+	return (-1);
+}
+
+/*
+ * Let an idle worker go unless the pool
+ * is already at its minimum size
+ */
+static int
+worker_pool_shrink(worker_pool_t * pool) {
+
+	int n = __atomic_load_n(&pool->num_workers, __ATOMIC_RELAXED);
+	while (n > pool->min_workers) {
+
+		if (__atomic_compare_exchange_n(&pool->num_workers, &n, n - 1,
+			0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			return (0);
+	}
+
+	return (-1);
+}
+
+/*
+ * Create a worker pool and start its minimum
+ * number of worker threads
+ */
+worker_pool_t *
+worker_pool_create(int min_workers, int max_workers) {
+
+	worker_pool_t * pool = calloc(1, sizeof (worker_pool_t));
+	if (pool == NULL)
+		return (NULL);
+
+	pool->ring = job_ring_create();
+	if (pool->ring == NULL) {
+		free(pool);
+		return (NULL);
+	}
+
+	pool->min_workers = min_workers;
+	pool->max_workers = max_workers;
+	pool->idle_timeout_ms = WORKER_IDLE_TIMEOUT_MS;
+
+	for (int i = 0; i < min_workers; i++) {
+		if (worker_pool_grow(pool) < 0)
+			error("Error on spawning worker thread\n");
+	}
+
+	return (pool);
+}
+
+// Number of jobs waiting in the pool's queue
+unsigned long
+worker_pool_queue_depth(worker_pool_t * pool) {
+
+	return (job_ring_depth(pool->ring));
+}
+
+/*
+ * How long the oldest job in the pool's queue has
+ * been waiting so far, in microseconds
+ */
+unsigned long long
+worker_pool_queue_wait_us(worker_pool_t * pool) {
+
+	unsigned long long oldest = job_ring_oldest(pool->ring);
+	unsigned long long now = get_time_ns();
+
+	return ((oldest == 0 || oldest > now) ? 0 : (now - oldest) / 1000);
+}
+
+/*
+ * Queue a job on the pool. If jobs are piling up and
+ * no worker is idle, add a worker to absorb the load.
+ */
+int
+worker_pool_submit(worker_pool_t * pool, int fd,
+	struct sockaddr_storage client_addr, struct client_context * session) {
+
+	if (enqueue(pool->ring, fd, client_addr, session) < 0)
+		return (-1);
+
+	if (job_ring_depth(pool->ring) >= SCALE_UP_QUEUE_DEPTH &&
+		__atomic_load_n(&pool->ring->idle_workers, __ATOMIC_RELAXED) == 0)
+		worker_pool_grow(pool);
+
+	return (0);
+}
+
+/*
+ * Wait for the next job of the calling worker, recording
+ * how long the job sat in the queue. A worker that stays
+ * idle for the pool's idle timeout retires if the pool is
+ * above its minimum size.
+ */
+int
+worker_pool_next_job(worker_pool_t * pool, job_t * job) {
+
+	while (dequeue(pool->ring, job, pool->idle_timeout_ms) < 0) {
+
+		if (worker_pool_shrink(pool) == 0)
+			return (-1);
+	}
+
+	unsigned long long wait_ns = get_time_ns() - job->enqueue_time;
+	unsigned long long wait_us = wait_ns / 1000;
+	metrics_record(METRIC_QUEUE_WAIT, wait_ns);
+
+	int bucket = 0;
+	while (bucket < WAIT_HISTOGRAM_BUCKETS - 1 &&
+		wait_us >= (1ULL << bucket))
+		bucket++;
+	__atomic_fetch_add(&pool->wait_histogram[bucket], 1,
+		__ATOMIC_RELAXED);
+	__atomic_fetch_add(&pool->jobs_processed, 1, __ATOMIC_RELAXED);
+
+	// Jobs are waiting too long, so bring in another worker
+	if (wait_us >= SCALE_UP_WAIT_US &&
+		__atomic_load_n(&pool->ring->idle_workers, __ATOMIC_RELAXED) == 0)
+		worker_pool_grow(pool);
+
+	return (0);
+}
+
+/*
+ * Print the size of the pool, its queue depth
+ * and the queue wait histogram
+ */
+void
+worker_pool_report(worker_pool_t * pool, FILE * out) {
+
+	fprintf(out, "Worker pool: %d workers (min %d, max %d), "
+		"%d idle, queue depth %lu, %lu jobs processed\n",
+		__atomic_load_n(&pool->num_workers, __ATOMIC_RELAXED),
+		pool->min_workers, pool->max_workers,
+		__atomic_load_n(&pool->ring->idle_workers, __ATOMIC_RELAXED),
+		worker_pool_queue_depth(pool),
+		__atomic_load_n(&pool->jobs_processed, __ATOMIC_RELAXED));
+
+	fprintf(out, "Queue wait histogram (us):\n");
+	for (int i = 0; i < WAIT_HISTOGRAM_BUCKETS; i++) {
+
+		unsigned long count = __atomic_load_n(&pool->wait_histogram[i],
+			__ATOMIC_RELAXED);
+		if (count == 0)
+			continue;
+		if (i == WAIT_HISTOGRAM_BUCKETS - 1)
+			fprintf(out, "  >= %llu: %lu\n", 1ULL << (i - 1), count);
+		else
+			fprintf(out, "  < %llu: %lu\n", 1ULL << i, count);
+	}
+	fflush(out);
+}
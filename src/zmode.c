@@ -0,0 +1,301 @@
+#include "zmode.h"
+#include "crlf.h"
+#include "buffer_pool.h"
+#include "metrics.h"
+
+zmode_t *
+zmode_create() {
+
+	return (calloc(1, sizeof (zmode_t)));
+}
+
+void
+zmode_destroy(zmode_t * zmode) {
+
+	if (zmode == NULL)
+		return;
+	if (zmode->deflater_ready)
+		deflateEnd(&zmode->deflater);
+	if (zmode->inflater_ready)
+		inflateEnd(&zmode->inflater);
+	free(zmode);
+}
+
+// Make the deflater ready for a new stream at the given level
+static int
+zmode_deflater(zmode_t * zmode, int level) {
+
+	z_stream * z = &zmode->deflater;
+
+	if (!zmode->deflater_ready) {
+		memset(z, 0, sizeof (z_stream));
+		if (deflateInit2(z, level, Z_DEFLATED, MAX_WBITS, ZMODE_MEM_LEVEL,
+			Z_DEFAULT_STRATEGY) != Z_OK)
+			return (-1);
+		zmode->deflater_ready = 1;
+		zmode->level = level;
+		return (0);
+	}
+
+	if (deflateReset(z) != Z_OK)
+		return (-1);
+	// Nothing has gone in since the reset, so this changes no output
+	if (level != zmode->level) {
+		if (deflateParams(z, level, Z_DEFAULT_STRATEGY) != Z_OK)
+			return (-1);
+		zmode->level = level;
+	}
+
+	return (0);
+}
+
+static int
+zmode_inflater(zmode_t * zmode) {
+
+	z_stream * z = &zmode->inflater;
+
+	if (!zmode->inflater_ready) {
+		memset(z, 0, sizeof (z_stream));
+		if (inflateInit(z) != Z_OK)
+			return (-1);
+		zmode->inflater_ready = 1;
+		return (0);
+	}
+
+	return (inflateReset(z) == Z_OK ? 0 : -1);
+}
+
+int
+zmode_writer_open(zmode_writer_t * writer, zmode_t * zmode, int level,
+	int data_fd) {
+
+	if (zmode_deflater(zmode, level) < 0)
+		return (-1);
+
+	writer->out = buffer_pool_get();
+	if (writer->out == NULL)
+		return (-1);
+	writer->stream = &zmode->deflater;
+	writer->data_fd = data_fd;
+	writer->in_bytes = 0;
+	writer->out_bytes = 0;
+
+	return (0);
+}
+
+/*
+ * Run the deflater over its pending input, sending the output
+ * buffer every time it fills up; with Z_FINISH, until the end
+ * of the stream is out
+ */
+static int
+zmode_deflate(zmode_writer_t * writer, int flush) {
+
+	z_stream * z = writer->stream;
+
+	do {
+		z->next_out = (Bytef *)writer->out;
+		z->avail_out = BUFFER_POOL_BUFFER_SIZE;
+		if (deflate(z, flush) == Z_STREAM_ERROR)
+			return (-1);
+
+		size_t len = BUFFER_POOL_BUFFER_SIZE - z->avail_out;
+		if (len > 0 && write_all(writer->data_fd, writer->out, len) < 0)
+			return (-1);
+		writer->out_bytes += len;
+	} while (z->avail_out == 0);
+
+	return (0);
+}
+
+int
+zmode_write(zmode_writer_t * writer, const char * buffer, size_t len) {
+
+	writer->stream->next_in = (Bytef *)buffer;
+	writer->stream->avail_in = len;
+	writer->in_bytes += len;
+
+	return (zmode_deflate(writer, Z_NO_FLUSH));
+}
+
+int
+zmode_writer_close(zmode_writer_t * writer, int finish) {
+
+	int err = 0;
+	if (finish) {
+		writer->stream->next_in = NULL;
+		writer->stream->avail_in = 0;
+		err = zmode_deflate(writer, Z_FINISH);
+	}
+
+	buffer_pool_put(writer->out);
+	writer->out = NULL;
+
+	metrics_count(METRIC_ZMODE_BYTES, writer->in_bytes);
+	metrics_count(METRIC_ZMODE_WIRE_BYTES, writer->out_bytes);
+
+	return (err);
+}
+
+/*
+ * Blocks of the file are read into a pooled buffer, expanded
+ * past them in ASCII mode, and compressed into the writer's
+ */
+off_t
+zmode_send_file(zmode_t * zmode, int level, int file_fd, int data_fd,
+	int binary_flag, off_t offset) {
+
+	char * in = buffer_pool_get();
+	if (in == NULL)
+		return (-1);
+	char * converted = in + CRLF_BLOCK_SIZE;
+
+	zmode_writer_t writer;
+	if (zmode_writer_open(&writer, zmode, level, data_fd) < 0) {
+		buffer_pool_put(in);
+		return (-1);
+	}
+
+	crlf_state_t state;
+	crlf_init(&state);
+	off_t nsent = 0;
+	ssize_t nread;
+	int err = 0;
+
+	while ((nread = pread(file_fd, in, CRLF_BLOCK_SIZE,
+		offset + nsent)) != 0) {
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -1;
+			break;
+		}
+
+		const char * block = in;
+		size_t len = nread;
+		if (!binary_flag) {
+			len = crlf_expand(&state, in, nread, converted);
+			block = converted;
+		}
+		if (zmode_write(&writer, block, len) < 0) {
+			err = -1;
+			break;
+		}
+		nsent += nread;
+	}
+
+	if (zmode_writer_close(&writer, err == 0) < 0)
+		err = -1;
+	buffer_pool_put(in);
+
+	return (err < 0 ? -1 : nsent);
+}
+
+ssize_t
+zmode_send_buffer(zmode_t * zmode, int level, int data_fd,
+	const char * buffer, size_t len) {
+
+	zmode_writer_t writer;
+	if (zmode_writer_open(&writer, zmode, level, data_fd) < 0)
+		return (-1);
+
+	int err = zmode_write(&writer, buffer, len);
+	if (zmode_writer_close(&writer, err == 0) < 0)
+		err = -1;
+
+	return (err < 0 ? -1 : (ssize_t)len);
+}
+
+/*
+ * The upload is read into one pooled buffer and inflated past
+ * it a block at a time; in ASCII mode each block is collapsed
+ * into a second buffer before it is written
+ */
+off_t
+zmode_recv_file(zmode_t * zmode, int data_fd, int file_fd, int binary_flag,
+	off_t offset) {
+
+	// A resumed upload continues at the restart offset
+	if (offset > 0 && lseek(file_fd, offset, SEEK_SET) < 0)
+		return (-1);
+	if (zmode_inflater(zmode) < 0)
+		return (-1);
+
+	char * in = buffer_pool_get();
+	if (in == NULL)
+		return (-1);
+	char * inflated = in + CRLF_BLOCK_SIZE;
+	char * out = NULL;
+	if (!binary_flag && (out = buffer_pool_get()) == NULL) {
+		buffer_pool_put(in);
+		return (-1);
+	}
+
+	z_stream * z = &zmode->inflater;
+	crlf_state_t state;
+	crlf_init(&state);
+	unsigned long long wire_bytes = 0;
+	off_t nstored = 0;
+	int ret = Z_OK;
+	int err = 0;
+
+	while (err == 0 && ret != Z_STREAM_END) {
+
+		ssize_t nread = read(data_fd, in, CRLF_BLOCK_SIZE);
+		if (nread < 0 && errno == EINTR)
+			continue;
+		// The upload may not end before its stream does
+		if (nread <= 0) {
+			err = -1;
+			break;
+		}
+		wire_bytes += nread;
+
+		z->next_in = (Bytef *)in;
+		z->avail_in = nread;
+		do {
+			z->next_out = (Bytef *)inflated;
+			z->avail_out = CRLF_BLOCK_SIZE;
+			ret = inflate(z, Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+				err = -1;
+				break;
+			}
+
+			const char * block = inflated;
+			size_t len = CRLF_BLOCK_SIZE - z->avail_out;
+			if (!binary_flag) {
+				len = crlf_collapse(&state, inflated, len, out);
+				block = out;
+			}
+			if (len > 0 && write_all(file_fd, block, len) < 0) {
+				err = -1;
+				break;
+			}
+			nstored += len;
+		} while (z->avail_out == 0 && ret != Z_STREAM_END);
+	}
+
+	if (err == 0 && !binary_flag) {
+		size_t len = crlf_collapse_finish(&state, out);
+		if (len > 0 && write_all(file_fd, out, len) < 0)
+			err = -1;
+		nstored += len;
+	}
+
+	buffer_pool_put(in);
+	if (out != NULL)
+		buffer_pool_put(out);
+
+	metrics_count(METRIC_ZMODE_BYTES, nstored);
+	metrics_count(METRIC_ZMODE_WIRE_BYTES, wire_bytes);
+
+	/*
+	 * Anything the file held past the resumed upload belongs
+	 * to the interrupted one, so cut it off
+	 */
+	if (err == 0 && offset > 0 && ftruncate(file_fd, offset + nstored) < 0)
+		err = -1;
+
+	return (err < 0 ? -1 : nstored);
+}